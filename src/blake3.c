@@ -0,0 +1,457 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <string.h>
+
+#include "blake3.h"
+#include "util.h"
+
+#if BLAKE3_HAVE_AVX2
+#  include <immintrin.h>
+#endif
+
+enum {
+        BLAKE3_CHUNK_START = 1 << 0,
+        BLAKE3_CHUNK_END   = 1 << 1,
+        BLAKE3_PARENT      = 1 << 2,
+        BLAKE3_ROOT        = 1 << 3,
+};
+
+static const uint32_t blake3_iv[8] = {
+        UINT32_C(0x6A09E667), UINT32_C(0xBB67AE85), UINT32_C(0x3C6EF372), UINT32_C(0xA54FF53A),
+        UINT32_C(0x510E527F), UINT32_C(0x9B05688C), UINT32_C(0x1F83D9AB), UINT32_C(0x5BE0CD19),
+};
+
+/* The message word permutation, applied once per round */
+static const uint8_t blake3_schedule[7][16] = {
+        { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+        { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+        { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+        { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+        { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+        { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+        { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static inline uint32_t rotate_right(uint32_t x, unsigned b) {
+        return (x >> b) | (x << (32 - b));
+}
+
+static inline uint32_t load_le32(const uint8_t *p) {
+        return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline __attribute__((always_inline)) void g(uint32_t *v, unsigned a, unsigned b, unsigned c, unsigned d, uint32_t x, uint32_t y) {
+        v[a] = v[a] + v[b] + x;
+        v[d] = rotate_right(v[d] ^ v[a], 16);
+        v[c] = v[c] + v[d];
+        v[b] = rotate_right(v[b] ^ v[c], 12);
+        v[a] = v[a] + v[b] + y;
+        v[d] = rotate_right(v[d] ^ v[a], 8);
+        v[c] = v[c] + v[d];
+        v[b] = rotate_right(v[b] ^ v[c], 7);
+}
+
+static inline __attribute__((always_inline)) void round_portable(uint32_t *v, const uint32_t *m, unsigned r) {
+        const uint8_t *s = blake3_schedule[r];
+
+        g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+
+        g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+}
+
+static void compress_in_place(uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len, uint64_t counter, uint8_t flags) {
+        uint32_t m[16], v[16];
+        unsigned i;
+
+        for (i = 0; i < 16; i++)
+                m[i] = load_le32(block + 4 * i);
+
+        memcpy(v, cv, sizeof(uint32_t) * 8);
+        memcpy(v + 8, blake3_iv, sizeof(uint32_t) * 4);
+        v[12] = (uint32_t) counter;
+        v[13] = (uint32_t) (counter >> 32);
+        v[14] = block_len;
+        v[15] = flags;
+
+        /* Spell out the rounds, so that the message schedule turns into constant indexes */
+        round_portable(v, m, 0);
+        round_portable(v, m, 1);
+        round_portable(v, m, 2);
+        round_portable(v, m, 3);
+        round_portable(v, m, 4);
+        round_portable(v, m, 5);
+        round_portable(v, m, 6);
+
+        for (i = 0; i < 8; i++)
+                cv[i] = v[i] ^ v[i + 8];
+}
+
+static void hash_chunk_portable(const uint8_t *in, uint64_t counter, uint32_t cv[8]) {
+        unsigned b;
+
+        memcpy(cv, blake3_iv, sizeof(blake3_iv));
+
+        for (b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++)
+                compress_in_place(cv, in + b * BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN, counter,
+                                  (b == 0 ? BLAKE3_CHUNK_START : 0) |
+                                  (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? BLAKE3_CHUNK_END : 0));
+}
+
+#if BLAKE3_HAVE_AVX2
+
+#define AVX2_LANES 8
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i rotate_right16_avx2(__m256i x) {
+        return _mm256_shuffle_epi8(x, _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                                       2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i rotate_right8_avx2(__m256i x) {
+        return _mm256_shuffle_epi8(x, _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+                                                       1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i rotate_right_avx2(__m256i x, int b) {
+        return _mm256_or_si256(_mm256_srli_epi32(x, b), _mm256_slli_epi32(x, 32 - b));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void g_avx2(__m256i *v, unsigned a, unsigned b, unsigned c, unsigned d, __m256i x, __m256i y) {
+        v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x);
+        v[d] = rotate_right16_avx2(_mm256_xor_si256(v[d], v[a]));
+        v[c] = _mm256_add_epi32(v[c], v[d]);
+        v[b] = rotate_right_avx2(_mm256_xor_si256(v[b], v[c]), 12);
+        v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y);
+        v[d] = rotate_right8_avx2(_mm256_xor_si256(v[d], v[a]));
+        v[c] = _mm256_add_epi32(v[c], v[d]);
+        v[b] = rotate_right_avx2(_mm256_xor_si256(v[b], v[c]), 7);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void round_avx2(__m256i *v, const __m256i *m, unsigned r) {
+        const uint8_t *s = blake3_schedule[r];
+
+        g_avx2(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g_avx2(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g_avx2(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g_avx2(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+
+        g_avx2(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g_avx2(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g_avx2(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g_avx2(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+}
+
+__attribute__((target("avx2")))
+static inline void transpose_avx2(__m256i v[8]) {
+        __m256i t[8], u[8];
+
+        /* Turns eight vectors of eight 32bit words each into eight vectors made of the n-th word of each */
+
+        t[0] = _mm256_unpacklo_epi32(v[0], v[1]);
+        t[1] = _mm256_unpackhi_epi32(v[0], v[1]);
+        t[2] = _mm256_unpacklo_epi32(v[2], v[3]);
+        t[3] = _mm256_unpackhi_epi32(v[2], v[3]);
+        t[4] = _mm256_unpacklo_epi32(v[4], v[5]);
+        t[5] = _mm256_unpackhi_epi32(v[4], v[5]);
+        t[6] = _mm256_unpacklo_epi32(v[6], v[7]);
+        t[7] = _mm256_unpackhi_epi32(v[6], v[7]);
+
+        u[0] = _mm256_unpacklo_epi64(t[0], t[2]);
+        u[1] = _mm256_unpackhi_epi64(t[0], t[2]);
+        u[2] = _mm256_unpacklo_epi64(t[1], t[3]);
+        u[3] = _mm256_unpackhi_epi64(t[1], t[3]);
+        u[4] = _mm256_unpacklo_epi64(t[4], t[6]);
+        u[5] = _mm256_unpackhi_epi64(t[4], t[6]);
+        u[6] = _mm256_unpacklo_epi64(t[5], t[7]);
+        u[7] = _mm256_unpackhi_epi64(t[5], t[7]);
+
+        v[0] = _mm256_permute2x128_si256(u[0], u[4], 0x20);
+        v[1] = _mm256_permute2x128_si256(u[1], u[5], 0x20);
+        v[2] = _mm256_permute2x128_si256(u[2], u[6], 0x20);
+        v[3] = _mm256_permute2x128_si256(u[3], u[7], 0x20);
+        v[4] = _mm256_permute2x128_si256(u[0], u[4], 0x31);
+        v[5] = _mm256_permute2x128_si256(u[1], u[5], 0x31);
+        v[6] = _mm256_permute2x128_si256(u[2], u[6], 0x31);
+        v[7] = _mm256_permute2x128_si256(u[3], u[7], 0x31);
+}
+
+__attribute__((target("avx2")))
+static void hash_chunks_avx2(const uint8_t *in, uint64_t counter, uint32_t cv[AVX2_LANES][8]) {
+        __m256i h[8], counter_low, counter_high;
+        unsigned i, j, b;
+
+        /* Compresses eight consecutive chunks at once, one in each 32bit lane. Note that this relies on the CPU
+         * being little endian, like the rest of the AVX2 code. */
+
+        for (i = 0; i < 8; i++)
+                h[i] = _mm256_set1_epi32((int) blake3_iv[i]);
+
+        counter_low = _mm256_setr_epi32((int) (uint32_t) (counter + 0), (int) (uint32_t) (counter + 1),
+                                        (int) (uint32_t) (counter + 2), (int) (uint32_t) (counter + 3),
+                                        (int) (uint32_t) (counter + 4), (int) (uint32_t) (counter + 5),
+                                        (int) (uint32_t) (counter + 6), (int) (uint32_t) (counter + 7));
+        counter_high = _mm256_setr_epi32((int) (uint32_t) ((counter + 0) >> 32), (int) (uint32_t) ((counter + 1) >> 32),
+                                         (int) (uint32_t) ((counter + 2) >> 32), (int) (uint32_t) ((counter + 3) >> 32),
+                                         (int) (uint32_t) ((counter + 4) >> 32), (int) (uint32_t) ((counter + 5) >> 32),
+                                         (int) (uint32_t) ((counter + 6) >> 32), (int) (uint32_t) ((counter + 7) >> 32));
+
+        for (b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++) {
+                __m256i m[16], v[16];
+                uint8_t flags;
+
+                /* Load the b-th block of each chunk, and transpose it, so that m[j] contains the j-th message word
+                 * of each lane */
+                for (j = 0; j < AVX2_LANES; j++) {
+                        const uint8_t *p = in + j * BLAKE3_CHUNK_LEN + b * BLAKE3_BLOCK_LEN;
+
+                        m[j] = _mm256_loadu_si256((const __m256i*) p);
+                        m[j + 8] = _mm256_loadu_si256((const __m256i*) (p + 32));
+                }
+                transpose_avx2(m);
+                transpose_avx2(m + 8);
+
+                flags = (b == 0 ? BLAKE3_CHUNK_START : 0) |
+                        (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? BLAKE3_CHUNK_END : 0);
+
+                for (i = 0; i < 8; i++)
+                        v[i] = h[i];
+                for (i = 0; i < 4; i++)
+                        v[i + 8] = _mm256_set1_epi32((int) blake3_iv[i]);
+                v[12] = counter_low;
+                v[13] = counter_high;
+                v[14] = _mm256_set1_epi32(BLAKE3_BLOCK_LEN);
+                v[15] = _mm256_set1_epi32(flags);
+
+                round_avx2(v, m, 0);
+                round_avx2(v, m, 1);
+                round_avx2(v, m, 2);
+                round_avx2(v, m, 3);
+                round_avx2(v, m, 4);
+                round_avx2(v, m, 5);
+                round_avx2(v, m, 6);
+
+                for (i = 0; i < 8; i++)
+                        h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+        }
+
+        /* h[i] contains the i-th word of each lane's chaining value, turn this around again */
+        transpose_avx2(h);
+        for (j = 0; j < AVX2_LANES; j++)
+                _mm256_storeu_si256((__m256i*) cv[j], h[j]);
+}
+
+#endif
+
+bool blake3_kernel_supported(Blake3Kernel kernel) {
+
+        switch (kernel) {
+
+        case BLAKE3_KERNEL_PORTABLE:
+                return true;
+
+        case BLAKE3_KERNEL_AVX2:
+#if BLAKE3_HAVE_AVX2 && __BYTE_ORDER == __LITTLE_ENDIAN
+                return __builtin_cpu_supports("avx2");
+#else
+                return false;
+#endif
+
+        default:
+                return false;
+        }
+}
+
+static void chunk_state_init(struct blake3_chunk_state *c, uint64_t counter) {
+        memcpy(c->cv, blake3_iv, sizeof(blake3_iv));
+        c->chunk_counter = counter;
+        c->buf_len = 0;
+        c->blocks_compressed = 0;
+}
+
+static size_t chunk_state_len(const struct blake3_chunk_state *c) {
+        return (size_t) c->blocks_compressed * BLAKE3_BLOCK_LEN + c->buf_len;
+}
+
+static uint8_t chunk_state_start_flag(const struct blake3_chunk_state *c) {
+        return c->blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0;
+}
+
+static void chunk_state_update(struct blake3_chunk_state *c, const uint8_t *in, size_t inlen) {
+
+        while (inlen > 0) {
+                size_t take;
+
+                /* Only compress a block once we know more data follows, as the last block of a chunk is special */
+                if (c->buf_len == BLAKE3_BLOCK_LEN) {
+                        compress_in_place(c->cv, c->buf, BLAKE3_BLOCK_LEN, c->chunk_counter, chunk_state_start_flag(c));
+                        c->blocks_compressed++;
+                        c->buf_len = 0;
+                }
+
+                take = MIN((size_t) (BLAKE3_BLOCK_LEN - c->buf_len), inlen);
+                memcpy(c->buf + c->buf_len, in, take);
+                c->buf_len += take;
+                in += take;
+                inlen -= take;
+        }
+}
+
+static void chunk_state_cv(const struct blake3_chunk_state *c, uint8_t flags, uint32_t cv[8]) {
+        uint8_t block[BLAKE3_BLOCK_LEN] = {};
+
+        memcpy(block, c->buf, c->buf_len);
+        memcpy(cv, c->cv, sizeof(c->cv));
+        compress_in_place(cv, block, c->buf_len, c->chunk_counter, chunk_state_start_flag(c) | BLAKE3_CHUNK_END | flags);
+}
+
+static void parent_cv(const uint32_t left[8], const uint32_t right[8], uint8_t flags, uint32_t cv[8]) {
+        uint8_t block[BLAKE3_BLOCK_LEN];
+        unsigned i;
+
+        for (i = 0; i < 8; i++) {
+                uint32_t l = htole32(left[i]), r = htole32(right[i]);
+
+                memcpy(block + 4 * i, &l, sizeof(l));
+                memcpy(block + 32 + 4 * i, &r, sizeof(r));
+        }
+
+        memcpy(cv, blake3_iv, sizeof(blake3_iv));
+        compress_in_place(cv, block, BLAKE3_BLOCK_LEN, 0, BLAKE3_PARENT | flags);
+}
+
+static void add_chunk_cv(struct blake3 *s, const uint32_t chunk_cv[8], uint64_t total_chunks) {
+        uint32_t cv[8];
+
+        /* Merge completed subtrees: each trailing zero bit in the chunk count means a subtree got complete */
+
+        memcpy(cv, chunk_cv, sizeof(cv));
+
+        while ((total_chunks & 1) == 0) {
+                assert(s->cv_stack_len > 0);
+                s->cv_stack_len--;
+                parent_cv(s->cv_stack[s->cv_stack_len], cv, 0, cv);
+                total_chunks >>= 1;
+        }
+
+        assert(s->cv_stack_len <= BLAKE3_MAX_DEPTH);
+        memcpy(s->cv_stack[s->cv_stack_len++], cv, sizeof(cv));
+}
+
+void blake3_init(struct blake3 *s) {
+        assert(s);
+
+        chunk_state_init(&s->chunk, 0);
+        s->cv_stack_len = 0;
+}
+
+void blake3_update_with_kernel(struct blake3 *s, Blake3Kernel kernel, const void *in, size_t inlen) {
+        const uint8_t *p = in;
+
+        assert(s);
+        assert(in || inlen == 0);
+        assert(blake3_kernel_supported(kernel));
+
+        while (inlen > 0) {
+                size_t take;
+
+                /* A chunk is only finished once we know more data follows, as the last one might be the root */
+                if (chunk_state_len(&s->chunk) == BLAKE3_CHUNK_LEN) {
+                        uint32_t cv[8];
+
+                        chunk_state_cv(&s->chunk, 0, cv);
+                        add_chunk_cv(s, cv, s->chunk.chunk_counter + 1);
+                        chunk_state_init(&s->chunk, s->chunk.chunk_counter + 1);
+                }
+
+                /* If we are at a chunk boundary, compress all whole chunks that are followed by more data directly
+                 * from the input, several at once if we can */
+                if (chunk_state_len(&s->chunk) == 0 && inlen > BLAKE3_CHUNK_LEN) {
+                        uint64_t counter = s->chunk.chunk_counter;
+                        size_t n = (inlen - 1) / BLAKE3_CHUNK_LEN;
+
+                        while (n > 0) {
+                                uint32_t cv[8];
+
+#if BLAKE3_HAVE_AVX2
+                                if (kernel == BLAKE3_KERNEL_AVX2 && n >= AVX2_LANES) {
+                                        uint32_t cvs[AVX2_LANES][8];
+                                        unsigned j;
+
+                                        hash_chunks_avx2(p, counter, cvs);
+
+                                        for (j = 0; j < AVX2_LANES; j++)
+                                                add_chunk_cv(s, cvs[j], counter + j + 1);
+
+                                        p += AVX2_LANES * BLAKE3_CHUNK_LEN;
+                                        inlen -= AVX2_LANES * BLAKE3_CHUNK_LEN;
+                                        counter += AVX2_LANES;
+                                        n -= AVX2_LANES;
+                                        continue;
+                                }
+#endif
+
+                                hash_chunk_portable(p, counter, cv);
+                                add_chunk_cv(s, cv, counter + 1);
+
+                                p += BLAKE3_CHUNK_LEN;
+                                inlen -= BLAKE3_CHUNK_LEN;
+                                counter++;
+                                n--;
+                        }
+
+                        chunk_state_init(&s->chunk, counter);
+                }
+
+                take = MIN(BLAKE3_CHUNK_LEN - chunk_state_len(&s->chunk), inlen);
+                chunk_state_update(&s->chunk, p, take);
+                p += take;
+                inlen -= take;
+        }
+}
+
+void blake3_update(struct blake3 *s, const void *in, size_t inlen) {
+        Blake3Kernel kernel;
+
+        /* Only bother with the vectorized code if there's enough data to fill all lanes */
+        if (inlen >= 8U*BLAKE3_CHUNK_LEN && blake3_kernel_supported(BLAKE3_KERNEL_AVX2))
+                kernel = BLAKE3_KERNEL_AVX2;
+        else
+                kernel = BLAKE3_KERNEL_PORTABLE;
+
+        blake3_update_with_kernel(s, kernel, in, inlen);
+}
+
+void blake3_finalize(const struct blake3 *s, uint8_t out[BLAKE3_OUT_LEN]) {
+        uint32_t cv[8];
+        size_t i;
+
+        assert(s);
+        assert(out);
+
+        /* Fold the stack of subtrees from the right, the last operation carrying the root flag */
+
+        if (s->cv_stack_len == 0)
+                chunk_state_cv(&s->chunk, BLAKE3_ROOT, cv);
+        else {
+                chunk_state_cv(&s->chunk, 0, cv);
+
+                for (i = s->cv_stack_len; i > 0; i--)
+                        parent_cv(s->cv_stack[i - 1], cv, i == 1 ? BLAKE3_ROOT : 0, cv);
+        }
+
+        for (i = 0; i < 8; i++) {
+                uint32_t v = htole32(cv[i]);
+
+                memcpy(out + 4 * i, &v, sizeof(v));
+        }
+}
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef fooblake3hfoo
+#define fooblake3hfoo
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* An implementation of the BLAKE3 hash function, in its default (unkeyed, 256 bit output) mode. See
+ * https://github.com/BLAKE3-team/BLAKE3-specs for the specification. BLAKE3 is a tree hash over 1K chunks, hence
+ * multiple chunks of a large input may be compressed in parallel SIMD lanes. */
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+/* Whether we can build the AVX2 code. Whether it is used is decided at runtime. */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define BLAKE3_HAVE_AVX2 1
+#else
+#  define BLAKE3_HAVE_AVX2 0
+#endif
+
+struct blake3_chunk_state {
+        uint32_t cv[8];
+        uint64_t chunk_counter;
+        uint8_t buf[BLAKE3_BLOCK_LEN];
+        uint8_t buf_len;
+        uint8_t blocks_compressed;
+};
+
+struct blake3 {
+        struct blake3_chunk_state chunk;
+        uint8_t cv_stack_len;
+        uint32_t cv_stack[BLAKE3_MAX_DEPTH + 1][8];
+};
+
+void blake3_init(struct blake3 *state);
+void blake3_update(struct blake3 *state, const void *in, size_t inlen);
+void blake3_finalize(const struct blake3 *state, uint8_t out[BLAKE3_OUT_LEN]);
+
+/* The implementations to compress whole chunks with, one of which is picked by blake3_update() depending on CPU
+ * support. All of them calculate the very same hash. Only exported for testing purposes. */
+typedef enum Blake3Kernel {
+        BLAKE3_KERNEL_PORTABLE,
+        BLAKE3_KERNEL_AVX2,
+        _BLAKE3_KERNEL_MAX,
+} Blake3Kernel;
+
+bool blake3_kernel_supported(Blake3Kernel kernel);
+void blake3_update_with_kernel(struct blake3 *state, Blake3Kernel kernel, const void *in, size_t inlen);
+
+#endif
@@ -766,3 +766,47 @@ int ca_chunk_file_remove(int chunk_fd, const char *prefix, const CaChunkID *chun
 
         return ca_chunk_file_unlink(chunk_fd, prefix, chunkid, ca_compressed_chunk_suffix());
 }
+
+static const char* const verify_table[_CA_CHUNK_VERIFY_MAX] = {
+        [CA_CHUNK_VERIFY_ALWAYS] = "always",
+        [CA_CHUNK_VERIFY_SAMPLE] = "sample",
+        [CA_CHUNK_VERIFY_NEVER] = "never",
+};
+
+const char *ca_chunk_verify_to_string(CaChunkVerify v) {
+        if (v < 0)
+                return NULL;
+        if (v >= _CA_CHUNK_VERIFY_MAX)
+                return NULL;
+
+        return verify_table[v];
+}
+
+CaChunkVerify ca_chunk_verify_from_string(const char *s) {
+        CaChunkVerify i;
+
+        if (isempty(s))
+                return _CA_CHUNK_VERIFY_INVALID;
+
+        for (i = 0; i < _CA_CHUNK_VERIFY_MAX; i++)
+                if (streq(verify_table[i], s))
+                        return i;
+
+        return _CA_CHUNK_VERIFY_INVALID;
+}
+
+bool ca_chunk_verify_pick(CaChunkVerify v, uint64_t sample) {
+
+        switch (v) {
+
+        case CA_CHUNK_VERIFY_NEVER:
+                return false;
+
+        case CA_CHUNK_VERIFY_SAMPLE:
+                /* Pick chunks randomly, so that over a couple of runs all of them are looked at eventually */
+                return sample <= 1 || random_u64() % sample == 0;
+
+        default:
+                return true;
+        }
+}
@@ -18,6 +18,17 @@ typedef enum CaChunkCompression {
         _CA_CHUNK_COMPRESSION_MAX,
 } CaChunkCompression;
 
+/* How thoroughly chunks are validated against their IDs when loaded from a store or received from a remote */
+typedef enum CaChunkVerify {
+        CA_CHUNK_VERIFY_ALWAYS,
+        CA_CHUNK_VERIFY_SAMPLE, /* Only one in N chunks, picked randomly */
+        CA_CHUNK_VERIFY_NEVER,
+        _CA_CHUNK_VERIFY_MAX,
+        _CA_CHUNK_VERIFY_INVALID = -1,
+} CaChunkVerify;
+
+#define CA_CHUNK_VERIFY_SAMPLE_DEFAULT 64U
+
 int ca_load_fd(int fd, ReallocBuffer *buffer);
 int ca_load_and_decompress_fd(int fd, ReallocBuffer *buffer);
 int ca_load_and_compress_fd(int fd, CaCompressionType compression_type, ReallocBuffer *buffer);
@@ -29,6 +40,12 @@ int ca_save_and_compress_fd(int fd, CaCompressionType compression_type, const vo
 int ca_decompress(const void *data, size_t size, ReallocBuffer *buffer);
 int ca_compress(CaCompressionType compression_type, const void *data, size_t size, ReallocBuffer *buffer);
 
+const char *ca_chunk_verify_to_string(CaChunkVerify v);
+CaChunkVerify ca_chunk_verify_from_string(const char *s);
+
+/* Decides whether the next chunk shall be validated */
+bool ca_chunk_verify_pick(CaChunkVerify v, uint64_t sample);
+
 int ca_chunk_file_open(int cache_fd, const char *prefix, const CaChunkID *chunkid, const char *suffix, int flags);
 
 int ca_chunk_file_test(int cache_fd, const char *prefix, const CaChunkID *chunkid);
@@ -6,6 +6,10 @@
 #include "cachunker.h"
 #include "util.h"
 
+#if CA_CHUNKER_HAVE_AVX2
+#  include <immintrin.h>
+#endif
+
 int ca_chunker_set_size(
                 CaChunker *c,
                 size_t min_size,
@@ -194,22 +198,273 @@ static bool shall_break(CaChunker *c, uint32_t v) {
         return (v % c->discriminator) == (c->discriminator - 1);
 }
 
+static uint64_t discriminator_magic(size_t discriminator) {
+
+        /* Precalculates the constant for is_cut() below. See Lemire, Kaser, Kurz: "Faster Remainder by Direct
+         * Computation" (2019). Note that this overflows to 0 for a discriminator of 1, which is what we want. */
+
+        assert(discriminator > 0);
+        assert(discriminator <= CA_CHUNK_SIZE_LIMIT_MAX);
+
+        return UINT64_MAX / discriminator + 1;
+}
+
+static inline bool is_cut(uint32_t v, uint64_t magic) {
+
+        /* Equivalent to (v % discriminator) == (discriminator - 1), i.e. v + 1 being divisible by the
+         * discriminator, but without a division. This is exact as long as v + 1 fits in 33 bits and the
+         * discriminator in 31 bits. */
+
+        return ((uint64_t) v + 1) * magic <= magic - 1;
+}
+
+static inline uint32_t buzhash_roll(uint32_t h, uint8_t leave, uint8_t enter) {
+        return rol32(h, 1) ^ rol32(buzhash_table[leave], CA_CHUNKER_WINDOW_SIZE) ^ buzhash_table[enter];
+}
+
+static uint32_t buzhash_window(const uint8_t *q) {
+        uint32_t h = 0;
+        size_t i;
+
+        /* Calculates the hash of the CA_CHUNKER_WINDOW_SIZE bytes at q, the same way as ca_chunker_start() */
+
+        for (i = 1; i < CA_CHUNKER_WINDOW_SIZE; i++, q++)
+                h ^= rol32(buzhash_table[*q], CA_CHUNKER_WINDOW_SIZE - i);
+
+        return h ^ buzhash_table[*q];
+}
+
+/* The scan kernels roll the hash over the n bytes at q, reading the bytes leaving the window directly from the
+ * CA_CHUNKER_WINDOW_SIZE bytes preceding q, which hence must be valid too. They return the offset of the first byte
+ * after which to cut, or n if there is none, in which case *h is updated with the hash after the last byte. Note
+ * that they don't check the maximum chunk size, the caller has to limit n accordingly. */
+
+static size_t scan_generic(const uint8_t *q, size_t n, uint32_t *h, size_t discriminator) {
+        const uint8_t *leave = q - CA_CHUNKER_WINDOW_SIZE;
+        uint64_t magic = discriminator_magic(discriminator);
+        uint32_t v = *h;
+        size_t i = 0;
+
+        /* Unroll a bit: the loads and table lookups don't depend on the hash, only the rotation and the XOR
+         * do, hence the CPU can run ahead with the former */
+        for (; i + 4 <= n; i += 4) {
+                v = buzhash_roll(v, leave[i], q[i]);
+                if (is_cut(v, magic))
+                        return i;
+
+                v = buzhash_roll(v, leave[i+1], q[i+1]);
+                if (is_cut(v, magic))
+                        return i + 1;
+
+                v = buzhash_roll(v, leave[i+2], q[i+2]);
+                if (is_cut(v, magic))
+                        return i + 2;
+
+                v = buzhash_roll(v, leave[i+3], q[i+3]);
+                if (is_cut(v, magic))
+                        return i + 3;
+        }
+
+        for (; i < n; i++) {
+                v = buzhash_roll(v, leave[i], q[i]);
+                if (is_cut(v, magic))
+                        return i;
+        }
+
+        *h = v;
+        return n;
+}
+
+#if CA_CHUNKER_HAVE_AVX2
+
+#define AVX2_LANES 8
+#define AVX2_STRIDE 512
+
+__attribute__((target("avx2")))
+static inline __m256i rol32_avx2(__m256i v, int i) {
+        return _mm256_or_si256(_mm256_slli_epi32(v, i), _mm256_srli_epi32(v, 32 - i));
+}
+
+typedef struct DivisibilityTest {
+        uint32_t inverse;
+        uint32_t limit;
+        unsigned shift;
+} DivisibilityTest;
+
+static DivisibilityTest divisibility_test(size_t discriminator) {
+        DivisibilityTest t;
+        uint32_t odd;
+        unsigned i;
+
+        /* Precalculates the constants for testing 32bit values for divisibility by the discriminator with a
+         * multiplication and a rotation only (see Hacker's Delight, 10-17): for d = 2^s * o with o odd, x is
+         * divisible by d iff rotr(x * o^-1 mod 2^32, s) <= (2^32 - 1) / d. */
+
+        assert(discriminator > 0);
+        assert(discriminator <= UINT32_MAX);
+
+        t.shift = __builtin_ctz((uint32_t) discriminator);
+        odd = (uint32_t) discriminator >> t.shift;
+
+        /* Newton's iteration, each step doubles the number of correct bits */
+        t.inverse = odd;
+        for (i = 0; i < 5; i++)
+                t.inverse *= 2 - odd * t.inverse;
+
+        t.limit = UINT32_MAX / (uint32_t) discriminator;
+
+        return t;
+}
+
+__attribute__((target("avx2")))
+static inline unsigned maybe_cut_avx2(__m256i v, const DivisibilityTest *t) {
+        __m256i x;
+
+        /* Vectorized prefilter for is_cut(), i.e. tests if v + 1 is divisible by the discriminator. This uses 32bit
+         * arithmetic, hence v + 1 wraps around for v == UINT32_MAX, which then always passes the test. Hits hence
+         * need to be verified with is_cut(), but they are rare anyway. */
+
+        x = _mm256_mullo_epi32(_mm256_add_epi32(v, _mm256_set1_epi32(1)), _mm256_set1_epi32(t->inverse));
+        x = _mm256_or_si256(_mm256_srl_epi32(x, _mm_cvtsi32_si128(t->shift)),
+                            _mm256_sll_epi32(x, _mm_cvtsi32_si128(32 - t->shift)));
+        x = _mm256_cmpeq_epi32(_mm256_min_epu32(x, _mm256_set1_epi32(t->limit)), x);
+
+        return (unsigned) _mm256_movemask_ps(_mm256_castsi256_ps(x));
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const uint8_t *q, size_t n, uint32_t *h, size_t discriminator) {
+        const __m256i offsets = _mm256_setr_epi32(0, AVX2_STRIDE, 2*AVX2_STRIDE, 3*AVX2_STRIDE,
+                                                  4*AVX2_STRIDE, 5*AVX2_STRIDE, 6*AVX2_STRIDE, 7*AVX2_STRIDE);
+        const __m256i byte_mask = _mm256_set1_epi32(0xff);
+        const DivisibilityTest test = divisibility_test(discriminator);
+        const uint64_t magic = discriminator_magic(discriminator);
+        __m256i entered[AVX2_STRIDE];
+        size_t done = 0;
+        uint32_t v = *h;
+
+        /* The rolling hash is inherently sequential, but given that the hash only depends on the last window of
+         * data, we can split a block of input into AVX2_LANES stripes and roll through all of them in parallel,
+         * after seeding each stripe with the hash of the window preceding it. The first cut in the earliest stripe
+         * that has one is then exactly the cut scan_generic() would find.
+         *
+         * Gathers are expensive, hence we fetch four bytes per lane at once, and reuse the table values of the
+         * bytes entering the window for when they leave it again. */
+
+        assert_cc(AVX2_STRIDE % 4 == 0);
+        assert_cc(AVX2_STRIDE >= CA_CHUNKER_WINDOW_SIZE);
+        assert_cc(CA_CHUNKER_WINDOW_SIZE % 4 == 0);
+
+        while (n - done >= AVX2_LANES * AVX2_STRIDE) {
+                const uint8_t *b = q + done;
+                uint32_t hashes[AVX2_LANES] __attribute__((aligned(32)));
+                size_t first_cut[AVX2_LANES];
+                unsigned found = 0;
+                __m256i hv;
+                size_t j, t, u;
+
+                hashes[0] = v;
+                for (j = 1; j < AVX2_LANES; j++)
+                        hashes[j] = buzhash_window(b + j * AVX2_STRIDE - CA_CHUNKER_WINDOW_SIZE);
+
+                hv = _mm256_load_si256((const __m256i*) hashes);
+
+                for (t = 0; t < AVX2_STRIDE; t += 4) {
+                        __m256i enter_bytes, leave_bytes = _mm256_setzero_si256();
+
+                        enter_bytes = _mm256_i32gather_epi32((const int*) (b + t), offsets, 1);
+                        if (t < CA_CHUNKER_WINDOW_SIZE)
+                                leave_bytes = _mm256_i32gather_epi32((const int*) (b + t - CA_CHUNKER_WINDOW_SIZE), offsets, 1);
+
+                        for (u = 0; u < 4; u++) {
+                                __m256i te, tl;
+                                unsigned cut;
+
+                                te = _mm256_i32gather_epi32((const int*) buzhash_table, _mm256_and_si256(enter_bytes, byte_mask), 4);
+                                enter_bytes = _mm256_srli_epi32(enter_bytes, 8);
+                                entered[t + u] = te;
+
+                                if (t < CA_CHUNKER_WINDOW_SIZE) {
+                                        tl = _mm256_i32gather_epi32((const int*) buzhash_table, _mm256_and_si256(leave_bytes, byte_mask), 4);
+                                        leave_bytes = _mm256_srli_epi32(leave_bytes, 8);
+                                } else
+                                        tl = entered[t + u - CA_CHUNKER_WINDOW_SIZE];
+
+                                hv = _mm256_xor_si256(rol32_avx2(hv, 1), _mm256_xor_si256(te, rol32_avx2(tl, CA_CHUNKER_WINDOW_SIZE % 32)));
+
+                                cut = maybe_cut_avx2(hv, &test) & ~found;
+                                if (_likely_(cut == 0))
+                                        continue;
+
+                                _mm256_store_si256((__m256i*) hashes, hv);
+                                for (j = 0; j < AVX2_LANES; j++)
+                                        if ((cut & (1U << j)) && !is_cut(hashes[j], magic))
+                                                cut &= ~(1U << j);
+
+                                /* A cut in the first stripe is definitely the first one */
+                                if (cut & 1)
+                                        return done + t + u;
+
+                                for (j = 1; j < AVX2_LANES; j++)
+                                        if (cut & (1U << j))
+                                                first_cut[j] = t + u;
+
+                                found |= cut;
+                        }
+                }
+
+                if (found != 0) {
+                        j = __builtin_ctz(found);
+                        return done + j * AVX2_STRIDE + first_cut[j];
+                }
+
+                _mm256_store_si256((__m256i*) hashes, hv);
+                v = hashes[AVX2_LANES-1];
+                done += AVX2_LANES * AVX2_STRIDE;
+        }
+
+        *h = v;
+        return done + scan_generic(q + done, n - done, h, discriminator);
+}
+
+#endif
+
+bool ca_chunker_kernel_supported(CaChunkerKernel kernel) {
+
+        switch (kernel) {
+
+        case CA_CHUNKER_KERNEL_GENERIC:
+                return true;
+
+        case CA_CHUNKER_KERNEL_AVX2:
+#if CA_CHUNKER_HAVE_AVX2
+                return __builtin_cpu_supports("avx2");
+#else
+                return false;
+#endif
+
+        default:
+                return false;
+        }
+}
+
 static bool CA_CHUNKER_IS_FIXED_SIZE(CaChunker *c) {
         return c->chunk_size_min == c->chunk_size_avg &&
                 c->chunk_size_max == c->chunk_size_avg;
 }
 
-size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n) {
+size_t ca_chunker_scan_with_kernel(CaChunker *c, CaChunkerKernel kernel, const void* p, size_t n) {
         const uint8_t *q = p;
         uint32_t v;
-        size_t k = 0, skip = 0, idx;
+        size_t k = 0, skip = 0, idx, m, i;
 
         assert(c);
         assert(p);
+        assert(ca_chunker_kernel_supported(kernel));
 
         if (CA_CHUNKER_IS_FIXED_SIZE(c)) {
                 /* Special case: fixed size chunker */
-                size_t m, fixed_size = c->chunk_size_avg;
+                size_t fixed_size = c->chunk_size_avg;
 
                 /* Append to window to make it full */
                 assert(c->chunk_size < fixed_size);
@@ -241,7 +496,6 @@ size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n) {
          * chunk size. */
 
         if (c->window_size < CA_CHUNKER_WINDOW_SIZE) {
-                size_t m;
 
                 /* Append to window to make it full */
                 m = MIN(CA_CHUNKER_WINDOW_SIZE - c->window_size, n);
@@ -266,7 +520,9 @@ size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n) {
 
         idx = (c->chunk_size - skip) % CA_CHUNKER_WINDOW_SIZE;
 
-        while (n > 0) {
+        /* As long as the bytes leaving the window are not part of the data passed in, take them from our copy of
+         * the window */
+        while (n > 0 && (size_t) (q - (const uint8_t*) p) < CA_CHUNKER_WINDOW_SIZE) {
                 v = ca_chunker_roll(c, c->window[idx], *q);
                 c->chunk_size++;
                 k++;
@@ -281,6 +537,46 @@ size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n) {
                 q++, n--;
         }
 
+        if (n == 0)
+                return (size_t) -1;
+
+        /* From here on we can read the bytes leaving the window directly from the data passed in, which allows us
+         * to use one of the fast scan kernels. Let's not scan beyond the maximum chunk size though. */
+        assert(c->chunk_size < c->chunk_size_max);
+        m = MIN(n, c->chunk_size_max - c->chunk_size);
+
+        switch (kernel) {
+
+#if CA_CHUNKER_HAVE_AVX2
+        case CA_CHUNKER_KERNEL_AVX2:
+                i = scan_avx2(q, m, &c->h, c->discriminator);
+                break;
+#endif
+
+        default:
+                i = scan_generic(q, m, &c->h, c->discriminator);
+                break;
+        }
+
+        if (i < m) {
+                k += i + 1;
+                goto now;
+        }
+
+        c->chunk_size += m;
+        k += m;
+
+        if (c->chunk_size >= c->chunk_size_max)
+                goto now;
+
+        /* No border found, and we consumed all data. Save the last window of it for the next invocation. */
+        assert(m == n);
+        q += n;
+
+        idx = (c->chunk_size - skip) % CA_CHUNKER_WINDOW_SIZE;
+        for (i = 0; i < CA_CHUNKER_WINDOW_SIZE; i++)
+                c->window[(idx + i) % CA_CHUNKER_WINDOW_SIZE] = q[(ssize_t) i - CA_CHUNKER_WINDOW_SIZE];
+
         return (size_t) -1;
 
 now:
@@ -290,3 +586,16 @@ now:
 
         return k;
 }
+
+size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n) {
+        CaChunkerKernel kernel;
+
+        /* Only bother with the vectorized kernel for larger amounts of data, and do the CPU check per call rather
+         * than caching it, so that this remains safe to call from multiple threads. The check is cheap. */
+        if (n >= 16U*1024U && ca_chunker_kernel_supported(CA_CHUNKER_KERNEL_AVX2))
+                kernel = CA_CHUNKER_KERNEL_AVX2;
+        else
+                kernel = CA_CHUNKER_KERNEL_GENERIC;
+
+        return ca_chunker_scan_with_kernel(c, kernel, p, n);
+}
@@ -13,6 +13,13 @@
 /* Our checksum window size */
 #define CA_CHUNKER_WINDOW_SIZE 48
 
+/* Whether we can build the AVX2 scan kernel. Whether it is used is decided at runtime. */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define CA_CHUNKER_HAVE_AVX2 1
+#else
+#  define CA_CHUNKER_HAVE_AVX2 0
+#endif
+
 /* The chunk cut discriminator. In order to get an average chunk size of avg, we cut whenever for a hash value "h" at
  * byte "i" given the descriminator "d(avg)": h(i) mod d(avg) == d(avg) - 1. Note that the discriminator
  * calculated like this only yields correct results as long as the minimal chunk size is picked as avg/4, and the
@@ -54,4 +61,15 @@ size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n);
 uint32_t ca_chunker_start(CaChunker *c, const void *p, size_t n);
 uint32_t ca_chunker_roll(CaChunker *c, uint8_t pop_byte, uint8_t push_byte);
 
+/* The scan kernels, one of which is picked by ca_chunker_scan() depending on CPU support. All of them find the very
+ * same chunk borders. Only exported for testing purposes. */
+typedef enum CaChunkerKernel {
+        CA_CHUNKER_KERNEL_GENERIC,
+        CA_CHUNKER_KERNEL_AVX2,
+        _CA_CHUNKER_KERNEL_MAX,
+} CaChunkerKernel;
+
+bool ca_chunker_kernel_supported(CaChunkerKernel kernel);
+size_t ca_chunker_scan_with_kernel(CaChunker *c, CaChunkerKernel kernel, const void* p, size_t n);
+
 #endif
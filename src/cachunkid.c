@@ -5,6 +5,7 @@
 
 #include "cachunk.h"
 #include "cachunkid.h"
+#include "hash-funcs.h"
 #include "log.h"
 
 static char encode_char(uint8_t x) {
@@ -66,6 +67,19 @@ char* ca_chunk_id_format(const CaChunkID *id, char v[CA_CHUNK_ID_FORMAT_MAX]) {
         return v;
 }
 
+static void ca_chunk_id_hash_func(const void *p, struct siphash *state) {
+        siphash24_compress(p, sizeof(CaChunkID), state);
+}
+
+static int ca_chunk_id_compare_func(const void *a, const void *b) {
+        return memcmp(a, b, sizeof(CaChunkID));
+}
+
+const struct hash_ops ca_chunk_id_hash_ops = {
+        .hash = ca_chunk_id_hash_func,
+        .compare = ca_chunk_id_compare_func,
+};
+
 int ca_chunk_id_make(CaDigest *digest, const void *p, size_t l, CaChunkID *ret) {
         if (!digest)
                 return -EINVAL;
@@ -88,6 +102,29 @@ int ca_chunk_id_make(CaDigest *digest, const void *p, size_t l, CaChunkID *ret)
         return 0;
 }
 
+int ca_chunk_id_make_batch(CaDigest *digest, const void *const p[], const size_t l[], size_t n, CaChunkID ret[]) {
+        size_t i;
+
+        if (!digest)
+                return -EINVAL;
+        if (n > 0 && (!p || !l || !ret))
+                return -EINVAL;
+
+        for (i = 0; i < n; i++) {
+                if (!p[i])
+                        return -EINVAL;
+                if (l[i] < CA_CHUNK_SIZE_LIMIT_MIN)
+                        return -EINVAL;
+                if (l[i] > CA_CHUNK_SIZE_LIMIT_MAX)
+                        return -EINVAL;
+        }
+
+        if (ca_digest_get_size(digest) != sizeof(CaChunkID))
+                return -EINVAL;
+
+        return ca_digest_batch(digest, p, l, n, ret);
+}
+
 char* ca_chunk_id_format_path(
                 const char *prefix/*前缀*/,
                 const CaChunkID *chunkid/*chunkid*/,
@@ -46,8 +46,14 @@ static inline bool ca_chunk_id_is_null(const CaChunkID *a) {
         return true;
 }
 
+struct hash_ops;
+extern const struct hash_ops ca_chunk_id_hash_ops;
+
 int ca_chunk_id_make(CaDigest *digest, const void *p, size_t l, CaChunkID *ret);
 
+/* Like ca_chunk_id_make(), but for 'n' chunks at once, see ca_digest_batch() */
+int ca_chunk_id_make_batch(CaDigest *digest, const void *const p[], const size_t l[], size_t n, CaChunkID ret[]);
+
 #define CA_CHUNK_ID_PATH_SIZE(prefix, suffix)                                 \
         (strlen_null(prefix) + 4 + 1 + CA_CHUNK_ID_FORMAT_MAX + strlen_null(suffix))
 
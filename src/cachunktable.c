@@ -0,0 +1,480 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cachunktable.h"
+#include "log.h"
+
+/* #undef EBADMSG */
+/* #define EBADMSG __LINE__ */
+
+#define CA_CHUNK_TABLE_MAGIC UINT64_C(0x7a1ec6e0b3f1a9d5)
+
+/* The initial sizes of a table */
+#define CA_CHUNK_TABLE_BUCKETS_MIN UINT64_C(1024)
+#define CA_CHUNK_TABLE_HEAP_MIN UINT64_C(65536)
+
+typedef struct CaChunkTableHeader {
+        le64_t magic;
+        le64_t n_buckets;   /* always a power of two */
+        le64_t n_entries;
+        le64_t heap_size;   /* bytes used in the heap, the rest of the file is allocated but unused */
+        uint8_t tag[CA_CHUNK_TABLE_TAG_SIZE];
+} CaChunkTableHeader;
+
+typedef struct CaChunkTableBucket {
+        uint8_t chunk[CA_CHUNK_ID_SIZE];
+        le64_t offset;      /* relative to the beginning of the heap */
+        le64_t size;        /* zero if the bucket is unused */
+} CaChunkTableBucket;
+
+struct CaChunkTable {
+        int fd;
+        void *map;
+        size_t map_size;
+};
+
+static inline CaChunkTableHeader* ca_chunk_table_header(CaChunkTable *t) {
+        return t->map;
+}
+
+static inline uint64_t ca_chunk_table_n_buckets(CaChunkTable *t) {
+        return le64toh(ca_chunk_table_header(t)->n_buckets);
+}
+
+static inline CaChunkTableBucket* ca_chunk_table_buckets(CaChunkTable *t) {
+        return (CaChunkTableBucket*) ((uint8_t*) t->map + sizeof(CaChunkTableHeader));
+}
+
+static inline uint64_t ca_chunk_table_heap_offset(uint64_t n_buckets) {
+        return sizeof(CaChunkTableHeader) + n_buckets * sizeof(CaChunkTableBucket);
+}
+
+static inline uint8_t* ca_chunk_table_heap(CaChunkTable *t) {
+        return (uint8_t*) t->map + ca_chunk_table_heap_offset(ca_chunk_table_n_buckets(t));
+}
+
+static int ca_chunk_table_resize(CaChunkTable *t, uint64_t size) {
+        void *m;
+
+        assert(t);
+        assert(size > 0);
+
+        /* Changes the size of the file and remaps it. Only growing the file is supported. */
+
+        if (size > SIZE_MAX)
+                return -EFBIG;
+
+        assert(size >= t->map_size);
+
+        if (ftruncate(t->fd, size) < 0)
+                return -errno;
+
+        if (t->map)
+                m = mremap(t->map, t->map_size, size, MREMAP_MAYMOVE);
+        else
+                m = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, t->fd, 0);
+        if (m == MAP_FAILED)
+                return -errno;
+
+        t->map = m;
+        t->map_size = size;
+
+        return 0;
+}
+
+static int ca_chunk_table_initialize(CaChunkTable *t) {
+        CaChunkTableHeader *h;
+        int r;
+
+        assert(t);
+
+        if (t->map) {
+                (void) munmap(t->map, t->map_size);
+                t->map = NULL;
+                t->map_size = 0;
+        }
+
+        if (ftruncate(t->fd, 0) < 0)
+                return -errno;
+
+        r = ca_chunk_table_resize(t, ca_chunk_table_heap_offset(CA_CHUNK_TABLE_BUCKETS_MIN) + CA_CHUNK_TABLE_HEAP_MIN);
+        if (r < 0)
+                return r;
+
+        h = ca_chunk_table_header(t);
+        h->magic = htole64(CA_CHUNK_TABLE_MAGIC);
+        h->n_buckets = htole64(CA_CHUNK_TABLE_BUCKETS_MIN);
+
+        return 0;
+}
+
+static int ca_chunk_table_verify(CaChunkTable *t) {
+        CaChunkTableBucket *buckets;
+        CaChunkTableHeader *h;
+        uint64_t n_buckets, heap_offset, n_used = 0, i;
+
+        assert(t);
+
+        if (t->map_size < sizeof(CaChunkTableHeader))
+                return -EBADMSG;
+
+        h = ca_chunk_table_header(t);
+        if (le64toh(h->magic) != CA_CHUNK_TABLE_MAGIC)
+                return -EBADMSG;
+
+        n_buckets = le64toh(h->n_buckets);
+        if (n_buckets < CA_CHUNK_TABLE_BUCKETS_MIN)
+                return -EBADMSG;
+        if ((n_buckets & (n_buckets - 1)) != 0)
+                return -EBADMSG;
+        if (n_buckets > (t->map_size - sizeof(CaChunkTableHeader)) / sizeof(CaChunkTableBucket))
+                return -EBADMSG;
+        if (le64toh(h->n_entries) >= n_buckets)
+                return -EBADMSG;
+
+        heap_offset = ca_chunk_table_heap_offset(n_buckets);
+        if (le64toh(h->heap_size) > t->map_size - heap_offset)
+                return -EBADMSG;
+
+        /* Lookups rely on finding an unused bucket to end their search on, hence make sure the entry counter is
+         * actually right, and not just claims so */
+        buckets = ca_chunk_table_buckets(t);
+        for (i = 0; i < n_buckets; i++)
+                if (buckets[i].size != 0)
+                        n_used++;
+        if (n_used != le64toh(h->n_entries))
+                return -EBADMSG;
+
+        return 0;
+}
+
+static int ca_chunk_table_open(CaChunkTable *t) {
+        struct stat st;
+        int r;
+
+        assert(t);
+        assert(t->fd >= 0);
+
+        if (fstat(t->fd, &st) < 0)
+                return -errno;
+        if (!S_ISREG(st.st_mode))
+                return -EBADFD;
+
+        if (st.st_size == 0)
+                return ca_chunk_table_initialize(t);
+
+        r = ca_chunk_table_resize(t, st.st_size);
+        if (r < 0)
+                return r;
+
+        r = ca_chunk_table_verify(t);
+        if (r < 0) {
+                log_debug("Chunk table is invalid, resetting.");
+                return ca_chunk_table_initialize(t);
+        }
+
+        return 0;
+}
+
+int ca_chunk_table_new_fd(int fd, CaChunkTable **ret) {
+        CaChunkTable *t;
+        int r;
+
+        if (fd < 0)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        t = new0(CaChunkTable, 1);
+        if (!t)
+                return -ENOMEM;
+
+        t->fd = fd;
+
+        r = ca_chunk_table_open(t);
+        if (r < 0) {
+                ca_chunk_table_unref(t);
+                return r;
+        }
+
+        *ret = t;
+        return 0;
+}
+
+int ca_chunk_table_new_path(const char *path, CaChunkTable **ret) {
+        int fd;
+
+        if (!path)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW, 0666);
+        if (fd < 0)
+                return -errno;
+
+        /* Two processes modifying the same table at the same time won't end well */
+        if (flock(fd, LOCK_EX|LOCK_NB) < 0) {
+                safe_close(fd);
+                return errno == EWOULDBLOCK ? -EBUSY : -errno;
+        }
+
+        return ca_chunk_table_new_fd(fd, ret);
+}
+
+int ca_chunk_table_new_temporary(CaChunkTable **ret) {
+        _cleanup_free_ char *p = NULL;
+        const char *d;
+        int fd, r;
+
+        if (!ret)
+                return -EINVAL;
+
+        r = var_tmp_dir(&d);
+        if (r < 0)
+                return r;
+
+        fd = open(d, O_TMPFILE|O_RDWR|O_CLOEXEC, 0600);
+        if (fd < 0) {
+                /* Fall back to a named file we remove right-away, if O_TMPFILE is not supported */
+                if (asprintf(&p, "%s/%" PRIx64 ".cachtbl", d, random_u64()) < 0)
+                        return -ENOMEM;
+
+                fd = open(p, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW, 0600);
+                if (fd < 0)
+                        return -errno;
+
+                (void) unlink(p);
+        }
+
+        return ca_chunk_table_new_fd(fd, ret);
+}
+
+CaChunkTable *ca_chunk_table_unref(CaChunkTable *t) {
+        if (!t)
+                return NULL;
+
+        if (t->map)
+                (void) munmap(t->map, t->map_size);
+
+        safe_close(t->fd);
+
+        return mfree(t);
+}
+
+static CaChunkTableBucket* ca_chunk_table_find(CaChunkTable *t, const CaChunkID *id, bool *found) {
+        CaChunkTableBucket *buckets;
+        uint64_t mask, k;
+
+        assert(t);
+        assert(id);
+        assert(found);
+
+        /* Chunk IDs are cryptographic hashes, hence we can just use their first bytes to pick the bucket. The table
+         * is never filled entirely, hence there's always an unused bucket to end the search on. */
+
+        buckets = ca_chunk_table_buckets(t);
+        mask = ca_chunk_table_n_buckets(t) - 1;
+
+        for (k = le64toh(id->u64[0]) & mask;; k = (k + 1) & mask) {
+                CaChunkTableBucket *b = buckets + k;
+
+                if (b->size == 0) {
+                        *found = false;
+                        return b;
+                }
+
+                if (memcmp(b->chunk, id, CA_CHUNK_ID_SIZE) == 0) {
+                        *found = true;
+                        return b;
+                }
+        }
+}
+
+static int ca_chunk_table_grow_buckets(CaChunkTable *t) {
+        _cleanup_free_ CaChunkTableBucket *old = NULL;
+        uint64_t n_buckets, heap_size, heap_allocated, i;
+        CaChunkTableHeader *h;
+        int r;
+
+        assert(t);
+
+        h = ca_chunk_table_header(t);
+        n_buckets = le64toh(h->n_buckets);
+        heap_size = le64toh(h->heap_size);
+        heap_allocated = t->map_size - ca_chunk_table_heap_offset(n_buckets);
+
+        if (n_buckets > UINT64_MAX / 2 / sizeof(CaChunkTableBucket))
+                return -EFBIG;
+
+        old = memdup(ca_chunk_table_buckets(t), n_buckets * sizeof(CaChunkTableBucket));
+        if (!old)
+                return -ENOMEM;
+
+        r = ca_chunk_table_resize(t, ca_chunk_table_heap_offset(n_buckets * 2) + heap_allocated);
+        if (r < 0)
+                return r;
+
+        /* Move the heap out of the way, and then rehash everything into the larger bucket array */
+        memmove((uint8_t*) t->map + ca_chunk_table_heap_offset(n_buckets * 2),
+                (uint8_t*) t->map + ca_chunk_table_heap_offset(n_buckets),
+                heap_size);
+
+        h = ca_chunk_table_header(t);
+        h->n_buckets = htole64(n_buckets * 2);
+        memzero(ca_chunk_table_buckets(t), n_buckets * 2 * sizeof(CaChunkTableBucket));
+
+        for (i = 0; i < n_buckets; i++) {
+                CaChunkTableBucket *b;
+                bool found;
+
+                if (old[i].size == 0)
+                        continue;
+
+                b = ca_chunk_table_find(t, (const CaChunkID*) old[i].chunk, &found);
+                assert(!found);
+
+                *b = old[i];
+        }
+
+        return 0;
+}
+
+int ca_chunk_table_put(CaChunkTable *t, const CaChunkID *id, const void *data, size_t size) {
+        uint64_t n_entries, heap_size, heap_allocated;
+        CaChunkTableHeader *h;
+        CaChunkTableBucket *b;
+        bool found;
+        int r;
+
+        if (!t)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (!data)
+                return -EINVAL;
+        if (size == 0)
+                return -EINVAL;
+
+        b = ca_chunk_table_find(t, id, &found);
+        if (found)
+                return -EEXIST;
+
+        h = ca_chunk_table_header(t);
+
+        /* Whatever the tag said about the contents, it's no longer true */
+        memzero(h->tag, sizeof(h->tag));
+
+        /* Keep the load factor below 3/4 */
+        n_entries = le64toh(h->n_entries);
+        if ((n_entries + 1) * 4 > ca_chunk_table_n_buckets(t) * 3) {
+                r = ca_chunk_table_grow_buckets(t);
+                if (r < 0)
+                        return r;
+        }
+
+        h = ca_chunk_table_header(t);
+        heap_size = le64toh(h->heap_size);
+        heap_allocated = t->map_size - ca_chunk_table_heap_offset(ca_chunk_table_n_buckets(t));
+
+        if (size > heap_allocated - heap_size) {
+                uint64_t n;
+
+                n = MAX(heap_allocated * 2, heap_size + size);
+
+                r = ca_chunk_table_resize(t, ca_chunk_table_heap_offset(ca_chunk_table_n_buckets(t)) + n);
+                if (r < 0)
+                        return r;
+
+                h = ca_chunk_table_header(t);
+        }
+
+        memcpy(ca_chunk_table_heap(t) + heap_size, data, size);
+
+        b = ca_chunk_table_find(t, id, &found);
+        assert(!found);
+
+        memcpy(b->chunk, id, CA_CHUNK_ID_SIZE);
+        b->offset = htole64(heap_size);
+        b->size = htole64(size);
+
+        h->heap_size = htole64(heap_size + size);
+        h->n_entries = htole64(n_entries + 1);
+
+        return 0;
+}
+
+int ca_chunk_table_get(CaChunkTable *t, const CaChunkID *id, const void **ret, size_t *ret_size) {
+        CaChunkTableBucket *b;
+        uint64_t offset, size;
+        bool found;
+
+        if (!t)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+
+        b = ca_chunk_table_find(t, id, &found);
+        if (!found)
+                return -ENOENT;
+
+        offset = le64toh(b->offset);
+        size = le64toh(b->size);
+
+        if (offset > le64toh(ca_chunk_table_header(t)->heap_size) ||
+            size > le64toh(ca_chunk_table_header(t)->heap_size) - offset)
+                return -EBADMSG;
+
+        if (ret)
+                *ret = ca_chunk_table_heap(t) + offset;
+        if (ret_size)
+                *ret_size = size;
+
+        return 0;
+}
+
+uint64_t ca_chunk_table_get_n_entries(CaChunkTable *t) {
+        if (!t)
+                return 0;
+
+        return le64toh(ca_chunk_table_header(t)->n_entries);
+}
+
+int ca_chunk_table_reset(CaChunkTable *t) {
+        if (!t)
+                return -EINVAL;
+
+        return ca_chunk_table_initialize(t);
+}
+
+int ca_chunk_table_get_tag(CaChunkTable *t, uint8_t ret[CA_CHUNK_TABLE_TAG_SIZE]) {
+        if (!t)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        memcpy(ret, ca_chunk_table_header(t)->tag, CA_CHUNK_TABLE_TAG_SIZE);
+        return 0;
+}
+
+int ca_chunk_table_set_tag(CaChunkTable *t, const uint8_t tag[CA_CHUNK_TABLE_TAG_SIZE]) {
+        if (!t)
+                return -EINVAL;
+        if (!tag)
+                return -EINVAL;
+
+        /* Make sure the entries hit the disk before the tag declaring them valid does */
+        if (msync(t->map, t->map_size, MS_SYNC) < 0)
+                return -errno;
+
+        memcpy(ca_chunk_table_header(t)->tag, tag, CA_CHUNK_TABLE_TAG_SIZE);
+
+        if (msync(t->map, sizeof(CaChunkTableHeader), MS_SYNC) < 0)
+                return -errno;
+
+        return 0;
+}
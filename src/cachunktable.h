@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef foocachunktablehfoo
+#define foocachunktablehfoo
+
+#include "cachunkid.h"
+#include "util.h"
+
+/* A hash table mapping chunk IDs to short blobs of data, kept in a single file that is mapped into memory. Uses open
+ * addressing with linear probing, the blobs are stored in a heap following the buckets. Entries may be added, but not
+ * removed individually. The table carries a "tag" in its header, which users may use to record what its contents are
+ * valid for, so that it may be reused by later runs. */
+
+typedef struct CaChunkTable CaChunkTable;
+
+#define CA_CHUNK_TABLE_TAG_SIZE 32U
+
+/* Takes possession of the fd */
+int ca_chunk_table_new_fd(int fd, CaChunkTable **ret);
+
+/* Creates the file if it doesn't exist yet. Returns -EBUSY if another process is using it. */
+int ca_chunk_table_new_path(const char *path, CaChunkTable **ret);
+
+/* An anonymous table in /var/tmp, that is removed automatically */
+int ca_chunk_table_new_temporary(CaChunkTable **ret);
+
+CaChunkTable *ca_chunk_table_unref(CaChunkTable *t);
+DEFINE_TRIVIAL_CLEANUP_FUNC(CaChunkTable*, ca_chunk_table_unref);
+
+/* Returns -EEXIST if there's already an entry for the chunk */
+int ca_chunk_table_put(CaChunkTable *t, const CaChunkID *id, const void *data, size_t size);
+
+/* Returns -ENOENT if there's no entry. The returned pointer is valid until the next ca_chunk_table_put(). */
+int ca_chunk_table_get(CaChunkTable *t, const CaChunkID *id, const void **ret, size_t *ret_size);
+
+uint64_t ca_chunk_table_get_n_entries(CaChunkTable *t);
+
+/* Removes all entries, and clears the tag */
+int ca_chunk_table_reset(CaChunkTable *t);
+
+/* A table never tagged, or reset since, has an all-zero tag */
+int ca_chunk_table_get_tag(CaChunkTable *t, uint8_t ret[CA_CHUNK_TABLE_TAG_SIZE]);
+
+/* Writes all entries to disk, and then the tag */
+int ca_chunk_table_set_tag(CaChunkTable *t, const uint8_t tag[CA_CHUNK_TABLE_TAG_SIZE]);
+
+#endif
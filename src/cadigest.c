@@ -2,7 +2,9 @@
 
 #include <openssl/sha.h>
 
+#include "blake3.h"
 #include "cadigest.h"
+#include "sha2-multibuffer.h"
 #include "util.h"
 
 struct CaDigest {
@@ -12,6 +14,7 @@ struct CaDigest {
         union {
                 SHA256_CTX sha256;
                 SHA512_CTX sha512;
+                struct blake3 blake3;
         };
 };
 
@@ -44,6 +47,10 @@ void ca_digest_reset(CaDigest *d) {
 
                 break;
 
+        case CA_DIGEST_BLAKE3:
+                blake3_init(&d->blake3);
+                break;
+
         default:
         		/*未知类型*/
                 assert_not_reached("Unknown hash function");
@@ -97,6 +104,10 @@ void ca_digest_write(CaDigest *d, const void *p, size_t l) {
                 SHA512_Update(&d->sha512, p, l);
                 break;
 
+        case CA_DIGEST_BLAKE3:
+                blake3_update(&d->blake3, p, l);
+                break;
+
         default:
                 assert_not_reached("Unknown hash function");
         }
@@ -119,6 +130,11 @@ const void* ca_digest_read(CaDigest *d) {
                 SHA512_Final(d->result, &d->sha512);
                 break;
 
+        case CA_DIGEST_BLAKE3:
+                assert(sizeof(d->result) >= BLAKE3_OUT_LEN);
+                blake3_finalize(&d->blake3, d->result);
+                break;
+
         default:
                 assert_not_reached("Unknown hash function");
 
@@ -157,6 +173,9 @@ size_t ca_digest_type_size(CaDigestType t) {
                 assert(SHA256_DIGEST_LENGTH == SHA512_DIGEST_LENGTH/2);
                 return SHA256_DIGEST_LENGTH;
 
+        case CA_DIGEST_BLAKE3:
+                return BLAKE3_OUT_LEN;
+
         default:
                 return (size_t) -1;
         }
@@ -166,6 +185,7 @@ size_t ca_digest_type_size(CaDigestType t) {
 static const char *const table[_CA_DIGEST_TYPE_MAX] = {
         [CA_DIGEST_SHA256] = "sha256",
         [CA_DIGEST_SHA512_256] = "sha512-256",
+        [CA_DIGEST_BLAKE3] = "blake3",
 };
 
 const char *ca_digest_type_to_string(CaDigestType t) {
@@ -221,3 +241,79 @@ int ca_digest_set_type(CaDigest *d, CaDigestType t) {
 
         return 0;
 }
+
+static int ca_digest_type_multi_buffer_kernel(CaDigestType t, Sha2MultiBufferKernel *ret) {
+        Sha2MultiBufferKernel k;
+
+        assert(ret);
+
+        /* Returns > 0 and the kernel to use if buffers of the specified digest type should be hashed with the
+         * multi-buffer code, 0 if they should be hashed one by one */
+
+        if (!IN_SET(t, CA_DIGEST_SHA256, CA_DIGEST_SHA512_256))
+                return 0;
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+        /* OpenSSL's SHA256 is faster than ours if the CPU has the SHA extensions */
+        if (t == CA_DIGEST_SHA256 && __builtin_cpu_supports("sha"))
+                return 0;
+#endif
+
+        k = sha2_multi_buffer_kernel_best();
+        if (k == SHA2_MULTI_BUFFER_KERNEL_PORTABLE)
+                return 0;
+
+        *ret = k;
+        return 1;
+}
+
+size_t ca_digest_type_batch_size(CaDigestType t) {
+        Sha2MultiBufferKernel k;
+
+        if (ca_digest_type_multi_buffer_kernel(t, &k) <= 0)
+                return 1;
+
+        /* Pass twice as many buffers as there are lanes, so that a lane can pick up the next buffer as soon as it is
+         * done with the previous one, even if the buffers are of different size */
+        if (t == CA_DIGEST_SHA256)
+                return sha256_multi_buffer_lanes(k) * 2;
+
+        return sha512_256_multi_buffer_lanes(k) * 2;
+}
+
+size_t ca_digest_get_batch_size(CaDigest *d) {
+        if (!d)
+                return (size_t) -1;
+
+        return ca_digest_type_batch_size(d->type);
+}
+
+int ca_digest_batch(CaDigest *d, const void *const p[], const size_t l[], size_t n, void *ret) {
+        Sha2MultiBufferKernel k;
+        size_t i, size;
+
+        if (!d)
+                return -EINVAL;
+        if (n > 0 && (!p || !l || !ret))
+                return -EINVAL;
+
+        size = ca_digest_get_size(d);
+
+        if (ca_digest_type_multi_buffer_kernel(d->type, &k) > 0) {
+                assert(size == SHA2_MULTI_BUFFER_OUT_LEN);
+
+                if (d->type == CA_DIGEST_SHA256)
+                        sha256_multi_buffer(k, p, l, n, ret);
+                else
+                        sha512_256_multi_buffer(k, p, l, n, ret);
+        } else
+                for (i = 0; i < n; i++) {
+                        ca_digest_reset(d);
+                        ca_digest_write(d, p[i], l[i]);
+                        memcpy((uint8_t*) ret + i * size, ca_digest_read(d), size);
+                }
+
+        /* Leave the object in the same state either way, whatever was written to it before is dropped */
+        ca_digest_reset(d);
+        return 0;
+}
@@ -12,6 +12,7 @@ typedef struct CaDigest CaDigest;
 typedef enum CaDigestType {
         CA_DIGEST_SHA256,
         CA_DIGEST_SHA512_256,
+        CA_DIGEST_BLAKE3,
         _CA_DIGEST_TYPE_MAX,
         CA_DIGEST_DEFAULT = CA_DIGEST_SHA512_256,
         _CA_DIGEST_TYPE_INVALID = -1,
@@ -58,4 +59,12 @@ CaDigestType ca_digest_type_from_string(const char *name);
 
 int ca_digest_set_type(CaDigest *d, CaDigestType t);
 
+/* Hashes 'n' independent buffers at once, and writes their digests to 'ret', one after the other. Depending on the
+ * digest and the CPU multiple buffers are processed in parallel in SIMD lanes, which increases throughput
+ * considerably. ca_digest_get_batch_size() returns how many buffers are worth passing at once, or 1 if there's no
+ * such implementation, and the buffers are hashed one by one. Resets the digest object. */
+size_t ca_digest_type_batch_size(CaDigestType t);
+size_t ca_digest_get_batch_size(CaDigest *d);
+int ca_digest_batch(CaDigest *d, const void *const p[], const size_t l[], size_t n, void *ret);
+
 #endif
@@ -28,6 +28,7 @@
 #include "caencoder.h"
 #include "caformat-util.h"
 #include "caformat.h"
+#include "cajobqueue.h"
 #include "camakebst.h"
 #include "camatch.h"
 #include "canametable.h"
@@ -47,6 +48,26 @@
 /* #undef ENXIO */
 /* #define ENXIO __LINE__ */
 
+/* How much payload to read per step. Large enough that the chunker sees most chunks in one piece and can process them
+ * right where they were read to, without collecting them from several steps first. */
+#define ENCODER_PAYLOAD_WINDOW_SIZE ((size_t) (4U*1024U*1024U))
+
+/* How many directory entries to look up ahead of the encoder, per worker thread */
+#define ENCODER_PREFETCH_PER_THREAD 16U
+
+/* A duplicate of a directory fd, shared by the prefetch jobs for its entries. Only ever referenced and released on
+ * the encoder's thread, so that the fd stays valid until all jobs referring to it are retired. */
+typedef struct CaEncoderPrefetchDir {
+        unsigned n_ref;
+        int fd;
+} CaEncoderPrefetchDir;
+
+typedef struct CaEncoderPrefetchJob {
+        CaEncoderPrefetchDir *dir;
+        uint64_t feature_flags;
+        char name[NAME_MAX+1];
+} CaEncoderPrefetchJob;
+
 /* Encodes whether we found a ".caexclude" file in this directory, and if we did, whether we loaded it */
 typedef enum CaEncoderHasExcludeFile {
         CA_ENCODER_HAS_EXCLUDE_FILE_DONT_KNOW = -1,
@@ -81,6 +102,10 @@ typedef struct CaEncoderNode {
         size_t n_dirents;/*dirents数组大小*/
         size_t dirent_idx;
 
+        /* Entries before this index have been handed to the prefetch queue already */
+        size_t prefetch_idx;
+        CaEncoderPrefetchDir *prefetch_dir;
+
         /* For S_ISLNK */
         char *symlink_target;/*link时填充target*/
 
@@ -201,6 +226,13 @@ struct CaEncoder {
         bool want_archive_digest:1;/*是否需要archive摘要*/
         bool want_payload_digest:1;
         bool want_hardlink_digest:1;
+
+        /* Whether the payload data in the buffer was synthesized for a hole in the file, i.e. is all zeros */
+        bool payload_hole:1;
+
+        /* Looks up the metadata of upcoming directory entries on worker threads, to warm the kernel caches */
+        CaJobQueue *prefetch_queue;
+        unsigned n_threads;
 };
 
 #define CA_ENCODER_AT_ROOT(e) ((e)->node_idx == 0)
@@ -238,6 +270,20 @@ static CaEncoderACLEntry* ca_encoder_acl_entry_free(CaEncoderACLEntry *l, size_t
         return mfree(l);
 }
 
+static CaEncoderPrefetchDir* ca_encoder_prefetch_dir_unref(CaEncoderPrefetchDir *d) {
+        if (!d)
+                return NULL;
+
+        assert(d->n_ref > 0);
+        d->n_ref--;
+
+        if (d->n_ref > 0)
+                return NULL;
+
+        safe_close(d->fd);
+        return mfree(d);
+}
+
 static void ca_encoder_node_free(CaEncoderNode *n) {
         size_t i;
 
@@ -253,6 +299,9 @@ static void ca_encoder_node_free(CaEncoderNode *n) {
         n->dirents = mfree(n->dirents);
         n->n_dirents = 0;
 
+        n->prefetch_dir = ca_encoder_prefetch_dir_unref(n->prefetch_dir);
+        n->prefetch_idx = 0;
+
         n->symlink_target = mfree(n->symlink_target);
 
         for (i = 0; i < n->n_xattrs; i++) {
@@ -305,6 +354,9 @@ CaEncoder *ca_encoder_unref(CaEncoder *e) {
         if (!e)
                 return NULL;
 
+        /* Joins the worker threads first, so that no job uses a directory fd anymore when we close it below */
+        ca_job_queue_unref(e->prefetch_queue);
+
         for (i = 0; i < e->n_nodes; i++)
                 ca_encoder_node_free(e->nodes + i);
 
@@ -363,6 +415,18 @@ int ca_encoder_get_covering_feature_flags(CaEncoder *e, uint64_t *ret) {
         return 0;
 }
 
+int ca_encoder_set_n_threads(CaEncoder *e, unsigned n) {
+        if (!e)
+                return -EINVAL;
+        if (e->prefetch_queue)
+                return -EBUSY;
+
+        /* Zero or one turns off looking up entries ahead of time */
+        e->n_threads = n;
+
+        return 0;
+}
+
 int ca_encoder_set_base_fd(CaEncoder *e, int fd) {
         struct stat st;
         struct statfs sfs;
@@ -2071,6 +2135,159 @@ static int ca_encoder_update_name_table_end_offset(CaEncoder *e, CaEncoderNode *
         return 0;
 }
 
+static int ca_encoder_prefetch_job_run(void *p, void *userdata) {
+        CaEncoderPrefetchJob *job = p;
+        _cleanup_(safe_closep) int fd = -1;
+        struct stat st;
+
+        assert(job);
+        assert(job->dir);
+
+        /* Runs on a worker thread, and does what ca_encoder_open_child() and the metadata readers will do for this
+         * entry shortly, so that they find the inode, its attributes and its directory entries cached. The results
+         * are thrown away, hence errors don't matter either: the encoder will run into them on its own. */
+
+        if (fstatat(job->dir->fd, job->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                return 0;
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+                return 0;
+
+        fd = openat(job->dir->fd, job->name,
+                    O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW|(S_ISDIR(st.st_mode) ? O_DIRECTORY : 0));
+        if (fd < 0)
+                return 0;
+
+        if (job->feature_flags & (CA_FORMAT_WITH_CHATTR|CA_FORMAT_EXCLUDE_NODUMP)) {
+                unsigned flags;
+
+                (void) read_attr_fd(fd, &flags);
+        }
+
+        if (job->feature_flags & (CA_FORMAT_WITH_XATTRS|CA_FORMAT_WITH_ACL|CA_FORMAT_WITH_SELINUX|CA_FORMAT_WITH_FCAPS)) {
+                char list[4096];
+                ssize_t l;
+
+                /* Lists that don't fit are skipped, they are rare and the encoder will read them anyway */
+                l = flistxattr(fd, list, sizeof(list));
+                if (l > 0) {
+                        const char *q;
+
+                        for (q = list; q < list + l; q += strlen(q) + 1)
+                                (void) fgetxattr(fd, q, NULL, 0);
+                }
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+                DIR *d;
+
+                d = fdopendir(fd);
+                if (!d)
+                        return 0;
+                fd = -1;
+
+                while (readdir(d))
+                        ;
+
+                closedir(d);
+        }
+
+        return 0;
+}
+
+static void ca_encoder_prefetch_job_free(void *p) {
+        CaEncoderPrefetchJob *job = p;
+
+        assert(job);
+
+        /* Called on the encoder's thread once the workers are gone, for jobs that were never retired */
+        job->dir = ca_encoder_prefetch_dir_unref(job->dir);
+}
+
+static void ca_encoder_prefetch_retire(CaEncoder *e) {
+        CaEncoderPrefetchJob *job;
+
+        assert(e);
+
+        while (ca_job_queue_peek(e->prefetch_queue, false, (void**) &job, NULL) >= 0) {
+                job->dir = ca_encoder_prefetch_dir_unref(job->dir);
+                assert_se(ca_job_queue_retire(e->prefetch_queue) >= 0);
+        }
+}
+
+static int ca_encoder_prefetch(CaEncoder *e, CaEncoderNode *n) {
+        size_t window;
+        int r;
+
+        assert(e);
+        assert(n);
+
+        /* Hands the entries following the current one in this directory to the worker threads. This never waits for
+         * the workers, and doesn't change what or in which order the encoder itself reads: the archive stays the
+         * same regardless of the number of threads. */
+
+        if (e->n_threads <= 1)
+                return 0;
+        if (n->fd < 0)
+                return 0;
+
+        window = (size_t) e->n_threads * ENCODER_PREFETCH_PER_THREAD;
+
+        if (!e->prefetch_queue) {
+                r = ca_job_queue_new(e->n_threads, window, sizeof(CaEncoderPrefetchJob),
+                                     ca_encoder_prefetch_job_run, ca_encoder_prefetch_job_free, e, &e->prefetch_queue);
+                if (r < 0)
+                        return r;
+        }
+
+        ca_encoder_prefetch_retire(e);
+
+        /* The current entry is opened right away, hence start with the one after it */
+        if (n->prefetch_idx <= n->dirent_idx)
+                n->prefetch_idx = n->dirent_idx + 1;
+
+        while (n->prefetch_idx < n->n_dirents &&
+               n->prefetch_idx <= n->dirent_idx + window) {
+
+                const struct dirent *de = n->dirents[n->prefetch_idx];
+                CaEncoderPrefetchJob *job;
+
+                job = ca_job_queue_acquire(e->prefetch_queue);
+                if (!job) /* All slots busy, try again with the next entry */
+                        break;
+
+                if (!n->prefetch_dir) {
+                        n->prefetch_dir = new0(CaEncoderPrefetchDir, 1);
+                        if (!n->prefetch_dir)
+                                return -ENOMEM;
+
+                        n->prefetch_dir->n_ref = 1;
+                        n->prefetch_dir->fd = fcntl(n->fd, F_DUPFD_CLOEXEC, 3);
+                        if (n->prefetch_dir->fd < 0) {
+                                r = -errno;
+                                n->prefetch_dir = mfree(n->prefetch_dir);
+                                return r;
+                        }
+                }
+
+                strncpy(job->name, de->d_name, sizeof(job->name) - 1);
+                job->name[sizeof(job->name) - 1] = 0;
+                job->feature_flags = e->feature_flags;
+
+                job->dir = n->prefetch_dir;
+                job->dir->n_ref++;
+
+                r = ca_job_queue_submit(e->prefetch_queue);
+                if (r < 0) {
+                        job->dir = ca_encoder_prefetch_dir_unref(job->dir);
+                        return r;
+                }
+
+                n->prefetch_idx++;
+        }
+
+        return 0;
+}
+
 static int ca_encoder_step_node(CaEncoder *e, CaEncoderNode *n) {
         int r;
 
@@ -2206,6 +2423,10 @@ static int ca_encoder_step_node(CaEncoder *e, CaEncoderNode *n) {
                                 return CA_ENCODER_DATA;
                         }
 
+                        r = ca_encoder_prefetch(e, n);
+                        if (r < 0)
+                                return r;
+
                         /*打开de对应的child dirent*/
                         r = ca_encoder_open_child(e, n, de);
                         if (r < 0)
@@ -2319,8 +2540,60 @@ int ca_encoder_step(CaEncoder *e) {
         return ca_encoder_step_node(e, n);
 }
 
+static int ca_encoder_node_get_payload_run(CaEncoderNode *n, uint64_t offset, uint64_t size, uint64_t *ret_run, bool *ret_hole) {
+        off_t o;
+
+        assert(n);
+        assert(offset < size);
+        assert(ret_run);
+        assert(ret_hole);
+
+        /* Determines whether the payload at the specified offset is a hole or data, and how far that stretches */
+
+        /* Files with as many blocks allocated as their size needs have no holes, don't bother the file system then */
+        if (!S_ISREG(n->stat.st_mode) || (uint64_t) n->stat.st_blocks * 512U >= size)
+                goto data;
+
+        o = lseek(n->fd, (off_t) offset, SEEK_DATA);
+        if (o < 0) {
+                if (errno == ENXIO) { /* Nothing but a hole until the end of the file */
+                        *ret_run = size - offset;
+                        *ret_hole = true;
+                        return 0;
+                }
+                if (IN_SET(errno, EINVAL, EOPNOTSUPP)) /* Not supported by the file system */
+                        goto data;
+
+                return -errno;
+        }
+        if ((uint64_t) o > offset) {
+                *ret_run = MIN((uint64_t) o, size) - offset;
+                *ret_hole = true;
+                return 0;
+        }
+
+        o = lseek(n->fd, (off_t) offset, SEEK_HOLE);
+        if (o < 0) {
+                if (IN_SET(errno, EINVAL, EOPNOTSUPP))
+                        goto data;
+
+                return -errno;
+        }
+        if ((uint64_t) o > offset) {
+                *ret_run = MIN((uint64_t) o, size) - offset;
+                *ret_hole = false;
+                return 0;
+        }
+
+data:
+        *ret_run = size - offset;
+        *ret_hole = false;
+        return 0;
+}
+
 static int ca_encoder_get_payload_data(CaEncoder *e, CaEncoderNode *n, uint64_t suggested_size) {
-        uint64_t size;
+        uint64_t size, run = 0;
+        bool hole = false;
         ssize_t m;
         size_t k;
         void *p;
@@ -2340,15 +2613,37 @@ static int ca_encoder_get_payload_data(CaEncoder *e, CaEncoderNode *n, uint64_t
         if (e->payload_offset >= size) /* at EOF? */
                 return 0;
 
-        k = (size_t) MIN(BUFFER_SIZE, size - e->payload_offset);
+        r = ca_encoder_node_get_payload_run(n, e->payload_offset, size, &run, &hole);
+        if (r < 0)
+                return r;
+
+        /* Never mix data and holes in one go, so that holes may be passed on as such */
+        k = (size_t) MIN(ENCODER_PAYLOAD_WINDOW_SIZE, run);
         if (suggested_size != UINT64_MAX && k > suggested_size)
                 k = suggested_size;
 
+        /* Files are read front to back, tell the kernel so, and have it read the next window while the current one is
+         * processed. This is just a hint, hence ignore failures. */
+        if (e->payload_offset == 0)
+                (void) posix_fadvise(n->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (e->payload_offset + k < size)
+                (void) posix_fadvise(n->fd, e->payload_offset + k,
+                                     MIN(ENCODER_PAYLOAD_WINDOW_SIZE, size - e->payload_offset - k),
+                                     POSIX_FADV_WILLNEED);
+
         /*准备buffer*/
         p = realloc_buffer_acquire(&e->buffer, k);
         if (!p)
                 return -ENOMEM;
 
+        e->payload_hole = hole;
+
+        if (hole) {
+                /* Holes read as zeros, hence don't actually read them */
+                memset(p, 0, k);
+                return 1;
+        }
+
         /*自文件中分片读取内容，填充到buffer中*/
         m = pread(n->fd, p, k, e->payload_offset);
         if (m < 0) {
@@ -3059,6 +3354,32 @@ done:
         return 1;
 }
 
+int ca_encoder_skip_entry(CaEncoder *e, uint64_t size) {
+        if (!e)
+                return -EINVAL;
+        if (size == 0 || size == UINT64_MAX)
+                return -EINVAL;
+        if (e->state != CA_ENCODER_ENTRY)
+                return -ENODATA;
+
+        /* Skips over the ENTRY record of the current node without generating it, on the caller's word that it is
+         * 'size' bytes long. This avoids reading the node's metadata (xattrs, ACLs, chattr flags, …) altogether, and
+         * is useful when the caller already knows the record from a previous run, for example because the node's
+         * inode, generation and ctime match what is recorded in the cache. Since no data is generated this may only
+         * be used if no digests are calculated, and only if nothing of the record has been returned yet. */
+
+        if (e->want_archive_digest || e->want_hardlink_digest || e->want_payload_digest)
+                return -EBUSY;
+        if (e->payload_offset > 0 || realloc_buffer_size(&e->buffer) > 0 || e->skipped_bytes > 0)
+                return -EBUSY;
+
+        if (size < sizeof(CaFormatEntry))
+                return -EINVAL;
+
+        e->skipped_bytes = size;
+        return 0;
+}
+
 static int ca_encoder_node_path(CaEncoder *e, CaEncoderNode *node, char **ret) {
         _cleanup_free_ char *p = NULL;
         size_t n = 0, i;
@@ -3507,6 +3828,20 @@ int ca_encoder_current_payload_offset(CaEncoder *e, uint64_t *ret) {
         return 0;
 }
 
+int ca_encoder_current_payload_hole(CaEncoder *e) {
+        if (!e)
+                return -EINVAL;
+        if (e->state != CA_ENCODER_IN_PAYLOAD)
+                return -ENODATA;
+        if (realloc_buffer_size(&e->buffer) == 0)
+                return -ENODATA;
+
+        /* Returns > 0 if the payload data last returned by ca_encoder_get_data() is a hole in the file, i.e. all
+         * zeros, 0 otherwise */
+
+        return e->payload_hole;
+}
+
 int ca_encoder_current_archive_offset(CaEncoder *e, uint64_t *ret) {
         if (!e)
                 return -EINVAL;
@@ -3519,6 +3854,43 @@ int ca_encoder_current_archive_offset(CaEncoder *e, uint64_t *ret) {
         return 0;
 }
 
+static uint64_t ca_encoder_node_subtree_fingerprint(CaEncoder *e, CaEncoderNode *n) {
+        struct siphash state;
+        uint64_t start_offset;
+        size_t i;
+
+        assert(e);
+        assert(n);
+        assert(e->state == CA_ENCODER_GOODBYE);
+
+        /* Calculates a fingerprint of everything the GOODBYE record of a directory is generated from: the names of
+         * its children and the positions of their serializations relative to the record. Returns UINT64_MAX if we
+         * don't know them, for example because we got here through a seek. */
+
+        if (!n->name_table)
+                return UINT64_MAX;
+        if (e->archive_offset == UINT64_MAX)
+                return UINT64_MAX;
+        if (e->archive_offset < e->payload_offset)
+                return UINT64_MAX;
+
+        start_offset = e->archive_offset - e->payload_offset;
+
+        siphash24_init(&state, (const uint8_t[16]) CA_FORMAT_GOODBYE_HASH_KEY);
+        siphash24_compress(&(uint64_t) { htole64(start_offset - n->name_table->entry_offset) }, sizeof(uint64_t), &state);
+
+        for (i = 0; i < ca_name_table_items(n->name_table); i++) {
+                CaNameItem *item = n->name_table->items + i;
+
+                siphash24_compress(&(uint64_t) { htole64(item->hash) }, sizeof(uint64_t), &state);
+                siphash24_compress(&(uint64_t) { htole64(start_offset - item->start_offset) }, sizeof(uint64_t), &state);
+                siphash24_compress(&(uint64_t) { htole64(item->end_offset - item->start_offset) }, sizeof(uint64_t), &state);
+        }
+
+        /* UINT64_MAX means "unspecified" for locations, avoid it */
+        return MIN(siphash24_finalize(&state), UINT64_MAX - 1);
+}
+
 int ca_encoder_current_location(CaEncoder *e, uint64_t add, CaLocation **ret) {
         CaEncoderNode *node, *name_table_node;
         _cleanup_free_ char *path = NULL;
@@ -3602,6 +3974,9 @@ int ca_encoder_current_location(CaEncoder *e, uint64_t add, CaLocation **ret) {
         l->generation_valid = node->generation_valid > 0;
         l->generation = node->generation;
 
+        if (designator == CA_LOCATION_GOODBYE)
+                l->subtree = ca_encoder_node_subtree_fingerprint(e, node);
+
         l->name_table = name_table_node ? ca_name_table_ref(name_table_node->name_table) : NULL;
 
         if (e->archive_offset != UINT64_MAX)
@@ -3752,7 +4127,7 @@ static int ca_encoder_node_install_name_table(CaEncoder *e, CaEncoderNode *node,
 }
 
 int ca_encoder_seek_location(CaEncoder *e, CaLocation *location) {
-        CaEncoderNode *node;
+        CaEncoderNode *node, *child;
         int r;
 
         if (!e)
@@ -3883,6 +4258,14 @@ int ca_encoder_seek_location(CaEncoder *e, CaLocation *location) {
                 if (!S_ISDIR(node->stat.st_mode))
                         return -ENOTDIR;
 
+                /* The child might be one we already opened before, and partially serialized. Start from scratch
+                 * with it, we'll enter it right after the FILENAME record. */
+                child = ca_encoder_current_child_node(e);
+                if (child) {
+                        child->dirent_idx = 0;
+                        child->name_table = ca_name_table_unref(child->name_table);
+                }
+
                 ca_encoder_enter_state(e, CA_ENCODER_FILENAME);
                 e->payload_offset = location->offset;
                 e->archive_offset = location->archive_offset;
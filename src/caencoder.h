@@ -32,6 +32,8 @@ int ca_encoder_get_covering_feature_flags(CaEncoder *e, uint64_t *ret);
 int ca_encoder_set_uid_shift(CaEncoder *e, uid_t u);
 int ca_encoder_set_uid_range(CaEncoder *e, uid_t u);
 
+int ca_encoder_set_n_threads(CaEncoder *e, unsigned n);
+
 /* Input: a directory tree, block device node or regular file */
 int ca_encoder_set_base_fd(CaEncoder *e, int fd);
 int ca_encoder_get_base_fd(CaEncoder *e);
@@ -40,6 +42,7 @@ int ca_encoder_step(CaEncoder *e);
 
 /* Output: archive stream data */
 int ca_encoder_get_data(CaEncoder *e, uint64_t suggested_size, const void **ret, size_t *ret_size);
+int ca_encoder_skip_entry(CaEncoder *e, uint64_t size);
 
 int ca_encoder_current_path(CaEncoder *e, char **ret);
 int ca_encoder_current_mode(CaEncoder *d, mode_t *ret);
@@ -57,6 +60,7 @@ int ca_encoder_current_xattr(CaEncoder *e, CaIterate where, const char **ret_nam
 int ca_encoder_current_quota_projid(CaEncoder *e, uint32_t *ret);
 
 int ca_encoder_current_payload_offset(CaEncoder *e, uint64_t *ret);
+int ca_encoder_current_payload_hole(CaEncoder *e);
 int ca_encoder_current_archive_offset(CaEncoder *e, uint64_t *ret);
 
 int ca_encoder_current_location(CaEncoder *e, uint64_t add, CaLocation **ret);
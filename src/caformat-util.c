@@ -211,6 +211,10 @@ int ca_feature_flags_normalize(uint64_t flags, uint64_t *ret) {
         if (flags & CA_FORMAT_WITH_SUBVOLUME_RO)
                 flags |= CA_FORMAT_WITH_SUBVOLUME;
 
+        /* Only one digest algorithm may be in effect. SHA512/256 takes precedence, as it is our default. */
+        if (flags & CA_FORMAT_SHA512_256)
+                flags &= ~CA_FORMAT_BLAKE3;
+
         *ret = flags;
         return 0;
 }
@@ -258,6 +262,10 @@ int ca_feature_flags_are_normalized(uint64_t flags) {
             !(flags & CA_FORMAT_WITH_SUBVOLUME))
                 return false;
 
+        if ((flags & CA_FORMAT_BLAKE3) &&
+            (flags & CA_FORMAT_SHA512_256))
+                return false;
+
         return true;
 }
 
@@ -534,6 +542,9 @@ uint64_t ca_feature_flags_from_digest_type(CaDigestType type) {
         case CA_DIGEST_SHA512_256:
                 return CA_FORMAT_SHA512_256;
 
+        case CA_DIGEST_BLAKE3:
+                return CA_FORMAT_BLAKE3;
+
         default:
                 return UINT64_MAX;
         }
@@ -543,6 +554,8 @@ CaDigestType ca_feature_flags_to_digest_type(uint64_t flags) {
 
         if (flags & CA_FORMAT_SHA512_256)
                 return CA_DIGEST_SHA512_256;
+        else if (flags & CA_FORMAT_BLAKE3)
+                return CA_DIGEST_BLAKE3;
         else
                 return CA_DIGEST_SHA256;
 }
@@ -76,6 +76,11 @@ enum {
 
         /* The end marker used in the TABLE object */
         CA_FORMAT_TABLE_TAIL_MARKER     = UINT64_C(0x4b4f050e5549ecd1),
+
+        /* The packfile and packfile index format */
+        CA_FORMAT_PACK                  = UINT64_C(0x30ca9c8e3d8bbb01),
+        CA_FORMAT_PACK_CHUNK            = UINT64_C(0xf6d705d24a23c929),
+        CA_FORMAT_PACK_INDEX            = UINT64_C(0xd18968a02a320e7b),
 };
 
 /* Feature flags */
@@ -124,6 +129,7 @@ enum {
         /* XFS/ext4 project quota ID */
         CA_FORMAT_WITH_QUOTA_PROJID      = UINT64_C(0x100000000),
 
+        CA_FORMAT_BLAKE3                 = UINT64_C(0x0800000000000000),
         CA_FORMAT_EXCLUDE_FILE           = UINT64_C(0x1000000000000000),
         CA_FORMAT_SHA512_256             = UINT64_C(0x2000000000000000),
         CA_FORMAT_EXCLUDE_SUBMOUNTS      = UINT64_C(0x4000000000000000),
@@ -269,7 +275,8 @@ enum {
                 CA_FORMAT_EXCLUDE_NODUMP|
                 CA_FORMAT_EXCLUDE_SUBMOUNTS|
                 CA_FORMAT_EXCLUDE_FILE|
-                CA_FORMAT_SHA512_256,
+                CA_FORMAT_SHA512_256|
+                CA_FORMAT_BLAKE3,
 };
 
 typedef struct CaFormatHeader {
@@ -446,4 +453,43 @@ typedef struct CaFormatTable {
         /* Followed by one CaFormatTableTail */
 } CaFormatTable;
 
+/* A packfile contains many chunks of a store, in the order they were added:
+ *
+ * PACK              -- the file header
+ * PACK_CHUNK        -- one chunk, followed by its (possibly compressed) data
+ * ...               -- more of these
+ *
+ * Its matching index file contains one PACK_INDEX object, listing all chunks of the packfile sorted by their ID. The
+ * index file is written once the packfile is complete, hence a packfile without index is still being written (or its
+ * writer died). */
+
+enum {
+        CA_FORMAT_PACK_CHUNK_COMPRESSED = 0x1,
+};
+
+typedef struct CaFormatPack {
+        CaFormatHeader header;
+        le64_t flags;          /* currently always zero */
+} CaFormatPack;
+
+typedef struct CaFormatPackChunk {
+        CaFormatHeader header; /* size includes the chunk data */
+        le64_t flags;          /* CA_FORMAT_PACK_CHUNK_COMPRESSED */
+        uint8_t chunk[CA_CHUNK_ID_SIZE];
+        uint8_t data[];
+} CaFormatPackChunk;
+
+typedef struct CaFormatPackIndexItem {
+        uint8_t chunk[CA_CHUNK_ID_SIZE];
+        le64_t offset;         /* the offset of the PACK_CHUNK object in the packfile */
+        le64_t size;           /* the size of the chunk data */
+        le64_t flags;          /* same as in the PACK_CHUNK object */
+} CaFormatPackIndexItem;
+
+typedef struct CaFormatPackIndex {
+        CaFormatHeader header; /* size covers the whole index file */
+        le32_t fanout[256];    /* fanout[i] is the number of items whose chunk ID starts with a byte <= i */
+        CaFormatPackIndexItem items[];
+} CaFormatPackIndex;
+
 #endif
@@ -646,7 +646,7 @@ static int feature_flags_warning(CaSync *s) {
                 }
         }
 
-        unsupported = ff & ~(CA_FORMAT_WITH_FUSE|CA_FORMAT_SHA512_256|CA_FORMAT_EXCLUDE_SUBMOUNTS|CA_FORMAT_EXCLUDE_NODUMP|CA_FORMAT_EXCLUDE_FILE);
+        unsupported = ff & ~(CA_FORMAT_WITH_FUSE|CA_FORMAT_SHA512_256|CA_FORMAT_BLAKE3|CA_FORMAT_EXCLUDE_SUBMOUNTS|CA_FORMAT_EXCLUDE_NODUMP|CA_FORMAT_EXCLUDE_FILE);
         if (unsupported == 0)
                 return 0;
 
@@ -2,6 +2,7 @@
 
 #include <fcntl.h>
 #include <stddef.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "cachunk.h"
@@ -9,6 +10,7 @@
 #include "caformat.h"
 #include "caindex.h"
 #include "def.h"
+#include "realloc-buffer.h"
 #include "util.h"
 
 /* #undef EBADMSG */
@@ -48,6 +50,16 @@ struct CaIndex {
 
         uint64_t file_size; /* The size of the index file */
         uint64_t blob_size; /* The size of the blob this index file describes */
+
+        /* When reading a regular file we map it into memory in its entirety, so that items may be accessed without
+         * any syscalls */
+        void *map;
+        size_t map_size;
+
+        /* Otherwise items are read and written in batches of this size */
+        size_t buffer_size;
+        ReallocBuffer read_buffer;
+        ReallocBuffer write_buffer;
 };
 
 static inline uint64_t CA_INDEX_METADATA_SIZE(CaIndex *i) {
@@ -68,6 +80,7 @@ static CaIndex* ca_index_new(void) {
         i->file_size = UINT64_MAX;
         i->blob_size = UINT64_MAX;
         i->feature_flags = UINT64_MAX;
+        i->buffer_size = BUFFER_SIZE;
 
         return i;
 }
@@ -139,6 +152,12 @@ CaIndex *ca_index_unref(CaIndex *i) {
                 free(i->temporary_path);
         }
 
+        if (i->map)
+                (void) munmap(i->map, i->map_size);
+
+        realloc_buffer_free(&i->read_buffer);
+        realloc_buffer_free(&i->write_buffer);
+
         if (i->fd >= 2)
                 safe_close(i->fd);
 
@@ -172,6 +191,16 @@ int ca_index_set_fd(CaIndex *i, int fd) {
         return 0;
 }
 
+int ca_index_set_buffer_size(CaIndex *i, size_t size) {
+        if (!i)
+                return -EINVAL;
+        if (size < sizeof(CaFormatTableItem))
+                return -EINVAL;
+
+        i->buffer_size = size;
+        return 0;
+}
+
 int ca_index_set_path(CaIndex *i, const char *path) {
         if (!i)
                 return -EINVAL;
@@ -187,6 +216,41 @@ int ca_index_set_path(CaIndex *i, const char *path) {
         return 0;
 }
 
+static int ca_index_map(CaIndex *i) {
+        struct stat st;
+        void *m;
+
+        assert(i);
+        assert(i->fd >= 0);
+
+        if (i->mode != CA_INDEX_READ)
+                return 0;
+        if (i->map)
+                return 0;
+
+        if (fstat(i->fd, &st) < 0)
+                return -errno;
+
+        /* If this is not a regular file (for example a pipe), or something we can't map, we'll read it the
+         * traditional way instead. */
+        if (!S_ISREG(st.st_mode))
+                return 0;
+        if (st.st_size <= 0)
+                return 0;
+        if ((uint64_t) st.st_size > SIZE_MAX)
+                return 0;
+
+        m = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, i->fd, 0);
+        if (m == MAP_FAILED)
+                return 0;
+
+        i->map = m;
+        i->map_size = (size_t) st.st_size;
+        i->file_size = (uint64_t) st.st_size;
+
+        return 1;
+}
+
 static int ca_index_open_fd(CaIndex *i) {
         const char *p;
         int r;
@@ -195,7 +259,7 @@ static int ca_index_open_fd(CaIndex *i) {
 
         if (i->fd >= 0)
         	/*index已有fd,直接返回*/
-                return 0;
+                return ca_index_map(i);
 
         switch (i->open_flags & O_ACCMODE) {
 
@@ -242,9 +306,72 @@ static int ca_index_open_fd(CaIndex *i) {
         if (i->fd < 0)
                 return -errno;
 
+        r = ca_index_map(i);
+        if (r < 0)
+                return r;
+
         return 1;
 }
 
+static int ca_index_flush(CaIndex *i) {
+        int r;
+
+        assert(i);
+
+        if (realloc_buffer_size(&i->write_buffer) == 0)
+                return 0;
+
+        r = loop_write(i->fd, realloc_buffer_data(&i->write_buffer), realloc_buffer_size(&i->write_buffer));
+        if (r < 0)
+                return r;
+
+        realloc_buffer_empty(&i->write_buffer);
+        return 0;
+}
+
+static int ca_index_write_buffered(CaIndex *i, const void *p, size_t size) {
+        assert(i);
+        assert(p || size == 0);
+
+        if (!realloc_buffer_append(&i->write_buffer, p, size))
+                return -ENOMEM;
+
+        if (realloc_buffer_size(&i->write_buffer) < i->buffer_size)
+                return 0;
+
+        return ca_index_flush(i);
+}
+
+static int ca_index_read_buffered(CaIndex *i, void *p, size_t size) {
+        int r;
+
+        assert(i);
+        assert(p || size == 0);
+
+        /* Reads the next 'size' bytes at the cooked offset, either from the memory map, or from the read buffer,
+         * which is refilled from the fd as needed. The caller advances the cooked offset. */
+
+        if (i->map) {
+                if (i->cooked_offset > i->map_size ||
+                    i->map_size - i->cooked_offset < size)
+                        return -EPIPE;
+
+                memcpy(p, (const uint8_t*) i->map + i->cooked_offset, size);
+                return 0;
+        }
+
+        while (realloc_buffer_size(&i->read_buffer) < size) {
+                r = realloc_buffer_read_size(&i->read_buffer, i->fd, i->buffer_size);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        return -EPIPE;
+        }
+
+        memcpy(p, realloc_buffer_data(&i->read_buffer), size);
+        return realloc_buffer_advance(&i->read_buffer, size);
+}
+
 static int ca_index_write_head(CaIndex *i) {
 
         struct {
@@ -287,7 +414,7 @@ static int ca_index_write_head(CaIndex *i) {
         assert(i->cooked_offset == 0);
 
         /*写入head*/
-        r = loop_write(i->fd, &head, sizeof(head));
+        r = ca_index_write_buffered(i, &head, sizeof(head));
         if (r < 0)
                 return r;
 
@@ -323,7 +450,6 @@ static int ca_index_read_head(CaIndex *i) {
                 CaFormatIndex index;
                 CaFormatHeader table;
         } head;
-        ssize_t n;
         int r;
 
         assert(i);
@@ -344,13 +470,9 @@ static int ca_index_read_head(CaIndex *i) {
                 return -EAGAIN;
 
         /*读取结构体head*/
-        n = loop_read(i->fd, &head, sizeof(head));
-        if (n < 0)
-        	/*读取失败，返回错误*/
-                return (int) n;
-        if (n != sizeof(head))
-        	/*读取长度不足*/
-                return -EPIPE;
+        r = ca_index_read_buffered(i, &head, sizeof(head));
+        if (r < 0)
+                return r;
 
         if (le64toh(head.index.header.size) != sizeof(CaFormatIndex) ||
             le64toh(head.index.header.type) != CA_FORMAT_INDEX)
@@ -397,6 +519,28 @@ static int ca_index_read_head(CaIndex *i) {
         return 0;
 }
 
+static ssize_t ca_index_pread(CaIndex *i, void *buf, size_t size, uint64_t offset) {
+        ssize_t n;
+
+        assert(i);
+        assert(buf);
+
+        if (i->map) {
+                if (offset >= i->map_size)
+                        return 0;
+
+                n = (ssize_t) MIN(size, i->map_size - offset);
+                memcpy(buf, (const uint8_t*) i->map + offset, n);
+                return n;
+        }
+
+        n = pread(i->fd, buf, size, offset);
+        if (n < 0)
+                return -errno;
+
+        return n;
+}
+
 int ca_index_open(CaIndex *i) {
         int r;
 
@@ -476,7 +620,7 @@ int ca_index_write_chunk(CaIndex *i, const CaChunkID *id, uint64_t size) {
         item.offset = htole64(end);
         memcpy(&item.chunk, id, sizeof(CaChunkID));
 
-        r = loop_write(i->fd, &item, sizeof(item));
+        r = ca_index_write_buffered(i, &item, sizeof(item));
         if (r < 0)
                 return r;
 
@@ -510,7 +654,11 @@ int ca_index_write_eof(CaIndex *i) {
                             sizeof(tail));
         tail.marker = htole64(CA_FORMAT_TABLE_TAIL_MARKER);
 
-        r = loop_write(i->fd, &tail, sizeof(tail));
+        r = ca_index_write_buffered(i, &tail, sizeof(tail));
+        if (r < 0)
+                return r;
+
+        r = ca_index_flush(i);
         if (r < 0)
                 return r;
 
@@ -547,11 +695,9 @@ int ca_index_read_chunk(CaIndex *i, CaChunkID *ret_id, uint64_t *ret_offset_end,
         if (r == 0)
                 return -EAGAIN;
 
-        n = loop_read(i->fd, &buffer, sizeof(buffer));
-        if (n < 0)
-                return (int) n;
-        if (n != sizeof(buffer))
-                return -EPIPE;
+        r = ca_index_read_buffered(i, &buffer, sizeof(buffer));
+        if (r < 0)
+                return r;
 
         /* { */
         /*         char ids[CA_CHUNK_ID_FORMAT_MAX]; */
@@ -564,14 +710,22 @@ int ca_index_read_chunk(CaIndex *i, CaChunkID *ret_id, uint64_t *ret_offset_end,
             buffer.tail._zero_fill2 == 0 &&
             buffer.tail.index_offset == htole64(sizeof(CaFormatIndex)) &&
             le64toh(buffer.tail.size) == (i->cooked_offset - i->start_offset + offsetof(CaFormatTable, items) + sizeof(CaFormatTableTail))) {
-                uint8_t final_byte;
+                if (i->map) {
+                        if (i->cooked_offset + sizeof(buffer) != i->map_size)
+                                return -EBADMSG;
+                } else {
+                        uint8_t final_byte;
 
-                /* We try to read one more byte than we expect. if we can read it there's trailing garbage. */
-                n = read(i->fd, &final_byte, sizeof(final_byte));
-                if (n < 0)
-                        return -errno;
-                if (n != 0)
-                        return -EBADMSG;
+                        if (realloc_buffer_size(&i->read_buffer) > 0)
+                                return -EBADMSG;
+
+                        /* We try to read one more byte than we expect. if we can read it there's trailing garbage. */
+                        n = read(i->fd, &final_byte, sizeof(final_byte));
+                        if (n < 0)
+                                return -errno;
+                        if (n != 0)
+                                return -EBADMSG;
+                }
 
                 if (ret_id)
                         memset(ret_id, 0, sizeof(CaChunkID));
@@ -629,8 +783,12 @@ int ca_index_set_position(CaIndex *i, uint64_t position) {
                 return -EINVAL;
 
         /*跳到q对应的位置处*/
-        if (lseek(i->fd, q, SEEK_SET) == (off_t) -1)
-                return -errno;
+        if (!i->map) {
+                if (lseek(i->fd, q, SEEK_SET) == (off_t) -1)
+                        return -errno;
+
+                realloc_buffer_empty(&i->read_buffer);
+        }
 
         i->cooked_offset = q;
         i->item_position = position;
@@ -794,6 +952,11 @@ int ca_index_incremental_read(CaIndex *i, ReallocBuffer *buffer) {
         if (i->raw_offset >= i->cooked_offset)
                 return i->wrote_eof ? 0 : -EAGAIN;
 
+        /* Make sure everything written so far is in the file, so that we can read it back */
+        r = ca_index_flush(i);
+        if (r < 0)
+                return r;
+
         m = MIN(BUFFER_SIZE, i->cooked_offset - i->raw_offset);
 
         p = realloc_buffer_acquire(buffer, m);
@@ -980,17 +1143,17 @@ static int ca_index_read_tail(CaIndex *i) {
         if (size == CA_INDEX_METADATA_SIZE(i)) {
                 /* If there's not a single chunk, then the blob has size zero, in this case only read the tail */
 
-                l = pread(i->fd, &buffer.tail, sizeof(buffer.tail), size - sizeof(buffer.tail));
+                l = ca_index_pread(i, &buffer.tail, sizeof(buffer.tail), size - sizeof(buffer.tail));
                 if (l < 0)
-                        return -errno;
+                        return (int) l;
                 if (l != sizeof(buffer.tail))
                         return -EBADMSG;
         } else {
                 /* If there's at least one chunk, then read the last chunk's data, too */
 
-                l = pread(i->fd, &buffer, sizeof(buffer), size - sizeof(buffer));
+                l = ca_index_pread(i, &buffer, sizeof(buffer), size - sizeof(buffer));
                 if (l < 0)
-                        return -errno;
+                        return (int) l;
                 if (l != sizeof(buffer))
                         return -EBADMSG;
         }
@@ -1025,98 +1188,131 @@ int ca_index_get_blob_size(CaIndex *i, uint64_t *ret) {
         return 0;
 }
 
-int ca_index_seek(CaIndex *i, uint64_t offset, uint64_t *ret_skip) {
-        uint64_t size, n_chunks, left, right;
+static int ca_index_read_item_offset(CaIndex *i, uint64_t n, uint64_t *ret) {
+        CaFormatTableItem item;
+        ssize_t l;
+
+        assert(i);
+        assert(ret);
+
+        l = ca_index_pread(i, &item, sizeof(item), i->start_offset + n * sizeof(CaFormatTableItem));
+        if (l < 0)
+                return (int) l;
+        if (l != sizeof(item))
+                return -EBADMSG;
+
+        *ret = le64toh(item.offset);
+        return 0;
+}
+
+int ca_index_get_chunk(CaIndex *i, uint64_t n, CaChunkID *ret_id, uint64_t *ret_offset_end, uint64_t *ret_size) {
+        CaFormatTableItem item;
+        uint64_t n_chunks, previous;
+        ssize_t l;
         int r;
 
         if (!i)
                 return -EINVAL;
+        if (!IN_SET(i->mode, CA_INDEX_READ, CA_INDEX_INCREMENTAL_READ))
+                return -ENOTTY;
 
-        r = ca_index_get_blob_size(i, &size);
+        r = ca_index_open(i);
         if (r < 0)
                 return r;
 
-        if (offset >= size)
-                return -ENXIO;
-
         r = ca_index_get_total_chunks(i, &n_chunks);
         if (r < 0)
                 return r;
-        if (n_chunks == 0)
+        if (n >= n_chunks)
                 return -ENXIO;
 
-        /* Small opimization for seeking within the first chunk */
-        if (n_chunks == 1 || offset < i->chunk_size_min) {
-                r = ca_index_set_position(i, 0);
+        l = ca_index_pread(i, &item, sizeof(item), i->start_offset + n * sizeof(CaFormatTableItem));
+        if (l < 0)
+                return (int) l;
+        if (l != sizeof(item))
+                return -EBADMSG;
+
+        if (n > 0) {
+                r = ca_index_read_item_offset(i, n - 1, &previous);
                 if (r < 0)
                         return r;
+        } else
+                previous = 0;
 
-                if (ret_skip)
-                        *ret_skip = offset;
-
-                return 0;
-        }
-
-        /* Implement bisection to find the right chunk */
-        left = 0;
-        right = n_chunks - 2;
-        for (;;) {
-                uint64_t first_chunk_end, second_chunk_end, p;
-
-                p = left + (right - left) / 2;
+        if (previous >= le64toh(item.offset))
+                return -EBADMSG;
+        if (le64toh(item.offset) - previous > i->chunk_size_max)
+                return -EBADMSG;
 
-                r = ca_index_set_position(i, p);
-                if (r < 0)
-                        return r;
+        if (ret_id)
+                memcpy(ret_id, item.chunk, sizeof(CaChunkID));
+        if (ret_offset_end)
+                *ret_offset_end = le64toh(item.offset);
+        if (ret_size)
+                *ret_size = le64toh(item.offset) - previous;
 
-                r = ca_index_read_chunk(i, NULL, &first_chunk_end, NULL);
-                if (r < 0)
-                        return r;
+        return 0;
+}
 
-                if (offset < first_chunk_end) {
+int ca_index_seek(CaIndex *i, uint64_t offset, uint64_t *ret_skip) {
+        uint64_t size, n_chunks, left, right, previous;
+        int r;
 
-                        if (p == 0) {
-                                /* This is left of the first chunk boundary? Then it's definitely in the first chunk */
+        if (!i)
+                return -EINVAL;
 
-                                r = ca_index_set_position(i, 0);
-                                if (r < 0)
-                                        return r;
+        r = ca_index_get_blob_size(i, &size);
+        if (r < 0)
+                return r;
 
-                                if (ret_skip)
-                                        *ret_skip = offset;
+        if (offset >= size)
+                return -ENXIO;
 
-                                return 0;
-                        }
+        r = ca_index_get_total_chunks(i, &n_chunks);
+        if (r < 0)
+                return r;
+        if (n_chunks == 0)
+                return -ENXIO;
 
-                        if (p == right)
-                                return -EBADMSG;
+        /* Bisect for the first chunk whose end offset is beyond the offset we are looking for. The chunk end offsets
+         * are strictly increasing, and the last one is the blob size, hence there always is one. */
+        left = 0;
+        right = n_chunks - 1;
+        while (left < right) {
+                uint64_t p, end;
 
-                        right = p;
-                        continue;
-                }
+                p = left + (right - left) / 2;
 
-                r = ca_index_read_chunk(i, NULL, &second_chunk_end, NULL);
+                r = ca_index_read_item_offset(i, p, &end);
                 if (r < 0)
                         return r;
 
-                if (offset >= second_chunk_end) {
-                        left = p+1;
-                        continue;
-                }
-
-                /* We found it, now let's position the read ptr on the second chunk again */
+                if (offset < end)
+                        right = p;
+                else
+                        left = p + 1;
+        }
 
-                r = ca_index_set_position(i, p + 1);
+        if (left > 0) {
+                r = ca_index_read_item_offset(i, left - 1, &previous);
                 if (r < 0)
                         return r;
+                if (previous > offset)
+                        return -EBADMSG;
+        } else
+                previous = 0;
 
-                i->previous_chunk_offset = first_chunk_end;
+        /* Position the read pointer on the chunk we found */
+        r = ca_index_set_position(i, left);
+        if (r < 0)
+                return r;
 
-                if (ret_skip)
-                        *ret_skip = offset - first_chunk_end;
+        i->previous_chunk_offset = previous;
 
-                return 0;
-        }
+        if (ret_skip)
+                *ret_skip = offset - previous;
+
+        return 0;
 }
 
 int ca_index_set_feature_flags(CaIndex *i, uint64_t flags) {
@@ -22,6 +22,9 @@ int ca_index_set_path(CaIndex *i, const char *path);
 
 int ca_index_set_make_mode(CaIndex *i, mode_t m);
 
+/* How many bytes of items to read or write at once, unless the index file is mapped into memory */
+int ca_index_set_buffer_size(CaIndex *i, size_t size);
+
 int ca_index_open(CaIndex *i);
 
 int ca_index_install(CaIndex *i);
@@ -31,6 +34,9 @@ int ca_index_write_eof(CaIndex *i);
 
 int ca_index_read_chunk(CaIndex *i, CaChunkID *id, uint64_t *ret_offset_end, uint64_t *ret_size);
 
+/* Returns the n-th chunk of the index, without changing the read position */
+int ca_index_get_chunk(CaIndex *i, uint64_t n, CaChunkID *ret_id, uint64_t *ret_offset_end, uint64_t *ret_size);
+
 int ca_index_set_position(CaIndex *i, uint64_t position);
 int ca_index_get_position(CaIndex *i, uint64_t *ret);
 int ca_index_get_available_chunks(CaIndex *i, uint64_t *ret);
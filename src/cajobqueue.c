@@ -0,0 +1,338 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cajobqueue.h"
+
+typedef enum CaJobState {
+        CA_JOB_FREE,
+        CA_JOB_ACQUIRED,
+        CA_JOB_PENDING,
+        CA_JOB_RUNNING,
+        CA_JOB_DONE,
+} CaJobState;
+
+struct CaJobQueue {
+        CaJobFunction func;
+        CaJobFreeFunction free_func;
+        void *userdata;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t work_cond; /* signalled when a job got submitted, or we shall quit */
+        pthread_cond_t done_cond; /* signalled when a job completed */
+
+        pthread_t *threads;
+        size_t n_threads;
+
+        uint8_t *slots;
+        size_t slot_size;
+        size_t n_slots;
+
+        CaJobState *states;
+        int *results;
+
+        size_t head;      /* Index of the oldest job */
+        size_t n_queued;  /* Number of submitted jobs not retired yet */
+        size_t n_taken;   /* Number of submitted jobs (counted from the head) that a worker already picked up */
+        bool acquired;    /* Whether the slot following the queued jobs has been handed out */
+
+        bool quit;
+
+        int notify_fd; /* eventfd to write to when a job completed, not owned */
+};
+
+static void *ca_job_queue_slot(CaJobQueue *q, size_t i) {
+        return q->slots + (i % q->n_slots) * q->slot_size;
+}
+
+static void *ca_job_queue_worker(void *p) {
+        CaJobQueue *q = p;
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+        for (;;) {
+                size_t i;
+                int r;
+
+                while (!q->quit && q->n_taken >= q->n_queued)
+                        assert_se(pthread_cond_wait(&q->work_cond, &q->mutex) == 0);
+
+                if (q->quit)
+                        break;
+
+                i = (q->head + q->n_taken) % q->n_slots;
+                q->n_taken++;
+
+                assert(q->states[i] == CA_JOB_PENDING);
+                q->states[i] = CA_JOB_RUNNING;
+
+                assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+                r = q->func(ca_job_queue_slot(q, i), q->userdata);
+                assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+                q->states[i] = CA_JOB_DONE;
+                q->results[i] = r;
+
+                assert_se(pthread_cond_broadcast(&q->done_cond) == 0);
+
+                if (q->notify_fd >= 0) {
+                        uint64_t one = 1;
+
+                        (void) write(q->notify_fd, &one, sizeof(one));
+                }
+        }
+
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+        return NULL;
+}
+
+int ca_job_queue_new(
+                size_t n_threads,
+                size_t n_slots,
+                size_t slot_size,
+                CaJobFunction func,
+                CaJobFreeFunction free_func,
+                void *userdata,
+                CaJobQueue **ret) {
+
+        CaJobQueue *q;
+        int r;
+
+        if (n_slots == 0)
+                return -EINVAL;
+        if (slot_size == 0)
+                return -EINVAL;
+        if (!func)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        q = new0(CaJobQueue, 1);
+        if (!q)
+                return -ENOMEM;
+
+        q->func = func;
+        q->free_func = free_func;
+        q->userdata = userdata;
+        q->notify_fd = -1;
+
+        assert_se(pthread_mutex_init(&q->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&q->work_cond, NULL) == 0);
+        assert_se(pthread_cond_init(&q->done_cond, NULL) == 0);
+
+        /* Keep every slot suitably aligned for whatever the caller stores in it */
+        q->slot_size = ALIGN_TO(slot_size, sizeof(max_align_t));
+        q->n_slots = n_slots;
+
+        q->slots = calloc(n_slots, q->slot_size);
+        q->states = new0(CaJobState, n_slots);
+        q->results = new0(int, n_slots);
+        if (!q->slots || !q->states || !q->results) {
+                r = -ENOMEM;
+                goto fail;
+        }
+
+        if (n_threads > 0) {
+                q->threads = new(pthread_t, n_threads);
+                if (!q->threads) {
+                        r = -ENOMEM;
+                        goto fail;
+                }
+
+                for (; q->n_threads < n_threads; q->n_threads++) {
+                        r = pthread_create(q->threads + q->n_threads, NULL, ca_job_queue_worker, q);
+                        if (r != 0) {
+                                r = -r;
+                                goto fail;
+                        }
+                }
+        }
+
+        *ret = q;
+        return 0;
+
+fail:
+        ca_job_queue_unref(q);
+        return r;
+}
+
+CaJobQueue* ca_job_queue_unref(CaJobQueue *q) {
+        size_t i;
+
+        if (!q)
+                return NULL;
+
+        if (q->n_threads > 0) {
+                assert_se(pthread_mutex_lock(&q->mutex) == 0);
+                q->quit = true;
+                assert_se(pthread_cond_broadcast(&q->work_cond) == 0);
+                assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+                for (i = 0; i < q->n_threads; i++)
+                        assert_se(pthread_join(q->threads[i], NULL) == 0);
+        }
+        free(q->threads);
+
+        if (q->free_func && q->slots)
+                for (i = 0; i < q->n_slots; i++)
+                        q->free_func(ca_job_queue_slot(q, i));
+
+        free(q->slots);
+        free(q->states);
+        free(q->results);
+
+        assert_se(pthread_cond_destroy(&q->work_cond) == 0);
+        assert_se(pthread_cond_destroy(&q->done_cond) == 0);
+        assert_se(pthread_mutex_destroy(&q->mutex) == 0);
+
+        return mfree(q);
+}
+
+void* ca_job_queue_acquire(CaJobQueue *q) {
+        void *p;
+
+        if (!q)
+                return NULL;
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+        if (q->n_queued >= q->n_slots)
+                p = NULL;
+        else {
+                size_t i;
+
+                i = (q->head + q->n_queued) % q->n_slots;
+                assert(IN_SET(q->states[i], CA_JOB_FREE, CA_JOB_ACQUIRED));
+
+                q->states[i] = CA_JOB_ACQUIRED;
+                q->acquired = true;
+                p = ca_job_queue_slot(q, i);
+        }
+
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+        return p;
+}
+
+int ca_job_queue_submit(CaJobQueue *q) {
+        size_t i;
+
+        if (!q)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+        if (!q->acquired) {
+                assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+                return -EBADR;
+        }
+
+        i = (q->head + q->n_queued) % q->n_slots;
+        assert(q->states[i] == CA_JOB_ACQUIRED);
+
+        q->acquired = false;
+        q->n_queued++;
+
+        if (q->n_threads == 0) {
+                /* Without any worker threads we simply run the job synchronously */
+                q->n_taken++;
+                assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+                q->results[i] = q->func(ca_job_queue_slot(q, i), q->userdata);
+                q->states[i] = CA_JOB_DONE;
+                return 0;
+        }
+
+        q->states[i] = CA_JOB_PENDING;
+        assert_se(pthread_cond_signal(&q->work_cond) == 0);
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+        return 0;
+}
+
+int ca_job_queue_peek(CaJobQueue *q, bool wait, void **ret, int *ret_result) {
+        int r;
+
+        if (!q)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+        for (;;) {
+                if (q->n_queued == 0) {
+                        r = -ENODATA;
+                        break;
+                }
+
+                if (q->states[q->head] == CA_JOB_DONE) {
+                        if (ret)
+                                *ret = ca_job_queue_slot(q, q->head);
+                        if (ret_result)
+                                *ret_result = q->results[q->head];
+
+                        r = 0;
+                        break;
+                }
+
+                if (!wait) {
+                        r = -EAGAIN;
+                        break;
+                }
+
+                assert_se(pthread_cond_wait(&q->done_cond, &q->mutex) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+        return r;
+}
+
+int ca_job_queue_retire(CaJobQueue *q) {
+        int r;
+
+        if (!q)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+        if (q->n_queued == 0)
+                r = -ENODATA;
+        else if (q->states[q->head] != CA_JOB_DONE)
+                r = -EBUSY;
+        else {
+                q->states[q->head] = CA_JOB_FREE;
+                q->head = (q->head + 1) % q->n_slots;
+                q->n_queued--;
+                q->n_taken--;
+                r = 0;
+        }
+
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+        return r;
+}
+
+size_t ca_job_queue_queued(CaJobQueue *q) {
+        size_t n;
+
+        if (!q)
+                return 0;
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+        n = q->n_queued;
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+        return n;
+}
+
+int ca_job_queue_set_notify_fd(CaJobQueue *q, int fd) {
+        if (!q)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+        q->notify_fd = fd;
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+        return 0;
+}
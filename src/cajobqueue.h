@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef foocajobqueuehfoo
+#define foocajobqueuehfoo
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util.h"
+
+/* A simple bounded queue of jobs that are executed on a pool of worker threads, but retired strictly in the order
+ * they were submitted in. Each job lives in a caller-sized slot that is reused once the job is retired, so that
+ * callers may keep buffers around in it. */
+
+typedef struct CaJobQueue CaJobQueue;
+
+/* Executed on a worker thread for each submitted job. The return value is reported when the job is retired. */
+typedef int (*CaJobFunction)(void *job, void *userdata);
+
+/* Invoked for every slot when the queue is destroyed, to release whatever the caller stored in it */
+typedef void (*CaJobFreeFunction)(void *job);
+
+int ca_job_queue_new(size_t n_threads, size_t n_slots, size_t slot_size, CaJobFunction func, CaJobFreeFunction free_func, void *userdata, CaJobQueue **ret);
+CaJobQueue* ca_job_queue_unref(CaJobQueue *q);
+DEFINE_TRIVIAL_CLEANUP_FUNC(CaJobQueue*, ca_job_queue_unref);
+
+/* Returns the next free slot, or NULL if all slots are in use and the oldest job needs to be retired first */
+void* ca_job_queue_acquire(CaJobQueue *q);
+int ca_job_queue_submit(CaJobQueue *q);
+
+/* Returns the oldest job once it completed, along with its result. Returns -EAGAIN if it is still being processed
+ * and 'wait' is false, and -ENODATA if there is no job queued at all. */
+int ca_job_queue_peek(CaJobQueue *q, bool wait, void **ret, int *ret_result);
+int ca_job_queue_retire(CaJobQueue *q);
+
+size_t ca_job_queue_queued(CaJobQueue *q);
+
+/* Makes worker threads write a 64bit 1 to the specified eventfd each time a job completed, so that the oldest job
+ * may be waited for in a poll() loop. The fd is not taken possession of, and must stay valid while the queue
+ * exists. Pass -1 to turn this off again. */
+int ca_job_queue_set_notify_fd(CaJobQueue *q, int fd);
+
+#endif
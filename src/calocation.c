@@ -22,6 +22,7 @@ static CaLocation* ca_location_alloc(void) {
         l->offset = UINT64_MAX;
         l->size = UINT64_MAX;
         l->mtime = UINT64_MAX;
+        l->subtree = UINT64_MAX;
         l->archive_offset = UINT64_MAX;
         l->feature_flags = UINT64_MAX;
 
@@ -121,6 +122,7 @@ int ca_location_copy(CaLocation *l, CaLocation **ret) {
         copy->inode = l->inode;
         copy->generation_valid = l->generation_valid;
         copy->generation = l->generation;
+        copy->subtree = l->subtree;
         copy->name_table = ca_name_table_ref(l->name_table);
         copy->archive_offset = l->archive_offset;
         copy->feature_flags = l->feature_flags;
@@ -139,7 +141,7 @@ const char* ca_location_format_full(CaLocation *l, CaLocationWith with) {
 
         /* Here's how we format location strings:
          *
-         *     <path>+<designator><offset>[:<size>][@<inode>.<mtime>[.<generation>]][%<features>][#<archive-offset>][$<name-table>]
+         *     <path>+<designator><offset>[:<size>][@<inode>.<mtime>[.<generation>]][^<subtree>][%<features>][#<archive-offset>][$<name-table>]
          *
          * == Mandatory
          *
@@ -153,6 +155,7 @@ const char* ca_location_format_full(CaLocation *l, CaLocationWith with) {
          * inode:          the inode number of the path to the file/directory we are serializing
          * mtime:          the modification time in ns of the inode
          * generation:     when known the file's generation code
+         * subtree:        for GOODBYE records, the fingerprint of the directory's serialized children
          * features:       the feature mask used for encoding
          * archive-offset: the current offset in the archive
          * name-table:     the current name table, built up to the location
@@ -186,6 +189,12 @@ const char* ca_location_format_full(CaLocation *l, CaLocationWith with) {
                 }
         }
 
+        if ((with & CA_LOCATION_WITH_MTIME) && l->subtree != UINT64_MAX) {
+                r = realloc_buffer_printf(&buffer, "^%" PRIx64, l->subtree);
+                if (r < 0)
+                        return NULL;
+        }
+
         if ((with & CA_LOCATION_WITH_FEATURE_FLAGS) && l->feature_flags != UINT64_MAX) {
                 r = realloc_buffer_printf(&buffer, "%%%" PRIx64, l->feature_flags);
                 if (r < 0)
@@ -218,7 +227,7 @@ const char* ca_location_format_full(CaLocation *l, CaLocationWith with) {
 }
 
 int ca_location_parse(const char *text, CaLocation **ret) {
-        uint64_t offset, size = UINT64_MAX, mtime = UINT64_MAX, inode = 0, features = UINT64_MAX, archive_offset = UINT64_MAX;
+        uint64_t offset, size = UINT64_MAX, mtime = UINT64_MAX, inode = 0, subtree = UINT64_MAX, features = UINT64_MAX, archive_offset = UINT64_MAX;
         _cleanup_(ca_name_table_unrefp) CaNameTable *nt = NULL;
         const char *q, *c, *u;
         CaLocation *l;
@@ -277,6 +286,18 @@ int ca_location_parse(const char *text, CaLocation **ret) {
                 u = strndupa(u, q - u);
         }
 
+        /* The '^' suffix (subtree fingerprint) is optional */
+        q = strchr(u+2, '^');
+        if (q) {
+                r = safe_atox64(q + 1, &subtree);
+                if (r < 0)
+                        return r;
+                if (subtree == UINT64_MAX)
+                        return -EINVAL;
+
+                u = strndupa(u, q - u);
+        }
+
         /* The '@' suffix (inode/mtime/generation info) is optional */
         q = strchr(u+2, '@');
         if (q) {
@@ -368,6 +389,7 @@ int ca_location_parse(const char *text, CaLocation **ret) {
         l->mtime = mtime;
         l->generation = generation;
         l->generation_valid = generation_valid;
+        l->subtree = subtree;
         l->feature_flags = features;
         l->archive_offset = archive_offset;
 
@@ -516,6 +538,9 @@ int ca_location_merge(CaLocation **a, CaLocation *b) {
                         return 0;
         }
 
+        if ((*a)->subtree != b->subtree)
+                return 0;
+
         if ((*a)->n_ref == 1)
                 (*a)->formatted = mfree((*a)->formatted);
         else {
@@ -635,6 +660,9 @@ int ca_location_id_make(CaDigest *digest, CaLocation *l, bool include_size/*摘
                         ca_digest_write_u32(digest, (uint32_t) l->generation);
         }
 
+        if (l->subtree != UINT64_MAX)
+                ca_digest_write_u64(digest, l->subtree);
+
         if (l->feature_flags != UINT64_MAX)
                 ca_digest_write_u64(digest, l->feature_flags);
 
@@ -678,6 +706,9 @@ bool ca_location_equal(CaLocation *a, CaLocation *b, CaLocationWith with) {
                                 if (a->generation != b->generation)
                                         return false;
                 }
+
+                if (a->subtree != b->subtree)
+                        return false;
         }
 
         if (with & CA_LOCATION_WITH_FEATURE_FLAGS)
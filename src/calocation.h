@@ -64,6 +64,11 @@ typedef struct CaLocation {
         int generation; /* only valid if generation_valid is true */
         bool generation_valid;
 
+        /* For GOODBYE locations: a fingerprint of the directory's serialized children, i.e. their names and the
+         * sizes of their serializations. Changes deep in a subtree don't alter the directory's mtime, but do alter
+         * its GOODBYE record, and this is how we notice. If unspecified set to UINT64_MAX. */
+        uint64_t subtree;
+
         /* The feature flags used for encoding, so that we don't use cached data created with different settings (if unspecified UINT64_MAX) */
         uint64_t feature_flags;
 
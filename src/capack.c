@@ -0,0 +1,1164 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "caformat.h"
+#include "capack.h"
+#include "def.h"
+#include "dirent-util.h"
+#include "log.h"
+#include "set.h"
+
+#define CA_PACK_NAME_MAX (16 + 7 + 1)
+
+typedef struct CaPackFile {
+        uint64_t name;  /* The random number the packfile and its index file are named after */
+        int fd;         /* The packfile itself, opened lazily for completed packfiles */
+        uint64_t size;
+
+        /* The mmap()ed index file, for completed packfiles */
+        void *map;
+        size_t map_size;
+        const CaFormatPackIndex *index;
+        size_t n_items;
+
+        bool compacting:1;
+} CaPackFile;
+
+typedef struct CaPackItem {
+        CaChunkID chunk_id; /* Needs to be first, as this is used as key in a Set */
+        uint64_t offset;
+        uint64_t size;
+        uint64_t flags;
+} CaPackItem;
+
+struct CaPack {
+        pthread_mutex_t mutex;
+
+        char *path;
+        int dir_fd;
+        bool loaded;
+
+        CaPackFile **files; /* Completed packfiles */
+        size_t n_files;
+
+        /* The packfile we are currently appending to, and what we put into it so far */
+        CaPackFile *writing;
+        Set *written_items;
+
+        uint64_t size_max;
+
+        Set *removed_chunks;
+};
+
+static CaPackFile* ca_pack_file_free(CaPackFile *f) {
+        if (!f)
+                return NULL;
+
+        safe_close(f->fd);
+
+        if (f->map)
+                (void) munmap(f->map, f->map_size);
+
+        return mfree(f);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(CaPackFile*, ca_pack_file_free);
+
+static int ca_pack_item_compare(const void *a, const void *b) {
+        const CaFormatPackIndexItem *x = a, *y = b;
+
+        return memcmp(x->chunk, y->chunk, CA_CHUNK_ID_SIZE);
+}
+
+static char *ca_pack_file_name(uint64_t name, const char *suffix, char buffer[CA_PACK_NAME_MAX]) {
+        assert(strlen(suffix) == 7);
+
+        assert_se(snprintf(buffer, CA_PACK_NAME_MAX, "%016" PRIx64 "%s", name, suffix) == CA_PACK_NAME_MAX - 1);
+        return buffer;
+}
+
+static int ca_pack_parse_name(const char *fn, const char *suffix, uint64_t *ret) {
+        char buffer[17];
+        const char *e;
+
+        e = endswith(fn, suffix);
+        if (!e || e - fn != 16)
+                return -EINVAL;
+
+        memcpy(buffer, fn, 16);
+        buffer[16] = 0;
+
+        return safe_atox64(buffer, ret);
+}
+
+static int ca_pack_pread(int fd, void *p, size_t size, uint64_t offset) {
+        uint8_t *q = p;
+
+        while (size > 0) {
+                ssize_t n;
+
+                n = pread(fd, q, size, offset);
+                if (n < 0)
+                        return -errno;
+                if (n == 0) /* Truncated? */
+                        return -EBADMSG;
+
+                q += n;
+                size -= n;
+                offset += n;
+        }
+
+        return 0;
+}
+
+CaPack *ca_pack_new(void) {
+        CaPack *p;
+
+        p = new0(CaPack, 1);
+        if (!p)
+                return NULL;
+
+        if (pthread_mutex_init(&p->mutex, NULL) != 0)
+                return mfree(p);
+
+        p->dir_fd = -1;
+        p->size_max = CA_PACK_SIZE_MAX_DEFAULT;
+
+        return p;
+}
+
+int ca_pack_set_path(CaPack *p, const char *path) {
+        if (!p)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+
+        if (p->path)
+                return -EBUSY;
+
+        p->path = strdup(path);
+        if (!p->path)
+                return -ENOMEM;
+
+        return 0;
+}
+
+int ca_pack_set_size_max(CaPack *p, uint64_t size) {
+        if (!p)
+                return -EINVAL;
+        if (size == 0)
+                return -EINVAL;
+
+        p->size_max = size;
+        return 0;
+}
+
+static int ca_pack_file_load_index(CaPack *p, CaPackFile *f) {
+        char fn[CA_PACK_NAME_MAX];
+        _cleanup_(safe_closep) int fd = -1;
+        const CaFormatPackIndex *index;
+        uint32_t previous = 0;
+        struct stat st;
+        void *map;
+        size_t i, n;
+
+        assert(p);
+        assert(f);
+        assert(!f->map);
+
+        fd = openat(p->dir_fd, ca_pack_file_name(f->name, ".capidx", fn), O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+        if (!S_ISREG(st.st_mode))
+                return -EBADMSG;
+        if ((uint64_t) st.st_size < sizeof(CaFormatPackIndex))
+                return -EBADMSG;
+        if (((uint64_t) st.st_size - sizeof(CaFormatPackIndex)) % sizeof(CaFormatPackIndexItem) != 0)
+                return -EBADMSG;
+
+        n = (st.st_size - sizeof(CaFormatPackIndex)) / sizeof(CaFormatPackIndexItem);
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+                return -errno;
+
+        index = map;
+        if (le64toh(index->header.type) != CA_FORMAT_PACK_INDEX ||
+            le64toh(index->header.size) != (uint64_t) st.st_size)
+                goto fail;
+
+        /* Validate the fanout table once, so that lookups can trust it */
+        for (i = 0; i < ELEMENTSOF(index->fanout); i++) {
+                uint32_t k = le32toh(index->fanout[i]);
+
+                if (k < previous || k > n)
+                        goto fail;
+
+                previous = k;
+        }
+        if (previous != n)
+                goto fail;
+
+        f->map = map;
+        f->map_size = st.st_size;
+        f->index = index;
+        f->n_items = n;
+
+        return 0;
+
+fail:
+        (void) munmap(map, st.st_size);
+        return -EBADMSG;
+}
+
+static int ca_pack_file_open(CaPack *p, CaPackFile *f) {
+        char fn[CA_PACK_NAME_MAX];
+
+        assert(p);
+        assert(f);
+
+        if (f->fd >= 0)
+                return 0;
+
+        f->fd = openat(p->dir_fd, ca_pack_file_name(f->name, ".capack", fn), O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (f->fd < 0)
+                return -errno;
+
+        return 0;
+}
+
+static int ca_pack_add_file(CaPack *p, uint64_t name) {
+        CaPackFile *f, **a;
+        char fn[CA_PACK_NAME_MAX];
+        struct stat st;
+        int r;
+
+        assert(p);
+
+        if (fstatat(p->dir_fd, ca_pack_file_name(name, ".capack", fn), &st, AT_SYMLINK_NOFOLLOW) < 0)
+                return -errno;
+        if (!S_ISREG(st.st_mode))
+                return -EBADMSG;
+
+        f = new0(CaPackFile, 1);
+        if (!f)
+                return -ENOMEM;
+
+        f->name = name;
+        f->fd = -1;
+        f->size = st.st_size;
+
+        r = ca_pack_file_load_index(p, f);
+        if (r < 0) {
+                ca_pack_file_free(f);
+                return r;
+        }
+
+        a = realloc_multiply(p->files, sizeof(CaPackFile*), p->n_files + 1);
+        if (!a) {
+                ca_pack_file_free(f);
+                return -ENOMEM;
+        }
+
+        p->files = a;
+        p->files[p->n_files++] = f;
+
+        return 0;
+}
+
+static int ca_pack_opendir(CaPack *p, DIR **ret) {
+        DIR *d;
+        int fd;
+
+        assert(p);
+        assert(ret);
+
+        /* Not just a dup() of the directory fd, as that would share the position */
+        fd = openat(p->dir_fd, ".", O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+        if (fd < 0)
+                return -errno;
+
+        d = fdopendir(fd);
+        if (!d) {
+                safe_close(fd);
+                return -errno;
+        }
+
+        *ret = d;
+        return 0;
+}
+
+static int ca_pack_load(CaPack *p) {
+        _cleanup_(closedirp) DIR *d = NULL;
+        struct dirent *de;
+        int r;
+
+        assert(p);
+
+        if (p->loaded)
+                return 0;
+        if (!p->path)
+                return -EUNATCH;
+
+        p->dir_fd = open(p->path, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+        if (p->dir_fd < 0) {
+                if (errno != ENOENT)
+                        return -errno;
+
+                /* No packfiles yet */
+                p->loaded = true;
+                return 0;
+        }
+
+        r = ca_pack_opendir(p, &d);
+        if (r < 0)
+                goto fail;
+
+        FOREACH_DIRENT_ALL(de, d, r = -errno; goto fail) {
+                uint64_t name;
+
+                if (ca_pack_parse_name(de->d_name, ".capidx", &name) < 0)
+                        continue;
+
+                r = ca_pack_add_file(p, name);
+                if (r == -ENOENT) /* Index without packfile? Ignore. */
+                        continue;
+                if (r < 0) {
+                        log_debug_errno(r, "Failed to load packfile index %s: %m", de->d_name);
+                        goto fail;
+                }
+        }
+
+        p->loaded = true;
+        return 0;
+
+fail:
+        /* Start from scratch next time */
+        while (p->n_files > 0)
+                ca_pack_file_free(p->files[--p->n_files]);
+
+        p->dir_fd = safe_close(p->dir_fd);
+        return r;
+}
+
+static const CaFormatPackIndexItem *ca_pack_file_find(CaPackFile *f, const CaChunkID *chunk_id) {
+        size_t lo, hi;
+        uint8_t b;
+
+        assert(f);
+        assert(f->index);
+        assert(chunk_id);
+
+        b = chunk_id->bytes[0];
+        lo = b > 0 ? le32toh(f->index->fanout[b-1]) : 0;
+        hi = le32toh(f->index->fanout[b]);
+
+        while (lo < hi) {
+                size_t m = lo + (hi - lo) / 2;
+                int c;
+
+                c = memcmp(chunk_id, f->index->items[m].chunk, CA_CHUNK_ID_SIZE);
+                if (c == 0)
+                        return f->index->items + m;
+                if (c < 0)
+                        hi = m;
+                else
+                        lo = m + 1;
+        }
+
+        return NULL;
+}
+
+static bool ca_pack_locate(CaPack *p, const CaChunkID *chunk_id, CaPackFile **ret_file, CaPackItem *ret_item) {
+        CaPackItem *w;
+        size_t i;
+
+        assert(p);
+        assert(chunk_id);
+
+        w = set_get(p->written_items, (void*) chunk_id);
+        if (w) {
+                if (ret_file)
+                        *ret_file = p->writing;
+                if (ret_item)
+                        *ret_item = *w;
+                return true;
+        }
+
+        /* Look at the most recent packfiles first */
+        for (i = p->n_files; i > 0; i--) {
+                CaPackFile *f = p->files[i-1];
+                const CaFormatPackIndexItem *item;
+
+                if (f->compacting)
+                        continue;
+
+                item = ca_pack_file_find(f, chunk_id);
+                if (!item)
+                        continue;
+
+                if (ret_file)
+                        *ret_file = f;
+                if (ret_item)
+                        *ret_item = (CaPackItem) {
+                                .chunk_id = *chunk_id,
+                                .offset = le64toh(item->offset),
+                                .size = le64toh(item->size),
+                                .flags = le64toh(item->flags),
+                        };
+                return true;
+        }
+
+        return false;
+}
+
+static int ca_pack_read_locked(CaPack *p, CaPackFile *f, const CaPackItem *item, ReallocBuffer *buffer) {
+        const CaFormatPackChunk *c;
+        size_t n;
+        void *q;
+        int r;
+
+        assert(p);
+        assert(f);
+        assert(item);
+        assert(buffer);
+
+        if (item->size > CA_CHUNK_SIZE_LIMIT_MAX)
+                return -EBADMSG;
+
+        r = ca_pack_file_open(p, f);
+        if (r < 0)
+                return r;
+
+        /* Read the object header along with the data, and verify it matches what the index says */
+        n = offsetof(CaFormatPackChunk, data) + item->size;
+        q = realloc_buffer_acquire(buffer, n);
+        if (!q)
+                return -ENOMEM;
+
+        r = ca_pack_pread(f->fd, q, n, item->offset);
+        if (r < 0)
+                return r;
+
+        c = q;
+        if (le64toh(c->header.type) != CA_FORMAT_PACK_CHUNK ||
+            le64toh(c->header.size) != n ||
+            le64toh(c->flags) != item->flags ||
+            memcmp(c->chunk, &item->chunk_id, CA_CHUNK_ID_SIZE) != 0)
+                return -EBADMSG;
+
+        return realloc_buffer_advance(buffer, offsetof(CaFormatPackChunk, data));
+}
+
+static int ca_pack_finish_locked(CaPack *p) {
+        _cleanup_free_ CaFormatPackIndex *index = NULL;
+        char fn[CA_PACK_NAME_MAX], pn[CA_PACK_NAME_MAX];
+        _cleanup_free_ char *temp = NULL;
+        _cleanup_(safe_closep) int fd = -1;
+        CaPackFile *f, **a;
+        CaPackItem *item;
+        Iterator it;
+        size_t n, i, j, sz;
+        int r;
+
+        assert(p);
+
+        f = p->writing;
+        if (!f)
+                return 0;
+
+        ca_pack_file_name(f->name, ".capack", pn);
+
+        n = set_size(p->written_items);
+        if (n == 0) {
+                /* Nothing was written, get rid of the empty packfile again */
+                (void) unlinkat(p->dir_fd, pn, 0);
+                p->writing = ca_pack_file_free(f);
+                return 0;
+        }
+
+        sz = offsetof(CaFormatPackIndex, items) + n * sizeof(CaFormatPackIndexItem);
+        index = malloc0(sz);
+        if (!index)
+                return -ENOMEM;
+
+        index->header.size = htole64(sz);
+        index->header.type = htole64(CA_FORMAT_PACK_INDEX);
+
+        i = 0;
+        SET_FOREACH(item, p->written_items, it) {
+                index->items[i] = (CaFormatPackIndexItem) {
+                        .offset = htole64(item->offset),
+                        .size = htole64(item->size),
+                        .flags = htole64(item->flags),
+                };
+                memcpy(index->items[i].chunk, &item->chunk_id, CA_CHUNK_ID_SIZE);
+                i++;
+        }
+        assert(i == n);
+
+        qsort(index->items, n, sizeof(CaFormatPackIndexItem), ca_pack_item_compare);
+
+        for (i = 0, j = 0; i < ELEMENTSOF(index->fanout); i++) {
+                while (j < n && index->items[j].chunk[0] <= i)
+                        j++;
+
+                index->fanout[i] = htole32(j);
+        }
+
+        ca_pack_file_name(f->name, ".capidx", fn);
+
+        r = tempfn_random(fn, &temp);
+        if (r < 0)
+                return r;
+
+        fd = openat(p->dir_fd, temp, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC|O_NOCTTY, 0444);
+        if (fd < 0)
+                return -errno;
+
+        r = loop_write(fd, index, sz);
+        if (r < 0)
+                goto fail;
+
+        /* The index must never become visible before the chunks it refers to */
+        if (fdatasync(f->fd) < 0 || fdatasync(fd) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        if (renameat(p->dir_fd, temp, p->dir_fd, fn) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        temp = mfree(temp);
+
+        a = realloc_multiply(p->files, sizeof(CaPackFile*), p->n_files + 1);
+        if (!a)
+                return -ENOMEM;
+        p->files = a;
+
+        r = ca_pack_file_load_index(p, f);
+        if (r < 0)
+                return r;
+
+        /* The file was opened for writing, but is only read from from now on */
+        p->files[p->n_files++] = f;
+        p->writing = NULL;
+        set_clear_free(p->written_items);
+
+        return 0;
+
+fail:
+        (void) unlinkat(p->dir_fd, temp, 0);
+        return r;
+}
+
+static int ca_pack_start_locked(CaPack *p) {
+        char fn[CA_PACK_NAME_MAX];
+        _cleanup_(ca_pack_file_freep) CaPackFile *f = NULL;
+        CaFormatPack header = {
+                .header.size = htole64(sizeof(CaFormatPack)),
+                .header.type = htole64(CA_FORMAT_PACK),
+        };
+        int r;
+
+        assert(p);
+        assert(!p->writing);
+
+        if (p->dir_fd < 0) {
+                if (mkdir(p->path, 0777) < 0 && errno != EEXIST)
+                        return -errno;
+
+                p->dir_fd = open(p->path, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+                if (p->dir_fd < 0)
+                        return -errno;
+        }
+
+        if (!p->written_items) {
+                p->written_items = set_new(&ca_chunk_id_hash_ops);
+                if (!p->written_items)
+                        return -ENOMEM;
+        }
+
+        f = new0(CaPackFile, 1);
+        if (!f)
+                return -ENOMEM;
+
+        f->name = random_u64();
+        f->fd = openat(p->dir_fd, ca_pack_file_name(f->name, ".capack", fn), O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC|O_NOCTTY, 0444);
+        if (f->fd < 0)
+                return -errno;
+
+        r = loop_write(f->fd, &header, sizeof(header));
+        if (r < 0) {
+                (void) unlinkat(p->dir_fd, fn, 0);
+                return r;
+        }
+
+        f->size = sizeof(header);
+        p->writing = f;
+        f = NULL;
+
+        return 0;
+}
+
+static int ca_pack_put_locked(CaPack *p, const CaChunkID *chunk_id, uint64_t flags, const void *data, uint64_t size) {
+        CaFormatPackChunk header = {
+                .header.size = htole64(offsetof(CaFormatPackChunk, data) + size),
+                .header.type = htole64(CA_FORMAT_PACK_CHUNK),
+                .flags = htole64(flags),
+        };
+        CaPackItem *item;
+        int r;
+
+        assert(p);
+        assert(chunk_id);
+
+        /* Start a new packfile if this one is full, but always put at least one chunk into each */
+        if (p->writing &&
+            set_size(p->written_items) > 0 &&
+            p->writing->size + offsetof(CaFormatPackChunk, data) + size > p->size_max) {
+                r = ca_pack_finish_locked(p);
+                if (r < 0)
+                        return r;
+        }
+
+        if (!p->writing) {
+                r = ca_pack_start_locked(p);
+                if (r < 0)
+                        return r;
+        }
+
+        item = new(CaPackItem, 1);
+        if (!item)
+                return -ENOMEM;
+
+        *item = (CaPackItem) {
+                .chunk_id = *chunk_id,
+                .offset = p->writing->size,
+                .size = size,
+                .flags = flags,
+        };
+
+        memcpy(header.chunk, chunk_id, CA_CHUNK_ID_SIZE);
+
+        r = loop_write(p->writing->fd, &header, offsetof(CaFormatPackChunk, data));
+        if (r >= 0)
+                r = loop_write(p->writing->fd, data, size);
+        if (r < 0) {
+                /* Drop the partially written object again */
+                (void) ftruncate(p->writing->fd, p->writing->size);
+                (void) lseek(p->writing->fd, p->writing->size, SEEK_SET);
+
+                free(item);
+                return r;
+        }
+
+        r = set_consume(p->written_items, item);
+        if (r < 0)
+                return r;
+
+        p->writing->size += offsetof(CaFormatPackChunk, data) + size;
+        return 0;
+}
+
+int ca_pack_exists(CaPack *p) {
+        int r;
+
+        if (!p)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        r = ca_pack_load(p);
+        if (r >= 0)
+                r = p->dir_fd >= 0;
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+        return r;
+}
+
+int ca_pack_has(CaPack *p, const CaChunkID *chunk_id) {
+        int r;
+
+        if (!p)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        r = ca_pack_load(p);
+        if (r >= 0)
+                r = ca_pack_locate(p, chunk_id, NULL, NULL);
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+        return r;
+}
+
+int ca_pack_get(CaPack *p, const CaChunkID *chunk_id, ReallocBuffer *buffer, CaChunkCompression *ret_effective_compression) {
+        CaPackFile *f;
+        CaPackItem item;
+        int r;
+
+        if (!p)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (!buffer)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        r = ca_pack_load(p);
+        if (r < 0)
+                goto finish;
+
+        if (!ca_pack_locate(p, chunk_id, &f, &item)) {
+                r = -ENOENT;
+                goto finish;
+        }
+
+        r = ca_pack_read_locked(p, f, &item, buffer);
+        if (r < 0)
+                goto finish;
+
+        if (ret_effective_compression)
+                *ret_effective_compression = item.flags & CA_FORMAT_PACK_CHUNK_COMPRESSED ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED;
+
+finish:
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+        return r;
+}
+
+int ca_pack_put(CaPack *p, const CaChunkID *chunk_id, CaChunkCompression effective_compression, const void *data, uint64_t size) {
+        int r;
+
+        if (!p)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (effective_compression < 0)
+                return -EINVAL;
+        if (effective_compression >= CA_CHUNK_AS_IS)
+                return -EINVAL;
+        if (!data)
+                return -EINVAL;
+        if (size <= 0)
+                return -EINVAL;
+        if (size > CA_CHUNK_SIZE_LIMIT_MAX)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        r = ca_pack_load(p);
+        if (r < 0)
+                goto finish;
+
+        if (ca_pack_locate(p, chunk_id, NULL, NULL)) {
+                /* If the chunk was about to be removed, it's needed after all */
+                free(set_remove(p->removed_chunks, chunk_id));
+
+                r = -EEXIST;
+                goto finish;
+        }
+
+        r = ca_pack_put_locked(p, chunk_id, effective_compression == CA_CHUNK_COMPRESSED ? CA_FORMAT_PACK_CHUNK_COMPRESSED : 0, data, size);
+
+finish:
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+        return r;
+}
+
+int ca_pack_flush(CaPack *p) {
+        int r;
+
+        if (!p)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        r = ca_pack_finish_locked(p);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return r;
+}
+
+int ca_pack_remove(CaPack *p, const CaChunkID *chunk_id) {
+        CaChunkID *copy;
+        int r;
+
+        if (!p)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        r = ca_pack_load(p);
+        if (r < 0)
+                goto finish;
+
+        if (!ca_pack_locate(p, chunk_id, NULL, NULL)) {
+                r = -ENOENT;
+                goto finish;
+        }
+
+        r = set_ensure_allocated(&p->removed_chunks, &ca_chunk_id_hash_ops);
+        if (r < 0)
+                goto finish;
+
+        copy = memdup(chunk_id, sizeof(CaChunkID));
+        if (!copy) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        r = set_consume(p->removed_chunks, copy);
+        if (r == -EEXIST)
+                r = 0;
+
+finish:
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+        return r;
+}
+
+static int ca_pack_recover_locked(CaPack *p, uint64_t name) {
+        char fn[CA_PACK_NAME_MAX];
+        _cleanup_(safe_closep) int fd = -1;
+        _cleanup_(realloc_buffer_free) ReallocBuffer buffer = {};
+        CaFormatPack header;
+        uint64_t offset;
+        int r;
+
+        assert(p);
+        assert(!p->writing);
+
+        /* Writes the index of a packfile whose writer never got around to do so, by collecting all complete chunks
+         * in it. Whatever follows the last complete chunk is ignored. */
+
+        fd = openat(p->dir_fd, ca_pack_file_name(name, ".capack", fn), O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (fd < 0)
+                return -errno;
+
+        r = ca_pack_pread(fd, &header, sizeof(header), 0);
+        if (r == -EBADMSG)
+                goto empty;
+        if (r < 0)
+                return r;
+        if (le64toh(header.header.type) != CA_FORMAT_PACK ||
+            le64toh(header.header.size) != sizeof(header))
+                goto empty;
+
+        r = ca_pack_start_locked(p);
+        if (r < 0)
+                return r;
+
+        offset = sizeof(header);
+        for (;;) {
+                const CaFormatPackChunk *c;
+                CaChunkID chunk_id;
+                uint64_t size;
+                void *q;
+
+                q = realloc_buffer_acquire(&buffer, offsetof(CaFormatPackChunk, data));
+                if (!q)
+                        return -ENOMEM;
+
+                r = ca_pack_pread(fd, q, offsetof(CaFormatPackChunk, data), offset);
+                if (r == -EBADMSG)
+                        break;
+                if (r < 0)
+                        return r;
+
+                c = q;
+                size = le64toh(c->header.size);
+                if (le64toh(c->header.type) != CA_FORMAT_PACK_CHUNK ||
+                    size <= offsetof(CaFormatPackChunk, data) ||
+                    size > offsetof(CaFormatPackChunk, data) + CA_CHUNK_SIZE_LIMIT_MAX)
+                        break;
+
+                q = realloc_buffer_acquire(&buffer, size);
+                if (!q)
+                        return -ENOMEM;
+
+                r = ca_pack_pread(fd, q, size, offset);
+                if (r == -EBADMSG)
+                        break;
+                if (r < 0)
+                        return r;
+
+                c = q;
+                memcpy(&chunk_id, c->chunk, sizeof(chunk_id));
+
+                if (!ca_pack_locate(p, &chunk_id, NULL, NULL)) {
+                        r = ca_pack_put_locked(p, &chunk_id, le64toh(c->flags), c->data, size - offsetof(CaFormatPackChunk, data));
+                        if (r < 0)
+                                return r;
+                }
+
+                offset += size;
+        }
+
+        r = ca_pack_finish_locked(p);
+        if (r < 0)
+                return r;
+
+empty:
+        if (unlinkat(p->dir_fd, fn, 0) < 0)
+                return -errno;
+
+        return 0;
+}
+
+static int ca_pack_recover_all_locked(CaPack *p) {
+        _cleanup_(closedirp) DIR *d = NULL;
+        struct dirent *de;
+        int r;
+
+        assert(p);
+
+        r = ca_pack_opendir(p, &d);
+        if (r < 0)
+                return r;
+
+        FOREACH_DIRENT_ALL(de, d, return -errno) {
+                char fn[CA_PACK_NAME_MAX];
+                uint64_t name;
+                size_t i;
+
+                if (ca_pack_parse_name(de->d_name, ".capack", &name) < 0)
+                        continue;
+
+                for (i = 0; i < p->n_files; i++)
+                        if (p->files[i]->name == name)
+                                break;
+                if (i < p->n_files)
+                        continue;
+
+                if (faccessat(p->dir_fd, ca_pack_file_name(name, ".capidx", fn), F_OK, AT_SYMLINK_NOFOLLOW) >= 0)
+                        continue;
+
+                log_debug("Writing missing index of packfile %s.", de->d_name);
+
+                r = ca_pack_recover_locked(p, name);
+                if (r < 0)
+                        return log_debug_errno(r, "Failed to recover packfile %s: %m", de->d_name);
+        }
+
+        return 0;
+}
+
+static int ca_pack_compact_locked(CaPack *p) {
+        _cleanup_(realloc_buffer_free) ReallocBuffer buffer = {};
+        size_t i, j, n_compacting = 0, n_small = 0;
+        int r;
+
+        assert(p);
+
+        r = ca_pack_load(p);
+        if (r < 0)
+                return r;
+        if (p->dir_fd < 0)
+                return 0;
+
+        r = ca_pack_finish_locked(p);
+        if (r < 0)
+                return r;
+
+        r = ca_pack_recover_all_locked(p);
+        if (r < 0)
+                return r;
+
+        /* Rewrite every packfile that contains removed chunks. If there's something to rewrite anyway, or there
+         * are multiple small packfiles, merge all small packfiles too. */
+        for (i = 0; i < p->n_files; i++) {
+                CaPackFile *f = p->files[i];
+
+                if (f->size < p->size_max / 4)
+                        n_small++;
+
+                if (set_isempty(p->removed_chunks))
+                        continue;
+
+                for (j = 0; j < f->n_items; j++)
+                        if (set_contains(p->removed_chunks, f->index->items[j].chunk)) {
+                                f->compacting = true;
+                                n_compacting++;
+                                break;
+                        }
+        }
+
+        if (n_compacting > 0 || n_small > 1)
+                for (i = 0; i < p->n_files; i++)
+                        if (!p->files[i]->compacting && p->files[i]->size < p->size_max / 4) {
+                                p->files[i]->compacting = true;
+                                n_compacting++;
+                        }
+
+        if (n_compacting == 0)
+                goto finish;
+
+        /* Copy over all chunks we keep, unless some other packfile has them too */
+        for (i = 0; i < p->n_files; i++) {
+                CaPackFile *f = p->files[i];
+
+                if (!f->compacting)
+                        continue;
+
+                for (j = 0; j < f->n_items; j++) {
+                        const CaFormatPackIndexItem *item = f->index->items + j;
+                        CaPackItem location;
+
+                        memcpy(&location.chunk_id, item->chunk, sizeof(CaChunkID));
+
+                        if (set_contains(p->removed_chunks, &location.chunk_id))
+                                continue;
+                        if (ca_pack_locate(p, &location.chunk_id, NULL, NULL))
+                                continue;
+
+                        location.offset = le64toh(item->offset);
+                        location.size = le64toh(item->size);
+                        location.flags = le64toh(item->flags);
+
+                        realloc_buffer_empty(&buffer);
+
+                        r = ca_pack_read_locked(p, f, &location, &buffer);
+                        if (r < 0)
+                                return r;
+
+                        r = ca_pack_put_locked(p, &location.chunk_id, location.flags, realloc_buffer_data(&buffer), realloc_buffer_size(&buffer));
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        r = ca_pack_finish_locked(p);
+        if (r < 0)
+                return r;
+
+        /* Now that the new packfiles are complete, remove the old ones. First the index, so that nobody looks for
+         * the packfile anymore. */
+        for (i = 0, j = 0; i < p->n_files; i++) {
+                CaPackFile *f = p->files[i];
+                char fn[CA_PACK_NAME_MAX];
+
+                if (!f->compacting) {
+                        p->files[j++] = f;
+                        continue;
+                }
+
+                if (unlinkat(p->dir_fd, ca_pack_file_name(f->name, ".capidx", fn), 0) < 0 && errno != ENOENT)
+                        r = -errno;
+                else if (unlinkat(p->dir_fd, ca_pack_file_name(f->name, ".capack", fn), 0) < 0 && errno != ENOENT)
+                        r = -errno;
+
+                ca_pack_file_free(f);
+        }
+        p->n_files = j;
+
+        if (r < 0)
+                return r;
+
+finish:
+        set_clear_free(p->removed_chunks);
+        return 0;
+}
+
+int ca_pack_compact(CaPack *p) {
+        size_t i;
+        int r;
+
+        if (!p)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        r = ca_pack_compact_locked(p);
+
+        for (i = 0; i < p->n_files; i++)
+                p->files[i]->compacting = false;
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+        return r;
+}
+
+int ca_pack_enumerate(CaPack *p, uint64_t *cursor, CaChunkID *ret_chunk_id) {
+        size_t i, j;
+        int r;
+
+        if (!p)
+                return -EINVAL;
+        if (!cursor)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        r = ca_pack_load(p);
+        if (r < 0)
+                goto finish;
+
+        /* The upper 32 bits of the cursor are the packfile, the lower ones the item in it */
+        i = (size_t) (*cursor >> 32);
+        j = (size_t) (*cursor & UINT32_MAX);
+
+        for (;;) {
+                if (i >= p->n_files) {
+                        r = 0;
+                        break;
+                }
+
+                if (j < p->files[i]->n_items) {
+                        if (ret_chunk_id)
+                                memcpy(ret_chunk_id, p->files[i]->index->items[j].chunk, sizeof(CaChunkID));
+
+                        *cursor = ((uint64_t) i << 32) | (uint64_t) (j + 1);
+                        r = 1;
+                        break;
+                }
+
+                i++;
+                j = 0;
+        }
+
+finish:
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+        return r;
+}
+
+CaPack *ca_pack_unref(CaPack *p) {
+        size_t i;
+        int r;
+
+        if (!p)
+                return NULL;
+
+        r = ca_pack_finish_locked(p);
+        if (r < 0)
+                log_debug_errno(r, "Failed to complete packfile: %m");
+
+        ca_pack_file_free(p->writing);
+        set_free_free(p->written_items);
+
+        for (i = 0; i < p->n_files; i++)
+                ca_pack_file_free(p->files[i]);
+        free(p->files);
+
+        set_free_free(p->removed_chunks);
+
+        safe_close(p->dir_fd);
+        free(p->path);
+
+        assert_se(pthread_mutex_destroy(&p->mutex) == 0);
+
+        return mfree(p);
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef foocapackhfoo
+#define foocapackhfoo
+
+#include "cachunk.h"
+#include "cachunkid.h"
+#include "util.h"
+
+/* Implements a directory of packfiles: large files each containing many chunks appended to each other, plus one
+ * index file per packfile mapping chunk IDs to their location in it. This is an alternative to storing every chunk in
+ * a file of its own, which gets expensive in inodes and directory entries on stores with millions of chunks.
+ *
+ * Every writer appends to a packfile of its own, whose index file is only written once it is complete. Readers only
+ * look at packfiles that have an index file. All calls may be made from multiple threads at the same time. */
+
+typedef struct CaPack CaPack;
+
+/* Where to start a new packfile by default */
+#define CA_PACK_SIZE_MAX_DEFAULT (UINT64_C(1024)*1024U*1024U)
+
+CaPack *ca_pack_new(void);
+CaPack *ca_pack_unref(CaPack *p);
+
+int ca_pack_set_path(CaPack *p, const char *path);
+int ca_pack_set_size_max(CaPack *p, uint64_t size);
+
+/* Returns > 0 if the directory exists (and thus the store uses packfiles), 0 if not */
+int ca_pack_exists(CaPack *p);
+
+int ca_pack_has(CaPack *p, const CaChunkID *chunk_id);
+int ca_pack_get(CaPack *p, const CaChunkID *chunk_id, ReallocBuffer *buffer, CaChunkCompression *ret_effective_compression);
+int ca_pack_put(CaPack *p, const CaChunkID *chunk_id, CaChunkCompression effective_compression, const void *data, uint64_t size);
+
+/* Writes the index of the packfile currently being written, so that it becomes visible to others */
+int ca_pack_flush(CaPack *p);
+
+/* Marks a chunk for removal. It is only actually dropped by the next ca_pack_compact() */
+int ca_pack_remove(CaPack *p, const CaChunkID *chunk_id);
+
+/* Rewrites all packfiles containing removed chunks, and merges small packfiles into larger ones. Also writes the
+ * index of packfiles whose writer died before finishing them. Must not be called while others write to the
+ * directory. */
+int ca_pack_compact(CaPack *p);
+
+/* Enumerates all chunks in completed packfiles. Start with *cursor set to zero. Returns 0 when done. */
+int ca_pack_enumerate(CaPack *p, uint64_t *cursor, CaChunkID *ret_chunk_id);
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(CaPack*, ca_pack_unref);
+
+#endif
@@ -0,0 +1,475 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <unistd.h>
+
+#include "cajobqueue.h"
+#include "caparallelchunker.h"
+
+/* How much to read from the file at once */
+#define CA_PARALLEL_CHUNKER_BUFFER_SIZE ((size_t) (1024U*1024U))
+
+typedef struct CaParallelChunkerSegment {
+        uint64_t offset;
+        uint64_t size;
+
+        /* The borders found when starting with a fresh chunker at the segment's beginning, as absolute offsets */
+        uint64_t *borders;
+        size_t n_borders;
+        size_t n_allocated;
+
+        /* The chunker state at the end of the segment */
+        CaChunker chunker;
+
+        /* Set if the file ended before the end of the segment */
+        bool eof;
+
+        uint8_t *buffer;
+} CaParallelChunkerSegment;
+
+struct CaParallelChunker {
+        CaChunker template;
+        int fd;
+        uint64_t size;
+        uint64_t segment_size;
+
+        CaJobQueue *queue;
+        uint64_t next_segment; /* Offset of the next segment to queue */
+
+        /* The serial chunker, and the file offset up to which the borders are known */
+        CaChunker chunker;
+        uint64_t offset;
+
+        /* The borders determined so far that haven't been handed out yet */
+        uint64_t *borders;
+        size_t n_borders;
+        size_t n_allocated;
+        size_t borders_idx;
+
+        /* The position of the caller in the file, and the next border it will hit */
+        uint64_t position;
+        uint64_t border;
+        bool border_valid;
+
+        uint8_t *buffer;
+};
+
+static ssize_t ca_parallel_chunker_read(int fd, void *p, uint64_t offset, size_t l) {
+        ssize_t sum = 0;
+
+        while (l > 0) {
+                ssize_t n;
+
+                n = pread(fd, p, l, offset);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                }
+                if (n == 0)
+                        break;
+
+                p = (uint8_t*) p + n;
+                offset += n;
+                l -= n;
+                sum += n;
+        }
+
+        return sum;
+}
+
+static int append_border(uint64_t **borders, size_t *n_borders, size_t *n_allocated, uint64_t offset) {
+        assert(borders);
+        assert(n_borders);
+        assert(n_allocated);
+
+        if (!greedy_realloc((void**) borders, n_allocated, *n_borders + 1, sizeof(uint64_t)))
+                return -ENOMEM;
+
+        (*borders)[(*n_borders)++] = offset;
+        return 0;
+}
+
+static int ca_parallel_chunker_segment_run(void *job, void *userdata) {
+        CaParallelChunkerSegment *seg = job;
+        CaParallelChunker *p = userdata;
+        uint64_t offset, end;
+        int r;
+
+        assert(seg);
+        assert(p);
+
+        /* Runs on a worker thread, and scans a segment as if a chunk started at its beginning */
+
+        if (!seg->buffer) {
+                seg->buffer = new(uint8_t, CA_PARALLEL_CHUNKER_BUFFER_SIZE);
+                if (!seg->buffer)
+                        return -ENOMEM;
+        }
+
+        seg->chunker = p->template;
+        seg->n_borders = 0;
+
+        offset = seg->offset;
+        end = seg->offset + seg->size;
+
+        while (offset < end) {
+                const uint8_t *q;
+                bool truncated;
+                size_t m;
+                ssize_t l;
+
+                m = (size_t) MIN(end - offset, (uint64_t) CA_PARALLEL_CHUNKER_BUFFER_SIZE);
+
+                l = ca_parallel_chunker_read(p->fd, seg->buffer, offset, m);
+                if (l < 0)
+                        return (int) l;
+                truncated = (size_t) l < m;
+
+                q = seg->buffer;
+                while (l > 0) {
+                        size_t k;
+
+                        k = ca_chunker_scan(&seg->chunker, q, l);
+                        if (k == (size_t) -1) {
+                                offset += l;
+                                break;
+                        }
+
+                        offset += k;
+                        q += k;
+                        l -= k;
+
+                        r = append_border(&seg->borders, &seg->n_borders, &seg->n_allocated, offset);
+                        if (r < 0)
+                                return r;
+                }
+
+                if (truncated)
+                        break;
+        }
+
+        if (offset < end) {
+                /* The file got truncated while we were looking at it */
+                seg->size = offset - seg->offset;
+                seg->eof = true;
+        } else
+                seg->eof = false;
+
+        return 0;
+}
+
+static void ca_parallel_chunker_segment_free(void *job) {
+        CaParallelChunkerSegment *seg = job;
+
+        free(seg->borders);
+        free(seg->buffer);
+}
+
+int ca_parallel_chunker_new(
+                const CaChunker *chunker,
+                int fd,
+                uint64_t size,
+                size_t n_threads,
+                uint64_t segment_size,
+                CaParallelChunker **ret) {
+
+        CaParallelChunker *p;
+        int r;
+
+        if (!chunker)
+                return -EINVAL;
+        if (chunker->chunk_size != 0 || chunker->window_size != 0)
+                return -EINVAL;
+        if (fd < 0)
+                return -EINVAL;
+        if (segment_size == 0)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        p = new0(CaParallelChunker, 1);
+        if (!p)
+                return -ENOMEM;
+
+        p->template = *chunker;
+        p->chunker = *chunker;
+        p->size = size;
+        p->segment_size = segment_size;
+
+        p->buffer = new(uint8_t, CA_PARALLEL_CHUNKER_BUFFER_SIZE);
+        if (!p->buffer) {
+                r = -ENOMEM;
+                goto fail;
+        }
+
+        /* Keep a couple of segments per thread queued, so that the workers don't run dry while we stitch */
+        r = ca_job_queue_new(n_threads, MAX(n_threads, (size_t) 1) * 2, sizeof(CaParallelChunkerSegment),
+                             ca_parallel_chunker_segment_run, ca_parallel_chunker_segment_free, p, &p->queue);
+        if (r < 0)
+                goto fail;
+
+        p->fd = fd;
+        *ret = p;
+        return 0;
+
+fail:
+        p->fd = -1;
+        ca_parallel_chunker_unref(p);
+        return r;
+}
+
+CaParallelChunker* ca_parallel_chunker_unref(CaParallelChunker *p) {
+        if (!p)
+                return NULL;
+
+        /* Stop the workers first, they use the fd */
+        ca_job_queue_unref(p->queue);
+
+        safe_close(p->fd);
+        free(p->borders);
+        free(p->buffer);
+
+        return mfree(p);
+}
+
+static int ca_parallel_chunker_queue(CaParallelChunker *p) {
+        int r;
+
+        assert(p);
+
+        while (p->next_segment < p->size) {
+                CaParallelChunkerSegment *seg;
+                uint64_t size;
+
+                seg = ca_job_queue_acquire(p->queue);
+                if (!seg)
+                        break;
+
+                size = MIN(p->segment_size, p->size - p->next_segment);
+
+                seg->offset = p->next_segment;
+                seg->size = size;
+
+                r = ca_job_queue_submit(p->queue);
+                if (r < 0)
+                        return r;
+
+                /* Note that the segment belongs to the workers now, hence don't look at it anymore */
+                p->next_segment += size;
+        }
+
+        return 0;
+}
+
+static bool ca_parallel_chunker_segment_has_border(CaParallelChunkerSegment *seg, uint64_t offset, size_t *ret_idx) {
+        size_t a, b;
+
+        assert(seg);
+        assert(ret_idx);
+
+        a = 0;
+        b = seg->n_borders;
+
+        while (a < b) {
+                size_t m = a + (b - a) / 2;
+
+                if (seg->borders[m] < offset)
+                        a = m + 1;
+                else if (seg->borders[m] > offset)
+                        b = m;
+                else {
+                        *ret_idx = m;
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+static int ca_parallel_chunker_adopt(CaParallelChunker *p, CaParallelChunkerSegment *seg, size_t idx) {
+        int r;
+
+        assert(p);
+        assert(seg);
+        assert(idx <= seg->n_borders);
+
+        /* The serial chunker and the segment's chunker are in sync from here on, hence take over the remaining
+         * borders of the segment as they are */
+
+        for (; idx < seg->n_borders; idx++) {
+                r = append_border(&p->borders, &p->n_borders, &p->n_allocated, seg->borders[idx]);
+                if (r < 0)
+                        return r;
+        }
+
+        p->chunker = seg->chunker;
+        p->offset = seg->offset + seg->size;
+
+        if (seg->eof)
+                p->size = p->offset;
+
+        return 0;
+}
+
+static int ca_parallel_chunker_stitch(CaParallelChunker *p, CaParallelChunkerSegment *seg) {
+        uint64_t end;
+        int r;
+
+        assert(p);
+        assert(seg);
+        assert(seg->offset == p->offset);
+
+        /* If the serial chunker is exactly at a border where the segment starts, there's nothing to resynchronise */
+        if (p->chunker.chunk_size == 0)
+                return ca_parallel_chunker_adopt(p, seg, 0);
+
+        end = seg->offset + seg->size;
+
+        while (p->offset < end) {
+                const uint8_t *q;
+                size_t m;
+                ssize_t l;
+
+                m = (size_t) MIN(end - p->offset, (uint64_t) CA_PARALLEL_CHUNKER_BUFFER_SIZE);
+
+                l = ca_parallel_chunker_read(p->fd, p->buffer, p->offset, m);
+                if (l < 0)
+                        return (int) l;
+                if ((size_t) l < m) {
+                        /* The file got truncated in the meantime */
+                        end = p->offset + l;
+                        p->size = end;
+                }
+
+                q = p->buffer;
+                while (l > 0) {
+                        size_t k, idx;
+
+                        k = ca_chunker_scan(&p->chunker, q, l);
+                        if (k == (size_t) -1) {
+                                p->offset += l;
+                                break;
+                        }
+
+                        p->offset += k;
+                        q += k;
+                        l -= k;
+
+                        r = append_border(&p->borders, &p->n_borders, &p->n_allocated, p->offset);
+                        if (r < 0)
+                                return r;
+
+                        if (ca_parallel_chunker_segment_has_border(seg, p->offset, &idx))
+                                return ca_parallel_chunker_adopt(p, seg, idx + 1);
+                }
+        }
+
+        if (seg->eof)
+                p->size = p->offset;
+
+        return 0;
+}
+
+static int ca_parallel_chunker_next(CaParallelChunker *p, uint64_t *ret) {
+        int r;
+
+        assert(p);
+        assert(ret);
+
+        for (;;) {
+                CaParallelChunkerSegment *seg;
+                int result;
+
+                if (p->borders_idx < p->n_borders) {
+                        *ret = p->borders[p->borders_idx++];
+                        return 0;
+                }
+
+                p->n_borders = p->borders_idx = 0;
+
+                if (p->offset >= p->size)
+                        return -ENODATA;
+
+                r = ca_parallel_chunker_queue(p);
+                if (r < 0)
+                        return r;
+
+                r = ca_job_queue_peek(p->queue, true, (void**) &seg, &result);
+                if (r < 0)
+                        return r;
+                if (result < 0)
+                        return result;
+
+                r = ca_parallel_chunker_stitch(p, seg);
+                if (r < 0)
+                        return r;
+
+                r = ca_job_queue_retire(p->queue);
+                if (r < 0)
+                        return r;
+        }
+}
+
+int ca_parallel_chunker_scan(CaParallelChunker *p, const void *q, size_t n, size_t *ret) {
+        uint64_t m;
+        size_t k;
+        int r;
+
+        if (!p)
+                return -EINVAL;
+        if (!q && n > 0)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (!p->border_valid) {
+                r = ca_parallel_chunker_next(p, &p->border);
+                if (r == -ENODATA)
+                        p->border = UINT64_MAX;
+                else if (r < 0)
+                        return r;
+
+                p->border_valid = true;
+        }
+
+        if (p->border != UINT64_MAX) {
+                assert(p->border > p->position);
+
+                if (n < p->border - p->position) {
+                        p->position += n;
+                        *ret = (size_t) -1;
+                        return 0;
+                }
+
+                k = (size_t) (p->border - p->position);
+                p->position = p->border;
+                p->border_valid = false;
+
+                *ret = k;
+                return 0;
+        }
+
+        /* There are no further borders within the part of the file we looked at, but there might be data beyond it
+         * if the file grew in the meantime. The serial chunker has the state of the end of that part, hence
+         * continue with it. */
+        m = p->size > p->position ? p->size - p->position : 0;
+        if (n <= m) {
+                p->position += n;
+                *ret = (size_t) -1;
+                return 0;
+        }
+
+        p->position += m;
+
+        k = ca_chunker_scan(&p->chunker, (const uint8_t*) q + m, n - m);
+        if (k == (size_t) -1) {
+                p->position += n - m;
+                *ret = (size_t) -1;
+        } else {
+                p->position += k;
+                *ret = (size_t) m + k;
+        }
+
+        return 0;
+}
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef foocaparallelchunkerhfoo
+#define foocaparallelchunkerhfoo
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "cachunker.h"
+#include "util.h"
+
+/* Determines the chunk borders of a seekable file on multiple threads. The file is split into large segments, each
+ * of which is scanned by a worker thread, starting with a fresh chunker at the segment's beginning. The results are
+ * then stitched together in order: as soon as the borders found serially coincide with a border of the next
+ * segment, the rest of that segment's borders are taken over unmodified, as the chunker state is reset at each
+ * border. Otherwise the segment is rescanned serially until such a resynchronisation point is found. The resulting
+ * borders are hence exactly the ones a single CaChunker finds when fed the whole file. */
+
+typedef struct CaParallelChunker CaParallelChunker;
+
+/* The default size of the segments to scan on each thread */
+#define CA_PARALLEL_CHUNKER_SEGMENT_SIZE_DEFAULT ((uint64_t) (16U*1024U*1024U))
+
+/* Takes possession of the fd. 'size' is the number of bytes to scan, starting at the beginning of the file. The
+ * chunker object is used as template for the chunk sizes to use, and must not have seen any data yet. */
+int ca_parallel_chunker_new(const CaChunker *chunker, int fd, uint64_t size, size_t n_threads, uint64_t segment_size, CaParallelChunker **ret);
+CaParallelChunker* ca_parallel_chunker_unref(CaParallelChunker *p);
+DEFINE_TRIVIAL_CLEANUP_FUNC(CaParallelChunker*, ca_parallel_chunker_unref);
+
+/* Works like ca_chunker_scan(), i.e. the caller is expected to pass in the file contents in order, and the position
+ * of the next border is returned in *ret, or (size_t) -1 if there is none in the passed data. Data beyond the size
+ * specified at construction time is scanned serially. */
+int ca_parallel_chunker_scan(CaParallelChunker *p, const void *q, size_t n, size_t *ret);
+
+#endif
@@ -27,6 +27,9 @@ const char *ca_protocol_type_name(uint64_t u) {
         case CA_PROTOCOL_CHUNK:
                 return "chunk";
 
+        case CA_PROTOCOL_CHUNKS:
+                return "chunks";
+
         case CA_PROTOCOL_MISSING:
                 return "missing";
 
@@ -35,6 +38,9 @@ const char *ca_protocol_type_name(uint64_t u) {
 
         case CA_PROTOCOL_ABORT:
                 return "abort";
+
+        case CA_PROTOCOL_EXTENSIONS:
+                return "extensions";
         }
 
         return NULL;
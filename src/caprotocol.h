@@ -16,9 +16,16 @@ enum {
         CA_PROTOCOL_ARCHIVE_EOF = UINT64_C(0x450bef663f24cbad),
         CA_PROTOCOL_REQUEST     = UINT64_C(0x8ab427e0f89d9210),
         CA_PROTOCOL_CHUNK       = UINT64_C(0x5213dd180a84bc8c),
+        CA_PROTOCOL_CHUNKS      = UINT64_C(0x9f3d6a04b2c871e5),
         CA_PROTOCOL_MISSING     = UINT64_C(0xd010f9fac82b7b6c),
         CA_PROTOCOL_GOODBYE     = UINT64_C(0xad205dbf1a3686c3),
         CA_PROTOCOL_ABORT       = UINT64_C(0xe7d9136b7efea352),
+        CA_PROTOCOL_EXTENSIONS  = UINT64_C(0x6ac1e2b95d0f4a37),
+};
+
+enum {
+        CA_PROTOCOL_PROBE_MAGIC0 = UINT64_C(0x2f8e4c1d9ab37560),
+        CA_PROTOCOL_PROBE_MAGIC1 = UINT64_C(0xc95b0e7a3d16f284),
 };
 
 /* Protocol description:
@@ -38,7 +45,7 @@ enum {
  *
  *      Followed by multiple:
  *      C → S: CA_PROTOCOL_REQUEST
- *      S → C: CA_PROTOCOL_CHUNK
+ *      S → C: CA_PROTOCOL_CHUNK (or CA_PROTOCOL_CHUNKS)
  *
  *      Finished by:
  *      C → S: CA_PROTOCOL_GOODBYE (optional)
@@ -52,11 +59,31 @@ enum {
  *
  *      Followed by multiple:
  *      S → C: CA_PROTOCOL_REQUEST
- *      C → S: CA_PROTOCOL_CHUNK (or CA_PROTOCOL_MISSING)
+ *      C → S: CA_PROTOCOL_CHUNK (or CA_PROTOCOL_CHUNKS or CA_PROTOCOL_MISSING)
  *
  *      Finished by:
  *      S → C: CA_PROTOCOL_GOODBYE
  *
+ * A single CA_PROTOCOL_REQUEST may ask for multiple chunks.
+ *
+ * Protocol extensions are negotiated without touching CA_PROTOCOL_HELLO, which older peers refuse if it carries
+ * anything they don't know. Before its first real request, the requesting side sends a CA_PROTOCOL_REQUEST for a
+ * probe chunk ID (see CaProtocolProbe) announcing the extensions it understands. An older peer doesn't know that chunk
+ * and answers with CA_PROTOCOL_MISSING, after which nothing changes. A newer peer answers with CA_PROTOCOL_EXTENSIONS,
+ * announcing its own extensions. An extension is only used once both sides announced it:
+ *      C → S: CA_PROTOCOL_REQUEST (probe)
+ *      S → C: CA_PROTOCOL_EXTENSIONS (or CA_PROTOCOL_MISSING)
+ * (On push the roles of C and S are swapped, as for all requests.)
+ *
+ * With CA_PROTOCOL_BATCH, multiple chunks may be sent to the requesting side in a single CA_PROTOCOL_CHUNKS frame
+ * instead of one CA_PROTOCOL_CHUNK frame each.
+ *
+ * With CA_PROTOCOL_WINDOW, CA_PROTOCOL_EXTENSIONS carries the window the answering side supports: the number of
+ * chunks that may be requested but not yet answered with CA_PROTOCOL_CHUNK, CA_PROTOCOL_CHUNKS or
+ * CA_PROTOCOL_MISSING, and the chunk data those amount to, estimated from the average size of the chunks received so
+ * far. The requesting side then keeps its requests within the smaller of its own and that window. Zero means
+ * "unlimited". Without it, requests are only limited by how much is still queued for sending.
+ *
  * When a non-recoverable error occurs, either side can send CA_PROTOCOL_ABORTED with an explanation, and terminate the
  * connection.
  *
@@ -96,6 +123,14 @@ enum {
         CA_PROTOCOL_FEATURE_FLAGS_MAX = 0x1fff,
 };
 
+enum {
+        /* Protocol extensions I understand, announced in the probe and in CA_PROTOCOL_EXTENSIONS */
+        CA_PROTOCOL_WINDOW              = 0x1, /* I announce my request window, or keep my requests within yours */
+        CA_PROTOCOL_BATCH               = 0x2, /* You may send me CA_PROTOCOL_CHUNKS frames */
+
+        CA_PROTOCOL_EXTENSION_FLAGS_MAX = 0x3,
+};
+
 typedef struct CaProtocolFile {  /* Used for index as well as archive */
         CaProtocolHeader header;
         uint8_t data[];
@@ -116,6 +151,19 @@ enum {
         CA_PROTOCOL_REQUEST_FLAG_MAX = 1,
 };
 
+typedef struct CaProtocolProbe { /* Requested in place of a chunk ID */
+        le64_t magic[2];         /* CA_PROTOCOL_PROBE_MAGIC0, CA_PROTOCOL_PROBE_MAGIC1 */
+        le64_t extension_flags;
+        le64_t reserved;         /* zero */
+} CaProtocolProbe;
+
+typedef struct CaProtocolExtensions {
+        CaProtocolHeader header;
+        le64_t extension_flags;
+        le64_t window_requests;  /* only valid with CA_PROTOCOL_WINDOW */
+        le64_t window_bytes;     /* ditto */
+} CaProtocolExtensions;
+
 typedef struct CaProtocolChunk {
         CaProtocolHeader header;
         le64_t flags;
@@ -128,6 +176,18 @@ enum {
         CA_PROTOCOL_CHUNK_FLAG_MAX = 1,
 };
 
+typedef struct CaProtocolChunksItem {
+        le64_t size; /* including this header */
+        le64_t flags; /* same as for CaProtocolChunk */
+        uint8_t chunk[CA_CHUNK_ID_SIZE];
+        uint8_t data[];
+} CaProtocolChunksItem;
+
+typedef struct CaProtocolChunks {
+        CaProtocolHeader header;
+        uint8_t items[]; /* one or more CaProtocolChunksItem, back to back */
+} CaProtocolChunks;
+
 typedef struct CaProtocolMissing {
         CaProtocolHeader header;
         uint8_t chunk[CA_CHUNK_ID_SIZE];
@@ -5,6 +5,7 @@
 #include <poll.h>
 #include <stddef.h>
 #include <sys/prctl.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 
 #include "caformat-util.h"
@@ -13,6 +14,7 @@
 #include "caprotocol.h"
 #include "caremote.h"
 #include "def.h"
+#include "hashmap.h"
 #include "realloc-buffer.h"
 #include "rm-rf.h"
 #include "time-util.h"
@@ -24,6 +26,17 @@
 #define REMOTE_BUFFER_SIZE (1024U*1024U)
 #define REMOTE_BUFFER_LOW (1024U*4U)
 
+/* If the other side takes CA_PROTOCOL_CHUNKS frames, let this much chunk data queue up before we stop accepting more,
+ * so that small chunks can be coalesced and written in one go */
+#define REMOTE_BUFFER_BATCH (1024U*128U)
+
+/* Don't grow coalesced frames beyond this size */
+#define REMOTE_FRAME_COALESCE_MAX REMOTE_BUFFER_SIZE
+
+/* The default request window: how many chunks, and how much chunk data, we keep requested but not yet received */
+#define REMOTE_WINDOW_REQUESTS (16U*1024U)
+#define REMOTE_WINDOW_BYTES (UINT64_C(256)*1024U*1024U)
+
 typedef enum CaRemoteState {
         CA_REMOTE_HELLO,
         CA_REMOTE_RUNNING,
@@ -37,6 +50,26 @@ typedef struct CaRemoteFile {
         bool complete;
 } CaRemoteFile;
 
+/* Keep the GET request queue in memory as long as it stays below this size, and move it to the cache directory
+ * beyond */
+#define CA_REMOTE_REQUESTS_MEMORY_DEFAULT ((uint64_t) (64U*1024U*1024U))
+
+/* A rough estimate of the memory a queued request needs: the entry itself, its queue slot, and the hash table
+ * bookkeeping */
+#define CA_REMOTE_REQUEST_MEMORY (sizeof(CaRemoteRequest) + sizeof(CaChunkID) + 4 * sizeof(void*))
+
+typedef struct CaRemoteRequest {
+        CaChunkID id;
+        bool high_priority;
+        uint64_t position; /* Position in the queue, also when already dispatched */
+} CaRemoteRequest;
+
+/* A ring of chunk IDs, indexed by queue position modulo its (power of two) size */
+typedef struct CaRemoteQueue {
+        CaChunkID *items;
+        size_t n_allocated;
+} CaRemoteQueue;
+
 struct CaRemote {
         unsigned n_ref;
 
@@ -60,6 +93,8 @@ struct CaRemote {
 
         int log_level;
         uint64_t rate_limit_bps;
+        unsigned max_active_chunks;
+        unsigned max_host_connections;
 
         ReallocBuffer input_buffer;
         ReallocBuffer output_buffer;
@@ -69,6 +104,14 @@ struct CaRemote {
         uint64_t queue_start_high, queue_start_low;
         uint64_t queue_end_high, queue_end_low;
 
+        /* The GET requests, indexed by chunk ID, and the two queues they are dispatched from. If this grows
+         * beyond 'requests_memory_max' the requests are moved into a symlink farm in the cache directory
+         * instead, and 'requests_on_disk' is set. */
+        Hashmap *requests;
+        CaRemoteQueue queue_high, queue_low;
+        uint64_t requests_memory_max;
+        bool requests_on_disk;
+
         uint64_t local_feature_flags;
         uint64_t remote_feature_flags;
 
@@ -84,13 +127,47 @@ struct CaRemote {
         bool sent_goodbye;
 
         size_t frame_size;
+        size_t frame_item_offset; /* Offset of the next item to process in the current CA_PROTOCOL_CHUNKS frame */
+
+        /* Offset of the last frame in the output buffer that further data may be appended to, or (size_t) -1 */
+        size_t open_frame_offset;
+
+        /* A chunk file whose contents are passed to the output fd by the kernel, once the first 'send_offset' bytes
+         * of the output buffer have been written. 'send_left' is how much of it remains. */
+        int send_fd;
+        uint64_t send_left;
+        size_t send_offset;
+        int output_sendfile; /* Whether the output fd is a pipe or socket, -1 if not determined yet */
 
         CaDigestType digest_type;
         CaDigest* validate_digest;
+        CaChunkVerify verify;
+        uint64_t verify_sample;
 
         uint64_t n_requests;
         uint64_t n_request_bytes;
 
+        /* Flow control of our requests: the window we support, the one the other side announced (UINT64_MAX if it
+         * didn't), the chunks requested but not received yet, and the chunks received in answer so far. The
+         * unanswered requests are tracked by ID, since requests raised to high priority are sent a second time,
+         * but the other side might answer both with one chunk. */
+        uint64_t window_requests, window_bytes;
+        uint64_t remote_window_requests, remote_window_bytes;
+        Hashmap *in_flight;
+        uint64_t n_answered, n_answered_bytes;
+
+        /* Time spent with requests queued but the window full, and since when that's the case, if it is */
+        uint64_t window_stall_nsec;
+        uint64_t window_stall_start;
+
+        /* Protocol extensions negotiated after the hello (see CaProtocolProbe): the ones the other side announced,
+         * whether we sent our probe and got an answer, and whether we got the other side's probe and answered it */
+        uint64_t remote_extension_flags;
+        bool sent_probe;
+        bool probe_answered;
+        bool got_probe;
+        bool sent_extensions;
+
         CaCompressionType compression_type;
 };
 
@@ -108,6 +185,16 @@ CaRemote* ca_remote_new(void) {
         rr->input_fd = -1;
         rr->output_fd = -1;
 
+        rr->open_frame_offset = (size_t) -1;
+
+        rr->send_fd = -1;
+        rr->output_sendfile = -1;
+
+        rr->window_requests = REMOTE_WINDOW_REQUESTS;
+        rr->window_bytes = REMOTE_WINDOW_BYTES;
+        rr->remote_window_requests = UINT64_MAX;
+        rr->remote_window_bytes = UINT64_MAX;
+
         rr->index_file.fd = -1;
         rr->archive_file.fd = -1;
 
@@ -116,6 +203,7 @@ CaRemote* ca_remote_new(void) {
 
         rr->log_level = -1;
         rr->rate_limit_bps = UINT64_MAX;
+        rr->requests_memory_max = CA_REMOTE_REQUESTS_MEMORY_DEFAULT;
 
         rr->digest_type = _CA_DIGEST_TYPE_INVALID;
         rr->compression_type = CA_COMPRESSION_DEFAULT;
@@ -208,11 +296,18 @@ CaRemote* ca_remote_unref(CaRemote *rr) {
         free(rr->cache_path);
         rr->cache_fd = safe_close(rr->cache_fd);
 
+        hashmap_free_free(rr->requests);
+        hashmap_free_free(rr->in_flight);
+        free(rr->queue_high.items);
+        free(rr->queue_low.items);
+
         if (rr->input_fd > 2)
                 safe_close(rr->input_fd);
         if (rr->output_fd > 2)
                 safe_close(rr->output_fd);
 
+        safe_close(rr->send_fd);
+
         realloc_buffer_free(&rr->input_buffer);
         realloc_buffer_free(&rr->output_buffer);
         realloc_buffer_free(&rr->chunk_buffer);
@@ -249,6 +344,35 @@ int ca_remote_set_rate_limit_bps(CaRemote *rr, uint64_t rate_limit_bps) {
         return 0;
 }
 
+int ca_remote_set_max_active_chunks(CaRemote *rr, unsigned n) {
+        if (!rr)
+                return -EINVAL;
+
+        rr->max_active_chunks = n;
+
+        return 0;
+}
+
+int ca_remote_set_max_host_connections(CaRemote *rr, unsigned n) {
+        if (!rr)
+                return -EINVAL;
+
+        rr->max_host_connections = n;
+
+        return 0;
+}
+
+int ca_remote_set_requests_memory_max(CaRemote *rr, uint64_t size) {
+        if (!rr)
+                return -EINVAL;
+        if (rr->requests_on_disk || !hashmap_isempty(rr->requests))
+                return -EBUSY;
+
+        rr->requests_memory_max = size;
+
+        return 0;
+}
+
 int ca_remote_set_local_feature_flags(CaRemote *rr, uint64_t flags) {
         if (!rr)
                 return -EINVAL;
@@ -269,6 +393,23 @@ int ca_remote_set_local_feature_flags(CaRemote *rr, uint64_t flags) {
         return 0;
 }
 
+int ca_remote_set_window(CaRemote *rr, uint64_t requests, uint64_t bytes) {
+        if (!rr)
+                return -EINVAL;
+        if (requests == 0)
+                return -EINVAL;
+        if (bytes == 0)
+                return -EINVAL;
+        if (rr->sent_hello)
+                return -EBUSY;
+
+        /* UINT64_MAX means "unlimited" */
+
+        rr->window_requests = requests;
+        rr->window_bytes = bytes;
+        return 0;
+}
+
 int ca_remote_add_local_feature_flags(CaRemote *rr, uint64_t flags) {
         if (!rr)
                 return -EINVAL;
@@ -358,6 +499,12 @@ static size_t ca_remote_get_read_size(CaRemote *rr) {
         return MAX(rr->frame_size, REMOTE_BUFFER_SIZE);
 }
 
+static bool ca_remote_has_output(CaRemote *rr) {
+        assert(rr);
+
+        return realloc_buffer_size(&rr->output_buffer) > 0 || rr->send_fd >= 0;
+}
+
 int ca_remote_get_io_events(CaRemote *rr, short *ret_input_events, short *ret_output_events) {
 
         if (!rr)
@@ -372,7 +519,7 @@ int ca_remote_get_io_events(CaRemote *rr, short *ret_input_events, short *ret_ou
         else
                 *ret_input_events = 0;
 
-        if (realloc_buffer_size(&rr->output_buffer) > 0)
+        if (ca_remote_has_output(rr))
                 *ret_output_events = POLLOUT;
         else
                 *ret_output_events = 0;
@@ -705,7 +852,7 @@ static int ca_remote_init_cache(CaRemote *rr) {
         return 1;
 }
 
-static int ca_remote_enqueue_request(CaRemote *rr, const CaChunkID *id, bool high_priority, bool please_requeue) {
+static int ca_remote_enqueue_request_disk(CaRemote *rr, const CaChunkID *id, bool high_priority, bool please_requeue) {
         char ids[CA_CHUNK_ID_FORMAT_MAX];
         uint64_t position;
         const char *f, *queue_name;
@@ -715,15 +862,10 @@ static int ca_remote_enqueue_request(CaRemote *rr, const CaChunkID *id, bool hig
         assert(rr);
         assert(id);
 
-        r = ca_remote_init_cache(rr);
-        if (r < 0)
-                return r;
-
-        /* Enqueues a GET request. We maintain a 2-level priority queue on disk for this, in two directories
-         * "low-priority" and "high-priority". This could be much easier if we could maintain this entirely in memory,
-         * but given that the list might be quite large we use a symlink farm instead. For each queued GET request we
-         * create two symlinks: one pointing from the queue position to the chunk hash, and one the other way. That
-         * way we can easily enqueue, dequeue and check whether a specific chunk is already queued. */
+        /* Enqueues a GET request, once the queue got too large to keep it in memory. We maintain the 2-level
+         * priority queue on disk then, in two directories "low-priority" and "high-priority". For each queued GET
+         * request we create two symlinks: one pointing from the queue position to the chunk hash, and one the other
+         * way. That way we can easily enqueue, dequeue and check whether a specific chunk is already queued. */
 
         if (!ca_chunk_id_format(id, ids))
                 return -EINVAL;
@@ -819,7 +961,7 @@ finish:
         return r;
 }
 
-static int ca_remote_dequeue_request(CaRemote *rr, int only_high_priority, CaChunkID *ret, bool *ret_high_priority) {
+static int ca_remote_dequeue_request_disk(CaRemote *rr, int only_high_priority, CaChunkID *ret, bool *ret_high_priority) {
         const char *queue_name;
         uint64_t position;
         char *ids;
@@ -885,6 +1027,206 @@ static int ca_remote_dequeue_request(CaRemote *rr, int only_high_priority, CaChu
         return 0;
 }
 
+static int ca_remote_queue_push(CaRemoteQueue *q, uint64_t start, uint64_t end, const CaChunkID *id) {
+        assert(q);
+        assert(start <= end);
+        assert(id);
+
+        /* Appends an item at position 'end', where the items from 'start' to 'end' are in use */
+
+        if (end - start >= q->n_allocated) {
+                CaChunkID *items;
+                size_t n;
+                uint64_t i;
+
+                n = MAX(q->n_allocated * 2, (size_t) 64U);
+                if (n <= q->n_allocated)
+                        return -ENOMEM;
+
+                items = new(CaChunkID, n);
+                if (!items)
+                        return -ENOMEM;
+
+                for (i = start; i < end; i++)
+                        items[i & (n - 1)] = q->items[i & (q->n_allocated - 1)];
+
+                free(q->items);
+                q->items = items;
+                q->n_allocated = n;
+        }
+
+        q->items[end & (q->n_allocated - 1)] = *id;
+        return 0;
+}
+
+static int ca_remote_spill_requests(CaRemote *rr) {
+        CaRemoteRequest *req;
+        Iterator i;
+
+        assert(rr);
+        assert(rr->cache_fd >= 0);
+        assert(!rr->requests_on_disk);
+
+        /* The queue grew too large to keep it in memory, write it out in the format
+         * ca_remote_enqueue_request_disk() uses. Requests already dispatched are written out too, so that they are
+         * still recognized as queued before. */
+
+        log_debug("GET request queue exceeds %" PRIu64 " bytes, moving it to disk.", rr->requests_memory_max);
+
+        (void) mkdirat(rr->cache_fd, "chunks", 0777);
+        (void) mkdirat(rr->cache_fd, "low-priority", 0777);
+        (void) mkdirat(rr->cache_fd, "high-priority", 0777);
+
+        HASHMAP_FOREACH(req, rr->requests, i) {
+                char ids[CA_CHUNK_ID_FORMAT_MAX], qpos[sizeof("high-priority/") + DECIMAL_STR_MAX(uint64_t)];
+                const char *f;
+
+                if (!ca_chunk_id_format(&req->id, ids))
+                        return -EINVAL;
+
+                snprintf(qpos, sizeof(qpos), "%s%" PRIu64, req->high_priority ? "high-priority/" : "low-priority/", req->position);
+                f = strjoina("chunks/", ids);
+
+                if (symlinkat(qpos, rr->cache_fd, f) < 0)
+                        return -errno;
+                if (symlinkat(ids, rr->cache_fd, qpos) < 0)
+                        return -errno;
+        }
+
+        rr->requests = hashmap_free_free(rr->requests);
+        rr->queue_high.items = mfree(rr->queue_high.items);
+        rr->queue_high.n_allocated = 0;
+        rr->queue_low.items = mfree(rr->queue_low.items);
+        rr->queue_low.n_allocated = 0;
+
+        rr->requests_on_disk = true;
+        return 0;
+}
+
+static int ca_remote_enqueue_request(CaRemote *rr, const CaChunkID *id, bool high_priority, bool please_requeue) {
+        CaRemoteRequest *req;
+        int r;
+
+        assert(rr);
+        assert(id);
+
+        r = ca_remote_init_cache(rr);
+        if (r < 0)
+                return r;
+
+        /* Enqueues a GET request. We maintain a 2-level priority queue for this: a high-priority and a low-priority
+         * ring of chunk IDs, plus a table of all chunks queued so far, which records the queue and position each is
+         * currently at. Items in the rings that don't match the table anymore are stale, and skipped when
+         * dequeuing. Requests stay in the table after they have been dispatched, so that we can tell that they have
+         * been queued before. */
+
+        if (rr->requests_on_disk)
+                return ca_remote_enqueue_request_disk(rr, id, high_priority, please_requeue);
+
+        req = hashmap_get(rr->requests, id);
+        if (req) {
+                /* Already queued on the same priority? Then there's nothing to do. */
+                if (req->high_priority == high_priority)
+                        return 0;
+
+                /* Not matching, but the new priority is low? Then there's nothing to do.*/
+                if (!high_priority)
+                        return 0;
+
+                /* Was the old low-priority item already dispatched? Don't requeue the item then, except this is explicitly requested. */
+                if (req->position < rr->queue_start_low && !please_requeue)
+                        return 0;
+        } else {
+                if ((uint64_t) (hashmap_size(rr->requests) + 1) * CA_REMOTE_REQUEST_MEMORY > rr->requests_memory_max) {
+                        r = ca_remote_spill_requests(rr);
+                        if (r < 0)
+                                return r;
+
+                        return ca_remote_enqueue_request_disk(rr, id, high_priority, please_requeue);
+                }
+
+                r = hashmap_ensure_allocated(&rr->requests, &ca_chunk_id_hash_ops);
+                if (r < 0)
+                        return r;
+        }
+
+        if (high_priority)
+                r = ca_remote_queue_push(&rr->queue_high, rr->queue_start_high, rr->queue_end_high, id);
+        else
+                r = ca_remote_queue_push(&rr->queue_low, rr->queue_start_low, rr->queue_end_low, id);
+        if (r < 0)
+                return r;
+
+        if (!req) {
+                req = new(CaRemoteRequest, 1);
+                if (!req)
+                        return -ENOMEM;
+
+                req->id = *id;
+
+                r = hashmap_put(rr->requests, &req->id, req);
+                if (r < 0) {
+                        free(req);
+                        return r;
+                }
+        }
+
+        req->high_priority = high_priority;
+
+        if (high_priority)
+                req->position = rr->queue_end_high++;
+        else
+                req->position = rr->queue_end_low++;
+
+        return 1;
+}
+
+static int ca_remote_dequeue_request(CaRemote *rr, int only_high_priority, CaChunkID *ret, bool *ret_high_priority) {
+        assert(rr);
+        assert(ret);
+
+        if (rr->cache_fd < 0)
+                return -ENODATA;
+
+        if (rr->requests_on_disk)
+                return ca_remote_dequeue_request_disk(rr, only_high_priority, ret, ret_high_priority);
+
+        for (;;) {
+                CaRemoteRequest *req;
+                CaRemoteQueue *q;
+                uint64_t *start;
+                bool hp;
+
+                if (rr->queue_start_high < rr->queue_end_high && only_high_priority != 0) {
+                        hp = true;
+                        q = &rr->queue_high;
+                        start = &rr->queue_start_high;
+                } else if (rr->queue_start_low < rr->queue_end_low && only_high_priority <= 0) {
+                        hp = false;
+                        q = &rr->queue_low;
+                        start = &rr->queue_start_low;
+                } else
+                        return -ENODATA;
+
+                req = hashmap_get(rr->requests, q->items + (*start & (q->n_allocated - 1)));
+
+                /* Skip over items that have been forgotten or moved to the other queue in the meantime */
+                if (!req || req->high_priority != hp || req->position != *start) {
+                        (*start)++;
+                        continue;
+                }
+
+                (*start)++;
+
+                *ret = req->id;
+
+                if (ret_high_priority)
+                        *ret_high_priority = hp;
+
+                return 0;
+        }
+}
+
 static int ca_remote_file_open(CaRemote *rr, CaRemoteFile *f, int flags) {
         int r;
 
@@ -1002,6 +1344,12 @@ static int ca_remote_start(CaRemote *rr) {
                         if (rr->rate_limit_bps != UINT64_MAX)
                                 argc++;
 
+                        /* Only the protocol helpers know these, not casync on the other side of ssh */
+                        if (rr->callout && rr->max_active_chunks > 0)
+                                argc++;
+                        if (rr->callout && rr->max_host_connections > 0)
+                                argc++;
+
                         args = newa(char*, argc + 1);
 
                         if (rr->callout) {
@@ -1047,6 +1395,22 @@ static int ca_remote_start(CaRemote *rr) {
                                 i++;
                         }
 
+                        if (rr->callout && rr->max_active_chunks > 0) {
+                                r = asprintf(args + i, "--max-active-chunks=%u", rr->max_active_chunks);
+                                if (r < 0)
+                                        return log_oom();
+
+                                i++;
+                        }
+
+                        if (rr->callout && rr->max_host_connections > 0) {
+                                r = asprintf(args + i, "--max-host-connections=%u", rr->max_host_connections);
+                                if (r < 0)
+                                        return log_oom();
+
+                                i++;
+                        }
+
                         args[i + CA_REMOTE_ARG_OPERATION] = (char*) ((rr->local_feature_flags & (CA_PROTOCOL_PUSH_CHUNKS|CA_PROTOCOL_PUSH_INDEX|CA_PROTOCOL_PUSH_ARCHIVE)) ? "push" : "pull");
                         args[i + CA_REMOTE_ARG_BASE_URL] = /* rr->base_url ? rr->base_url + skip :*/ (char*) "-";
                         args[i + CA_REMOTE_ARG_ARCHIVE_URL] = rr->archive_url ? rr->archive_url + skip : (char*) "-";
@@ -1137,21 +1501,113 @@ static int ca_remote_read(CaRemote *rr) {
         return CA_REMOTE_STEP;
 }
 
+static int ca_remote_send_fallback(CaRemote *rr) {
+        ReallocBuffer b = {};
+        ssize_t n;
+        void *p;
+
+        assert(rr);
+        assert(rr->send_fd >= 0);
+        assert(rr->send_offset == 0);
+
+        /* The kernel can't copy between these fds after all, hence read the rest of the file into memory, in front of
+         * what was queued after it */
+
+        p = realloc_buffer_extend(&b, rr->send_left);
+        if (!p)
+                return -ENOMEM;
+
+        n = loop_read(rr->send_fd, p, rr->send_left);
+        if (n < 0) {
+                realloc_buffer_free(&b);
+                return (int) n;
+        }
+        if ((uint64_t) n != rr->send_left) { /* File shrunk? */
+                realloc_buffer_free(&b);
+                return -EIO;
+        }
+
+        if (!realloc_buffer_append(&b, realloc_buffer_data(&rr->output_buffer), realloc_buffer_size(&rr->output_buffer))) {
+                realloc_buffer_free(&b);
+                return -ENOMEM;
+        }
+
+        realloc_buffer_free(&rr->output_buffer);
+        rr->output_buffer = b;
+
+        rr->open_frame_offset = (size_t) -1;
+        rr->send_fd = safe_close(rr->send_fd);
+        rr->send_left = 0;
+
+        return CA_REMOTE_STEP;
+}
+
+static int ca_remote_send(CaRemote *rr) {
+        ssize_t n;
+
+        assert(rr);
+        assert(rr->send_fd >= 0);
+        assert(rr->send_offset == 0);
+
+        n = sendfile(rr->output_fd, rr->send_fd, NULL, MIN(rr->send_left, (uint64_t) SSIZE_MAX));
+        if (n < 0) {
+                if (errno == EAGAIN)
+                        return CA_REMOTE_POLL;
+                if (IN_SET(errno, EINVAL, ENOSYS)) {
+                        rr->output_sendfile = false;
+                        return ca_remote_send_fallback(rr);
+                }
+
+                return -errno;
+        }
+        if (n == 0) /* File shrunk? */
+                return -EIO;
+
+        rr->send_left -= n;
+        if (rr->send_left == 0)
+                rr->send_fd = safe_close(rr->send_fd);
+
+        return CA_REMOTE_STEP;
+}
+
 static int ca_remote_write(CaRemote *rr) {
+        size_t k;
         ssize_t n;
+        int r;
 
         assert(rr);
 
-        if (realloc_buffer_size(&rr->output_buffer) == 0)
+        if (!ca_remote_has_output(rr))
                 return CA_REMOTE_POLL;
 
-        n = write(rr->output_fd, realloc_buffer_data(&rr->output_buffer), realloc_buffer_size(&rr->output_buffer));
-        if (n < 0)
-                return errno == EAGAIN ? CA_REMOTE_POLL : -errno;
+        /* If a chunk file is pending, write only what has been queued before it */
+        k = rr->send_fd >= 0 ? rr->send_offset : realloc_buffer_size(&rr->output_buffer);
+        if (k > 0) {
+                n = write(rr->output_fd, realloc_buffer_data(&rr->output_buffer), k);
+                if (n < 0)
+                        return errno == EAGAIN ? CA_REMOTE_POLL : -errno;
+
+                realloc_buffer_advance(&rr->output_buffer, n);
+
+                /* The frame we might have appended to is (partially) written now */
+                rr->open_frame_offset = (size_t) -1;
+
+                if (rr->send_fd >= 0) {
+                        rr->send_offset -= n;
+                        if (rr->send_offset > 0)
+                                return CA_REMOTE_STEP;
+                }
+        }
 
-        realloc_buffer_advance(&rr->output_buffer, n);
+        if (rr->send_fd >= 0) {
+                r = ca_remote_send(rr);
+                if (r < 0)
+                        return r;
+                if (r == CA_REMOTE_POLL && k == 0)
+                        return CA_REMOTE_POLL;
+        }
 
-        if (rr->sent_goodbye && realloc_buffer_size(&rr->output_buffer) == 0)
+        if (rr->sent_goodbye && !ca_remote_has_output(rr))
                 return CA_REMOTE_FINISHED;
 
         return CA_REMOTE_STEP;
@@ -1176,6 +1632,14 @@ static bool operations_and_services_compatible(uint64_t operations, uint64_t ser
         return true;
 }
 
+static uint64_t window_from_wire(uint64_t v) {
+        return v == 0 ? UINT64_MAX : v;
+}
+
+static uint64_t window_to_wire(uint64_t v) {
+        return v == UINT64_MAX ? 0 : v;
+}
+
 static int ca_remote_process_hello(CaRemote *rr, const CaProtocolHello *hello) {
         uint64_t remote_flags;
 
@@ -1293,7 +1757,38 @@ static int ca_remote_process_archive_eof(CaRemote *rr, const CaProtocolFileEOF *
         return CA_REMOTE_READ_ARCHIVE_EOF;
 }
 
+static const CaProtocolProbe* chunk_id_to_probe(const uint8_t *id) {
+        const CaProtocolProbe *probe;
+
+        assert(id);
+
+        assert_cc(sizeof(CaProtocolProbe) == CA_CHUNK_ID_SIZE);
+
+        probe = (const CaProtocolProbe*) id;
+
+        if (read_le64(&probe->magic[0]) != CA_PROTOCOL_PROBE_MAGIC0 ||
+            read_le64(&probe->magic[1]) != CA_PROTOCOL_PROBE_MAGIC1)
+                return NULL;
+
+        return probe;
+}
+
+static void ca_remote_process_probe(CaRemote *rr, const CaProtocolProbe *probe) {
+        assert(rr);
+        assert(probe);
+
+        /* The other side announces the extensions it understands. Only the first probe counts, we answer it in
+         * ca_remote_send_extensions(). Flags we don't know are ignored, we'll never make use of them. */
+
+        if (rr->got_probe)
+                return;
+
+        rr->remote_extension_flags = read_le64(&probe->extension_flags) & CA_PROTOCOL_EXTENSION_FLAGS_MAX;
+        rr->got_probe = true;
+}
+
 static int ca_remote_process_request(CaRemote *rr, const CaProtocolRequest *req) {
+        bool requested = false;
         const uint8_t *p;
         size_t ms;
         int r;
@@ -1304,37 +1799,45 @@ static int ca_remote_process_request(CaRemote *rr, const CaProtocolRequest *req)
         ms = read_le64(&req->header.size) - offsetof(CaProtocolRequest, chunks);
 
         for (p = req->chunks; p < req->chunks + ms; p += CA_CHUNK_ID_SIZE) {
+                const CaProtocolProbe *probe;
+
+                probe = chunk_id_to_probe(p);
+                if (probe) {
+                        ca_remote_process_probe(rr, probe);
+                        continue;
+                }
+
                 r = ca_remote_enqueue_request(rr, (const CaChunkID*) p, read_le64(&req->flags) & CA_PROTOCOL_REQUEST_HIGH_PRIORITY, false);
                 if (r < 0)
                         return r;
+
+                requested = true;
         }
 
-        return CA_REMOTE_REQUEST;
+        return requested ? CA_REMOTE_REQUEST : CA_REMOTE_STEP;
 }
 
-static int ca_remote_process_chunk(CaRemote *rr, const CaProtocolChunk *chunk) {
-        size_t ms;
+static int ca_remote_save_chunk(CaRemote *rr, const uint8_t *id, uint64_t flags, const void *data, size_t size) {
         int r;
 
         assert(rr);
-        assert(chunk);
+        assert(id);
+        assert(data);
 
         if (rr->cache_fd < 0)
                 return -ENOTTY;
 
-        memcpy(&rr->last_chunk, chunk->chunk, CA_CHUNK_ID_SIZE);
+        memcpy(&rr->last_chunk, id, CA_CHUNK_ID_SIZE);
         rr->last_chunk_valid = true;
 
-        ms = read_le64(&chunk->header.size) - offsetof(CaProtocolChunk, data);
-
         r = ca_chunk_file_save(rr->cache_fd,
                                NULL,
                                &rr->last_chunk,
-                               (read_le64(&chunk->flags) & CA_PROTOCOL_CHUNK_COMPRESSED) ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED,
+                               (flags & CA_PROTOCOL_CHUNK_COMPRESSED) ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED,
                                CA_CHUNK_AS_IS,
                                CA_COMPRESSION_DEFAULT,
-                               chunk->data,
-                               ms);
+                               data,
+                               size);
         if (r == -EEXIST)
                 return CA_REMOTE_STEP;
         if (r < 0)
@@ -1343,12 +1846,81 @@ static int ca_remote_process_chunk(CaRemote *rr, const CaProtocolChunk *chunk) {
         return CA_REMOTE_CHUNK;
 }
 
+static void ca_remote_answered(CaRemote *rr, const void *chunk_id, uint64_t size) {
+        CaChunkID *id;
+
+        assert(rr);
+        assert(chunk_id);
+
+        /* One of our requests got answered (or the other side sent us something unasked, in which case there's
+         * nothing to account) */
+
+        id = hashmap_remove(rr->in_flight, chunk_id);
+        if (!id)
+                return;
+
+        free(id);
+
+        rr->n_answered++;
+        rr->n_answered_bytes += size;
+}
+
+static int ca_remote_process_chunk(CaRemote *rr, const CaProtocolChunk *chunk) {
+        assert(rr);
+        assert(chunk);
+
+        ca_remote_answered(rr, chunk->chunk, read_le64(&chunk->header.size) - offsetof(CaProtocolChunk, data));
+
+        return ca_remote_save_chunk(rr,
+                                    chunk->chunk,
+                                    read_le64(&chunk->flags),
+                                    chunk->data,
+                                    read_le64(&chunk->header.size) - offsetof(CaProtocolChunk, data));
+}
+
+static int ca_remote_process_chunks_item(CaRemote *rr, const CaProtocolChunks *chunks) {
+        const CaProtocolChunksItem *item;
+        int r;
+
+        assert(rr);
+        assert(chunks);
+
+        /* We hand out the chunks of the frame one at a time, so that the caller may look at each with
+         * ca_remote_next_chunk() */
+
+        if (rr->frame_item_offset == 0)
+                rr->frame_item_offset = offsetof(CaProtocolChunks, items);
+
+        item = (const CaProtocolChunksItem*) ((const uint8_t*) chunks + rr->frame_item_offset);
+
+        ca_remote_answered(rr, item->chunk, read_le64(&item->size) - offsetof(CaProtocolChunksItem, data));
+
+        r = ca_remote_save_chunk(rr,
+                                 item->chunk,
+                                 read_le64(&item->flags),
+                                 item->data,
+                                 read_le64(&item->size) - offsetof(CaProtocolChunksItem, data));
+        if (r < 0)
+                return r;
+
+        rr->frame_item_offset += read_le64(&item->size);
+        return r;
+}
+
 static int ca_remote_process_missing(CaRemote *rr, const CaProtocolMissing *missing) {
         int r;
 
         assert(rr);
         assert(missing);
 
+        /* An older peer doesn't know our probe, and says so. Then we simply don't use any extensions. */
+        if (rr->sent_probe && chunk_id_to_probe(missing->chunk)) {
+                rr->probe_answered = true;
+                return CA_REMOTE_STEP;
+        }
+
+        ca_remote_answered(rr, missing->chunk, 0);
+
         if (rr->cache_fd < 0)
                 return -ENOTTY;
 
@@ -1361,6 +1933,21 @@ static int ca_remote_process_missing(CaRemote *rr, const CaProtocolMissing *miss
         return CA_REMOTE_CHUNK;
 }
 
+static int ca_remote_process_extensions(CaRemote *rr, const CaProtocolExtensions *e) {
+        assert(rr);
+        assert(e);
+
+        rr->remote_extension_flags = read_le64(&e->extension_flags) & CA_PROTOCOL_EXTENSION_FLAGS_MAX;
+        rr->probe_answered = true;
+
+        if (rr->remote_extension_flags & CA_PROTOCOL_WINDOW) {
+                rr->remote_window_requests = window_from_wire(read_le64(&e->window_requests));
+                rr->remote_window_bytes = window_from_wire(read_le64(&e->window_bytes));
+        }
+
+        return CA_REMOTE_STEP;
+}
+
 static int ca_remote_file_install(CaRemoteFile *f) {
         assert(f);
 
@@ -1495,6 +2082,43 @@ static const CaProtocolChunk* validate_chunk(CaRemote *rr, const CaProtocolHeade
         return c;
 }
 
+static const CaProtocolChunks* validate_chunks(CaRemote *rr, const CaProtocolHeader *h) {
+        uint64_t size, offset;
+
+        assert(rr);
+        assert(h);
+
+        size = read_le64(&h->size);
+
+        if (size < offsetof(CaProtocolChunks, items) + offsetof(CaProtocolChunksItem, data) + 1)
+                return NULL;
+        if (read_le64(&h->type) != CA_PROTOCOL_CHUNKS)
+                return NULL;
+
+        /* Make sure the items exactly fill the frame */
+        for (offset = offsetof(CaProtocolChunks, items); offset < size; ) {
+                const CaProtocolChunksItem *item;
+                uint64_t item_size;
+
+                if (size - offset < offsetof(CaProtocolChunksItem, data) + 1)
+                        return NULL;
+
+                item = (const CaProtocolChunksItem*) ((const uint8_t*) h + offset);
+
+                item_size = read_le64(&item->size);
+                if (item_size < offsetof(CaProtocolChunksItem, data) + 1)
+                        return NULL;
+                if (item_size > size - offset)
+                        return NULL;
+                if (read_le64(&item->flags) & ~CA_PROTOCOL_CHUNK_FLAG_MAX)
+                        return NULL;
+
+                offset += item_size;
+        }
+
+        return (const CaProtocolChunks*) h;
+}
+
 static const CaProtocolMissing* validate_missing(CaRemote *rr, const CaProtocolHeader *h) {
         assert(rr);
         assert(h);
@@ -1507,6 +2131,18 @@ static const CaProtocolMissing* validate_missing(CaRemote *rr, const CaProtocolH
         return (const CaProtocolMissing*) h;
 }
 
+static const CaProtocolExtensions* validate_extensions(CaRemote *rr, const CaProtocolHeader *h) {
+        assert(rr);
+        assert(h);
+
+        if (read_le64(&h->size) != sizeof(CaProtocolExtensions))
+                return NULL;
+        if (read_le64(&h->type) != CA_PROTOCOL_EXTENSIONS)
+                return NULL;
+
+        return (const CaProtocolExtensions*) h;
+}
+
 static const CaProtocolGoodbye* validate_goodbye(CaRemote *rr, const CaProtocolHeader *h) {
         assert(rr);
         assert(h);
@@ -1698,6 +2334,37 @@ static int ca_remote_process_message(CaRemote *rr) {
                 break;
         }
 
+        case CA_PROTOCOL_CHUNKS: {
+                const CaProtocolChunks *chunks;
+
+                if (rr->state != CA_REMOTE_RUNNING)
+                        return -EBADMSG;
+                if (((rr->local_feature_flags & CA_PROTOCOL_PULL_CHUNKS) == 0) &&
+                    ((rr->remote_feature_flags & CA_PROTOCOL_PUSH_CHUNKS) == 0))
+                        return -EBADMSG;
+                if (!rr->sent_probe) /* We didn't announce CA_PROTOCOL_BATCH */
+                        return -EBADMSG;
+
+                /* Validate the frame as a whole when we see it first */
+                if (rr->frame_item_offset == 0) {
+                        chunks = validate_chunks(rr, h);
+                        if (!chunks)
+                                return -EBADMSG;
+                } else
+                        chunks = (const CaProtocolChunks*) h;
+
+                step = ca_remote_process_chunks_item(rr, chunks);
+                if (step < 0)
+                        return step;
+
+                /* More items left? Then keep the frame around for the next step */
+                if (rr->frame_item_offset < size)
+                        return step;
+
+                rr->frame_item_offset = 0;
+                break;
+        }
+
         case CA_PROTOCOL_MISSING: {
                 const CaProtocolMissing *missing;
 
@@ -1715,6 +2382,22 @@ static int ca_remote_process_message(CaRemote *rr) {
                 break;
         }
 
+        case CA_PROTOCOL_EXTENSIONS: {
+                const CaProtocolExtensions *e;
+
+                if (rr->state != CA_REMOTE_RUNNING)
+                        return -EBADMSG;
+                if (!rr->sent_probe) /* Only ever sent in answer to our probe */
+                        return -EBADMSG;
+
+                e = validate_extensions(rr, h);
+                if (!e)
+                        return -EBADMSG;
+
+                step = ca_remote_process_extensions(rr, e);
+                break;
+        }
+
         case CA_PROTOCOL_GOODBYE: {
                 const CaProtocolGoodbye *goodbye;
 
@@ -1776,6 +2459,32 @@ static int ca_remote_send_hello(CaRemote *rr) {
         return CA_REMOTE_STEP;
 }
 
+static int ca_remote_send_extensions(CaRemote *rr) {
+        CaProtocolExtensions *e;
+
+        assert(rr);
+
+        /* Answers the other side's probe, which tells us it knows this frame */
+
+        if (!rr->got_probe)
+                return CA_REMOTE_POLL;
+        if (rr->sent_extensions)
+                return CA_REMOTE_POLL;
+
+        e = realloc_buffer_extend0(&rr->output_buffer, sizeof(CaProtocolExtensions));
+        if (!e)
+                return -ENOMEM;
+
+        write_le64(&e->header.size, sizeof(CaProtocolExtensions));
+        write_le64(&e->header.type, CA_PROTOCOL_EXTENSIONS);
+        write_le64(&e->extension_flags, CA_PROTOCOL_EXTENSION_FLAGS_MAX);
+        write_le64(&e->window_requests, window_to_wire(rr->window_requests));
+        write_le64(&e->window_bytes, window_to_wire(rr->window_bytes));
+
+        rr->sent_extensions = true;
+        return CA_REMOTE_STEP;
+}
+
 static int ca_remote_send_file(
                 CaRemote *rr,
                 CaRemoteFile *f,
@@ -1869,6 +2578,110 @@ static int ca_remote_send_archive(CaRemote *rr) {
                         CA_REMOTE_WRITE_ARCHIVE);
 }
 
+static void ca_remote_get_window_effective(CaRemote *rr, uint64_t *ret_requests, uint64_t *ret_bytes) {
+        assert(rr);
+
+        /* Unless the other side told us its window, there's none, and only the fill level of the output buffer limits
+         * our requests */
+        if (!(rr->remote_extension_flags & CA_PROTOCOL_WINDOW)) {
+                *ret_requests = UINT64_MAX;
+                *ret_bytes = UINT64_MAX;
+                return;
+        }
+
+        *ret_requests = MIN(rr->window_requests, rr->remote_window_requests);
+        *ret_bytes = MIN(rr->window_bytes, rr->remote_window_bytes);
+}
+
+static uint64_t ca_remote_bytes_in_flight(CaRemote *rr) {
+        assert(rr);
+
+        /* We don't know how large the chunks we requested are before we get them, hence estimate */
+        if (rr->n_answered == 0)
+                return 0;
+
+        return hashmap_size(rr->in_flight) * (rr->n_answered_bytes / rr->n_answered);
+}
+
+static int ca_remote_add_in_flight(CaRemote *rr, const CaChunkID *id) {
+        CaChunkID *copy;
+        int r;
+
+        assert(rr);
+        assert(id);
+
+        if (hashmap_contains(rr->in_flight, id))
+                return 0;
+
+        r = hashmap_ensure_allocated(&rr->in_flight, &ca_chunk_id_hash_ops);
+        if (r < 0)
+                return r;
+
+        copy = memdup(id, sizeof(CaChunkID));
+        if (!copy)
+                return -ENOMEM;
+
+        r = hashmap_put(rr->in_flight, copy, copy);
+        if (r < 0) {
+                free(copy);
+                return r;
+        }
+
+        return 1;
+}
+
+static bool ca_remote_window_full(CaRemote *rr) {
+        uint64_t requests, bytes;
+
+        assert(rr);
+
+        ca_remote_get_window_effective(rr, &requests, &bytes);
+
+        return hashmap_size(rr->in_flight) >= requests || ca_remote_bytes_in_flight(rr) >= bytes;
+}
+
+static void ca_remote_window_stall(CaRemote *rr, bool b) {
+        assert(rr);
+
+        if (b) {
+                if (rr->window_stall_start == 0)
+                        rr->window_stall_start = now(CLOCK_MONOTONIC);
+        } else if (rr->window_stall_start != 0) {
+                rr->window_stall_nsec += now(CLOCK_MONOTONIC) - rr->window_stall_start;
+                rr->window_stall_start = 0;
+        }
+}
+
+static int ca_remote_send_probe(CaRemote *rr) {
+        CaProtocolRequest *req;
+        CaProtocolProbe *probe;
+        size_t sz;
+
+        assert(rr);
+
+        /* Announces the extensions we understand, in a request for a chunk that older peers won't know and answer
+         * with CA_PROTOCOL_MISSING, see caprotocol.h. It's marked high priority so that it is answered before any
+         * of our real requests. */
+
+        sz = offsetof(CaProtocolRequest, chunks) + sizeof(CaProtocolProbe);
+
+        req = realloc_buffer_extend0(&rr->output_buffer, sz);
+        if (!req)
+                return -ENOMEM;
+
+        write_le64(&req->header.size, sz);
+        write_le64(&req->header.type, CA_PROTOCOL_REQUEST);
+        write_le64(&req->flags, CA_PROTOCOL_REQUEST_HIGH_PRIORITY);
+
+        probe = (CaProtocolProbe*) req->chunks;
+        write_le64(&probe->magic[0], CA_PROTOCOL_PROBE_MAGIC0);
+        write_le64(&probe->magic[1], CA_PROTOCOL_PROBE_MAGIC1);
+        write_le64(&probe->extension_flags, CA_PROTOCOL_EXTENSION_FLAGS_MAX);
+
+        rr->sent_probe = true;
+        return 0;
+}
+
 static int ca_remote_send_request(CaRemote *rr) {
         size_t header_offset = (size_t) -1;
         int only_high_priority = -1, r;
@@ -1886,18 +2699,42 @@ static int ca_remote_send_request(CaRemote *rr) {
         if (realloc_buffer_size(&rr->output_buffer) > REMOTE_BUFFER_LOW)
                 return CA_REMOTE_POLL;
 
+        if (!rr->sent_probe && ca_remote_has_pending_requests(rr) > 0) {
+                r = ca_remote_send_probe(rr);
+                if (r < 0)
+                        return r;
+
+                return CA_REMOTE_STEP;
+        }
+
+        /* Until we know the other side's window, if any, hold back our requests */
+        if (rr->sent_probe && !rr->probe_answered)
+                return CA_REMOTE_POLL;
+
         for (;;) {
                 CaProtocolRequest *req;
                 bool high_priority;
                 CaChunkID id;
                 void *p;
 
+                if (ca_remote_window_full(rr)) {
+                        /* Note down the time we'd have something to send but may not */
+                        ca_remote_window_stall(rr, ca_remote_has_pending_requests(rr) > 0);
+                        break;
+                }
+
+                ca_remote_window_stall(rr, false);
+
                 r = ca_remote_dequeue_request(rr, only_high_priority, &id, &high_priority);
                 if (r == -ENODATA)
                         break;
                 if (r < 0)
                         return r;
 
+                r = ca_remote_add_in_flight(rr, &id);
+                if (r < 0)
+                        return r;
+
                 if (header_offset != (size_t) -1) {
                         /* If we already have a request, append one item */
                         p = realloc_buffer_extend(&rr->output_buffer, CA_CHUNK_ID_SIZE);
@@ -1957,6 +2794,10 @@ int ca_remote_step(CaRemote *rr) {
         if (r != CA_REMOTE_POLL)
                 return r;
 
+        r = ca_remote_send_extensions(rr);
+        if (r != CA_REMOTE_POLL)
+                return r;
+
         r = ca_remote_process_message(rr);
         if (r != CA_REMOTE_POLL)
                 return r;
@@ -1998,7 +2839,7 @@ int ca_remote_poll(CaRemote *rr, uint64_t timeout_nsec, const sigset_t *ss) {
                 n++;
         }
 
-        if (realloc_buffer_size(&rr->output_buffer) > 0) {
+        if (ca_remote_has_output(rr)) {
                 pollfd[n].fd = rr->output_fd;
                 pollfd[n].events = POLLOUT;
                 n++;
@@ -2044,6 +2885,9 @@ static int ca_remote_validate_chunk(
         if (l > CA_CHUNK_SIZE_LIMIT_MAX)
                 return -EINVAL;
 
+        if (!ca_chunk_verify_pick(rr->verify, rr->verify_sample))
+                return 0;
+
         if (compression == CA_CHUNK_COMPRESSED) {
                 realloc_buffer_empty(&rr->validate_buffer);
 
@@ -2202,6 +3046,70 @@ int ca_remote_next_request(CaRemote *rr, CaChunkID *ret) {
         return ca_remote_dequeue_request(rr, -1, ret, NULL);
 }
 
+static bool ca_remote_batching(CaRemote *rr) {
+        assert(rr);
+
+        /* Only if the requesting side announced it in its probe, see ca_remote_process_probe() */
+        return rr->got_probe &&
+                (rr->remote_extension_flags & CA_PROTOCOL_BATCH);
+}
+
+static size_t ca_remote_output_low(CaRemote *rr) {
+        assert(rr);
+
+        return ca_remote_batching(rr) ? REMOTE_BUFFER_BATCH : REMOTE_BUFFER_LOW;
+}
+
+static void *ca_remote_extend_frame(CaRemote *rr, uint64_t type, size_t header_size, size_t size) {
+        CaProtocolHeader *h;
+        size_t offset;
+        void *p;
+
+        assert(rr);
+        assert(header_size >= sizeof(CaProtocolHeader));
+
+        /* Appends 'size' bytes of payload to the frame of the specified type at the end of the output buffer, if
+         * there is one and it has room left. Otherwise starts a new frame, with 'header_size' bytes of header, of
+         * which only the generic part is initialized. Returns a pointer to the payload. */
+
+        if (rr->open_frame_offset != (size_t) -1) {
+                uint64_t frame_size;
+
+                h = realloc_buffer_data_offset(&rr->output_buffer, rr->open_frame_offset);
+                assert(h);
+
+                frame_size = read_le64(&h->size);
+
+                /* Only if nothing else has been appended since */
+                if (read_le64(&h->type) == type &&
+                    rr->open_frame_offset + frame_size == realloc_buffer_size(&rr->output_buffer) &&
+                    frame_size + size <= REMOTE_FRAME_COALESCE_MAX) {
+
+                        p = realloc_buffer_extend(&rr->output_buffer, size);
+                        if (!p)
+                                return NULL;
+
+                        h = realloc_buffer_data_offset(&rr->output_buffer, rr->open_frame_offset);
+                        write_le64(&h->size, frame_size + size);
+
+                        return p;
+                }
+        }
+
+        offset = realloc_buffer_size(&rr->output_buffer);
+
+        h = realloc_buffer_extend(&rr->output_buffer, header_size + size);
+        if (!h)
+                return NULL;
+
+        write_le64(&h->type, type);
+        write_le64(&h->size, header_size + size);
+
+        rr->open_frame_offset = offset;
+
+        return (uint8_t*) h + header_size;
+}
+
 int ca_remote_can_put_chunk(CaRemote *rr) {
         if (!rr)
                 return -EINVAL;
@@ -2217,7 +3125,9 @@ int ca_remote_can_put_chunk(CaRemote *rr) {
 
         if (rr->state != CA_REMOTE_RUNNING)
                 return 0; /* can't take your data right now. */
-        if (realloc_buffer_size(&rr->output_buffer) > REMOTE_BUFFER_LOW)
+        if (rr->send_fd >= 0)
+                return 0; /* still passing on the previous chunk file */
+        if (realloc_buffer_size(&rr->output_buffer) > ca_remote_output_low(rr))
                 return 0; /* won't take your data right now, already got enough in my queue */
 
         return 1;
@@ -2257,6 +3167,28 @@ int ca_remote_put_chunk(
         if (r == 0)
                 return -EAGAIN;
 
+        if (ca_remote_batching(rr)) {
+                CaProtocolChunksItem *item;
+
+                msz = offsetof(CaProtocolChunksItem, data) + size;
+                if (msz < size) /* overflow? */
+                        return -EFBIG;
+                if (offsetof(CaProtocolChunks, items) + msz > CA_PROTOCOL_SIZE_MAX)
+                        return -EFBIG;
+
+                item = ca_remote_extend_frame(rr, CA_PROTOCOL_CHUNKS, offsetof(CaProtocolChunks, items), msz);
+                if (!item)
+                        return -ENOMEM;
+
+                write_le64(&item->size, msz);
+                write_le64(&item->flags, compression == CA_CHUNK_COMPRESSED ? CA_PROTOCOL_CHUNK_COMPRESSED : 0);
+
+                memcpy(item->chunk, chunk_id, CA_CHUNK_ID_SIZE);
+                memcpy(item->data, data, size);
+
+                return 0;
+        }
+
         msz = offsetof(CaProtocolChunk, data) + size;
         if (msz < size) /* overflow? */
                 return -EFBIG;
@@ -2277,6 +3209,104 @@ int ca_remote_put_chunk(
         return 0;
 }
 
+static bool ca_remote_output_sendfile(CaRemote *rr) {
+        struct stat st;
+
+        assert(rr);
+
+        if (rr->output_sendfile < 0)
+                rr->output_sendfile = fstat(rr->output_fd, &st) >= 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode));
+
+        return rr->output_sendfile;
+}
+
+int ca_remote_put_chunk_fd(
+                CaRemote *rr,
+                const CaChunkID *chunk_id,
+                CaChunkCompression compression,
+                int fd,
+                uint64_t size) {
+
+        CaProtocolChunk *chunk;
+        uint64_t msz;
+        int r;
+
+        if (!rr)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (fd < 0)
+                return -EINVAL;
+        if (size < CA_CHUNK_SIZE_LIMIT_MIN)
+                return -EINVAL;
+        if (size > CA_CHUNK_SIZE_LIMIT_MAX)
+                return -EINVAL;
+        if (!IN_SET(compression, CA_CHUNK_COMPRESSED, CA_CHUNK_UNCOMPRESSED))
+                return -EINVAL;
+
+        if (!(rr->remote_feature_flags & CA_PROTOCOL_PULL_CHUNKS) &&
+            !(rr->local_feature_flags & CA_PROTOCOL_PUSH_CHUNKS))
+                return -ENOTTY;
+
+        r = ca_remote_can_put_chunk(rr);
+        if (r < 0)
+                return r;
+        if (r == 0)
+                return -EAGAIN;
+
+        /* Like ca_remote_put_chunk(), but takes the chunk data from the specified fd, reading 'size' bytes from its
+         * current position. If the output fd is a pipe or a socket only the frame header is queued, and the file
+         * contents are copied over by the kernel once it is written. Takes possession of the fd on success. */
+
+        if (!ca_remote_output_sendfile(rr)) {
+                ReallocBuffer b = {};
+                ssize_t n;
+                void *p;
+
+                p = realloc_buffer_extend(&b, size);
+                if (!p)
+                        return -ENOMEM;
+
+                n = loop_read(fd, p, size);
+                if (n < 0)
+                        r = (int) n;
+                else if ((uint64_t) n != size)
+                        r = -EIO;
+                else
+                        r = ca_remote_put_chunk(rr, chunk_id, compression, p, size);
+
+                realloc_buffer_free(&b);
+                if (r < 0)
+                        return r;
+
+                safe_close(fd);
+                return 0;
+        }
+
+        msz = offsetof(CaProtocolChunk, data) + size;
+        if (msz > CA_PROTOCOL_SIZE_MAX)
+                return -EFBIG;
+
+        chunk = realloc_buffer_extend(&rr->output_buffer, offsetof(CaProtocolChunk, data));
+        if (!chunk)
+                return -ENOMEM;
+
+        write_le64(&chunk->header.type, CA_PROTOCOL_CHUNK);
+        write_le64(&chunk->header.size, msz);
+        write_le64(&chunk->flags, compression == CA_CHUNK_COMPRESSED ? CA_PROTOCOL_CHUNK_COMPRESSED : 0);
+
+        memcpy(chunk->chunk, chunk_id, CA_CHUNK_ID_SIZE);
+
+        /* The payload isn't in the buffer, hence nothing may be appended to this frame */
+        rr->open_frame_offset = (size_t) -1;
+
+        rr->send_fd = fd;
+        rr->send_left = size;
+        rr->send_offset = realloc_buffer_size(&rr->output_buffer);
+
+        return 0;
+}
+
 int ca_remote_put_missing(CaRemote *rr, const CaChunkID *chunk_id) {
         CaProtocolMissing *missing;
         int r;
@@ -2320,7 +3350,7 @@ static int ca_remote_file_can_put(CaRemote *rr, CaRemoteFile *f) {
 
         if (rr->state != CA_REMOTE_RUNNING)
                 return 0;
-        if (realloc_buffer_size(&rr->output_buffer) > REMOTE_BUFFER_LOW)
+        if (realloc_buffer_size(&rr->output_buffer) > ca_remote_output_low(rr))
                 return 0;
 
         return 1;
@@ -2340,8 +3370,8 @@ int ca_remote_can_put_index(CaRemote *rr) {
 }
 
 static int ca_remote_file_put(CaRemote *rr, CaRemoteFile *f, uint64_t type, const void *data, size_t size) {
-        CaProtocolFile *p;
         size_t msz;
+        void *p;
 
         assert(rr);
         assert(f);
@@ -2352,14 +3382,12 @@ static int ca_remote_file_put(CaRemote *rr, CaRemoteFile *f, uint64_t type, cons
         if (msz > CA_PROTOCOL_SIZE_MAX)
                 return -EFBIG;
 
-        p = realloc_buffer_extend(&rr->output_buffer, msz);
+        /* Data written in small pieces is coalesced into the previous frame, if that hasn't been sent yet */
+        p = ca_remote_extend_frame(rr, type, offsetof(CaProtocolFile, data), size);
         if (!p)
                 return -ENOMEM;
 
-        write_le64(&p->header.type, type);
-        write_le64(&p->header.size, msz);
-
-        memcpy(p->data, data, size);
+        memcpy(p, data, size);
 
         return 0;
 }
@@ -2674,7 +3702,7 @@ int ca_remote_has_unwritten(CaRemote *rr) {
         if (rr->state == CA_REMOTE_EOF)
                 return -EPIPE;
 
-        return realloc_buffer_size(&rr->output_buffer) > 0;
+        return ca_remote_has_output(rr);
 }
 
 int ca_remote_has_chunks(CaRemote *rr) {
@@ -2693,6 +3721,9 @@ int ca_remote_has_chunks(CaRemote *rr) {
         if (rr->cache_fd < 0)
                 return 0;
 
+        if (!rr->requests_on_disk)
+                return !hashmap_isempty(rr->requests);
+
         r = xopendirat(rr->cache_fd, "chunks", 0, &d);
         if (r == -ENOENT)
                 return 0;
@@ -2730,8 +3761,9 @@ int ca_remote_forget_chunk(CaRemote *rr, const CaChunkID *id) {
 
         /* Forget everything we know about the specified chunk, and the chunk itself. Specifically:
          *
-         * - Remove the chunks/<hash> symlink
-         * - Remove the low-priority/<position> or high-priority</position> symlink
+         * - Remove the request from the in-memory table, or if the queue is on disk:
+         *   - Remove the chunks/<hash> symlink
+         *   - Remove the low-priority/<position> or high-priority</position> symlink
          * - Remove the cached chunk
          */
 
@@ -2743,6 +3775,16 @@ int ca_remote_forget_chunk(CaRemote *rr, const CaChunkID *id) {
         if (rr->cache_fd < 0)
                 return 0;
 
+        if (!rr->requests_on_disk) {
+                free(hashmap_remove(rr->requests, id));
+
+                r = ca_chunk_file_remove(rr->cache_fd, NULL, id);
+                if (r < 0 && r != -ENOENT)
+                        return r;
+
+                return 0;
+        }
+
         if (!ca_chunk_id_format(id, ids))
                 return -EINVAL;
 
@@ -2788,6 +3830,20 @@ finish:
         return r;
 }
 
+int ca_remote_set_verify(CaRemote *rr, CaChunkVerify verify, uint64_t sample) {
+        if (!rr)
+                return -EINVAL;
+        if (verify < 0)
+                return -EINVAL;
+        if (verify >= _CA_CHUNK_VERIFY_MAX)
+                return -EINVAL;
+
+        rr->verify = verify;
+        rr->verify_sample = sample > 0 ? sample : CA_CHUNK_VERIFY_SAMPLE_DEFAULT;
+
+        return 0;
+}
+
 int ca_remote_set_digest_type(CaRemote *rr, CaDigestType type) {
         int r;
 
@@ -2841,6 +3897,49 @@ int ca_remote_get_request_bytes(CaRemote *rr, uint64_t *ret) {
         return 0;
 }
 
+int ca_remote_get_window(CaRemote *rr, uint64_t *ret_requests, uint64_t *ret_bytes) {
+        if (!rr)
+                return -EINVAL;
+        if (!ret_requests)
+                return -EINVAL;
+        if (!ret_bytes)
+                return -EINVAL;
+        if (rr->state == CA_REMOTE_HELLO)
+                return -ENODATA;
+
+        ca_remote_get_window_effective(rr, ret_requests, ret_bytes);
+        return 0;
+}
+
+int ca_remote_get_window_used(CaRemote *rr, uint64_t *ret_requests, uint64_t *ret_bytes) {
+        if (!rr)
+                return -EINVAL;
+        if (!ret_requests)
+                return -EINVAL;
+        if (!ret_bytes)
+                return -EINVAL;
+
+        *ret_requests = hashmap_size(rr->in_flight);
+        *ret_bytes = ca_remote_bytes_in_flight(rr);
+        return 0;
+}
+
+int ca_remote_get_window_stall_nsec(CaRemote *rr, uint64_t *ret) {
+        uint64_t nsec;
+
+        if (!rr)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        nsec = rr->window_stall_nsec;
+        if (rr->window_stall_start != 0)
+                nsec += now(CLOCK_MONOTONIC) - rr->window_stall_start;
+
+        *ret = nsec;
+        return 0;
+}
+
 int ca_remote_set_compression_type(CaRemote *rr, CaCompressionType ct) {
         if (!rr)
                 return -EINVAL;
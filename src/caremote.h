@@ -47,12 +47,26 @@ int ca_remote_add_local_feature_flags(CaRemote *rr, uint64_t flags);
 int ca_remote_get_local_feature_flags(CaRemote *rr, uint64_t* flags);
 int ca_remote_get_remote_feature_flags(CaRemote *rr, uint64_t* flags);
 
+/* The most chunks and chunk bytes we keep requested but not yet received, UINT64_MAX for unlimited */
+int ca_remote_set_window(CaRemote *rr, uint64_t requests, uint64_t bytes);
+
 int ca_remote_set_digest_type(CaRemote *rr, CaDigestType type);
+
+/* Controls whether chunks received are validated against their IDs, see ca_store_set_verify() */
+int ca_remote_set_verify(CaRemote *rr, CaChunkVerify verify, uint64_t sample);
 int ca_remote_get_digest_type(CaRemote *rr, CaDigestType *ret);
 
 int ca_remote_set_log_level(CaRemote *rr, int log_level);
 int ca_remote_set_rate_limit_bps(CaRemote *rr, uint64_t rate_limit_bps);
 
+/* How many chunk transfers a protocol helper such as casync-http keeps in flight, and over how many connections to
+ * one host. 0 leaves the helper's default in place. */
+int ca_remote_set_max_active_chunks(CaRemote *rr, unsigned n);
+int ca_remote_set_max_host_connections(CaRemote *rr, unsigned n);
+
+/* Beyond this many bytes the queue of GET requests is kept in the cache directory instead of memory */
+int ca_remote_set_requests_memory_max(CaRemote *rr, uint64_t size);
+
 int ca_remote_set_io_fds(CaRemote *rr, int input_fd, int output_fd);
 int ca_remote_get_io_fds(CaRemote *rr, int *ret_input_fd, int *ret_output_fd);
 int ca_remote_get_io_events(CaRemote *rr, short *ret_input_events, short *ret_output_events);
@@ -85,6 +99,7 @@ int ca_remote_next_chunk(CaRemote *rr, CaChunkCompression desired_compression, C
 int ca_remote_next_request(CaRemote *rr, CaChunkID *ret);
 int ca_remote_can_put_chunk(CaRemote *rr);
 int ca_remote_put_chunk(CaRemote *rr, const CaChunkID *chunk_id, CaChunkCompression compression, const void *data, uint64_t size);
+int ca_remote_put_chunk_fd(CaRemote *rr, const CaChunkID *chunk_id, CaChunkCompression compression, int fd, uint64_t size);
 int ca_remote_put_missing(CaRemote *rr, const CaChunkID *chunk_id);
 
 /* pull mode: Read index data */
@@ -116,6 +131,11 @@ int ca_remote_forget_chunk(CaRemote *rr, const CaChunkID *id);
 int ca_remote_get_requests(CaRemote *rr, uint64_t *ret);
 int ca_remote_get_request_bytes(CaRemote *rr, uint64_t *ret);
 
+/* The window of unanswered requests to the other side, in chunks and (estimated) bytes, and how much of it is used */
+int ca_remote_get_window(CaRemote *rr, uint64_t *ret_requests, uint64_t *ret_bytes);
+int ca_remote_get_window_used(CaRemote *rr, uint64_t *ret_requests, uint64_t *ret_bytes);
+int ca_remote_get_window_stall_nsec(CaRemote *rr, uint64_t *ret);
+
 int ca_remote_set_compression_type(CaRemote *rr, CaCompressionType ct);
 
 #endif
@@ -1,10 +1,12 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
 #include <sys/stat.h>
+#include <dirent.h>
 #include <fcntl.h>
 
 #include "cachunk.h"
 #include "cachunker.h"
+#include "cachunktable.h"
 #include "caencoder.h"
 #include "cafileroot.h"
 #include "caformat-util.h"
@@ -12,8 +14,8 @@
 #include "calocation.h"
 #include "caseed.h"
 #include "def.h"
+#include "dirent-util.h"
 #include "realloc-buffer.h"
-#include "rm-rf.h"
 #include "time-util.h"
 #include "util.h"
 
@@ -26,23 +28,40 @@
 /* #undef EUNATCH */
 /* #define EUNATCH __LINE__ */
 
+typedef struct CaSeedChunk {
+        ReallocBuffer buffer;
+        CaLocation *location;
+} CaSeedChunk;
+
 struct CaSeed {
         CaEncoder *encoder;
         int base_fd;
+
+        /* Maps chunk IDs (and hardlink digests) to their locations in the seed, formatted as strings. If a cache
+         * file is configured it is kept around, and reused in later runs if the seed didn't change. */
+        CaChunkTable *table;
         int cache_fd;
         char *cache_path;
+        char *cache_directory;
+        uint8_t tag[CA_CHUNK_TABLE_TAG_SIZE];
 
         CaChunker chunker;
         CaDigest *chunk_digest;
 
         bool ready:1;
-        bool remove_cache:1;
+        bool cache_persistent:1;
+        bool cache_valid:1;
         bool cache_hardlink:1;
         bool cache_chunks:1;
 
         ReallocBuffer buffer;
         CaLocation *buffer_location;
 
+        /* If the chunk digest can hash multiple chunks at once, chunks are collected here first */
+        CaSeedChunk *batch;
+        size_t n_batch;
+        size_t batch_size;
+
         CaFileRoot *root;
 
         uint64_t feature_flags;
@@ -73,41 +92,37 @@ CaSeed *ca_seed_new(void) {
         return s;
 }
 
-static void ca_seed_remove_and_close_cache(CaSeed *s) {
-        assert(s);
-
-        if (!s->remove_cache)
-                return;
-
-        if (s->cache_path) {
-                (void) rm_rf(s->cache_path, REMOVE_ROOT|REMOVE_PHYSICAL);
-                s->cache_path = mfree(s->cache_path);
-                s->cache_fd = safe_close(s->cache_fd);
-        } else if (s->cache_fd >= 0) {
-                (void) rm_rf_children(s->cache_fd, REMOVE_PHYSICAL, NULL);
-                s->cache_fd = -1;
-        }
-}
-
 CaSeed *ca_seed_unref(CaSeed *s) {
+        size_t i;
+
         if (!s)
                 return NULL;
 
         ca_file_root_invalidate(s->root);
 
-        ca_seed_remove_and_close_cache(s);
-
         ca_encoder_unref(s->encoder);
 
         safe_close(s->base_fd);
+
+        ca_chunk_table_unref(s->table);
         safe_close(s->cache_fd);
         free(s->cache_path);
+        free(s->cache_directory);
 
         ca_digest_free(s->chunk_digest);
 
         realloc_buffer_free(&s->buffer);
         ca_location_unref(s->buffer_location);
 
+        if (s->batch) {
+                for (i = 0; i < s->batch_size; i++) {
+                        realloc_buffer_free(&s->batch[i].buffer);
+                        ca_location_unref(s->batch[i].location);
+                }
+
+                free(s->batch);
+        }
+
         ca_file_root_unref(s->root);
 
         return mfree(s);
@@ -150,7 +165,9 @@ int ca_seed_set_cache_fd(CaSeed *s, int fd) {
 
         if (s->cache_fd >= 0)
                 return -EBUSY;
-        if (s->cache_path)
+        if (s->cache_path || s->cache_directory)
+                return -EBUSY;
+        if (s->table)
                 return -EBUSY;
 
         s->cache_fd = fd;
@@ -165,7 +182,9 @@ int ca_seed_set_cache_path(CaSeed *s, const char *path) {
 
         if (s->cache_fd >= 0)
                 return -EBUSY;
-        if (s->cache_path)
+        if (s->cache_path || s->cache_directory)
+                return -EBUSY;
+        if (s->table)
                 return -EBUSY;
 
         s->cache_path = strdup(path);
@@ -175,12 +194,219 @@ int ca_seed_set_cache_path(CaSeed *s, const char *path) {
         return 0;
 }
 
+int ca_seed_set_cache_directory(CaSeed *s, const char *path) {
+        if (!s)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+
+        if (s->cache_fd >= 0)
+                return -EBUSY;
+        if (s->cache_path || s->cache_directory)
+                return -EBUSY;
+        if (s->table)
+                return -EBUSY;
+
+        s->cache_directory = strdup(path);
+        if (!s->cache_directory)
+                return -ENOMEM;
+
+        return 0;
+}
+
+static void ca_seed_fingerprint_stat(CaDigest *d, const struct stat *st) {
+        assert(d);
+        assert(st);
+
+        ca_digest_write_u64(d, st->st_ino);
+        ca_digest_write_u32(d, st->st_mode);
+        ca_digest_write_u32(d, st->st_uid);
+        ca_digest_write_u32(d, st->st_gid);
+        ca_digest_write_u64(d, st->st_rdev);
+        ca_digest_write_u64(d, st->st_size);
+        ca_digest_write_u64(d, st->st_mtim.tv_sec);
+        ca_digest_write_u64(d, st->st_mtim.tv_nsec);
+        ca_digest_write_u64(d, st->st_ctim.tv_sec);
+        ca_digest_write_u64(d, st->st_ctim.tv_nsec);
+}
+
+static int ca_seed_fingerprint_directory(CaDigest *d, int fd) {
+        _cleanup_(closedirp) DIR *dir = NULL;
+        struct dirent *de;
+        int dfd, r;
+
+        assert(d);
+        assert(fd >= 0);
+
+        dfd = openat(fd, ".", O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+        if (dfd < 0)
+                return -errno;
+
+        dir = fdopendir(dfd);
+        if (!dir) {
+                safe_close(dfd);
+                return -errno;
+        }
+
+        FOREACH_DIRENT_ALL(de, dir, return -errno) {
+                struct stat st;
+
+                if (dot_or_dot_dot(de->d_name))
+                        continue;
+
+                if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                        if (errno == ENOENT)
+                                continue;
+
+                        return -errno;
+                }
+
+                ca_digest_write(d, de->d_name, strlen(de->d_name) + 1);
+                ca_seed_fingerprint_stat(d, &st);
+
+                if (S_ISDIR(st.st_mode)) {
+                        _cleanup_(safe_closep) int subdir_fd = -1;
+
+                        subdir_fd = openat(dirfd(dir), de->d_name, O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOFOLLOW);
+                        if (subdir_fd < 0)
+                                return -errno;
+
+                        r = ca_seed_fingerprint_directory(d, subdir_fd);
+                        if (r < 0)
+                                return r;
+
+                        /* Mark the end of the directory */
+                        ca_digest_write_u8(d, 0);
+                }
+        }
+
+        return 0;
+}
+
+static int ca_seed_make_tag(CaSeed *s, int fd, uint8_t ret[CA_CHUNK_TABLE_TAG_SIZE]) {
+        _cleanup_(ca_digest_freep) CaDigest *d = NULL;
+        struct stat st;
+        int r;
+
+        assert(s);
+        assert(fd >= 0);
+        assert(ret);
+
+        /* Calculates a digest over the seed's parameters, and the metadata of all inodes in the seed. If it matches
+         * the tag of a persistent cache, then the chunks in the seed did not change since the cache was generated,
+         * and the cache may be used without reading all the seed's data again. */
+
+        r = ca_digest_new(CA_DIGEST_SHA256, &d);
+        if (r < 0)
+                return r;
+
+        assert(ca_digest_get_size(d) == CA_CHUNK_TABLE_TAG_SIZE);
+
+        ca_digest_write_u64(d, s->feature_flags);
+        ca_digest_write_u64(d, s->chunker.chunk_size_min);
+        ca_digest_write_u64(d, s->chunker.chunk_size_avg);
+        ca_digest_write_u64(d, s->chunker.chunk_size_max);
+        ca_digest_write_u8(d, s->cache_chunks);
+        ca_digest_write_u8(d, s->cache_hardlink);
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        ca_seed_fingerprint_stat(d, &st);
+
+        if (S_ISDIR(st.st_mode)) {
+                r = ca_seed_fingerprint_directory(d, fd);
+                if (r < 0)
+                        return r;
+        }
+
+        memcpy(ret, ca_digest_read(d), CA_CHUNK_TABLE_TAG_SIZE);
+        return 0;
+}
+
+static int ca_seed_open_cache(CaSeed *s) {
+        uint8_t tag[CA_CHUNK_TABLE_TAG_SIZE];
+        int fd, r;
+
+        assert(s);
+
+        if (s->table)
+                return 0;
+
+        fd = s->base_fd >= 0 ? s->base_fd : ca_encoder_get_base_fd(s->encoder);
+        if (fd < 0)
+                return -EUNATCH;
+
+        if (s->cache_fd >= 0) {
+                r = ca_chunk_table_new_fd(s->cache_fd, &s->table);
+                s->cache_fd = -1;
+                if (r < 0)
+                        return r;
+
+                s->cache_persistent = true;
+        } else {
+                if (!s->cache_path && s->cache_directory) {
+                        struct stat st;
+
+                        /* Name the cache after the inode of the seed */
+                        if (fstat(fd, &st) < 0)
+                                return -errno;
+
+                        (void) mkdir(s->cache_directory, 0777);
+
+                        if (asprintf(&s->cache_path, "%s/%" PRIx64 "-%" PRIx64 ".caseed",
+                                     s->cache_directory, (uint64_t) st.st_dev, (uint64_t) st.st_ino) < 0)
+                                return -ENOMEM;
+                }
+
+                if (s->cache_path) {
+                        r = ca_chunk_table_new_path(s->cache_path, &s->table);
+                        if (r == -EBUSY)
+                                log_debug("Seed cache %s is in use, not using it.", s->cache_path);
+                        else if (r < 0)
+                                return log_debug_errno(r, "Failed to open seed cache %s: %m", s->cache_path);
+                        else
+                                s->cache_persistent = true;
+                }
+
+                if (!s->table) {
+                        r = ca_chunk_table_new_temporary(&s->table);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        if (!s->cache_persistent)
+                return 0;
+
+        r = ca_seed_make_tag(s, fd, s->tag);
+        if (r < 0)
+                return r;
+
+        r = ca_chunk_table_get_tag(s->table, tag);
+        if (r < 0)
+                return r;
+
+        if (memcmp(tag, s->tag, sizeof(tag)) == 0) {
+                log_debug("Seed did not change since its cache was generated, reusing cache with %" PRIu64 " entries.",
+                          ca_chunk_table_get_n_entries(s->table));
+                s->cache_valid = true;
+                return 0;
+        }
+
+        return ca_chunk_table_reset(s->table);
+}
+
 static int ca_seed_open(CaSeed *s) {
         int r;
 
         if (!s)
                 return -EINVAL;
 
+        r = ca_seed_open_cache(s);
+        if (r < 0)
+                return r;
+
         if (!s->encoder) {
                 if (s->base_fd < 0)
                         return -EUNATCH;
@@ -204,27 +430,22 @@ static int ca_seed_open(CaSeed *s) {
                 s->base_fd = -1;
         }
 
-        if (s->cache_fd < 0) {
-                if (!s->cache_path) {
-                        const char *d;
-
-                        r = var_tmp_dir(&d);
-                        if (r < 0)
-                                return r;
+        return 0;
+}
 
-                        if (asprintf(&s->cache_path, "%s/%" PRIx64 ".cased", d, random_u64()) < 0)
-                                return -ENOMEM;
+static int ca_seed_allocate_digest(CaSeed *s) {
+        int r;
 
-                        s->remove_cache = true;
-                }
+        assert(s);
 
-                (void) mkdir(s->cache_path, 0777);
+        if (s->chunk_digest)
+                return 0;
 
-                s->cache_fd = open(s->cache_path, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
-                if (s->cache_fd < 0)
-                        return -errno;
-        }
+        r = ca_digest_new(ca_feature_flags_to_digest_type(s->feature_flags), &s->chunk_digest);
+        if (r < 0)
+                return r;
 
+        s->batch_size = ca_digest_get_batch_size(s->chunk_digest);
         return 0;
 }
 
@@ -238,25 +459,21 @@ static int ca_seed_make_chunk_id(CaSeed *s, const void *p, size_t l, CaChunkID *
         if (!ret)
                 return -EINVAL;
 
-        if (!s->chunk_digest) {
-                r = ca_digest_new(ca_feature_flags_to_digest_type(s->feature_flags), &s->chunk_digest);
-                if (r < 0)
-                        return r;
-        }
+        r = ca_seed_allocate_digest(s);
+        if (r < 0)
+                return r;
 
         return ca_chunk_id_make(s->chunk_digest, p, l, ret);
 }
 
-static int ca_seed_write_cache_entry(CaSeed *s, CaLocation *location, const void *data, size_t l) {
-        char ids[CA_CHUNK_ID_FORMAT_MAX];
-        const char *t, *four, *combined;
-        CaChunkID id;
+static int ca_seed_write_cache_entry_with_id(CaSeed *s, CaLocation *location, size_t l, const CaChunkID *id) {
+        const char *t;
         int r;
 
         assert(s);
         assert(location);
-        assert(data);
         assert(l > 0);
+        assert(id);
 
         r = ca_location_patch_size(&location, l);
         if (r < 0)
@@ -266,54 +483,103 @@ static int ca_seed_write_cache_entry(CaSeed *s, CaLocation *location, const void
         if (!t)
                 return -ENOMEM;
 
-        r = ca_seed_make_chunk_id(s, data, l, &id);
+        r = ca_chunk_table_put(s->table, id, t, strlen(t) + 1);
+        if (r == -EEXIST)
+                return 0;
+        if (r < 0)
+                return log_debug_errno(r, "Failed to add seed entry %s: %m", t);
+
+        return 1;
+}
+
+static int ca_seed_flush_batch(CaSeed *s) {
+        const void **data;
+        CaChunkID *ids;
+        size_t *sizes, i;
+        int r;
+
+        assert(s);
+
+        /* Hashes all chunks collected so far at once, and writes their cache entries */
+
+        if (s->n_batch == 0)
+                return 0;
+
+        data = newa(const void*, s->n_batch);
+        sizes = newa(size_t, s->n_batch);
+        ids = newa(CaChunkID, s->n_batch);
+
+        for (i = 0; i < s->n_batch; i++) {
+                data[i] = realloc_buffer_data(&s->batch[i].buffer);
+                sizes[i] = realloc_buffer_size(&s->batch[i].buffer);
+        }
+
+        r = ca_chunk_id_make_batch(s->chunk_digest, data, sizes, s->n_batch, ids);
         if (r < 0)
                 return r;
 
-        if (!ca_chunk_id_format(&id, ids))
-                return -EINVAL;
+        for (i = 0; i < s->n_batch; i++) {
+                r = ca_seed_write_cache_entry_with_id(s, s->batch[i].location, sizes[i], ids + i);
+                if (r < 0)
+                        return r;
 
-        four = strndupa(ids, 4);
-        combined = strjoina(four, "/", ids);
+                realloc_buffer_empty(&s->batch[i].buffer);
+                s->batch[i].location = ca_location_unref(s->batch[i].location);
+        }
 
-        (void) mkdirat(s->cache_fd, four, 0777);
+        s->n_batch = 0;
+        return 0;
+}
 
-        if (symlinkat(t, s->cache_fd, combined) < 0) {
-                _cleanup_(unlink_and_freep) char *temp = NULL;
-                _cleanup_(safe_closep) int fd = -1;
-                ssize_t n;
-                size_t k;
+static int ca_seed_write_cache_entry(CaSeed *s, CaLocation *location, const void *data, size_t l) {
+        CaSeedChunk *c;
+        CaChunkID id;
+        int r;
 
-                if (errno == EEXIST)
-                        return 0;
+        assert(s);
+        assert(location);
+        assert(data);
+        assert(l > 0);
 
-                if (errno != ENAMETOOLONG)
-                        return log_debug_errno(errno, "Failed to create seed entry symlink %s → %s: %m", combined, t);
+        r = ca_seed_allocate_digest(s);
+        if (r < 0)
+                return r;
 
-                r = tempfn_random(combined, &temp);
+        if (s->batch_size <= 1) {
+                r = ca_seed_make_chunk_id(s, data, l, &id);
                 if (r < 0)
-                        return log_debug_errno(r, "Failed to allocate temporary path for %s: %m", combined);
-
-                fd = openat(s->cache_fd, temp, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC|O_NOFOLLOW, 0666);
-                if (fd < 0)
-                        return log_debug_errno(errno, "Failed to create seed entry file %s: %m", combined);
-
-                k = strlen(t);
-                n = write(fd, t, k);
-                if (n < 0)
-                        return log_debug_errno(errno, "Failed to write seed entry file %s: %m", combined);
-                if ((size_t) n != k) {
-                        log_debug("Short write while writing seed entry file %s: %m", combined);
-                        return -EIO;
-                }
+                        return r;
+
+                return ca_seed_write_cache_entry_with_id(s, location, l, &id);
+        }
 
-                if (renameat(s->cache_fd, temp, s->cache_fd, combined) < 0)
-                        return log_debug_errno(errno, "Failed to move seed entry file %s into place: %m", combined);
+        /* Copy the chunk, and hash it together with the next ones */
 
-                temp = mfree(temp);
+        if (!s->batch) {
+                s->batch = new0(CaSeedChunk, s->batch_size);
+                if (!s->batch)
+                        return -ENOMEM;
         }
 
-        return 1;
+        c = s->batch + s->n_batch;
+
+        realloc_buffer_empty(&c->buffer);
+        if (!realloc_buffer_append(&c->buffer, data, l))
+                return -ENOMEM;
+
+        /* Patch the size in right away, which gives us our own copy of the location */
+        ca_location_unref(c->location);
+        c->location = ca_location_ref(location);
+        r = ca_location_patch_size(&c->location, l);
+        if (r < 0)
+                return r;
+
+        s->n_batch++;
+
+        if (s->n_batch < s->batch_size)
+                return 0;
+
+        return ca_seed_flush_batch(s);
 }
 
 static int ca_seed_cache_chunks(CaSeed *s) {
@@ -386,26 +652,22 @@ static int ca_seed_cache_final_chunk(CaSeed *s) {
         if (!s->cache_chunks)
                 return 0;
 
-        if (realloc_buffer_size(&s->buffer) == 0)
-                return 0;
-
-        if (!s->buffer_location)
-                return 0;
-
-        r = ca_seed_write_cache_entry(s, s->buffer_location, realloc_buffer_data(&s->buffer), realloc_buffer_size(&s->buffer));
-        if (r < 0)
-                return 0;
+        if (realloc_buffer_size(&s->buffer) > 0 && s->buffer_location) {
+                r = ca_seed_write_cache_entry(s, s->buffer_location, realloc_buffer_data(&s->buffer), realloc_buffer_size(&s->buffer));
+                if (r < 0)
+                        return 0;
 
-        realloc_buffer_empty(&s->buffer);
-        s->buffer_location = ca_location_unref(s->buffer_location);
+                realloc_buffer_empty(&s->buffer);
+                s->buffer_location = ca_location_unref(s->buffer_location);
+        }
 
+        (void) ca_seed_flush_batch(s);
         return 0;
 }
 
 static int ca_seed_cache_hardlink(CaSeed *s) {
-        const char *t, *four, *combined;
-        char v[CA_CHUNK_ID_FORMAT_MAX];
         CaLocation *location = NULL;
+        const char *t;
         char *path = NULL;
         CaChunkID digest;
         mode_t mode;
@@ -443,22 +705,9 @@ static int ca_seed_cache_hardlink(CaSeed *s) {
                 goto finish;
         }
 
-        if (!ca_chunk_id_format(&digest, v)) {
-                r = -EINVAL;
-                goto finish;
-        }
-
-        four = strndupa(v, 4);
-        combined = strjoina(four, "/", v);
-
-        (void) mkdirat(s->cache_fd, four, 0777);
-
-        if (symlinkat(t, s->cache_fd, combined) < 0 && errno != EEXIST) {
-                r = -errno;
-                goto finish;
-        }
-
-        r = 0;
+        r = ca_chunk_table_put(s->table, &digest, t, strlen(t) + 1);
+        if (r == -EEXIST)
+                r = 0;
 
 finish:
         ca_location_unref(location);
@@ -489,6 +738,14 @@ int ca_seed_step(CaSeed *s) {
         if (r < 0)
                 return r;
 
+        if (s->cache_valid) {
+                if (s->last_step_nsec == 0)
+                        s->last_step_nsec = now(CLOCK_MONOTONIC);
+
+                s->ready = true;
+                return CA_SEED_READY;
+        }
+
         for (;;) {
                 int step;
 
@@ -504,6 +761,13 @@ int ca_seed_step(CaSeed *s) {
                         if (r < 0)
                                 return r;
 
+                        if (s->cache_persistent) {
+                                /* Mark the cache as complete, so that it may be reused next time */
+                                r = ca_chunk_table_set_tag(s->table, s->tag);
+                                if (r < 0)
+                                        log_debug_errno(r, "Failed to finalize seed cache, ignoring: %m");
+                        }
+
                         if (s->last_step_nsec == 0)
                                 s->last_step_nsec = now(CLOCK_MONOTONIC);
 
@@ -534,14 +798,36 @@ int ca_seed_step(CaSeed *s) {
         }
 }
 
+static int ca_seed_lookup(CaSeed *s, const CaChunkID *id, CaLocation **ret) {
+        const char *t;
+        size_t n;
+        int r;
+
+        assert(s);
+        assert(id);
+        assert(ret);
+
+        r = ca_chunk_table_get(s->table, id, (const void**) &t, &n);
+        if (r < 0)
+                return r;
+
+        /* Safety check: let's make sure this is a NUL terminated string without embedded NUL bytes */
+        if (n == 0 || t[n-1] != 0 || memchr(t, 0, n-1))
+                return -EBADMSG;
+
+        r = ca_location_parse(t, ret);
+        if (r < 0)
+                return log_debug_errno(r, "Failed to parse location '%s': %m", t);
+
+        return 0;
+}
+
 int ca_seed_get(CaSeed *s,
                 const CaChunkID *chunk_id,
                 const void **ret,
                 size_t *ret_size,
                 CaOrigin **ret_origin) {
 
-        char id[CA_CHUNK_ID_FORMAT_MAX], *target = NULL;
-        const char *four, *combined;
         CaFileRoot *root = NULL;
         CaOrigin *origin = NULL;
         CaLocation *l = NULL;
@@ -557,53 +843,14 @@ int ca_seed_get(CaSeed *s,
                 return -EINVAL;
         if (!ret_size)
                 return -EINVAL;
-        if (s->cache_fd < 0)
+        if (!s->table)
                 return -EUNATCH;
         if (!s->cache_chunks)
                 return -ENOMEDIUM;
 
-        if (!ca_chunk_id_format(chunk_id, id))
-                return -EINVAL;
-
-        four = strndupa(id, 4);
-        combined = strjoina(four, "/", id);
-
-        r = readlinkat_malloc(s->cache_fd, combined, &target);
-        if (r == -EINVAL) {
-                _cleanup_(safe_closep) int fd = -1;
-                ReallocBuffer buffer = {};
-
-                /*在s->cache_fd中打开combined*/
-                fd = openat(s->cache_fd, combined, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
-                if (fd < 0)
-                        return log_debug_errno(errno, "Failed to read from seed file %s: %m", combined);
-
-                /*将fd内容填充到buffer中*/
-                r = realloc_buffer_read_full(&buffer, fd, 1024U*1024U);
-                if (r < 0)
-                        return r;
-
-                /* Safety check: let's make sure there's no embedded NUL byte */
-                r = realloc_buffer_memchr(&buffer, 0);
-                if (r >= 0)
-                		/*buffer中包含'\0'*/
-                        return -EINVAL;
-                if (r != -ENXIO)
-                        return r;
-
-                if (!realloc_buffer_append_byte(&buffer, 0))
-                        return -ENOMEM;
-
-                target = realloc_buffer_steal(&buffer);
-        } else if (r < 0)
-                return r;
-
-        /* fprintf(stderr, "GOT %s → %s\n", combined, target); */
-
-        r = ca_location_parse(target, &l);
-        free(target);
+        r = ca_seed_lookup(s, chunk_id, &l);
         if (r < 0)
-                return log_debug_errno(r, "Failed to parse location '%s': %m", target);
+                return r;
 
         if (l->size == UINT64_MAX) /* If the size is not specified, then this is a hardlink entry */
                 return -ENOENT;
@@ -733,30 +980,22 @@ finish:
 }
 
 int ca_seed_has(CaSeed *s, const CaChunkID *chunk_id) {
-        char id[CA_CHUNK_ID_FORMAT_MAX];
-        const char *four, *combined;
+        int r;
 
         if (!s)
                 return -EINVAL;
         if (!chunk_id)
                 return -EINVAL;
-        if (s->cache_fd < 0)
+        if (!s->table)
                 return -EUNATCH;
         if (!s->cache_chunks)
                 return -ENOMEDIUM;
 
-        if (!ca_chunk_id_format(chunk_id, id))
-                return -EINVAL;
-
-        four = strndupa(id, 4);
-        combined = strjoina(four, "/", id);
-
-        if (faccessat(s->cache_fd, combined, F_OK, AT_SYMLINK_NOFOLLOW) < 0) {
-                if (errno == ENOENT)
-                        return 0;
-
-                return -errno;
-        }
+        r = ca_chunk_table_get(s->table, chunk_id, NULL, NULL);
+        if (r == -ENOENT)
+                return 0;
+        if (r < 0)
+                return r;
 
         return 1;
 }
@@ -766,10 +1005,7 @@ int ca_seed_get_hardlink_target(
                 const CaChunkID *id,
                 char **ret) {
 
-        char v[CA_CHUNK_ID_FORMAT_MAX];
-        const char *four, *combined;
         CaLocation *l = NULL;
-        char *target;
         int r;
 
         if (!s)
@@ -778,23 +1014,12 @@ int ca_seed_get_hardlink_target(
                 return -EINVAL;
         if (!ret)
                 return -EINVAL;
-        if (s->cache_fd < 0)
+        if (!s->table)
                 return -EUNATCH;
         if (!s->cache_hardlink)
                 return -ENOMEDIUM;
 
-        if (!ca_chunk_id_format(id, v))
-                return -EINVAL;
-
-        four = strndupa(v, 4);
-        combined = strjoina(four, "/", v);
-
-        r = readlinkat_malloc(s->cache_fd, combined, &target);
-        if (r < 0)
-                return r;
-
-        r = ca_location_parse(target, &l);
-        free(target);
+        r = ca_seed_lookup(s, id, &l);
         if (r < 0)
                 return r;
 
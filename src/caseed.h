@@ -23,8 +23,12 @@ CaSeed *ca_seed_unref(CaSeed *s);
 int ca_seed_set_base_fd(CaSeed *s, int fd);
 int ca_seed_set_base_path(CaSeed *s, const char *path);
 
+/* The seed cache maps chunk IDs to their locations in the seed. By default a temporary one is used. If a file (or a
+ * directory to create one in, named after the seed) is specified, it is kept, and reused as long as the seed doesn't
+ * change. */
 int ca_seed_set_cache_fd(CaSeed *s, int fd);
 int ca_seed_set_cache_path(CaSeed *s, const char *path);
+int ca_seed_set_cache_directory(CaSeed *s, const char *path);
 
 int ca_seed_step(CaSeed *s);
 
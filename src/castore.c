@@ -5,9 +5,13 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "capack.h"
 #include "castore.h"
+#include "cauring.h"
 #include "def.h"
 #include "dirent-util.h"
+#include "hashmap.h"
+#include "log.h"
 #include "realloc-buffer.h"
 #include "rm-rf.h"
 #include "util.h"
@@ -18,21 +22,60 @@
 /* #undef EBADMSG */
 /* #define EBADMSG __LINE__ */
 
+/* How many chunk loads to keep in flight at most, by default and at most */
+#define STORE_PREFETCH_MAX_DEFAULT 32U
+#define STORE_PREFETCH_MAX_LIMIT 4096U
+
+typedef enum CaStoreReadState {
+        CA_STORE_READ_OPEN,
+        CA_STORE_READ_READ,
+        CA_STORE_READ_DONE,
+} CaStoreReadState;
+
+/* A chunk file being loaded through io_uring, on behalf of ca_store_prefetch() */
+typedef struct CaStoreRead {
+        CaChunkID id;
+        uint64_t seq;
+        CaStoreReadState state;
+        CaChunkCompression compression; /* Of the file we are opening or reading */
+        char *path;
+        int fd;
+        ReallocBuffer buffer;
+        uint64_t size, done;
+        int error;
+        bool discard; /* Nobody wants this anymore, free it as soon as the kernel is done with it */
+} CaStoreRead;
+
 struct CaStore {
         char *root;/*写对应的根路径,包含'/'符*/
         bool is_cache:1;
         bool mkdir_done:1;
+        bool packs:1;       /* Whether to put new chunks into packfiles */
+        bool write_packs:1; /* Whether we actually do, because it was requested or the store already has packfiles */
         ReallocBuffer buffer;
 
+        CaPack *pack;
+        ReallocBuffer pack_buffer;
+
         CaDigestType digest_type;
         ReallocBuffer validate_buffer;
         CaDigest *validate_digest;
+        bool digest_matched; /* Whether validate_digest was found to be the right one */
+        CaChunkVerify verify;
+        uint64_t verify_sample;
 
         CaChunkCompression compression;
         CaCompressionType compression_type;
 
         uint64_t n_requests;
         uint64_t n_request_bytes;
+
+        /* Chunks loaded ahead of time, indexed by their ID */
+        CaUring *uring;
+        bool uring_failed;
+        Hashmap *reads;
+        uint64_t read_seq;
+        unsigned prefetch_max;
 };
 
 struct CaStoreIterator {
@@ -41,6 +84,9 @@ struct CaStoreIterator {
         DIR *rootdir;
         struct dirent *subdir_de;
         DIR *subdir;
+
+        bool loose_done;
+        uint64_t pack_cursor;
 };
 
 CaStore* ca_store_new(void) {
@@ -55,6 +101,8 @@ CaStore* ca_store_new(void) {
         store->compression = CA_CHUNK_COMPRESSED;
         store->compression_type = CA_COMPRESSION_DEFAULT;
 
+        store->prefetch_max = STORE_PREFETCH_MAX_DEFAULT;
+
         return store;
 }
 
@@ -72,13 +120,168 @@ CaStore *ca_store_new_cache(void) {
         return s;
 }
 
+static CaStoreRead* ca_store_read_free(CaStoreRead *rd) {
+        if (!rd)
+                return NULL;
+
+        safe_close(rd->fd);
+        free(rd->path);
+        realloc_buffer_free(&rd->buffer);
+
+        return mfree(rd);
+}
+
+static void ca_store_read_finish(CaStoreRead *rd, int error) {
+        assert(rd);
+
+        rd->fd = safe_close(rd->fd);
+        rd->error = error;
+        rd->state = CA_STORE_READ_DONE;
+}
+
+static int ca_store_read_open(CaStore *store, CaStoreRead *rd) {
+        const char *suffix;
+
+        assert(store);
+        assert(rd);
+
+        suffix = rd->compression == CA_CHUNK_COMPRESSED ? ca_compressed_chunk_suffix() : NULL;
+
+        free(rd->path);
+        rd->path = malloc(CA_CHUNK_ID_PATH_SIZE(store->root, suffix));
+        if (!rd->path)
+                return -ENOMEM;
+
+        ca_chunk_id_format_path(store->root, &rd->id, suffix, rd->path);
+
+        rd->state = CA_STORE_READ_OPEN;
+
+        return ca_uring_queue_openat(store->uring, AT_FDCWD, rd->path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW, (uintptr_t) rd);
+}
+
+static int ca_store_read_process(CaStore *store, CaStoreRead *rd, int result) {
+        struct stat st;
+        void *p;
+
+        assert(store);
+        assert(rd);
+
+        switch (rd->state) {
+
+        case CA_STORE_READ_OPEN:
+                if (result == -ENOENT && rd->compression == CA_CHUNK_COMPRESSED) {
+                        /* No compressed version of the chunk, look for an uncompressed one */
+                        rd->compression = CA_CHUNK_UNCOMPRESSED;
+                        return ca_store_read_open(store, rd);
+                }
+                if (result < 0)
+                        return result;
+
+                rd->fd = result;
+
+                if (fstat(rd->fd, &st) < 0)
+                        return -errno;
+                if (!S_ISREG(st.st_mode))
+                        return -EBADMSG;
+                if ((uint64_t) st.st_size < CA_CHUNK_SIZE_LIMIT_MIN || (uint64_t) st.st_size > CA_CHUNK_SIZE_LIMIT_MAX)
+                        return -EBADMSG;
+
+                rd->size = st.st_size;
+
+                p = realloc_buffer_acquire(&rd->buffer, rd->size);
+                if (!p)
+                        return -ENOMEM;
+
+                rd->state = CA_STORE_READ_READ;
+                return ca_uring_queue_read(store->uring, rd->fd, p, rd->size, 0, (uintptr_t) rd);
+
+        case CA_STORE_READ_READ:
+                if (result < 0)
+                        return result;
+                if (result == 0) /* File shrunk? */
+                        return -EIO;
+
+                rd->done += result;
+                if (rd->done < rd->size)
+                        return ca_uring_queue_read(store->uring, rd->fd,
+                                                   (uint8_t*) realloc_buffer_data(&rd->buffer) + rd->done,
+                                                   rd->size - rd->done, rd->done, (uintptr_t) rd);
+
+                ca_store_read_finish(rd, 0);
+                return 0;
+
+        default:
+                assert_not_reached("Unexpected read state");
+        }
+}
+
+static int ca_store_process_completion(CaStore *store, bool wait) {
+        CaStoreRead *rd;
+        uint64_t cookie;
+        int r, result;
+
+        assert(store);
+        assert(store->uring);
+
+        r = ca_uring_complete(store->uring, wait, &cookie, &result);
+        if (r < 0)
+                return r;
+
+        rd = (CaStoreRead*) (uintptr_t) cookie;
+        assert(rd);
+
+        if (rd->discard) {
+                if (rd->state == CA_STORE_READ_OPEN && result >= 0)
+                        safe_close(result);
+
+                ca_store_read_free(rd);
+                return 0;
+        }
+
+        r = ca_store_read_process(store, rd, result);
+        if (r < 0) {
+                ca_store_read_finish(rd, r);
+                return 0;
+        }
+
+        return ca_uring_submit(store->uring);
+}
+
+static void ca_store_read_discard(CaStore *store, CaStoreRead *rd) {
+        assert(store);
+        assert(rd);
+
+        assert_se(hashmap_remove(store->reads, &rd->id) == rd);
+
+        if (rd->state == CA_STORE_READ_DONE)
+                ca_store_read_free(rd);
+        else
+                rd->discard = true;
+}
+
 CaStore* ca_store_unref(CaStore *store) {
         if (!store)
                 return NULL;
 
+        if (store->uring) {
+                /* The kernel might still write to our buffers, hence wait until it's done */
+                ca_store_prefetch_discard(store);
+
+                while (ca_uring_pending(store->uring) > 0)
+                        if (ca_store_process_completion(store, true) < 0)
+                                break;
+
+                ca_uring_unref(store->uring);
+        }
+
+        hashmap_free(store->reads);
+
         if (store->is_cache && store->root)
                 (void) rm_rf(store->root, REMOVE_ROOT|REMOVE_PHYSICAL);
 
+        ca_pack_unref(store->pack);
+        realloc_buffer_free(&store->pack_buffer);
+
         free(store->root);
         realloc_buffer_free(&store->buffer);
 
@@ -88,6 +291,153 @@ CaStore* ca_store_unref(CaStore *store) {
         return mfree(store);
 }
 
+static int ca_store_allocate_pack(CaStore *store) {
+        _cleanup_free_ char *path = NULL;
+        int r;
+
+        assert(store);
+        assert(store->root);
+
+        /* Caches never use packfiles, they are thrown away in the end anyway */
+        if (store->is_cache)
+                return 0;
+
+        path = strjoin(store->root, "packs", NULL);
+        if (!path)
+                return -ENOMEM;
+
+        store->pack = ca_pack_new();
+        if (!store->pack)
+                return -ENOMEM;
+
+        r = ca_pack_set_path(store->pack, path);
+        if (r < 0) {
+                store->pack = ca_pack_unref(store->pack);
+                return r;
+        }
+
+        return 0;
+}
+
+static int ca_store_take(
+                CaStore *store,
+                ReallocBuffer *b,
+                CaChunkCompression compression,
+                CaChunkCompression desired_compression,
+                CaChunkCompression *ret_effective_compression) {
+
+        int r;
+
+        assert(store);
+        assert(b);
+
+        /* Moves the chunk in 'b' into the store's buffer, converting it to the desired compression on the way */
+
+        if (desired_compression == CA_CHUNK_AS_IS || desired_compression == compression) {
+                ReallocBuffer t;
+
+                /* Already in the right format, hence just swap buffers */
+                t = store->buffer;
+                store->buffer = *b;
+                *b = t;
+
+                *ret_effective_compression = compression;
+                return 0;
+        }
+
+        if (desired_compression == CA_CHUNK_COMPRESSED)
+                r = ca_compress(store->compression_type,
+                                realloc_buffer_data(b),
+                                realloc_buffer_size(b),
+                                &store->buffer);
+        else
+                r = ca_decompress(realloc_buffer_data(b),
+                                  realloc_buffer_size(b),
+                                  &store->buffer);
+        if (r < 0)
+                return r;
+
+        *ret_effective_compression = desired_compression;
+        return 0;
+}
+
+static int ca_store_load_prefetched(
+                CaStore *store,
+                const CaChunkID *chunk_id,
+                CaChunkCompression desired_compression,
+                CaChunkCompression *ret_effective_compression) {
+
+        CaStoreRead *rd, *other;
+        Iterator i;
+        int r;
+
+        assert(store);
+
+        /* Returns > 0 if the chunk was prefetched successfully, 0 if it needs to be loaded the usual way */
+
+        rd = hashmap_get(store->reads, chunk_id);
+        if (!rd)
+                return 0;
+
+        while (rd->state != CA_STORE_READ_DONE) {
+                r = ca_store_process_completion(store, true);
+                if (r < 0) {
+                        ca_store_read_discard(store, rd);
+                        return 0;
+                }
+        }
+
+        assert_se(hashmap_remove(store->reads, chunk_id) == rd);
+
+        /* Chunks are requested in the order they were prefetched in, hence whatever was prefetched before this one
+         * has been skipped, and won't be asked for anymore */
+        HASHMAP_FOREACH(other, store->reads, i)
+                if (other->seq < rd->seq)
+                        ca_store_read_discard(store, other);
+
+        if (rd->error < 0) {
+                /* If it wasn't found, it might still be in a packfile, and if something else went wrong, let's
+                 * report that the usual way */
+                ca_store_read_free(rd);
+                return 0;
+        }
+
+        r = ca_store_take(store, &rd->buffer, rd->compression, desired_compression, ret_effective_compression);
+        ca_store_read_free(rd);
+        if (r < 0)
+                return r;
+
+        return 1;
+}
+
+static int ca_store_load(
+                CaStore *store,
+                const CaChunkID *chunk_id,
+                CaChunkCompression desired_compression,
+                CaChunkCompression *ret_effective_compression) {
+
+        CaChunkCompression packed;
+        int r;
+
+        assert(store);
+
+        r = ca_store_load_prefetched(store, chunk_id, desired_compression, ret_effective_compression);
+        if (r != 0)
+                return r < 0 ? r : 0;
+
+        if (store->pack) {
+                realloc_buffer_empty(&store->pack_buffer);
+
+                r = ca_pack_get(store->pack, chunk_id, &store->pack_buffer, &packed);
+                if (r >= 0)
+                        return ca_store_take(store, &store->pack_buffer, packed, desired_compression, ret_effective_compression);
+                if (r != -ENOENT)
+                        return r;
+        }
+
+        return ca_chunk_file_load(AT_FDCWD, store->root, chunk_id, desired_compression, store->compression_type, &store->buffer, ret_effective_compression);
+}
+
 int ca_store_set_path(CaStore *store, const char *path) {
         if (!store)
                 return -EINVAL;
@@ -105,6 +455,16 @@ int ca_store_set_path(CaStore *store, const char *path) {
         if (!store->root)
                 return -ENOMEM;
 
+        return ca_store_allocate_pack(store);
+}
+
+int ca_store_set_packs(CaStore *store, bool b) {
+        if (!store)
+                return -EINVAL;
+        if (store->is_cache)
+                return -ENOTTY;
+
+        store->packs = b;
         return 0;
 }
 
@@ -132,6 +492,65 @@ int ca_store_set_compression_type(CaStore *store, CaCompressionType compression_
         return 0;
 }
 
+static int ca_store_validate(CaStore *store, const CaChunkID *chunk_id, ReallocBuffer *v) {
+        CaDigestType old_type, i;
+        CaChunkID actual;
+        int r;
+
+        assert(store);
+        assert(chunk_id);
+        assert(v);
+
+        if (!store->validate_digest) {
+                r = ca_digest_new(store->digest_type >= 0 ? store->digest_type : CA_DIGEST_DEFAULT, &store->validate_digest);
+                if (r < 0)
+                        return r;
+        }
+
+        r = ca_chunk_id_make(store->validate_digest, realloc_buffer_data(v), realloc_buffer_size(v), &actual);
+        if (r < 0)
+                return r;
+
+        if (ca_chunk_id_equal(chunk_id, &actual)) {
+                store->digest_matched = true;
+                return 0;
+        }
+
+        /* If a digest is explicitly configured, or one matched before, only accept this digest */
+        if (store->digest_type >= 0 || store->digest_matched)
+                return -EBADMSG;
+
+        old_type = ca_digest_get_type(store->validate_digest);
+        if (old_type < 0)
+                return -EINVAL;
+
+        for (i = 0; i < _CA_DIGEST_TYPE_MAX; i++) {
+
+                if (i == old_type)
+                        continue;
+
+                r = ca_digest_set_type(store->validate_digest, i);
+                if (r < 0)
+                        return r;
+
+                r = ca_chunk_id_make(store->validate_digest, realloc_buffer_data(v), realloc_buffer_size(v), &actual);
+                if (r < 0)
+                        return r;
+
+                if (ca_chunk_id_equal(chunk_id, &actual)) {
+                        /* Stick to this one from now on, so that we don't go through all of them again */
+                        store->digest_matched = true;
+                        return 0;
+                }
+        }
+
+        r = ca_digest_set_type(store->validate_digest, old_type);
+        if (r < 0)
+                return r;
+
+        return -EBADMSG;
+}
+
 int ca_store_get(
                 CaStore *store,
                 const CaChunkID *chunk_id,
@@ -141,8 +560,6 @@ int ca_store_get(
                 CaChunkCompression *ret_effective_compression) {
 
         CaChunkCompression effective;
-        ReallocBuffer *v;
-        CaChunkID actual;
         int r;
 
         if (!store)
@@ -156,7 +573,20 @@ int ca_store_get(
 
         realloc_buffer_empty(&store->buffer);
 
-        r = ca_chunk_file_load(AT_FDCWD, store->root, chunk_id, desired_compression, store->compression_type, &store->buffer, &effective);
+        if (!ca_chunk_verify_pick(store->verify, store->verify_sample)) {
+                /* The store is trusted, hence just hand out the chunk the way it is needed */
+                r = ca_store_load(store, chunk_id, desired_compression, &effective);
+                if (r < 0)
+                        return r;
+
+                goto finish;
+        }
+
+        /* The chunk is validated in uncompressed form. Hence, if it needs to be compressed, do so only after
+         * validating it, rather than compressing it first and then decompressing it again to validate it. */
+        r = ca_store_load(store, chunk_id,
+                          desired_compression == CA_CHUNK_COMPRESSED ? CA_CHUNK_AS_IS : desired_compression,
+                          &effective);
         if (r < 0)
                 return r;
 
@@ -169,55 +599,46 @@ int ca_store_get(
                 if (r < 0)
                         return r;
 
-                v = &store->validate_buffer;
-        } else
-                v = &store->buffer;
-
-        if (!store->validate_digest) {
-                r = ca_digest_new(store->digest_type >= 0 ? store->digest_type : CA_DIGEST_DEFAULT, &store->validate_digest);
+                r = ca_store_validate(store, chunk_id, &store->validate_buffer);
                 if (r < 0)
                         return r;
-        }
 
-        r = ca_chunk_id_make(store->validate_digest, realloc_buffer_data(v), realloc_buffer_size(v), &actual);
-        if (r < 0)
-                return r;
+                /* The caller takes either, and we have the chunk uncompressed now anyway */
+                if (desired_compression == CA_CHUNK_AS_IS) {
+                        ReallocBuffer t;
 
-        if (!ca_chunk_id_equal(chunk_id, &actual)) {
-                CaDigestType old_type, i;
-                bool good = false;
-                /* If a digest is explicitly configured, only accept this digest */
+                        t = store->buffer;
+                        store->buffer = store->validate_buffer;
+                        store->validate_buffer = t;
 
-                if (store->digest_type >= 0)
-                        return -EBADMSG;
-
-                old_type = ca_digest_get_type(store->validate_digest);
-                if (old_type < 0)
-                        return -EINVAL;
+                        effective = CA_CHUNK_UNCOMPRESSED;
+                }
+        } else {
+                r = ca_store_validate(store, chunk_id, &store->buffer);
+                if (r < 0)
+                        return r;
 
-                for (i = 0; i < _CA_DIGEST_TYPE_MAX; i++) {
+                if (desired_compression == CA_CHUNK_COMPRESSED) {
+                        ReallocBuffer t;
 
-                        if (i == old_type)
-                                continue;
+                        realloc_buffer_empty(&store->validate_buffer);
 
-                        r = ca_digest_set_type(store->validate_digest, i);
+                        r = ca_compress(store->compression_type,
+                                        realloc_buffer_data(&store->buffer),
+                                        realloc_buffer_size(&store->buffer),
+                                        &store->validate_buffer);
                         if (r < 0)
                                 return r;
 
-                        r = ca_chunk_id_make(store->validate_digest, realloc_buffer_data(v), realloc_buffer_size(v), &actual);
-                        if (r < 0)
-                                return r;
+                        t = store->buffer;
+                        store->buffer = store->validate_buffer;
+                        store->validate_buffer = t;
 
-                        if (ca_chunk_id_equal(chunk_id, &actual)) {
-                                good = true;
-                                break;
-                        }
+                        effective = CA_CHUNK_COMPRESSED;
                 }
-
-                if (!good)
-                        return -EBADMSG;
         }
 
+finish:
         *ret = realloc_buffer_data(&store->buffer);
         *ret_size = realloc_buffer_size(&store->buffer);
 
@@ -227,16 +648,230 @@ int ca_store_get(
         store->n_requests++;
         store->n_request_bytes += realloc_buffer_size(&store->buffer);
 
-        return r;
+        return 0;
+}
+
+int ca_store_get_raw(
+                CaStore *store,
+                const CaChunkID *chunk_id,
+                const void **ret,
+                uint64_t *ret_size,
+                CaChunkCompression *ret_effective_compression) {
+
+        CaChunkCompression effective;
+        int r;
+
+        if (!store)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+        if (!ret_size)
+                return -EINVAL;
+        if (!ret_effective_compression)
+                return -EINVAL;
+        if (!store->root)
+                return store->is_cache ? -ENOENT : -EUNATCH;
+
+        /* Like ca_store_get(), but returns the chunk in whatever form it is stored in, and leaves decompressing and
+         * validating it to the caller, so that this may be done elsewhere, for example on a worker thread */
+
+        realloc_buffer_empty(&store->buffer);
+
+        r = ca_store_load(store, chunk_id, CA_CHUNK_AS_IS, &effective);
+        if (r < 0)
+                return r;
+
+        *ret = realloc_buffer_data(&store->buffer);
+        *ret_size = realloc_buffer_size(&store->buffer);
+        *ret_effective_compression = effective;
+
+        store->n_requests++;
+        store->n_request_bytes += realloc_buffer_size(&store->buffer);
+
+        return 0;
+}
+
+int ca_store_get_fd(CaStore *store, const CaChunkID *chunk_id, int *ret_fd, uint64_t *ret_size) {
+        _cleanup_(safe_closep) int fd = -1;
+        struct stat st;
+
+        if (!store)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (!ret_fd)
+                return -EINVAL;
+        if (!ret_size)
+                return -EINVAL;
+        if (!store->root)
+                return store->is_cache ? -ENOENT : -EUNATCH;
+
+        /* Opens the compressed chunk file directly, so that it may be passed on without copying it through a
+         * buffer. Unlike ca_store_get() the contents are not validated, the receiver has to do that. Chunks that
+         * only exist in uncompressed form or in a packfile are reported as -ENOENT, use ca_store_get() for
+         * those. */
+
+        fd = ca_chunk_file_open(AT_FDCWD, store->root, chunk_id, ca_compressed_chunk_suffix(), O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (fd == -ELOOP) /* If it's a symlink, then it's marked as "missing" */
+                return -EADDRNOTAVAIL;
+        if (fd < 0)
+                return fd;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+        if (!S_ISREG(st.st_mode))
+                return -EBADMSG;
+        if ((uint64_t) st.st_size < CA_CHUNK_SIZE_LIMIT_MIN || (uint64_t) st.st_size > CA_CHUNK_SIZE_LIMIT_MAX)
+                return -EBADMSG;
+
+        store->n_requests++;
+        store->n_request_bytes += st.st_size;
+
+        *ret_fd = fd;
+        fd = -1;
+
+        *ret_size = st.st_size;
+
+        return 0;
+}
+
+int ca_store_prefetch(CaStore *store, const CaChunkID *chunk_id) {
+        CaStoreRead *rd;
+        int r;
+
+        if (!store)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (!store->root)
+                return -EUNATCH;
+
+        if (!store->uring) {
+                if (store->uring_failed)
+                        return -EOPNOTSUPP;
+
+                r = ca_uring_new(store->prefetch_max * 2, &store->uring);
+                if (r < 0) {
+                        log_debug_errno(r, "Can't set up io_uring, loading chunks synchronously: %m");
+                        store->uring_failed = true;
+                        return -EOPNOTSUPP;
+                }
+        }
+
+        /* Move along what completed so far */
+        for (;;) {
+                r = ca_store_process_completion(store, false);
+                if (IN_SET(r, -EAGAIN, -ENODATA))
+                        break;
+                if (r < 0)
+                        return r;
+        }
+
+        if (hashmap_contains(store->reads, chunk_id))
+                return 0;
+        if (hashmap_size(store->reads) >= store->prefetch_max)
+                return -EBUSY;
+
+        r = hashmap_ensure_allocated(&store->reads, &ca_chunk_id_hash_ops);
+        if (r < 0)
+                return r;
+
+        rd = new0(CaStoreRead, 1);
+        if (!rd)
+                return -ENOMEM;
+
+        rd->id = *chunk_id;
+        rd->seq = store->read_seq++;
+        rd->fd = -1;
+        rd->compression = CA_CHUNK_COMPRESSED;
+
+        r = ca_store_read_open(store, rd);
+        if (r < 0) {
+                ca_store_read_free(rd);
+                return r;
+        }
+
+        /* From here on the kernel may reference 'rd', hence it's freed only on completion */
+        r = hashmap_put(store->reads, &rd->id, rd);
+        if (r < 0) {
+                rd->discard = true;
+                return r;
+        }
+
+        r = ca_uring_submit(store->uring);
+        if (r < 0)
+                return r;
+
+        return 1;
+}
+
+int ca_store_set_prefetch_max(CaStore *store, unsigned n) {
+        if (!store)
+                return -EINVAL;
+        if (n == 0)
+                return -EINVAL;
+
+        n = MIN(n, STORE_PREFETCH_MAX_LIMIT);
+
+        /* The ring is sized after this, hence it can't change anymore once set up */
+        if (store->uring && n != store->prefetch_max)
+                return -EBUSY;
+
+        store->prefetch_max = n;
+        return 0;
+}
+
+int ca_store_advise(CaStore *store, const CaChunkID *chunk_id) {
+        _cleanup_(safe_closep) int fd = -1;
+
+        if (!store)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (!store->root)
+                return store->is_cache ? -ENOENT : -EUNATCH;
+
+        /* Asks the kernel to read the chunk file into the page cache in the background, for when io_uring isn't
+         * around. Chunks in packfiles are not covered, for those -ENOENT is returned. */
+
+        fd = ca_chunk_file_open(AT_FDCWD, store->root, chunk_id, ca_compressed_chunk_suffix(), O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (fd == -ENOENT)
+                fd = ca_chunk_file_open(AT_FDCWD, store->root, chunk_id, NULL, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (fd == -ELOOP) /* If it's a symlink, then it's marked as "missing" */
+                return -EADDRNOTAVAIL;
+        if (fd < 0)
+                return fd;
+
+        return -posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+}
+
+void ca_store_prefetch_discard(CaStore *store) {
+        CaStoreRead *rd;
+        Iterator i;
+
+        if (!store)
+                return;
+
+        HASHMAP_FOREACH(rd, store->reads, i)
+                ca_store_read_discard(store, rd);
 }
 
 int ca_store_has(CaStore *store, const CaChunkID *chunk_id) {
+        int r;
 
         if (!store)
                 return -EINVAL;
         if (!store->root)
                 return store->is_cache ? -ENOENT : -EUNATCH;
 
+        if (store->pack) {
+                r = ca_pack_has(store->pack, chunk_id);
+                if (r != 0)
+                        return r;
+        }
+
         return ca_chunk_file_test(AT_FDCWD, store->root, chunk_id);
 }
 
@@ -249,6 +884,56 @@ int ca_store_put(
 
         int r;
 
+        if (!store)
+                return -EINVAL;
+
+        r = ca_store_prepare(store);
+        if (r < 0)
+                return r;
+
+        if (store->write_packs) {
+                _cleanup_(realloc_buffer_free) ReallocBuffer buffer = {};
+                CaChunkCompression desired_compression;
+
+                /* A chunk might still be around as file of its own, from before the store used packfiles */
+                r = ca_chunk_file_test(AT_FDCWD, store->root, chunk_id);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        return -EEXIST;
+
+                desired_compression = store->compression == CA_CHUNK_AS_IS ? effective_compression : store->compression;
+
+                if (desired_compression != effective_compression) {
+                        if (desired_compression == CA_CHUNK_COMPRESSED)
+                                r = ca_compress(store->compression_type, data, size, &buffer);
+                        else
+                                r = ca_decompress(data, size, &buffer);
+                        if (r < 0)
+                                return r;
+
+                        data = realloc_buffer_data(&buffer);
+                        size = realloc_buffer_size(&buffer);
+                }
+
+                return ca_pack_put(store->pack, chunk_id, desired_compression, data, size);
+        }
+
+        return ca_chunk_file_save(
+                        AT_FDCWD, store->root,
+                        chunk_id,
+                        effective_compression, store->compression,
+                        store->compression_type,
+                        data, size);
+}
+
+int ca_store_prepare(CaStore *store) {
+        int r;
+
+        /* Allocates and creates the store directory if that didn't happen yet. Once this succeeded,
+         * ca_store_put() doesn't modify the store object anymore, and may hence be called from multiple threads
+         * in parallel. */
+
         if (!store)
                 return -EINVAL;
 
@@ -270,15 +955,58 @@ int ca_store_put(
                 if (mkdir(store->root, 0777) < 0 && errno != EEXIST)
                         return -errno;
 
+                /* Once a store has packfiles, keep using them */
+                if (store->pack) {
+                        r = ca_pack_exists(store->pack);
+                        if (r < 0)
+                                return r;
+
+                        store->write_packs = store->packs || r > 0;
+                }
+
                 store->mkdir_done = true;
         }
 
-        return ca_chunk_file_save(
-                        AT_FDCWD, store->root,
-                        chunk_id,
-                        effective_compression, store->compression,
-                        store->compression_type,
-                        data, size);
+        return 0;
+}
+
+int ca_store_flush(CaStore *store) {
+        if (!store)
+                return -EINVAL;
+
+        if (!store->pack)
+                return 0;
+
+        return ca_pack_flush(store->pack);
+}
+
+int ca_store_remove(CaStore *store, const CaChunkID *chunk_id) {
+        int r;
+
+        if (!store)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (!store->root)
+                return store->is_cache ? -ENOENT : -EUNATCH;
+
+        if (store->pack) {
+                r = ca_pack_remove(store->pack, chunk_id);
+                if (r != -ENOENT)
+                        return r;
+        }
+
+        return ca_chunk_file_remove(AT_FDCWD, store->root, chunk_id);
+}
+
+int ca_store_compact(CaStore *store) {
+        if (!store)
+                return -EINVAL;
+
+        if (!store->pack)
+                return 0;
+
+        return ca_pack_compact(store->pack);
 }
 
 int ca_store_get_requests(CaStore *s, uint64_t *ret) {
@@ -301,6 +1029,20 @@ int ca_store_get_request_bytes(CaStore *s, uint64_t *ret) {
         return 0;
 }
 
+int ca_store_set_verify(CaStore *s, CaChunkVerify verify, uint64_t sample) {
+        if (!s)
+                return -EINVAL;
+        if (verify < 0)
+                return -EINVAL;
+        if (verify >= _CA_CHUNK_VERIFY_MAX)
+                return -EINVAL;
+
+        s->verify = verify;
+        s->verify_sample = sample > 0 ? sample : CA_CHUNK_VERIFY_SAMPLE_DEFAULT;
+
+        return 0;
+}
+
 int ca_store_set_digest_type(CaStore *s, CaDigestType type) {
         int r;
 
@@ -309,9 +1051,10 @@ int ca_store_set_digest_type(CaStore *s, CaDigestType type) {
         if (type >= _CA_DIGEST_TYPE_MAX)
                 return -EOPNOTSUPP;
 
-        if (type < 0)
+        if (type < 0) {
                 s->digest_type = _CA_DIGEST_TYPE_INVALID;
-        else {
+                s->digest_matched = false;
+        } else {
                 if (s->validate_digest) {
                         r = ca_digest_set_type(s->validate_digest, type);
                         if (r < 0)
@@ -347,13 +1090,7 @@ CaStoreIterator* ca_store_iterator_unref(CaStoreIterator *iter) {
         return mfree(iter);
 }
 
-int ca_store_iterator_next(
-                CaStoreIterator *iter,
-                int *rootdir_fd,
-                const char **subdir,
-                int *subdir_fd,
-                const char **chunk) {
-
+static int ca_store_iterator_next_loose(CaStoreIterator *iter, CaChunkID *ret_chunk_id) {
         struct dirent *de;
 
         if (!iter->rootdir) {
@@ -390,17 +1127,28 @@ int ca_store_iterator_next(
                 }
 
                 FOREACH_DIRENT_ALL(de, iter->subdir, return -errno) {
+                        char *e, ids[CA_CHUNK_ID_FORMAT_MAX];
+                        CaChunkID id;
+
                         if (!dirent_is_file_with_suffix(de, ".cacnk"))
                                 continue;
 
-                        if (rootdir_fd)
-                                *rootdir_fd = dirfd(iter->rootdir);
-                        if (subdir)
-                                *subdir = iter->subdir_de->d_name;
-                        if (subdir_fd)
-                                *subdir_fd = dirfd(iter->subdir);
-                        if (chunk)
-                                *chunk = de->d_name;
+                        e = strchr(de->d_name, '.');
+                        if (e - de->d_name != CA_CHUNK_ID_FORMAT_MAX - 1) {
+                                log_debug("Unexpected chunk file name \"%s\", ignoring.", de->d_name);
+                                continue;
+                        }
+
+                        memcpy(ids, de->d_name, CA_CHUNK_ID_FORMAT_MAX - 1);
+                        ids[CA_CHUNK_ID_FORMAT_MAX - 1] = 0;
+
+                        if (!ca_chunk_id_parse(ids, &id)) {
+                                log_debug("Failed to parse chunk ID \"%s\", ignoring.", ids);
+                                continue;
+                        }
+
+                        if (ret_chunk_id)
+                                *ret_chunk_id = id;
                         return 1; /* success */
                 }
 
@@ -408,3 +1156,26 @@ int ca_store_iterator_next(
                 iter->subdir = NULL;
         }
 }
+
+int ca_store_iterator_next(CaStoreIterator *iter, CaChunkID *ret_chunk_id) {
+        int r;
+
+        if (!iter)
+                return -EINVAL;
+        if (!iter->store->root)
+                return iter->store->is_cache ? 0 : -EUNATCH;
+
+        /* First enumerate the chunks stored in files of their own, then the ones in packfiles */
+        if (!iter->loose_done) {
+                r = ca_store_iterator_next_loose(iter, ret_chunk_id);
+                if (r != 0)
+                        return r;
+
+                iter->loose_done = true;
+        }
+
+        if (!iter->store->pack)
+                return 0;
+
+        return ca_pack_enumerate(iter->store->pack, &iter->pack_cursor, ret_chunk_id);
+}
@@ -21,25 +21,59 @@ int ca_store_set_path(CaStore *store, const char *path);
 int ca_store_set_compression(CaStore *store, CaChunkCompression c);
 int ca_store_set_compression_type(CaStore *store, CaCompressionType compression);
 
+/* Whether to append new chunks to packfiles, rather than storing each chunk in a file of its own. Stores that have
+ * packfiles already always use them. Chunks are found in either. */
+int ca_store_set_packs(CaStore *store, bool b);
+
+/* Returns the chunk validated against its ID, unless configured otherwise with ca_store_set_verify(). With
+ * CA_CHUNK_AS_IS a validated chunk is returned uncompressed, as that's the form it is validated in anyway. */
 int ca_store_get(CaStore *store, const CaChunkID *chunk_id, CaChunkCompression desired_compression, const void **ret, uint64_t *ret_size, CaChunkCompression *ret_effective_compression);
+
+/* Returns the chunk as stored, compressed or not, without validating it against its ID */
+int ca_store_get_raw(CaStore *store, const CaChunkID *chunk_id, const void **ret, uint64_t *ret_size, CaChunkCompression *ret_effective_compression);
+
+/* Returns an fd for the compressed chunk file, if the chunk is stored in a file of its own in compressed form */
+int ca_store_get_fd(CaStore *store, const CaChunkID *chunk_id, int *ret_fd, uint64_t *ret_size);
+
+/* Starts loading a chunk asynchronously via io_uring, so that a later ca_store_get() for it doesn't have to wait for
+ * the disk. Chunks need to be asked for in the order they were prefetched in, prefetched chunks that are skipped
+ * over are dropped. Returns -EOPNOTSUPP if the kernel doesn't support io_uring, and -EBUSY if enough chunks are in
+ * flight already. */
+int ca_store_prefetch(CaStore *store, const CaChunkID *chunk_id);
+void ca_store_prefetch_discard(CaStore *store);
+
+/* Sets how many chunks ca_store_prefetch() keeps in flight at most, before the first one is prefetched */
+int ca_store_set_prefetch_max(CaStore *store, unsigned n);
+
+/* Hints the kernel to read the chunk's file into the page cache, a cheaper alternative to ca_store_prefetch() for
+ * where that's not supported. Returns -ENOENT for chunks that aren't stored in a file of their own. */
+int ca_store_advise(CaStore *store, const CaChunkID *chunk_id);
+
 int ca_store_has(CaStore *store, const CaChunkID *chunk_id);
 int ca_store_put(CaStore *store, const CaChunkID *chunk_id, CaChunkCompression effective_compression, const void *data, uint64_t size);
+int ca_store_prepare(CaStore *store);
+
+/* Makes the chunks written so far visible to others, which matters for packfiles only */
+int ca_store_flush(CaStore *store);
+
+/* Removes a chunk. Chunks in packfiles are only actually removed by the next ca_store_compact() */
+int ca_store_remove(CaStore *store, const CaChunkID *chunk_id);
+int ca_store_compact(CaStore *store);
 
 int ca_store_get_requests(CaStore *s, uint64_t *ret);
 int ca_store_get_request_bytes(CaStore *s, uint64_t *ret);
 
 int ca_store_set_digest_type(CaStore *s, CaDigestType type);
 
+/* Controls whether chunks are validated by ca_store_get(). 'sample' is the N of CA_CHUNK_VERIFY_SAMPLE, zero selects
+ * the default. */
+int ca_store_set_verify(CaStore *s, CaChunkVerify verify, uint64_t sample);
+
 CaStoreIterator* ca_store_iterator_new(CaStore *store);
 CaStoreIterator* ca_store_iterator_unref(CaStoreIterator *iter);
 static inline void ca_store_iterator_unrefp(CaStoreIterator **iter) {
         ca_store_iterator_unref(*iter);
 }
-int ca_store_iterator_next(
-                CaStoreIterator *iter,
-                int *rootdir_fd,
-                const char **subdir,
-                int *subdir_fd,
-                const char **chunk);
+int ca_store_iterator_next(CaStoreIterator *iter, CaChunkID *ret_chunk_id);
 
 #endif
@@ -2,6 +2,7 @@
 
 #include <curl/curl.h>
 #include <getopt.h>
+#include <poll.h>
 #include <stddef.h>
 #include <unistd.h>
 
@@ -16,6 +17,8 @@ static volatile sig_atomic_t quit = false;
 static int arg_log_level = -1;
 static bool arg_verbose = false;
 static curl_off_t arg_rate_limit_bps = 0;
+static unsigned arg_max_active_chunks = 64;
+static unsigned arg_max_host_connections = 16;
 
 static enum {
         ARG_PROTOCOL_HTTP,
@@ -34,6 +37,15 @@ typedef enum ProcessUntil {
         PROCESS_UNTIL_FINISHED,
 } ProcessUntil;
 
+/* A chunk GET in flight on the multi handle */
+typedef struct ChunkTransfer {
+        CURL *curl;
+        CaChunkID id;
+        char *url;
+        ReallocBuffer buffer;
+        bool active;
+} ChunkTransfer;
+
 static CURLcode robust_curl_easy_perform(CURL *curl) {
         uint64_t sleep_base_usec = 100 * 1000;
         unsigned trial = 1;
@@ -168,6 +180,24 @@ static int process_remote(CaRemote *rr, ProcessUntil until) {
         }
 }
 
+static int step_remote(CaRemote *rr) {
+        int r;
+
+        assert(rr);
+
+        /* Like process_remote(), but only processes what can be processed without blocking */
+
+        for (;;) {
+                r = ca_remote_step(rr);
+                if (r == -EPIPE || r == CA_REMOTE_FINISHED)
+                        return -EPIPE;
+                if (r < 0)
+                        return log_error_errno(r, "Failed to process remoting engine: %m");
+                if (r == CA_REMOTE_POLL)
+                        return 0;
+        }
+}
+
 static int write_index(CaRemote *rr, ReallocBuffer *buffer) {
         int r;
 
@@ -369,14 +399,260 @@ static int acquire_file(CaRemote *rr,
         return 1;
 }
 
+static int setup_curl(CURL *curl, curl_off_t rate_limit_bps) {
+        assert(curl);
+
+        if (curl_easy_setopt(curl, CURLOPT_NETRC, CURL_NETRC_OPTIONAL) != CURLE_OK) {
+                log_error("Failed to make the use of ~/.netrc optional.");
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L) != CURLE_OK) {
+                log_error("Failed to turn on location following.");
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(curl, CURLOPT_PROTOCOLS, arg_protocol == ARG_PROTOCOL_FTP ? CURLPROTO_FTP :
+                                                      arg_protocol == ARG_PROTOCOL_SFTP? CURLPROTO_SFTP: CURLPROTO_HTTP|CURLPROTO_HTTPS) != CURLE_OK) {
+                log_error("Failed to limit protocols to HTTP/HTTPS/FTP/SFTP.");
+                return -EIO;
+        }
+
+        if (arg_protocol == ARG_PROTOCOL_SFTP) {
+                /* activate the ssh agent. For this to work you need
+                   to have ssh-agent running (type set | grep SSH_AGENT to check) */
+                if (curl_easy_setopt(curl, CURLOPT_SSH_AUTH_TYPES, CURLSSH_AUTH_AGENT) != CURLE_OK)
+                        log_error("Failed to turn on ssh agent support, ignoring.");
+        }
+
+        if (rate_limit_bps > 0) {
+                if (curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, rate_limit_bps) != CURLE_OK) {
+                        log_error("Failed to set CURL send speed limit.");
+                        return -EIO;
+                }
+
+                if (curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, rate_limit_bps) != CURLE_OK) {
+                        log_error("Failed to set CURL receive speed limit.");
+                        return -EIO;
+                }
+        }
+
+        if (curl_easy_setopt(curl, CURLOPT_VERBOSE, arg_log_level > 4)) {
+                log_error("Failed to set CURL verbosity.");
+                return -EIO;
+        }
+
+        return 0;
+}
+
+static int start_chunk_transfer(CURLM *multi, ChunkTransfer *t, const char *store_url, const CaChunkID *id) {
+        assert(multi);
+        assert(t);
+        assert(!t->active);
+        assert(store_url);
+        assert(id);
+
+        free(t->url);
+        t->url = chunk_url(store_url, id);
+        if (!t->url)
+                return log_oom();
+
+        t->id = *id;
+
+        if (curl_easy_setopt(t->curl, CURLOPT_URL, t->url) != CURLE_OK) {
+                log_error("Failed to set CURL URL to: %s", t->url);
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, write_buffer) != CURLE_OK) {
+                log_error("Failed to set CURL callback function.");
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, &t->buffer) != CURLE_OK) {
+                log_error("Failed to set CURL private data.");
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(t->curl, CURLOPT_PRIVATE, t) != CURLE_OK) {
+                log_error("Failed to set CURL private pointer.");
+                return -EIO;
+        }
+
+        log_debug("Acquiring %s...", t->url);
+
+        if (curl_multi_add_handle(multi, t->curl) != CURLM_OK) {
+                log_error("Failed to add CURL handle for %s.", t->url);
+                return -EIO;
+        }
+
+        t->active = true;
+        return 0;
+}
+
+static int update_rate_limits(ChunkTransfer *transfers, size_t n_transfers, size_t n_active) {
+        curl_off_t limit;
+        size_t i;
+
+        assert(transfers);
+
+        /* The rate limit applies to each transfer individually, hence split it up among the transfers actually
+         * running, so that together they get the configured limit, however many of them there are */
+
+        if (arg_rate_limit_bps <= 0 || n_active == 0)
+                return 0;
+
+        limit = MAX(arg_rate_limit_bps / (curl_off_t) n_active, (curl_off_t) 1);
+
+        for (i = 0; i < n_transfers; i++) {
+                if (!transfers[i].active)
+                        continue;
+
+                if (curl_easy_setopt(transfers[i].curl, CURLOPT_MAX_SEND_SPEED_LARGE, limit) != CURLE_OK) {
+                        log_error("Failed to set CURL send speed limit.");
+                        return -EIO;
+                }
+
+                if (curl_easy_setopt(transfers[i].curl, CURLOPT_MAX_RECV_SPEED_LARGE, limit) != CURLE_OK) {
+                        log_error("Failed to set CURL receive speed limit.");
+                        return -EIO;
+                }
+        }
+
+        return 0;
+}
+
+static int finish_chunk_transfer(CaRemote *rr, CURLM *multi, ChunkTransfer *t, CURLcode result) {
+        long protocol_status;
+        int r;
+
+        assert(rr);
+        assert(multi);
+        assert(t);
+        assert(t->active);
+
+        (void) curl_multi_remove_handle(multi, t->curl);
+        t->active = false;
+
+        if (result == CURLE_COULDNT_CONNECT) {
+                /* The server is probably overwhelmed by our requests, retry this one synchronously, with a
+                 * growing delay, which also throttles the others */
+                realloc_buffer_empty(&t->buffer);
+                result = robust_curl_easy_perform(t->curl);
+        }
+
+        if (result != CURLE_OK) {
+                log_error("Failed to acquire %s: %s", t->url, curl_easy_strerror(result));
+                return -EIO;
+        }
+
+        if (curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &protocol_status) != CURLE_OK) {
+                log_error("Failed to query response code");
+                return -EIO;
+        }
+
+        r = process_remote(rr, PROCESS_UNTIL_CAN_PUT_CHUNK);
+        if (r < 0)
+                return r;
+
+        if ((IN_SET(arg_protocol, ARG_PROTOCOL_HTTP, ARG_PROTOCOL_HTTPS) && protocol_status == 200) ||
+            (arg_protocol == ARG_PROTOCOL_FTP && (protocol_status >= 200 && protocol_status <= 299))||
+            (arg_protocol == ARG_PROTOCOL_SFTP && (protocol_status == 0))) {
+
+                r = ca_remote_put_chunk(rr, &t->id, CA_CHUNK_COMPRESSED, realloc_buffer_data(&t->buffer), realloc_buffer_size(&t->buffer));
+                if (r < 0)
+                        return log_error_errno(r, "Failed to write chunk: %m");
+
+        } else {
+                if (arg_verbose)
+                        log_error("HTTP/FTP/SFTP server failure %li while requesting %s.", protocol_status, t->url);
+
+                r = ca_remote_put_missing(rr, &t->id);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to write missing message: %m");
+        }
+
+        realloc_buffer_empty(&t->buffer);
+        return 0;
+}
+
+static int wait_transfers(CaRemote *rr, CURLM *multi) {
+        struct curl_waitfd waitfds[2] = {};
+        short input_events, output_events;
+        int input_fd, output_fd, r;
+        unsigned n = 0;
+
+        assert(rr);
+        assert(multi);
+
+        /* Sleep until either one of our transfers or the remoting engine has something to do */
+
+        r = ca_remote_get_io_fds(rr, &input_fd, &output_fd);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get remoting I/O file descriptors: %m");
+
+        r = ca_remote_get_io_events(rr, &input_events, &output_events);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get remoting I/O events: %m");
+
+        if (input_fd == output_fd) {
+                input_events |= output_events;
+                output_events = 0;
+        }
+
+        if (input_events != 0)
+                waitfds[n++] = (struct curl_waitfd) {
+                        .fd = input_fd,
+                        .events = (input_events & POLLIN ? CURL_WAIT_POLLIN : 0) |
+                                  (input_events & POLLOUT ? CURL_WAIT_POLLOUT : 0),
+                };
+
+        if (output_events != 0)
+                waitfds[n++] = (struct curl_waitfd) {
+                        .fd = output_fd,
+                        .events = (output_events & POLLIN ? CURL_WAIT_POLLIN : 0) |
+                                  (output_events & POLLOUT ? CURL_WAIT_POLLOUT : 0),
+                };
+
+        if (curl_multi_wait(multi, waitfds, n, 1000, NULL) != CURLM_OK) {
+                log_error("Failed to wait for CURL transfers.");
+                return -EIO;
+        }
+
+        return 0;
+}
+
+static void free_transfers(CURLM *multi, ChunkTransfer *transfers, size_t n) {
+        size_t i;
+
+        if (!transfers)
+                return;
+
+        for (i = 0; i < n; i++) {
+                ChunkTransfer *t = transfers + i;
+
+                if (t->curl) {
+                        if (t->active)
+                                (void) curl_multi_remove_handle(multi, t->curl);
+
+                        curl_easy_cleanup(t->curl);
+                }
+
+                free(t->url);
+                realloc_buffer_free(&t->buffer);
+        }
+
+        free(transfers);
+}
+
 static int run(int argc, char *argv[]) {
         const char *base_url, *archive_url, *index_url, *wstore_url;
-        size_t n_stores = 0, current_store = 0;
+        size_t n_stores = 0, current_store = 0, n_active = 0, n_limited = 0, i;
+        ChunkTransfer *transfers = NULL;
+        CURLM *multi = NULL;
         CURL *curl = NULL;
         _cleanup_(ca_remote_unrefp) CaRemote *rr = NULL;
         _cleanup_(realloc_buffer_free) ReallocBuffer buffer = {};
-        _cleanup_free_ char *url_buffer = NULL;
-        long protocol_status;
         int r;
 
         if (argc < _CA_REMOTE_ARG_MAX) {
@@ -430,51 +706,9 @@ static int run(int argc, char *argv[]) {
                 goto finish;
         }
 
-        if (curl_easy_setopt(curl, CURLOPT_NETRC, CURL_NETRC_OPTIONAL) != CURLE_OK) {
-                log_error("Failed to make the use of ~/.netrc optional.");
-                r = -EIO;
-                goto finish;
-        }
-
-        if (curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L) != CURLE_OK) {
-                log_error("Failed to turn on location following.");
-                r = -EIO;
-                goto finish;
-        }
-
-        if (curl_easy_setopt(curl, CURLOPT_PROTOCOLS, arg_protocol == ARG_PROTOCOL_FTP ? CURLPROTO_FTP :
-                                                      arg_protocol == ARG_PROTOCOL_SFTP? CURLPROTO_SFTP: CURLPROTO_HTTP|CURLPROTO_HTTPS) != CURLE_OK) {
-                log_error("Failed to limit protocols to HTTP/HTTPS/FTP/SFTP.");
-                r = -EIO;
-                goto finish;
-        }
-
-        if (arg_protocol == ARG_PROTOCOL_SFTP) {
-                /* activate the ssh agent. For this to work you need
-                   to have ssh-agent running (type set | grep SSH_AGENT to check) */
-                if (curl_easy_setopt(curl, CURLOPT_SSH_AUTH_TYPES, CURLSSH_AUTH_AGENT) != CURLE_OK)
-                        log_error("Failed to turn on ssh agent support, ignoring.");
-        }
-
-        if (arg_rate_limit_bps > 0) {
-                if (curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
-                        log_error("Failed to set CURL send speed limit.");
-                        r = -EIO;
-                        goto finish;
-                }
-
-                if (curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
-                        log_error("Failed to set CURL receive speed limit.");
-                        r = -EIO;
-                        goto finish;
-                }
-        }
-
-        if (curl_easy_setopt(curl, CURLOPT_VERBOSE, arg_log_level > 4)) {
-                log_error("Failed to set CURL verbosity.");
-                r = -EIO;
+        r = setup_curl(curl, arg_rate_limit_bps);
+        if (r < 0)
                 goto finish;
-        }
 
         if (archive_url) {
                 r = acquire_file(rr, curl, archive_url, write_archive, rr);
@@ -506,137 +740,143 @@ static int run(int argc, char *argv[]) {
                 realloc_buffer_empty(&buffer);
         }
 
-        for (;;) {
-                const char *store_url;
-                CaChunkID id;
-
-                if (quit) {
-                        log_info("Got exit signal, quitting.");
-                        r = 0;
-                        goto finish;
-                }
+        if (n_stores == 0) /* No stores? Then we did all we could do */
+                goto flush;
 
-                if (n_stores == 0)  /* No stores? Then we did all we could do */
-                        break;
+        multi = curl_multi_init();
+        if (!multi) {
+                r = log_oom();
+                goto finish;
+        }
 
-                r = process_remote(rr, PROCESS_UNTIL_HAVE_REQUEST);
-                if (r == -EPIPE) {
-                        r = 0;
-                        goto finish;
-                }
-                if (r < 0)
-                        goto finish;
+        if (curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) arg_max_host_connections) != CURLM_OK) {
+                log_error("Failed to set CURL host connection limit.");
+                r = -EIO;
+                goto finish;
+        }
 
-                r = ca_remote_next_request(rr, &id);
-                if (r == -ENODATA)
-                        continue;
-                if (r < 0) {
-                        log_error_errno(r, "Failed to determine next chunk to get: %m");
-                        goto finish;
-                }
+        /* Multiplexing on HTTP/2 is preferable over opening a bunch of connections. Not fatal if unsupported. */
+        (void) curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
 
-                current_store = current_store % n_stores;
-                if (wstore_url)
-                        store_url = current_store == 0 ? wstore_url : argv[current_store + _CA_REMOTE_ARG_MAX - 1];
-                else
-                        store_url = argv[current_store + _CA_REMOTE_ARG_MAX];
-                /* current_store++; */
+        transfers = new0(ChunkTransfer, arg_max_active_chunks);
+        if (!transfers) {
+                r = log_oom();
+                goto finish;
+        }
 
-                free(url_buffer);
-                url_buffer = chunk_url(store_url, &id);
-                if (!url_buffer) {
+        for (i = 0; i < arg_max_active_chunks; i++) {
+                transfers[i].curl = curl_easy_init();
+                if (!transfers[i].curl) {
                         r = log_oom();
                         goto finish;
                 }
 
-                if (curl_easy_setopt(curl, CURLOPT_URL, url_buffer) != CURLE_OK) {
-                        log_error("Failed to set CURL URL to: %s", url_buffer);
-                        r = -EIO;
+                /* The rate limit is split up among the active transfers as they come and go, see below */
+                r = setup_curl(transfers[i].curl, 0);
+                if (r < 0)
                         goto finish;
-                }
+        }
 
-                if (curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_buffer) != CURLE_OK) {
-                        log_error("Failed to set CURL callback function.");
-                        r = -EIO;
-                        goto finish;
-                }
+        for (;;) {
+                const char *store_url;
+                CURLMsg *msg;
+                int running, n_msgs;
+                CaChunkID id;
 
-                if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer) != CURLE_OK) {
-                        log_error("Failed to set CURL private data.");
-                        r = -EIO;
+                if (quit) {
+                        log_info("Got exit signal, quitting.");
+                        r = 0;
                         goto finish;
                 }
 
-                if (arg_rate_limit_bps > 0) {
-                        if (curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
-                                log_error("Failed to set CURL send speed limit.");
-                                r = -EIO;
+                /* Start a transfer for each request we have, as long as we have free transfers for them */
+                while (n_active < arg_max_active_chunks) {
+
+                        if (n_active == 0)
+                                /* Nothing in flight, hence nothing to do until we get a new request */
+                                r = process_remote(rr, PROCESS_UNTIL_HAVE_REQUEST);
+                        else
+                                r = step_remote(rr);
+                        if (r == -EPIPE) {
+                                r = 0;
                                 goto finish;
                         }
+                        if (r < 0)
+                                goto finish;
 
-                        if (curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
-                                log_error("Failed to set CURL receive speed limit.");
-                                r = -EIO;
+                        r = ca_remote_next_request(rr, &id);
+                        if (r == -ENODATA)
+                                break;
+                        if (r < 0) {
+                                log_error_errno(r, "Failed to determine next chunk to get: %m");
                                 goto finish;
                         }
-                }
 
-                if (curl_easy_setopt(curl, CURLOPT_VERBOSE, arg_log_level > 4)) {
-                        log_error("Failed to set CURL verbosity.");
-                        r = -EIO;
-                        goto finish;
+                        current_store = current_store % n_stores;
+                        if (wstore_url)
+                                store_url = current_store == 0 ? wstore_url : argv[current_store + _CA_REMOTE_ARG_MAX - 1];
+                        else
+                                store_url = argv[current_store + _CA_REMOTE_ARG_MAX];
+                        /* current_store++; */
+
+                        for (i = 0; i < arg_max_active_chunks && transfers[i].active; i++)
+                                ;
+                        assert(i < arg_max_active_chunks);
+
+                        r = start_chunk_transfer(multi, transfers + i, store_url, &id);
+                        if (r < 0)
+                                goto finish;
+
+                        n_active++;
                 }
 
-                log_debug("Acquiring %s...", url_buffer);
+                if (n_active == 0)
+                        continue;
 
-                if (robust_curl_easy_perform(curl) != CURLE_OK) {
-                        log_error("Failed to acquire %s", url_buffer);
-                        r = -EIO;
-                        goto finish;
+                if (n_active != n_limited) {
+                        r = update_rate_limits(transfers, arg_max_active_chunks, n_active);
+                        if (r < 0)
+                                goto finish;
+
+                        n_limited = n_active;
                 }
 
-                if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &protocol_status) != CURLE_OK) {
-                        log_error("Failed to query response code");
+                if (curl_multi_perform(multi, &running) != CURLM_OK) {
+                        log_error("Failed to run CURL transfers.");
                         r = -EIO;
                         goto finish;
                 }
 
-                r = process_remote(rr, PROCESS_UNTIL_CAN_PUT_CHUNK);
-                if (r == -EPIPE) {
-                        r = 0;
-                        goto finish;
-                }
-                if (r < 0)
-                        goto finish;
+                while ((msg = curl_multi_info_read(multi, &n_msgs))) {
+                        ChunkTransfer *t;
+                        char *p;
 
-                if ((IN_SET(arg_protocol, ARG_PROTOCOL_HTTP, ARG_PROTOCOL_HTTPS) && protocol_status == 200) ||
-                    (arg_protocol == ARG_PROTOCOL_FTP && (protocol_status >= 200 && protocol_status <= 299))||
-                    (arg_protocol == ARG_PROTOCOL_SFTP && (protocol_status == 0))) {
+                        if (msg->msg != CURLMSG_DONE)
+                                continue;
 
-                        r = ca_remote_put_chunk(rr, &id, CA_CHUNK_COMPRESSED, realloc_buffer_data(&buffer), realloc_buffer_size(&buffer));
-                        if (r < 0) {
-                                log_error_errno(r, "Failed to write chunk: %m");
+                        if (curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &p) != CURLE_OK) {
+                                log_error("Failed to query CURL private pointer.");
+                                r = -EIO;
                                 goto finish;
                         }
 
-                } else {
-                        if (arg_verbose)
-                                log_error("HTTP/FTP/SFTP server failure %li while requesting %s.", protocol_status, url_buffer);
+                        t = (ChunkTransfer*) p;
 
-                        r = ca_remote_put_missing(rr, &id);
-                        if (r < 0) {
-                                log_error_errno(r, "Failed to write missing message: %m");
+                        r = finish_chunk_transfer(rr, multi, t, msg->data.result);
+                        if (r == -EPIPE) {
+                                r = 0;
                                 goto finish;
                         }
+                        if (r < 0)
+                                goto finish;
+
+                        n_active--;
                 }
 
-                realloc_buffer_empty(&buffer);
+                if (running == 0)
+                        continue;
 
-                r = process_remote(rr, PROCESS_UNTIL_WRITTEN);
-                if (r == -EPIPE) {
-                        r = 0;
-                        goto finish;
-                }
+                r = wait_transfers(rr, multi);
                 if (r < 0)
                         goto finish;
         }
@@ -645,6 +885,11 @@ flush:
         r = process_remote(rr, PROCESS_UNTIL_FINISHED);
 
 finish:
+        free_transfers(multi, transfers, arg_max_active_chunks);
+
+        if (multi)
+                curl_multi_cleanup(multi);
+
         if (curl)
                 curl_easy_cleanup(curl);
 
@@ -659,13 +904,17 @@ static int parse_argv(int argc, char *argv[]) {
 
         enum {
                 ARG_RATE_LIMIT_BPS = 0x100,
+                ARG_MAX_ACTIVE_CHUNKS,
+                ARG_MAX_HOST_CONNECTIONS,
         };
 
         static const struct option options[] = {
                 { "help",           no_argument,       NULL, 'h'                },
                 { "log-level",      required_argument, NULL, 'l'                },
                 { "verbose",        no_argument,       NULL, 'v'                },
-                { "rate-limit-bps", required_argument, NULL, ARG_RATE_LIMIT_BPS },
+                { "rate-limit-bps",       required_argument, NULL, ARG_RATE_LIMIT_BPS       },
+                { "max-active-chunks",    required_argument, NULL, ARG_MAX_ACTIVE_CHUNKS    },
+                { "max-host-connections", required_argument, NULL, ARG_MAX_HOST_CONNECTIONS },
                 {}
         };
 
@@ -715,6 +964,24 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_rate_limit_bps = strtoll(optarg, NULL, 10);
                         break;
 
+                case ARG_MAX_ACTIVE_CHUNKS:
+                        r = safe_atou(optarg, &arg_max_active_chunks);
+                        if (r < 0)
+                                return log_error_errno(r, "Unable to parse number of active chunks %s: %m", optarg);
+                        if (arg_max_active_chunks == 0)
+                                return log_error_errno(EINVAL, "Number of active chunks cannot be zero.");
+
+                        break;
+
+                case ARG_MAX_HOST_CONNECTIONS:
+                        r = safe_atou(optarg, &arg_max_host_connections);
+                        if (r < 0)
+                                return log_error_errno(r, "Unable to parse number of host connections %s: %m", optarg);
+                        if (arg_max_host_connections == 0)
+                                return log_error_errno(EINVAL, "Number of host connections cannot be zero.");
+
+                        break;
+
                 case '?':
                         return -EINVAL;
 
@@ -59,12 +59,14 @@ static bool arg_delete = true;
 static bool arg_undo_immutable = false;
 static bool arg_recursive = true;
 static bool arg_seed_output = true;
+static bool arg_store_packs = false;
 /*命令行--store给定的参数，仅最后一个生效*/
 static char *arg_store = NULL;
 /*命令行--extra-store给定的参数，容许有多个*/
 static char **arg_extra_stores = NULL;
 /*命令行--seed给定的参数，容许有多个*/
 static char **arg_seeds = NULL;
+static char *arg_seed_cache = NULL;
 /*命令行--cache给定的参数，仅最后一个生效*/
 static char *arg_cache = NULL;
 /*命令行--cache-auto给定的参数*/
@@ -74,6 +76,13 @@ static size_t arg_chunk_size_min = 0;
 static size_t arg_chunk_size_avg = 0;
 static size_t arg_chunk_size_max = 0;
 static uint64_t arg_rate_limit_bps = UINT64_MAX;
+static unsigned arg_max_active_chunks = 0;
+static unsigned arg_max_host_connections = 0;
+static unsigned arg_threads = 0;
+static unsigned arg_prefetch_chunks = UINT_MAX;
+static uint64_t arg_prefetch_bytes = UINT64_MAX;
+static CaChunkVerify arg_verify = CA_CHUNK_VERIFY_ALWAYS;
+static uint64_t arg_verify_sample = 0;
 /*命令行--with给定的参数，解析所有flags,容许使用多次*/
 static uint64_t arg_with = 0;
 /*命令行--without给定的参数，解析所有without的flags,容许使用多次*/
@@ -107,17 +116,37 @@ static void help(void) {
                "                             be done\n"
                "     --store=PATH            The primary chunk store to use\n"
                "     --extra-store=PATH      Additional chunk store to look for chunks in\n"
+               "     --store-packs=yes       Put new chunks into packfiles in the store, rather\n"
+               "                             than into a file each\n"
                "     --chunk-size=[MIN:]AVG[:MAX]\n"
                "                             The minimal/average/maximum number of bytes in a\n"
                "                             chunk\n"
-               "     --digest=DIGEST         Pick digest algorithm (sha512-256 or sha256)\n"
+               "     --digest=DIGEST         Pick digest algorithm (sha512-256, sha256 or blake3)\n"
                "     --compression=COMPRESSION\n"
                "                             Pick compression algorithm (zstd, xz or gzip)\n"
                "     --seed=PATH             Additional file or directory to use as seed\n"
+               "     --seed-cache=PATH       Directory to keep seed caches in, to reuse them\n"
+               "                             while the seeds don't change\n"
                "     --cache=PATH            Directory to use as encoder cache\n"
                "  -c --cache-auto            Pick encoder cache directory automatically\n"
                "     --rate-limit-bps=LIMIT  Maximum bandwidth in bytes/s for remote\n"
                "                             communication\n"
+               "     --max-active-chunks=N   Number of chunks to download over HTTP, HTTPS, FTP\n"
+               "                             or SFTP at the same time (default: 64)\n"
+               "     --max-host-connections=N\n"
+               "                             Number of connections to open to one such server\n"
+               "                             (default: 16)\n"
+               "     --threads=N             Number of threads to use for processing chunks,\n"
+               "                             indexing seeds and looking up files ahead of time\n"
+               "                             (default: number of CPUs)\n"
+               "     --prefetch-chunks=N     Number of chunks to load from the local store ahead\n"
+               "                             of time when extracting, 0 to turn off\n"
+               "                             (default: 32)\n"
+               "     --prefetch-bytes=SIZE   Maximum size of the chunks loaded ahead of time\n"
+               "     --verify=MODE           Validate chunks taken from stores when extracting\n"
+               "                             (always, sample or never)\n"
+               "     --verify-sample=N       With --verify=sample, validate one in N chunks\n"
+               "                             (default: 64)\n"
                "     --exclude-nodump=no     Don't exclude files with chattr(1)'s +d 'nodump'\n"
                "                             flag when creating archive\n"
                "     --exclude-submounts=yes Exclude submounts when creating archive\n"
@@ -348,8 +377,16 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_EXTRA_STORE,
                 ARG_CHUNK_SIZE,
                 ARG_SEED,
+                ARG_SEED_CACHE,
                 ARG_CACHE,
                 ARG_RATE_LIMIT_BPS,
+                ARG_MAX_ACTIVE_CHUNKS,
+                ARG_MAX_HOST_CONNECTIONS,
+                ARG_THREADS,
+                ARG_PREFETCH_CHUNKS,
+                ARG_PREFETCH_BYTES,
+                ARG_VERIFY,
+                ARG_VERIFY_SAMPLE,
                 ARG_WITH,
                 ARG_WITHOUT,
                 ARG_WHAT,
@@ -368,6 +405,7 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_MKDIR,
                 ARG_DIGEST,
                 ARG_COMPRESSION,
+                ARG_STORE_PACKS,
                 ARG_VERSION,
         };
 
@@ -381,9 +419,17 @@ static int parse_argv(int argc, char *argv[]) {
                 { "extra-store",       required_argument, NULL, ARG_EXTRA_STORE       },
                 { "chunk-size",        required_argument, NULL, ARG_CHUNK_SIZE        },
                 { "seed",              required_argument, NULL, ARG_SEED              },
+                { "seed-cache",        required_argument, NULL, ARG_SEED_CACHE        },
                 { "cache",             required_argument, NULL, ARG_CACHE             },
                 { "cache-auto",        no_argument,       NULL, 'c'                   },
                 { "rate-limit-bps",    required_argument, NULL, ARG_RATE_LIMIT_BPS    },
+                { "max-active-chunks", required_argument, NULL, ARG_MAX_ACTIVE_CHUNKS },
+                { "max-host-connections", required_argument, NULL, ARG_MAX_HOST_CONNECTIONS },
+                { "threads",           required_argument, NULL, ARG_THREADS           },
+                { "prefetch-chunks",   required_argument, NULL, ARG_PREFETCH_CHUNKS   },
+                { "prefetch-bytes",    required_argument, NULL, ARG_PREFETCH_BYTES    },
+                { "verify",            required_argument, NULL, ARG_VERIFY            },
+                { "verify-sample",     required_argument, NULL, ARG_VERIFY_SAMPLE     },
                 { "with",              required_argument, NULL, ARG_WITH              },
                 { "without",           required_argument, NULL, ARG_WITHOUT           },
                 { "what",              required_argument, NULL, ARG_WHAT              },
@@ -402,6 +448,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "mkdir",             required_argument, NULL, ARG_MKDIR             },
                 { "digest",            required_argument, NULL, ARG_DIGEST            },
                 { "compression",       required_argument, NULL, ARG_COMPRESSION       },
+                { "store-packs",       required_argument, NULL, ARG_STORE_PACKS       },
                 {}
         };
 
@@ -483,6 +530,13 @@ static int parse_argv(int argc, char *argv[]) {
 
                         break;
 
+                case ARG_SEED_CACHE:
+                        r = free_and_strdup(&arg_seed_cache, optarg);
+                        if (r < 0)
+                                return log_oom();
+
+                        break;
+
                 case ARG_CACHE:
                 	/*更新arg_cache*/
                         r = free_and_strdup(&arg_cache, optarg);
@@ -506,6 +560,69 @@ static int parse_argv(int argc, char *argv[]) {
 
                         break;
 
+                case ARG_MAX_ACTIVE_CHUNKS:
+                        r = safe_atou(optarg, &arg_max_active_chunks);
+                        if (r < 0)
+                                return log_error_errno(r, "Unable to parse number of active chunks %s: %m", optarg);
+                        if (arg_max_active_chunks == 0)
+                                return log_error_errno(EINVAL, "Number of active chunks cannot be zero.");
+
+                        break;
+
+                case ARG_MAX_HOST_CONNECTIONS:
+                        r = safe_atou(optarg, &arg_max_host_connections);
+                        if (r < 0)
+                                return log_error_errno(r, "Unable to parse number of host connections %s: %m", optarg);
+                        if (arg_max_host_connections == 0)
+                                return log_error_errno(EINVAL, "Number of host connections cannot be zero.");
+
+                        break;
+
+                case ARG_THREADS:
+                        r = safe_atou(optarg, &arg_threads);
+                        if (r < 0)
+                                return log_error_errno(r, "Unable to parse number of threads %s: %m", optarg);
+                        if (arg_threads == 0)
+                                return log_error_errno(EINVAL, "Number of threads cannot be zero.");
+
+                        break;
+
+                case ARG_PREFETCH_CHUNKS:
+                        r = safe_atou(optarg, &arg_prefetch_chunks);
+                        if (r < 0)
+                                return log_error_errno(r, "Unable to parse number of chunks to prefetch %s: %m", optarg);
+
+                        break;
+
+                case ARG_PREFETCH_BYTES:
+                        r = parse_size(optarg, &arg_prefetch_bytes);
+                        if (r < 0)
+                                return log_error_errno(r, "Unable to parse prefetch size %s: %m", optarg);
+                        if (arg_prefetch_bytes == 0)
+                                return log_error_errno(EINVAL, "Prefetch size cannot be zero.");
+
+                        break;
+
+                case ARG_VERIFY: {
+                        CaChunkVerify v;
+
+                        v = ca_chunk_verify_from_string(optarg);
+                        if (v < 0)
+                                return log_error_errno(EINVAL, "Failed to parse --verify= parameter: %s", optarg);
+
+                        arg_verify = v;
+                        break;
+                }
+
+                case ARG_VERIFY_SAMPLE:
+                        r = safe_atou64(optarg, &arg_verify_sample);
+                        if (r < 0)
+                                return log_error_errno(r, "Unable to parse verification sample rate %s: %m", optarg);
+                        if (arg_verify_sample == 0)
+                                return log_error_errno(EINVAL, "Verification sample rate cannot be zero.");
+
+                        break;
+
                 case ARG_WITH: {
                 	/*指明需要打开的flag*/
                         uint64_t u;
@@ -599,6 +716,14 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_hardlink = r;
                         break;
 
+                case ARG_STORE_PACKS:
+                        r = parse_boolean(optarg);
+                        if (r < 0)
+                                return log_error_errno(r, "Failed to parse --store-packs= parameter: %s", optarg);
+
+                        arg_store_packs = r;
+                        break;
+
                 case ARG_DELETE:
                         r = parse_boolean(optarg);
                         if (r < 0)
@@ -776,6 +901,12 @@ static int load_seeds_and_extra_stores(CaSync *s) {
                         log_error("Failed to add seed %s, ignoring: %m", *i);
         }
 
+        if (arg_seed_cache) {
+                r = ca_sync_set_seed_cache_path(s, arg_seed_cache);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set seed cache directory: %m");
+        }
+
         return 0;
 }
 
@@ -829,6 +960,10 @@ static int load_feature_flags(CaSync *s, uint64_t default_with_flags) {
         if (r < 0 && r != -ENOTTY)
                 return log_error_errno(r, "Failed to set compression: %m");
 
+        r = ca_sync_set_store_packs(s, arg_store_packs);
+        if (r < 0)
+                return log_error_errno(r, "Failed to set store packfile mode: %m");
+
         r = ca_sync_set_delete(s, arg_delete);
         if (r < 0 && r != -ENOTTY)
                 return log_error_errno(r, "Failed to set deletion flag: %m");
@@ -1149,6 +1284,16 @@ static int verbose_print_done_extract(CaSync *s) {
                          runtime_nsec > 0 ? nsec * 100U / runtime_nsec : 0);
         }
 
+        r = ca_sync_get_remote_window_stall_nsec(s, &nsec);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0)
+                        return log_error_errno(r, "Failed to determine time stalled on the remote request window: %m");
+
+                log_info("Time stalled on remote request window: %s (%" PRIu64 "%%)",
+                         format_timespan(buffer, sizeof(buffer), nsec, NSEC_PER_MSEC),
+                         runtime_nsec > 0 ? nsec * 100U / runtime_nsec : 0);
+        }
+
         r = ca_sync_get_decoding_time_nsec(s, &nsec);
         if (!IN_SET(r, -ENODATA, -ENOTTY)) {
                 if (r < 0)
@@ -1375,6 +1520,24 @@ static int verb_make(int argc, char *argv[]) {
                         return log_error_errno(r, "Failed to set rate limit: %m");
         }
 
+        if (arg_max_active_chunks > 0) {
+                r = ca_sync_set_max_active_chunks(s, arg_max_active_chunks);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of active chunks: %m");
+        }
+
+        if (arg_max_host_connections > 0) {
+                r = ca_sync_set_max_host_connections(s, arg_max_host_connections);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of host connections: %m");
+        }
+
+        if (arg_threads > 0) {
+                r = ca_sync_set_n_threads(s, arg_threads);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of threads: %m");
+        }
+
         /*更新base_fd*/
         r = ca_sync_set_base_fd(s, input_fd);
         if (r < 0)
@@ -1693,6 +1856,40 @@ static int verb_extract(int argc, char *argv[]) {
                         return log_error_errno(r, "Failed to set rate limit: %m");
         }
 
+        if (arg_max_active_chunks > 0) {
+                r = ca_sync_set_max_active_chunks(s, arg_max_active_chunks);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of active chunks: %m");
+        }
+
+        if (arg_max_host_connections > 0) {
+                r = ca_sync_set_max_host_connections(s, arg_max_host_connections);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of host connections: %m");
+        }
+
+        if (arg_threads > 0) {
+                r = ca_sync_set_n_threads(s, arg_threads);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of threads: %m");
+        }
+
+        if (arg_prefetch_chunks != UINT_MAX) {
+                r = ca_sync_set_prefetch_chunks(s, arg_prefetch_chunks);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of chunks to prefetch: %m");
+        }
+
+        if (arg_prefetch_bytes != UINT64_MAX) {
+                r = ca_sync_set_prefetch_bytes(s, arg_prefetch_bytes);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set prefetch size: %m");
+        }
+
+        r = ca_sync_set_verify(s, arg_verify, arg_verify_sample);
+        if (r < 0)
+                return log_error_errno(r, "Failed to set chunk verification mode: %m");
+
         if (seek_path) {
                 if (output_fd >= 0)
                         r = ca_sync_set_boundary_fd(s, output_fd);
@@ -2320,6 +2517,18 @@ static int verb_list(int argc, char *argv[]) {
         if (r < 0)
                 return r;
 
+        if (arg_max_active_chunks > 0) {
+                r = ca_sync_set_max_active_chunks(s, arg_max_active_chunks);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of active chunks: %m");
+        }
+
+        if (arg_max_host_connections > 0) {
+                r = ca_sync_set_max_host_connections(s, arg_max_host_connections);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of host connections: %m");
+        }
+
         if (operation == LIST_ARCHIVE) {
                 if (input_fd >= 0)
                         r = ca_sync_set_archive_fd(s, input_fd);
@@ -2419,6 +2628,7 @@ static int verb_list(int argc, char *argv[]) {
                                 static const char * const table[_CA_DIGEST_TYPE_MAX] = {
                                         [CA_DIGEST_SHA256] = "sha256digest",
                                         [CA_DIGEST_SHA512_256] = "sha512256digest",
+                                        [CA_DIGEST_BLAKE3] = "blake3digest",
                                 };
 
                                 CaChunkID digest;
@@ -2627,6 +2837,18 @@ static int verb_digest(int argc, char *argv[]) {
         if (r < 0)
                 return r;
 
+        if (arg_max_active_chunks > 0) {
+                r = ca_sync_set_max_active_chunks(s, arg_max_active_chunks);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of active chunks: %m");
+        }
+
+        if (arg_max_host_connections > 0) {
+                r = ca_sync_set_max_host_connections(s, arg_max_host_connections);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of host connections: %m");
+        }
+
         if (operation == DIGEST_DIRECTORY || (operation == DIGEST_BLOB && input_fd >= 0))
                 r = ca_sync_set_base_fd(s, input_fd);
         else if (IN_SET(operation, DIGEST_ARCHIVE_INDEX, DIGEST_BLOB_INDEX)) {
@@ -2858,6 +3080,40 @@ static int verb_mount(int argc, char *argv[]) {
                         return log_error_errno(r, "Failed to set rate limit: %m");
         }
 
+        if (arg_max_active_chunks > 0) {
+                r = ca_sync_set_max_active_chunks(s, arg_max_active_chunks);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of active chunks: %m");
+        }
+
+        if (arg_max_host_connections > 0) {
+                r = ca_sync_set_max_host_connections(s, arg_max_host_connections);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of host connections: %m");
+        }
+
+        if (arg_threads > 0) {
+                r = ca_sync_set_n_threads(s, arg_threads);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of threads: %m");
+        }
+
+        if (arg_prefetch_chunks != UINT_MAX) {
+                r = ca_sync_set_prefetch_chunks(s, arg_prefetch_chunks);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of chunks to prefetch: %m");
+        }
+
+        if (arg_prefetch_bytes != UINT64_MAX) {
+                r = ca_sync_set_prefetch_bytes(s, arg_prefetch_bytes);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set prefetch size: %m");
+        }
+
+        r = ca_sync_set_verify(s, arg_verify, arg_verify_sample);
+        if (r < 0)
+                return log_error_errno(r, "Failed to set chunk verification mode: %m");
+
         if (operation == MOUNT_ARCHIVE) {
                 if (input_fd >= 0)
                         r = ca_sync_set_archive_fd(s, input_fd);
@@ -2986,6 +3242,40 @@ static int verb_mkdev(int argc, char *argv[]) {
                         return log_error_errno(r, "Failed to set rate limit: %m");
         }
 
+        if (arg_max_active_chunks > 0) {
+                r = ca_sync_set_max_active_chunks(s, arg_max_active_chunks);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of active chunks: %m");
+        }
+
+        if (arg_max_host_connections > 0) {
+                r = ca_sync_set_max_host_connections(s, arg_max_host_connections);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of host connections: %m");
+        }
+
+        if (arg_threads > 0) {
+                r = ca_sync_set_n_threads(s, arg_threads);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of threads: %m");
+        }
+
+        if (arg_prefetch_chunks != UINT_MAX) {
+                r = ca_sync_set_prefetch_chunks(s, arg_prefetch_chunks);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set number of chunks to prefetch: %m");
+        }
+
+        if (arg_prefetch_bytes != UINT64_MAX) {
+                r = ca_sync_set_prefetch_bytes(s, arg_prefetch_bytes);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set prefetch size: %m");
+        }
+
+        r = ca_sync_set_verify(s, arg_verify, arg_verify_sample);
+        if (r < 0)
+                return log_error_errno(r, "Failed to set chunk verification mode: %m");
+
         if (operation == MKDEV_BLOB) {
                 if (input_fd >= 0)
                         r = ca_sync_set_archive_fd(s, input_fd);
@@ -3596,6 +3886,7 @@ static int verb_pull(int argc, char *argv[]) {
                         bool found = false;
                         const void *p;
                         CaChunkID id;
+                        int fd = -1;
                         uint64_t l;
 
                         r = ca_remote_can_put_chunk(rr);
@@ -3611,6 +3902,15 @@ static int verb_pull(int argc, char *argv[]) {
                                 return log_error_errno(r, "Failed to determine which chunk to send next: %m");
 
                         for (i = 0; i < stores.n_stores; i++) {
+                                /* Compressed chunk files are passed on as they are, without reading them in */
+                                r = ca_store_get_fd(stores.stores[i], &id, &fd, &l);
+                                if (r >= 0) {
+                                        found = true;
+                                        break;
+                                }
+                                if (r != -ENOENT)
+                                        return log_error_errno(r, "Failed to query store: %m");
+
                                 r = ca_store_get(stores.stores[i], &id, CA_CHUNK_COMPRESSED, &p, &l, &compression);
                                 if (r >= 0) {
                                         found = true;
@@ -3620,7 +3920,11 @@ static int verb_pull(int argc, char *argv[]) {
                                         return log_error_errno(r, "Failed to query store: %m");
                         }
 
-                        if (found)
+                        if (fd >= 0) {
+                                r = ca_remote_put_chunk_fd(rr, &id, CA_CHUNK_COMPRESSED, fd, l);
+                                if (r < 0)
+                                        safe_close(fd);
+                        } else if (found)
                                 r = ca_remote_put_chunk(rr, &id, compression, p, l);
                         else
                                 r = ca_remote_put_missing(rr, &id);
@@ -3923,6 +4227,23 @@ static int verb_push(int argc, char *argv[]) {
                 }
         }
 
+        if (wstore_path) {
+                uint64_t window_requests, window_bytes, stall_nsec;
+
+                r = ca_store_flush(stores.stores[0]);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to flush store: %m");
+
+                if (ca_remote_get_window(rr, &window_requests, &window_bytes) >= 0 &&
+                    ca_remote_get_window_stall_nsec(rr, &stall_nsec) >= 0) {
+                        char buffer[FORMAT_BYTES_MAX];
+
+                        log_debug("Request window: %" PRIu64 " chunks, %" PRIu64 " bytes, stalled for %s.",
+                                  window_requests, window_bytes,
+                                  format_timespan(buffer, sizeof(buffer), stall_nsec, NSEC_PER_MSEC));
+                }
+        }
+
         if (index) {
                 r = ca_index_install(index);
                 if (r < 0)
@@ -4122,6 +4443,7 @@ int main(int argc, char *argv[]) {
 finish:
         free(arg_store);
         free(arg_cache);
+        free(arg_seed_cache);
         strv_free(arg_extra_stores);
         strv_free(arg_seeds);
 
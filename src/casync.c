@@ -1,7 +1,10 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
 #include <fcntl.h>
+#include <linux/fs.h>
 #include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 
 #include "cacache.h"
@@ -12,6 +15,8 @@
 #include "caformat-util.h"
 #include "caformat.h"
 #include "caindex.h"
+#include "cajobqueue.h"
+#include "caparallelchunker.h"
 #include "caprotocol.h"
 #include "caremote.h"
 #include "caseed.h"
@@ -31,6 +36,19 @@
 /* #undef EUNATCH */
 /* #define EUNATCH __LINE__ */
 
+/* How many chunks following the current one to load from the local store in the background while decoding, by
+ * default */
+#define SYNC_LOCAL_PREFETCH_CHUNKS_DEFAULT 32U
+
+/* How many different all-zero chunks to remember */
+#define SYNC_ZERO_CHUNKS_MAX 4U
+
+typedef struct CaSyncZeroChunk {
+        CaChunkID id;
+        uint64_t size;
+        bool stored; /* Whether it has been put into the stores while encoding already */
+} CaSyncZeroChunk;
+
 typedef enum CaDirection {
         CA_SYNC_ENCODE,
         CA_SYNC_DECODE,
@@ -78,7 +96,13 @@ struct CaSync {
         CaSeed **seeds;
         size_t n_seeds;
         size_t current_seed; /* The seed we are currently indexing */
+        /* With multiple seeds and threads, all seeds are indexed concurrently on worker threads instead, which
+         * signal completion on 'seed_notify_fd'. 'seed_cancel' asks them to stop early. */
+        CaJobQueue *seed_queue;
+        int seed_notify_fd;
+        bool seed_cancel;
         bool index_flags_propagated;
+        char *seed_cache_path; /* Where to keep seed caches, so that they may be reused */
 
         CaCache *cache;
         CaCacheState cache_state;
@@ -107,11 +131,42 @@ struct CaSync {
 
         CaDigest *chunk_digest;
 
+        /* Runs of zeros, as in holes of disk images, chunk up into the same few all-zero chunks over and over
+         * again. Those are recognized by their ID, and are neither hashed again, nor put into or read from the
+         * stores more than once. */
+        CaSyncZeroChunk zero_chunks[SYNC_ZERO_CHUNKS_MAX];
+        size_t n_zero_chunks;
+        size_t zero_chunks_next;
+        CaDigest *zero_chunk_digest;
+        ReallocBuffer zero_buffer;
+
+        /* When encoding with multiple threads, or if the chunk digest can hash multiple chunks at once, chunks
+         * are collected in batches, which are hashed, compressed and stored on worker threads (or synchronously
+         * if there are none), and then written to the index in order from this queue. */
+        CaJobQueue *chunk_queue;
+        struct CaSyncChunkJob *chunk_job; /* The batch we are currently filling, not submitted yet */
+        size_t chunk_batch_size;
+        unsigned n_threads;
+
+        /* When encoding a large seekable blob with multiple threads, chunk borders are determined ahead of the
+         * encoder on worker threads, rather than with 'chunker' */
+        CaParallelChunker *parallel_chunker;
+
+        /* When decoding from an index with multiple threads, the chunks following the current one are loaded from
+         * the local stores as they are, and decompressed and validated (as far as 'verify' says) on worker
+         * threads, to be picked up in order from this queue. */
+        CaJobQueue *decode_queue;
+        size_t decode_slots;
+        uint64_t decode_position; /* Index position of the chunk to queue next */
+        CaDigestType decode_digest_type;
+
         bool archive_eof;
         bool remote_index_eof;
 
         int log_level;/*用户指定的log级别*/
         size_t rate_limit_bps;/*bps速率*/
+        unsigned max_active_chunks;
+        unsigned max_host_connections;
 
         uint64_t feature_flags;
         uint64_t feature_flags_mask;
@@ -119,6 +174,14 @@ struct CaSync {
         uint64_t n_written_chunks;
         uint64_t n_reused_chunks;
         uint64_t n_prefetched_chunks;
+        uint64_t n_local_prefetched_chunks;
+        uint64_t local_prefetch_offset; /* End offset of the last chunk prefetched from the local store */
+        bool local_prefetch_advise;     /* io_uring is not available, merely ask the kernel for read-ahead */
+        unsigned prefetch_chunks;
+        uint64_t prefetch_bytes;
+
+        CaChunkVerify verify;
+        uint64_t verify_sample;
 
         uint64_t n_cache_hits;
         uint64_t n_cache_misses;
@@ -150,6 +213,7 @@ struct CaSync {
         uint64_t chunk_size_max;
 
         CaCompressionType compression_type;
+        bool store_packs;
 
         uint64_t first_chunk_request_nsec;
         uint64_t last_chunk_request_nsec;
@@ -182,6 +246,16 @@ static CaSync *ca_sync_new(void) {
 
         s->compression_type = CA_COMPRESSION_DEFAULT;
 
+        s->n_threads = cpus_online();
+
+        s->prefetch_chunks = SYNC_LOCAL_PREFETCH_CHUNKS_DEFAULT;
+        s->prefetch_bytes = UINT64_MAX;
+
+        s->verify = CA_CHUNK_VERIFY_ALWAYS;
+        s->verify_sample = CA_CHUNK_VERIFY_SAMPLE_DEFAULT;
+
+        s->seed_notify_fd = -1;
+
         return s;
 }
 
@@ -458,6 +532,16 @@ CaSync *ca_sync_unref(CaSync *s) {
         if (!s)
                 return NULL;
 
+        /* Stop the worker threads first, they might still access our stores */
+        ca_job_queue_unref(s->chunk_queue);
+        ca_job_queue_unref(s->decode_queue);
+        ca_parallel_chunker_unref(s->parallel_chunker);
+
+        /* The seed workers check this between steps, so that we don't have to wait for them to index everything */
+        __atomic_store_n(&s->seed_cancel, true, __ATOMIC_RELAXED);
+        ca_job_queue_unref(s->seed_queue);
+        safe_close(s->seed_notify_fd);
+
         ca_encoder_unref(s->encoder);
         ca_decoder_unref(s->decoder);
 
@@ -475,6 +559,7 @@ CaSync *ca_sync_unref(CaSync *s) {
         for (i = 0; i < s->n_seeds; i++)
                 ca_seed_unref(s->seeds[i]);
         free(s->seeds);
+        free(s->seed_cache_path);
 
         ca_sync_reset_cache_data(s);
         ca_cache_unref(s->cache);
@@ -511,6 +596,8 @@ CaSync *ca_sync_unref(CaSync *s) {
         ca_file_root_unref(s->archive_root);
 
         ca_digest_free(s->chunk_digest);
+        ca_digest_free(s->zero_chunk_digest);
+        realloc_buffer_free(&s->zero_buffer);
 
         return mfree(s);
 }
@@ -535,6 +622,103 @@ int ca_sync_set_rate_limit_bps(CaSync *s, uint64_t rate_limit_bps) {
         return 0;
 }
 
+int ca_sync_set_max_active_chunks(CaSync *s, unsigned n) {
+        if (!s)
+                return -EINVAL;
+
+        s->max_active_chunks = n;
+
+        return 0;
+}
+
+int ca_sync_set_max_host_connections(CaSync *s, unsigned n) {
+        if (!s)
+                return -EINVAL;
+
+        s->max_host_connections = n;
+
+        return 0;
+}
+
+static int ca_sync_setup_remote_transfers(CaSync *s, CaRemote *rr) {
+        int r;
+
+        assert(s);
+        assert(rr);
+
+        if (s->max_active_chunks > 0) {
+                r = ca_remote_set_max_active_chunks(rr, s->max_active_chunks);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->max_host_connections > 0) {
+                r = ca_remote_set_max_host_connections(rr, s->max_host_connections);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+int ca_sync_set_n_threads(CaSync *s, unsigned n) {
+        if (!s)
+                return -EINVAL;
+        if (CA_SYNC_IS_STARTED(s))
+                return -EBUSY;
+
+        /* Zero selects one thread per online CPU, one disables threading */
+        s->n_threads = n > 0 ? n : cpus_online();
+
+        return 0;
+}
+
+int ca_sync_set_prefetch_chunks(CaSync *s, unsigned n) {
+        if (!s)
+                return -EINVAL;
+        if (s->direction != CA_SYNC_DECODE)
+                return -ENOTTY;
+        if (CA_SYNC_IS_STARTED(s))
+                return -EBUSY;
+
+        /* Zero turns off loading chunks from the local store ahead of time */
+        s->prefetch_chunks = n;
+
+        return 0;
+}
+
+int ca_sync_set_prefetch_bytes(CaSync *s, uint64_t bytes) {
+        if (!s)
+                return -EINVAL;
+        if (bytes == 0)
+                return -EINVAL;
+        if (s->direction != CA_SYNC_DECODE)
+                return -ENOTTY;
+        if (CA_SYNC_IS_STARTED(s))
+                return -EBUSY;
+
+        /* UINT64_MAX means the window is bounded by the number of chunks only */
+        s->prefetch_bytes = bytes;
+
+        return 0;
+}
+
+int ca_sync_set_verify(CaSync *s, CaChunkVerify verify, uint64_t sample) {
+        if (!s)
+                return -EINVAL;
+        if (verify < 0)
+                return -EINVAL;
+        if (verify >= _CA_CHUNK_VERIFY_MAX)
+                return -EINVAL;
+        if (CA_SYNC_IS_STARTED(s))
+                return -EBUSY;
+
+        s->verify = verify;
+        s->verify_sample = sample > 0 ? sample : CA_CHUNK_VERIFY_SAMPLE_DEFAULT;
+
+        return 0;
+}
+
 int ca_sync_set_feature_flags(CaSync *s, uint64_t flags) {
         if (!s)
                 return -EINVAL;
@@ -698,6 +882,10 @@ int ca_sync_set_index_remote(CaSync *s, const char *url) {
                         return r;
         }
 
+        r = ca_sync_setup_remote_transfers(s, s->remote_index);
+        if (r < 0)
+                return r;
+
         r = ca_remote_set_index_url(s->remote_index, url);
         if (r < 0)
                 return r;
@@ -1063,6 +1251,10 @@ int ca_sync_set_store_remote(CaSync *s, const char *url) {
                         return r;
         }
 
+        r = ca_sync_setup_remote_transfers(s, s->remote_wstore);
+        if (r < 0)
+                return r;
+
         r = ca_remote_set_store_url(s->remote_wstore, url);
         if (r < 0)
                 return r;
@@ -1142,6 +1334,12 @@ int ca_sync_add_store_remote(CaSync *s, const char *url) {
                 return r;
         }
 
+        r = ca_sync_setup_remote_transfers(s, remote);
+        if (r < 0) {
+                ca_remote_unref(remote);
+                return r;
+        }
+
         array = realloc_multiply(s->remote_rstores, sizeof(CaRemote*),  s->n_remote_rstores+1);
         if (!array) {
                 ca_remote_unref(remote);
@@ -1239,6 +1437,17 @@ int ca_sync_add_seed_path(CaSync *s, const char *path) {
         return 0;
 }
 
+int ca_sync_set_seed_cache_path(CaSync *s, const char *path) {
+        if (!s)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+        if (CA_SYNC_IS_STARTED(s))
+                return -EBUSY;
+
+        return free_and_strdup(&s->seed_cache_path, path);
+}
+
 int ca_sync_set_cache_fd(CaSync *s, int fd) {
         _cleanup_(ca_cache_unrefp) CaCache *cache = NULL;
         int r;
@@ -1313,6 +1522,92 @@ static bool ca_sync_use_cache(CaSync *s) {
         return !!s->cache;
 }
 
+static int ca_sync_setup_parallel_chunker(CaSync *s) {
+        _cleanup_(safe_closep) int fd = -1;
+        uint64_t size, segment_size;
+        struct stat st;
+        int r;
+
+        assert(s);
+        assert(s->base_fd >= 0);
+
+        /* If we are encoding a large regular file or block device with multiple threads, determine the chunk
+         * borders in parallel, on a separate fd. The result is the same as if we'd chunk it serially. */
+
+        if (s->n_threads <= 1)
+                return 0;
+        if (s->cache)
+                return 0;
+
+        if (fstat(s->base_fd, &st) < 0)
+                return -errno;
+
+        if (S_ISREG(st.st_mode))
+                size = (uint64_t) st.st_size;
+        else if (S_ISBLK(st.st_mode)) {
+                if (ioctl(s->base_fd, BLKGETSIZE64, &size) < 0)
+                        return -errno;
+        } else
+                return 0;
+
+        /* Make sure segments are large compared to chunks, so that resynchronising at segment borders is cheap */
+        segment_size = MAX(CA_PARALLEL_CHUNKER_SEGMENT_SIZE_DEFAULT, (uint64_t) s->chunker.chunk_size_max * 64);
+        if (size < segment_size * 2)
+                return 0;
+
+        fd = fcntl(s->base_fd, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+                return -errno;
+
+        r = ca_parallel_chunker_new(&s->chunker, fd, size, s->n_threads, segment_size, &s->parallel_chunker);
+        if (r < 0)
+                return r;
+
+        fd = -1;
+        return 1;
+}
+
+static int ca_sync_propagate_verify(CaSync *s) {
+        size_t i;
+        int r;
+
+        assert(s);
+
+        /* Tells the stores and remotes how thoroughly to check the chunks they hand to us */
+
+        if (s->wstore) {
+                r = ca_store_set_verify(s->wstore, s->verify, s->verify_sample);
+                if (r < 0)
+                        return r;
+        }
+
+        for (i = 0; i < s->n_rstores; i++) {
+                r = ca_store_set_verify(s->rstores[i], s->verify, s->verify_sample);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->cache_store) {
+                r = ca_store_set_verify(s->cache_store, s->verify, s->verify_sample);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->remote_wstore) {
+                r = ca_remote_set_verify(s->remote_wstore, s->verify, s->verify_sample);
+                if (r < 0)
+                        return r;
+        }
+
+        for (i = 0; i < s->n_remote_rstores; i++) {
+                r = ca_remote_set_verify(s->remote_rstores[i], s->verify, s->verify_sample);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
 static int ca_sync_start(CaSync *s) {
         size_t i;
         int r;
@@ -1323,6 +1618,10 @@ static int ca_sync_start(CaSync *s) {
         	/*此函数已执行，同步已启动，返回*/
                 return 0;
 
+        r = ca_sync_propagate_verify(s);
+        if (r < 0)
+                return r;
+
         if (s->direction == CA_SYNC_ENCODE && s->archive_path && s->archive_fd < 0) {
         		/* encode情况下，指明了archive_path,未指明archive_fd,则先生成临时归档路径，
         		 * 再利用临时归档路径，产生s->archive_fd
@@ -1347,6 +1646,10 @@ static int ca_sync_start(CaSync *s) {
                 if (s->base_fd < 0)
                         return -EUNATCH;
 
+                r = ca_sync_setup_parallel_chunker(s);
+                if (r < 0)
+                        return r;
+
                 s->encoder = ca_encoder_new();
                 if (!s->encoder)
                         return -ENOMEM;
@@ -1366,6 +1669,10 @@ static int ca_sync_start(CaSync *s) {
 
                 s->base_fd = -1;
 
+                r = ca_encoder_set_n_threads(s->encoder, s->n_threads);
+                if (r < 0)
+                        return r;
+
                 r = ca_encoder_set_uid_shift(s->encoder, s->uid_shift);
                 if (r < 0)
                         return r;
@@ -1610,13 +1917,23 @@ static int ca_sync_start(CaSync *s) {
                 r = ca_seed_set_chunks(s->seeds[i], !!s->index);
                 if (r < 0)
                         return r;
+
+                if (s->seed_cache_path) {
+                        r = ca_seed_set_cache_directory(s->seeds[i], s->seed_cache_path);
+                        if (r < 0 && r != -EBUSY)
+                                return r;
+                }
         }
 
-        /* Tell the wstore which compression algorithm to use */
+        /* Tell the wstore which compression algorithm to use, and whether to put chunks into packfiles */
         if (s->wstore) {
                 r = ca_store_set_compression_type(s->wstore, s->compression_type);
                 if (r < 0)
                         return r;
+
+                r = ca_store_set_packs(s->wstore, s->store_packs);
+                if (r < 0)
+                        return r;
         }
 
         if (s->remote_wstore) {
@@ -1657,169 +1974,211 @@ static int ca_sync_write_remote_archive(CaSync *s, const void *p, size_t l) {
         return ca_remote_put_archive(s->remote_archive, p, l);
 }
 
-static int ca_sync_write_one_chunk(CaSync *s, const void *p, size_t l, CaOrigin *origin) {
+typedef struct CaSyncChunk {
+        ReallocBuffer buffer;
+        CaOrigin *origin;
         CaChunkID id;
+        uint64_t size;
+        bool cached:1; /* The chunk ID is already known from the cache, we only need to write it to the index */
+        bool zero:1;   /* The chunk is all zeros, and its ID is already known, but it still needs to be stored */
+        bool reused:1;
+} CaSyncChunk;
+
+typedef struct CaSyncChunkJob {
+        /* A batch of consecutive chunks */
+        CaSyncChunk *chunks;
+        size_t n_chunks;
+        size_t n_allocated;
+        CaDigest *digest;
+} CaSyncChunkJob;
+
+static const void* ca_sync_zeros(CaSync *s, size_t size) {
+        assert(s);
+
+        /* Returns at least 'size' zero bytes. The buffer never contains anything else, and is only ever grown. */
+
+        if (realloc_buffer_size(&s->zero_buffer) >= size)
+                return realloc_buffer_data(&s->zero_buffer);
+
+        return realloc_buffer_acquire0(&s->zero_buffer, size);
+}
+
+static int ca_sync_get_zero_chunk(CaSync *s, uint64_t size, CaSyncZeroChunk **ret) {
+        CaSyncZeroChunk *z;
+        const void *p;
+        size_t i;
         int r;
 
         assert(s);
-        assert(p || l == 0);
-        assert(!origin || ca_origin_bytes(origin) == l);
+        assert(size > 0);
+        assert(ret);
 
-        /* Processes a single chunk we just generated. Writes it to our wstore, our cache store, and our cache. Also
-         * writes a record about it into the index. Note that if we hit the cache ca_sync_write_one_cached_chunk() is
-         * called instead. */
+        /* Returns the all-zero chunk of the specified size, and determines its ID first if we haven't seen it yet */
 
-        r = ca_sync_make_chunk_id(s, p, l, &id);
-        if (r < 0)
-                return r;
+        for (i = 0; i < s->n_zero_chunks; i++)
+                if (s->zero_chunks[i].size == size) {
+                        *ret = s->zero_chunks + i;
+                        return 0;
+                }
 
-        s->n_written_chunks++;
+        if (size > CA_CHUNK_SIZE_LIMIT_MAX)
+                return -EBADMSG;
 
-        if (s->wstore) {
-                r = ca_store_put(s->wstore, &id, CA_CHUNK_UNCOMPRESSED, p, l);
-                if (r == -EEXIST)
-                        s->n_reused_chunks++;
-                else if (r < 0)
-                        return r;
-        }
+        if (!s->zero_chunk_digest) {
+                CaDigestType type;
+                uint64_t flags;
 
-        if (s->cache_store) {
-                r = ca_store_put(s->cache_store, &id, CA_CHUNK_UNCOMPRESSED, p, l);
-                if (r < 0 && r != -EEXIST)
-                        return r;
-        }
+                if (s->direction == CA_SYNC_ENCODE)
+                        flags = s->feature_flags;
+                else {
+                        r = ca_index_get_feature_flags(s->index, &flags);
+                        if (r < 0)
+                                return r;
+                }
 
-        if (s->index) {
-                r = ca_index_write_chunk(s->index, &id, l);
+                type = ca_feature_flags_to_digest_type(flags);
+                if (type < 0)
+                        return -EINVAL;
+
+                r = ca_digest_new(type, &s->zero_chunk_digest);
                 if (r < 0)
                         return r;
         }
 
-        if (s->cache) {
-                log_debug("Adding cache entry %s.", ca_location_format(ca_origin_get(origin, 0)));
+        p = ca_sync_zeros(s, size);
+        if (!p)
+                return -ENOMEM;
 
-                r = ca_cache_put(s->cache, origin, &id);
-                if (r < 0)
-                        return r;
-                if (r > 0)
-                        s->n_cache_added++;
+        /* Once all entries are taken, replace them in turn */
+        if (s->n_zero_chunks < SYNC_ZERO_CHUNKS_MAX)
+                z = s->zero_chunks + s->n_zero_chunks++;
+        else {
+                z = s->zero_chunks + s->zero_chunks_next;
+                s->zero_chunks_next = (s->zero_chunks_next + 1) % SYNC_ZERO_CHUNKS_MAX;
         }
 
-        if (ca_sync_use_cache(s))
-                s->cache_state = CA_SYNC_CACHE_CHECK;
+        z->size = 0;
+        z->stored = false;
+
+        r = ca_chunk_id_make(s->zero_chunk_digest, p, size, &z->id);
+        if (r < 0)
+                return r;
+
+        z->size = size;
 
+        *ret = z;
         return 0;
 }
 
-static int ca_sync_write_chunks(CaSync *s, const void *p, size_t l, CaLocation *location) {
+static int ca_sync_is_zero_chunk(CaSync *s, const CaChunkID *id, uint64_t size) {
+        CaSyncZeroChunk *z;
+        size_t cmin, cmax;
         int r;
 
         assert(s);
-        assert(p || l == 0);
+        assert(id);
 
-        /* Splits up the data that was just generated into chunks, and calls ca_sync_write_one_chunk() for it */
+        /* The chunker's hash over a run of zeros is constant, hence such runs are cut into chunks of either the
+         * minimum or the maximum chunk size. Only chunks of those sizes are hence compared with the all-zero chunk
+         * of the same size, so that we don't have to hash zeros for every chunk size we come across. */
 
-        if (!s->wstore && !s->cache_store && !s->index)
+        if (!s->index)
+                return 0;
+        if (size == 0 || size == UINT64_MAX)
                 return 0;
 
-        if (location) {
-                if (!s->buffer_origin) {
-                        r = ca_origin_new(&s->buffer_origin);
-                        if (r < 0)
-                                return r;
-                }
+        r = ca_index_get_chunk_size_min(s->index, &cmin);
+        if (r == -ENODATA)
+                return 0;
+        if (r < 0)
+                return r;
 
-                r = ca_origin_put(s->buffer_origin, location);
-                if (r < 0)
-                        return r;
-        }
+        r = ca_index_get_chunk_size_max(s->index, &cmax);
+        if (r == -ENODATA)
+                return 0;
+        if (r < 0)
+                return r;
 
-        while (l > 0) {
-                _cleanup_(ca_origin_unrefp) CaOrigin *chunk_origin = NULL;
-                const void *chunk;
-                size_t chunk_size, k;
+        if (size != cmin && size != cmax)
+                return 0;
 
-                k = ca_chunker_scan(&s->chunker, p, l);
-                if (k == (size_t) -1) {
-                        if (!realloc_buffer_append(&s->buffer, p, l))
-                                return -ENOMEM;
-                        return 0;
-                }
+        r = ca_sync_get_zero_chunk(s, size, &z);
+        if (r < 0)
+                return r;
 
-                if (realloc_buffer_size(&s->buffer) == 0) {
-                        chunk = p;
-                        chunk_size = k;
-                } else {
-                        if (!realloc_buffer_append(&s->buffer, p, k))
-                                return -ENOMEM;
+        return ca_chunk_id_equal(id, &z->id);
+}
 
-                        chunk = realloc_buffer_data(&s->buffer);
-                        chunk_size = realloc_buffer_size(&s->buffer);
-                }
+static int ca_sync_put_chunk(CaSync *s, const CaChunkID *id, const void *p, size_t l, bool *ret_reused) {
+        bool reused = false;
+        int r;
 
-                if (s->buffer_origin) {
-                        if (chunk_size == ca_origin_bytes(s->buffer_origin)) {
-                                chunk_origin = s->buffer_origin;
-                                s->buffer_origin = NULL;
-                        } else {
-                                r = ca_origin_extract_bytes(s->buffer_origin, chunk_size, &chunk_origin);
-                                if (r < 0)
-                                        return r;
+        assert(s);
+        assert(id);
+        assert(p || l == 0);
+        assert(ret_reused);
 
-                                r = ca_origin_advance_bytes(s->buffer_origin, chunk_size);
-                                if (r < 0)
-                                        return r;
-                        }
-                }
+        /* Writes a chunk to our wstore and our cache store. Note that this is called from the worker threads when
+         * encoding in parallel, hence don't touch anything in the CaSync object here that isn't constant while
+         * encoding. */
 
-                r = ca_sync_write_one_chunk(s, chunk, chunk_size, chunk_origin);
-                if (r < 0)
+        if (s->wstore) {
+                r = ca_store_put(s->wstore, id, CA_CHUNK_UNCOMPRESSED, p, l);
+                if (r == -EEXIST)
+                        reused = true;
+                else if (r < 0)
                         return r;
+        }
 
-                realloc_buffer_empty(&s->buffer);
-
-                p = (const uint8_t*) p + k;
-                l -= k;
+        if (s->cache_store) {
+                r = ca_store_put(s->cache_store, id, CA_CHUNK_UNCOMPRESSED, p, l);
+                if (r < 0 && r != -EEXIST)
+                        return r;
         }
 
+        *ret_reused = reused;
         return 0;
 }
 
-static int ca_sync_write_final_chunk(CaSync *s) {
+static int ca_sync_index_chunk(CaSync *s, const CaChunkID *id, uint64_t l, CaOrigin *origin, bool reused) {
         int r;
 
         assert(s);
+        assert(id);
 
-        if (!s->wstore && !s->cache_store && !s->index)
-                return 0;
+        /* Writes a record about a chunk we just stored into the index and the cache. This needs to be called in
+         * order of the chunks. */
 
-        if (realloc_buffer_size(&s->buffer) > 0) {
-                r = ca_sync_write_one_chunk(s, realloc_buffer_data(&s->buffer), realloc_buffer_size(&s->buffer), s->buffer_origin);
-                if (r < 0)
-                        return r;
-        }
+        s->n_written_chunks++;
+
+        if (reused)
+                s->n_reused_chunks++;
 
         if (s->index) {
-                r = ca_index_write_eof(s->index);
+                r = ca_index_write_chunk(s->index, id, l);
                 if (r < 0)
                         return r;
+        }
 
-                r = ca_index_install(s->index);
+        if (s->cache) {
+                log_debug("Adding cache entry %s.", ca_location_format(ca_origin_get(origin, 0)));
+
+                r = ca_cache_put(s->cache, origin, id);
                 if (r < 0)
                         return r;
+                if (r > 0)
+                        s->n_cache_added++;
         }
 
         return 0;
 }
 
-static int ca_sync_write_one_cached_chunk(CaSync *s, const CaChunkID *id, uint64_t size, CaLocation *location) {
+static int ca_sync_index_cached_chunk(CaSync *s, const CaChunkID *id, uint64_t size) {
         int r;
 
         assert(s);
         assert(id);
 
-        /* Much like ca_sync_write_one_chunk(), but is called when we are using the cache and had a cache hit */
-
         s->n_written_chunks ++;
 
         if (s->index) {
@@ -1831,171 +2190,703 @@ static int ca_sync_write_one_cached_chunk(CaSync *s, const CaChunkID *id, uint64
         return 0;
 }
 
-static int ca_sync_install_archive(CaSync *s) {
+static int ca_sync_chunk_job_run(void *p, void *userdata) {
+        CaSyncChunkJob *job = p;
+        CaSync *s = userdata;
+        const void **data;
+        CaChunkID *ids;
+        size_t *sizes, i, n = 0;
+        int r;
+
+        assert(job);
         assert(s);
 
-        if (!s->temporary_archive_path)
-                return 0;
+        /* Hashes all chunks of the batch whose ID isn't known yet at once, and then stores them */
 
-        if (!s->archive_path)
-                return 0;
+        data = newa(const void*, job->n_chunks);
+        sizes = newa(size_t, job->n_chunks);
+        ids = newa(CaChunkID, job->n_chunks);
 
-        if (rename(s->temporary_archive_path, s->archive_path) < 0)
-                return -errno;
+        for (i = 0; i < job->n_chunks; i++) {
+                CaSyncChunk *c = job->chunks + i;
+
+                if (c->cached || c->zero)
+                        continue;
+
+                data[n] = realloc_buffer_data(&c->buffer);
+                sizes[n] = c->size;
+                n++;
+        }
+
+        if (n > 0) {
+                if (!job->digest) {
+                        r = ca_digest_new(ca_feature_flags_to_digest_type(s->feature_flags), &job->digest);
+                        if (r < 0)
+                                return r;
+                }
+
+                r = ca_chunk_id_make_batch(job->digest, data, sizes, n, ids);
+                if (r < 0)
+                        return r;
+        }
+
+        for (i = 0, n = 0; i < job->n_chunks; i++) {
+                CaSyncChunk *c = job->chunks + i;
+                bool reused;
+
+                if (c->cached)
+                        continue;
+                if (!c->zero)
+                        c->id = ids[n++];
+                else if (c->reused) /* Put into the stores by an earlier job already */
+                        continue;
+
+                r = ca_sync_put_chunk(s, &c->id, realloc_buffer_data(&c->buffer), c->size, &reused);
+                if (r < 0)
+                        return r;
+
+                c->reused = reused;
+        }
 
-        s->temporary_archive_path = mfree(s->temporary_archive_path);
         return 0;
 }
 
-static int ca_sync_write_remote_archive_eof(CaSync *s) {
-        assert(s);
+static void ca_sync_chunk_job_free(void *p) {
+        CaSyncChunkJob *job = p;
+        size_t i;
 
-        if (!s->remote_archive)
-                return 0;
+        for (i = 0; i < job->n_allocated; i++) {
+                realloc_buffer_free(&job->chunks[i].buffer);
+                ca_origin_unref(job->chunks[i].origin);
+        }
 
-        return ca_remote_put_archive_eof(s->remote_archive);
+        free(job->chunks);
+        ca_digest_free(job->digest);
 }
 
-static int ca_sync_cache_get(CaSync *s, CaLocation *location) {
+static int ca_sync_setup_chunk_queue(CaSync *s) {
+        size_t n_threads, batch_size;
         int r;
 
         assert(s);
-        assert(location);
 
-        assert(s->cache);
-        assert(!s->current_cache_start_location);
-        assert(!s->current_cache_origin);
-
-        r = ca_cache_get(s->cache, location, &s->current_cache_chunk_id, &s->current_cache_origin);
-        if (r == -ENOENT) { /* No luck, no cached entry about this, let's generate new data then */
-                log_debug("Cache miss at %s.", ca_location_format(location));
-                s->n_cache_misses++;
-                return r;
-        }
-        if (r < 0)
-                return log_debug_errno(r, "Failed to acquire item from cache: %m");
+        /* Returns > 0 if chunks shall be processed in batches on the queue, 0 if they shall be processed right
+         * away */
 
-        log_debug("Yay, cache hit at %s.", ca_location_format(location));
+        if (s->chunk_queue)
+                return 1;
 
-        s->current_cache_start_location = ca_location_ref(location);
-        s->current_cache_chunk_size = ca_origin_bytes(s->current_cache_origin);
+        /* Without threads there's only a point in collecting chunks first if we can hash them faster that way */
+        n_threads = s->n_threads > 1 ? s->n_threads : 0;
+        batch_size = ca_digest_type_batch_size(ca_feature_flags_to_digest_type(s->feature_flags));
+        if (n_threads == 0 && batch_size <= 1)
+                return 0;
 
-        return r;
-}
+        /* Make sure the stores are fully set up before the workers start writing to them concurrently */
+        if (s->wstore) {
+                r = ca_store_prepare(s->wstore);
+                if (r < 0)
+                        return r;
+        }
 
-static int ca_sync_need_data(CaSync *s) {
-        assert(s);
+        if (s->cache_store) {
+                r = ca_store_prepare(s->cache_store);
+                if (r < 0)
+                        return r;
+        }
 
-        /* Returns true if we actually need to generate any data, i.e. when we are supposed to write an index or
-         * archive, or a store to write to is configured, or at least one form of digest is turned on. It neither is
-         * the case (because we just want to list files/directories) then we can avoid generating data and speed things
-         * up */
+        /* Allow a couple of chunks per thread to be in flight, so that the workers don't run dry while we
+         * retire chunks in order. Batches are large enough on their own to keep a worker busy for a while. */
+        r = ca_job_queue_new(n_threads, MAX(n_threads, (size_t) 1) * (batch_size > 1 ? 2 : 4), sizeof(CaSyncChunkJob),
+                             ca_sync_chunk_job_run, ca_sync_chunk_job_free, s, &s->chunk_queue);
+        if (r < 0)
+                return r;
 
-        return s->index || s->remote_index ||
-                s->archive_fd >= 0 || s->remote_archive ||
-                s->wstore || s->cache_store ||
-                s->archive_digest || s->hardlink_digest || s->payload_digest;
+        s->chunk_batch_size = batch_size;
+        return 1;
 }
 
-static int ca_sync_step_encode(CaSync *s) {
-        int r, step;
-        bool next_step;
+static int ca_sync_retire_one_chunk_job(CaSync *s, bool wait) {
+        CaSyncChunkJob *job;
+        int r, result;
+        size_t i;
 
         assert(s);
 
-        if (s->archive_eof)
-                return CA_SYNC_POLL;
+        r = ca_job_queue_peek(s->chunk_queue, wait, (void**) &job, &result);
+        if (IN_SET(r, -EAGAIN, -ENODATA))
+                return 0;
+        if (r < 0)
+                return r;
+        if (result < 0)
+                return result;
 
-        if (!s->encoder)
-                return CA_SYNC_POLL;
+        for (i = 0; i < job->n_chunks; i++) {
+                CaSyncChunk *c = job->chunks + i;
+
+                if (c->cached)
+                        r = ca_sync_index_cached_chunk(s, &c->id, c->size);
+                else
+                        r = ca_sync_index_chunk(s, &c->id, c->size, c->origin, c->reused);
+
+                c->origin = ca_origin_unref(c->origin);
 
-        if (s->remote_archive) {
-                /* If we shall store the result remotely, wait until the remote side accepts more data */
-                r = ca_remote_can_put_archive(s->remote_archive);
                 if (r < 0)
                         return r;
-                if (r == 0)
-                        return CA_SYNC_POLL;
         }
 
-        switch (s->cache_state) {
+        r = ca_job_queue_retire(s->chunk_queue);
+        if (r < 0)
+                return r;
 
-        case CA_SYNC_CACHE_OFF:
-        case CA_SYNC_CACHE_IDLE:
-                next_step = true;
-                break;
+        return 1;
+}
 
-        case CA_SYNC_CACHE_CHECK: {
-                CaLocation *location;
+static int ca_sync_submit_chunk_job(CaSync *s, bool flush) {
+        int r;
 
-                assert(!s->current_cache_start_location);
-                assert(!s->current_cache_origin);
+        assert(s);
 
-                /* Let's see if there's already data in the buffer. If so, let's see if we have a cached entry for
-                 * it. */
-                if (realloc_buffer_size(&s->buffer) == 0) {
-                        /* Nope, nothing new. Let's generate some new data then */
-                        next_step = true;
-                        break;
-                }
+        /* Queues the batch we are filling once it is full, or right away if 'flush' is true */
 
-                assert_se(location = ca_origin_get(s->buffer_origin, 0));
+        if (!s->chunk_job)
+                return 0;
+        if (!flush && s->chunk_job->n_chunks < s->chunk_batch_size)
+                return 0;
 
-                /* A previous iteration already read stuff into the buffer, however it wasn't enough for a whole
-                 * chunk. Let's see if instead of generating further data the cache can help us. */
+        s->chunk_job = NULL;
 
-                r = ca_sync_cache_get(s, location);
-                if (r == -ENOENT) { /* No luck */
-                        s->cache_state = CA_SYNC_CACHE_IDLE;
-                        next_step = true;
-                        break;
-                }
-                if (r < 0)
-                        return r;
+        r = ca_job_queue_submit(s->chunk_queue);
+        if (r < 0)
+                return r;
 
-                /* Yippieh! */
-                s->cache_state = CA_SYNC_CACHE_VERIFY;
-                return CA_SYNC_STEP;
-        }
+        return 0;
+}
 
-        case CA_SYNC_CACHE_VERIFY: {
-                CaLocation *a, *b;
+static int ca_sync_retire_chunk_jobs(CaSync *s, bool flush) {
+        int r;
 
-                assert(s->current_cache_start_location);
-                assert(s->current_cache_origin);
+        assert(s);
 
-                if (ca_origin_bytes(s->current_cache_origin) == 0) {
-                        /* Nice! All checked out! */
-                        log_debug("Cached block checked out (on buffer).");
-                        s->cache_state = CA_SYNC_CACHE_SUCCEEDED;
-                        return CA_SYNC_STEP;
-                }
+        /* Writes all chunks to the index whose processing completed, in order. If 'flush' is true waits for all
+         * queued chunks to complete, including the ones of a batch that isn't full yet. */
 
-                /* Let's see if there's data in the buffer we need to verify first. */
-                if (realloc_buffer_size(&s->buffer) == 0) {
-                        /* Nope there is not, let's generate some new data then */
-                        next_step = true;
-                        break;
-                }
+        if (!s->chunk_queue)
+                return 0;
 
-                assert_se(a = ca_origin_get(s->current_cache_origin, 0));
-                assert_se(b = ca_origin_get(s->buffer_origin, 0));
+        r = ca_sync_submit_chunk_job(s, flush);
+        if (r < 0)
+                return r;
 
-                if (ca_location_equal(a, b, CA_LOCATION_WITH_MTIME|CA_LOCATION_WITH_FEATURE_FLAGS)) {
-                        uint64_t sz;
+        do {
+                r = ca_sync_retire_one_chunk_job(s, flush);
+                if (r < 0)
+                        return r;
+        } while (r > 0);
 
-                        /* Yay, this location checked out. Let's advance both our buffer (and its origin), and the
-                         * cache origin. */
+        return 0;
+}
 
-                        assert_se(a->size != UINT64_MAX);
-                        assert_se(a->size != 0);
+static int ca_sync_acquire_chunk(CaSync *s, CaSyncChunk **ret) {
+        CaSyncChunkJob *job;
+        CaSyncChunk *c;
+        int r;
 
-                        assert_se(b->size != UINT64_MAX);
-                        assert_se(b->size != 0);
+        assert(s);
+        assert(s->chunk_queue);
+        assert(ret);
 
-                        sz = MIN(a->size, b->size);
+        /* Returns the next chunk of the batch we are filling, and starts a new batch if needed */
 
-                        r = ca_origin_advance_bytes(s->current_cache_origin, sz);
+        if (!s->chunk_job) {
+                for (;;) {
+                        job = ca_job_queue_acquire(s->chunk_queue);
+                        if (job)
+                                break;
+
+                        /* All slots are taken, wait until the oldest batch is done */
+                        r = ca_sync_retire_one_chunk_job(s, true);
+                        if (r < 0)
+                                return r;
+                }
+
+                if (!job->chunks) {
+                        job->chunks = new0(CaSyncChunk, s->chunk_batch_size);
+                        if (!job->chunks)
+                                return -ENOMEM;
+
+                        job->n_allocated = s->chunk_batch_size;
+                }
+
+                job->n_chunks = 0;
+                s->chunk_job = job;
+        }
+
+        job = s->chunk_job;
+        assert(job->n_chunks < job->n_allocated);
+
+        c = job->chunks + job->n_chunks++;
+        c->cached = false;
+        c->zero = false;
+        c->reused = false;
+
+        *ret = c;
+        return 0;
+}
+
+static int ca_sync_write_one_chunk(CaSync *s, const void *p, size_t l, bool zero, CaOrigin *origin) {
+        CaSyncZeroChunk *z = NULL;
+        CaChunkID id;
+        bool reused;
+        int r;
+
+        assert(s);
+        assert(p || l == 0);
+        assert(!origin || ca_origin_bytes(origin) == l);
+        assert(!zero || l > 0);
+
+        /* Processes a single chunk we just generated. Writes it to our wstore, our cache store, and our cache. Also
+         * writes a record about it into the index. Note that if we hit the cache ca_sync_write_one_cached_chunk() is
+         * called instead. When chunks are processed in batches, the chunk is copied and queued, and the index and
+         * the cache are updated as soon as its batch was processed. */
+
+        /* Zeros are common in disk images, recognize them even where the encoder couldn't tell us */
+        if (!zero && l > 0)
+                zero = memeqzero(p, l);
+        if (zero) {
+                r = ca_sync_get_zero_chunk(s, l, &z);
+                if (r < 0)
+                        return r;
+        }
+
+        r = ca_sync_setup_chunk_queue(s);
+        if (r < 0)
+                return r;
+        if (r > 0) {
+                CaSyncChunk *c;
+
+                r = ca_sync_acquire_chunk(s, &c);
+                if (r < 0)
+                        return r;
+
+                c->size = l;
+
+                if (z) {
+                        c->id = z->id;
+                        c->zero = true;
+
+                        /* Only the first instance needs to be stored, the others are in the stores by then */
+                        c->reused = z->stored;
+                        z->stored = true;
+                }
+
+                realloc_buffer_empty(&c->buffer);
+                if (!c->reused && !realloc_buffer_append(&c->buffer, p, l))
+                        return -ENOMEM;
+
+                /* The origin is only needed for the cache, and is owned by the caller, hence copy it */
+                if (s->cache && origin) {
+                        r = ca_origin_extract_bytes(origin, l, &c->origin);
+                        if (r < 0)
+                                return r;
+                }
+
+                r = ca_sync_submit_chunk_job(s, false);
+                if (r < 0)
+                        return r;
+
+                r = ca_sync_retire_chunk_jobs(s, false);
+                if (r < 0)
+                        return r;
+        } else {
+                if (z && z->stored) {
+                        id = z->id;
+                        reused = true;
+                } else {
+                        if (z)
+                                id = z->id;
+                        else {
+                                r = ca_sync_make_chunk_id(s, p, l, &id);
+                                if (r < 0)
+                                        return r;
+                        }
+
+                        r = ca_sync_put_chunk(s, &id, p, l, &reused);
+                        if (r < 0)
+                                return r;
+
+                        if (z)
+                                z->stored = true;
+                }
+
+                r = ca_sync_index_chunk(s, &id, l, origin, reused);
+                if (r < 0)
+                        return r;
+        }
+
+        if (ca_sync_use_cache(s))
+                s->cache_state = CA_SYNC_CACHE_CHECK;
+
+        return 0;
+}
+
+static int ca_sync_chunker_scan(CaSync *s, const void *p, size_t l, size_t *ret) {
+        assert(s);
+        assert(ret);
+
+        if (s->parallel_chunker)
+                return ca_parallel_chunker_scan(s->parallel_chunker, p, l, ret);
+
+        *ret = ca_chunker_scan(&s->chunker, p, l);
+        return 0;
+}
+
+static int ca_sync_write_chunks(CaSync *s, const void *p, size_t l, bool zero, CaLocation *location) {
+        int r;
+
+        assert(s);
+        assert(p || l == 0);
+
+        /* Splits up the data that was just generated into chunks, and calls ca_sync_write_one_chunk() for it. If
+         * 'zero' is true the data is known to be all zeros. */
+
+        if (!s->wstore && !s->cache_store && !s->index)
+                return 0;
+
+        if (location) {
+                if (!s->buffer_origin) {
+                        r = ca_origin_new(&s->buffer_origin);
+                        if (r < 0)
+                                return r;
+                }
+
+                r = ca_origin_put(s->buffer_origin, location);
+                if (r < 0)
+                        return r;
+        }
+
+        while (l > 0) {
+                _cleanup_(ca_origin_unrefp) CaOrigin *chunk_origin = NULL;
+                const void *chunk;
+                size_t chunk_size, k;
+                bool chunk_zero = false;
+
+                r = ca_sync_chunker_scan(s, p, l, &k);
+                if (r < 0)
+                        return r;
+                if (k == (size_t) -1) {
+                        if (!realloc_buffer_append(&s->buffer, p, l))
+                                return -ENOMEM;
+                        return 0;
+                }
+
+                /* A chunk that started in earlier data might contain more than zeros */
+                if (realloc_buffer_size(&s->buffer) == 0) {
+                        chunk = p;
+                        chunk_size = k;
+                        chunk_zero = zero;
+                } else {
+                        if (!realloc_buffer_append(&s->buffer, p, k))
+                                return -ENOMEM;
+
+                        chunk = realloc_buffer_data(&s->buffer);
+                        chunk_size = realloc_buffer_size(&s->buffer);
+                }
+
+                if (s->buffer_origin) {
+                        if (chunk_size == ca_origin_bytes(s->buffer_origin)) {
+                                chunk_origin = s->buffer_origin;
+                                s->buffer_origin = NULL;
+                        } else {
+                                r = ca_origin_extract_bytes(s->buffer_origin, chunk_size, &chunk_origin);
+                                if (r < 0)
+                                        return r;
+
+                                r = ca_origin_advance_bytes(s->buffer_origin, chunk_size);
+                                if (r < 0)
+                                        return r;
+                        }
+                }
+
+                r = ca_sync_write_one_chunk(s, chunk, chunk_size, chunk_zero, chunk_origin);
+                if (r < 0)
+                        return r;
+
+                realloc_buffer_empty(&s->buffer);
+
+                p = (const uint8_t*) p + k;
+                l -= k;
+        }
+
+        return 0;
+}
+
+static int ca_sync_write_final_chunk(CaSync *s) {
+        int r;
+
+        assert(s);
+
+        if (!s->wstore && !s->cache_store && !s->index)
+                return 0;
+
+        if (realloc_buffer_size(&s->buffer) > 0) {
+                r = ca_sync_write_one_chunk(s, realloc_buffer_data(&s->buffer), realloc_buffer_size(&s->buffer), false, s->buffer_origin);
+                if (r < 0)
+                        return r;
+        }
+
+        r = ca_sync_retire_chunk_jobs(s, true);
+        if (r < 0)
+                return r;
+
+        /* Make sure all chunks are visible in the store before the index referencing them is */
+        if (s->wstore) {
+                r = ca_store_flush(s->wstore);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->index) {
+                r = ca_index_write_eof(s->index);
+                if (r < 0)
+                        return r;
+
+                r = ca_index_install(s->index);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int ca_sync_write_one_cached_chunk(CaSync *s, const CaChunkID *id, uint64_t size, CaLocation *location) {
+        int r;
+
+        assert(s);
+        assert(id);
+
+        /* Much like ca_sync_write_one_chunk(), but is called when we are using the cache and had a cache hit */
+
+        if (s->chunk_queue) {
+                CaSyncChunk *c;
+
+                /* Chunks might still be in flight, hence queue this one too, to keep the index in order */
+
+                r = ca_sync_acquire_chunk(s, &c);
+                if (r < 0)
+                        return r;
+
+                c->cached = true;
+                c->id = *id;
+                c->size = size;
+
+                r = ca_sync_submit_chunk_job(s, false);
+                if (r < 0)
+                        return r;
+
+                return ca_sync_retire_chunk_jobs(s, false);
+        }
+
+        return ca_sync_index_cached_chunk(s, id, size);
+}
+
+static int ca_sync_install_archive(CaSync *s) {
+        assert(s);
+
+        if (!s->temporary_archive_path)
+                return 0;
+
+        if (!s->archive_path)
+                return 0;
+
+        if (rename(s->temporary_archive_path, s->archive_path) < 0)
+                return -errno;
+
+        s->temporary_archive_path = mfree(s->temporary_archive_path);
+        return 0;
+}
+
+static int ca_sync_write_remote_archive_eof(CaSync *s) {
+        assert(s);
+
+        if (!s->remote_archive)
+                return 0;
+
+        return ca_remote_put_archive_eof(s->remote_archive);
+}
+
+static int ca_sync_cache_get(CaSync *s, CaLocation *location) {
+        int r;
+
+        assert(s);
+        assert(location);
+
+        assert(s->cache);
+        assert(!s->current_cache_start_location);
+        assert(!s->current_cache_origin);
+
+        r = ca_cache_get(s->cache, location, &s->current_cache_chunk_id, &s->current_cache_origin);
+        if (r == -ENOENT) { /* No luck, no cached entry about this, let's generate new data then */
+                log_debug("Cache miss at %s.", ca_location_format(location));
+                s->n_cache_misses++;
+                return r;
+        }
+        if (r < 0)
+                return log_debug_errno(r, "Failed to acquire item from cache: %m");
+
+        log_debug("Yay, cache hit at %s.", ca_location_format(location));
+
+        s->current_cache_start_location = ca_location_ref(location);
+        s->current_cache_chunk_size = ca_origin_bytes(s->current_cache_origin);
+
+        return r;
+}
+
+static int ca_sync_cache_skip_entry(CaSync *s, CaLocation *cached_location, size_t *ret_size) {
+        int r;
+
+        assert(s);
+        assert(cached_location);
+        assert(ret_size);
+
+        /* The encoder's location just matched the cached one, including inode, generation and MAX(mtime, ctime). Any
+         * change to a node's metadata bumps its ctime, hence if the cache recorded its complete ENTRY record there's
+         * no need to read all the metadata again just to regenerate the same record: let the encoder skip it. The
+         * record is complete only if it isn't the last item of the cached origin, as a chunk boundary might have cut
+         * the last one short. Returns > 0 if the record was skipped, 0 if it needs to be generated after all. */
+
+        if (cached_location->designator != CA_LOCATION_ENTRY)
+                return 0;
+        if (cached_location->offset != 0)
+                return 0;
+        if (ca_origin_items(s->current_cache_origin) <= 1)
+                return 0;
+        if (cached_location->size > SIZE_MAX)
+                return 0;
+
+        r = ca_encoder_skip_entry(s->encoder, cached_location->size);
+        if (r == -EBUSY)
+                return 0;
+        if (r < 0)
+                return log_debug_errno(r, "Failed to skip entry record: %m");
+
+        *ret_size = cached_location->size;
+        return 1;
+}
+
+static int ca_sync_need_data(CaSync *s) {
+        assert(s);
+
+        /* Returns true if we actually need to generate any data, i.e. when we are supposed to write an index or
+         * archive, or a store to write to is configured, or at least one form of digest is turned on. It neither is
+         * the case (because we just want to list files/directories) then we can avoid generating data and speed things
+         * up */
+
+        return s->index || s->remote_index ||
+                s->archive_fd >= 0 || s->remote_archive ||
+                s->wstore || s->cache_store ||
+                s->archive_digest || s->hardlink_digest || s->payload_digest;
+}
+
+static int ca_sync_step_encode(CaSync *s) {
+        int r, step;
+        bool next_step;
+
+        assert(s);
+
+        if (s->archive_eof)
+                return CA_SYNC_POLL;
+
+        if (!s->encoder)
+                return CA_SYNC_POLL;
+
+        if (s->remote_archive) {
+                /* If we shall store the result remotely, wait until the remote side accepts more data */
+                r = ca_remote_can_put_archive(s->remote_archive);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        return CA_SYNC_POLL;
+        }
+
+        switch (s->cache_state) {
+
+        case CA_SYNC_CACHE_OFF:
+        case CA_SYNC_CACHE_IDLE:
+                next_step = true;
+                break;
+
+        case CA_SYNC_CACHE_CHECK: {
+                CaLocation *location;
+
+                assert(!s->current_cache_start_location);
+                assert(!s->current_cache_origin);
+
+                /* Let's see if there's already data in the buffer. If so, let's see if we have a cached entry for
+                 * it. */
+                if (realloc_buffer_size(&s->buffer) == 0) {
+                        /* Nope, nothing new. Let's generate some new data then */
+                        next_step = true;
+                        break;
+                }
+
+                assert_se(location = ca_origin_get(s->buffer_origin, 0));
+
+                /* A previous iteration already read stuff into the buffer, however it wasn't enough for a whole
+                 * chunk. Let's see if instead of generating further data the cache can help us. */
+
+                r = ca_sync_cache_get(s, location);
+                if (r == -ENOENT) { /* No luck */
+                        s->cache_state = CA_SYNC_CACHE_IDLE;
+                        next_step = true;
+                        break;
+                }
+                if (r < 0)
+                        return r;
+
+                /* Yippieh! */
+                s->cache_state = CA_SYNC_CACHE_VERIFY;
+                return CA_SYNC_STEP;
+        }
+
+        case CA_SYNC_CACHE_VERIFY: {
+                CaLocation *a, *b;
+
+                assert(s->current_cache_start_location);
+                assert(s->current_cache_origin);
+
+                if (ca_origin_bytes(s->current_cache_origin) == 0) {
+                        /* Nice! All checked out! */
+                        log_debug("Cached block checked out (on buffer).");
+                        s->cache_state = CA_SYNC_CACHE_SUCCEEDED;
+                        return CA_SYNC_STEP;
+                }
+
+                /* Let's see if there's data in the buffer we need to verify first. */
+                if (realloc_buffer_size(&s->buffer) == 0) {
+                        /* Nope there is not, let's generate some new data then */
+                        next_step = true;
+                        break;
+                }
+
+                assert_se(a = ca_origin_get(s->current_cache_origin, 0));
+                assert_se(b = ca_origin_get(s->buffer_origin, 0));
+
+                if (ca_location_equal(a, b, CA_LOCATION_WITH_MTIME|CA_LOCATION_WITH_FEATURE_FLAGS)) {
+                        uint64_t sz;
+
+                        /* Yay, this location checked out. Let's advance both our buffer (and its origin), and the
+                         * cache origin. */
+
+                        assert_se(a->size != UINT64_MAX);
+                        assert_se(a->size != 0);
+
+                        assert_se(b->size != UINT64_MAX);
+                        assert_se(b->size != 0);
+
+                        sz = MIN(a->size, b->size);
+
+                        r = ca_origin_advance_bytes(s->current_cache_origin, sz);
                         if (r < 0)
                                 return r;
 
@@ -2003,342 +2894,815 @@ static int ca_sync_step_encode(CaSync *s) {
                         if (r < 0)
                                 return r;
 
-                        r = realloc_buffer_advance(&s->buffer, sz);
+                        r = realloc_buffer_advance(&s->buffer, sz);
+                        if (r < 0)
+                                return r;
+
+                        return CA_SYNC_STEP;
+                }
+
+                /* Ah, dang, this didn't check out. Let's revert back. */
+                log_debug("Cache item out of date, location didn't match (on buffer).");
+                s->cache_state = CA_SYNC_CACHE_FAILED;
+                return CA_SYNC_STEP;
+        }
+
+        case CA_SYNC_CACHE_SUCCEEDED:
+                assert(s->current_cache_start_location);
+                assert(s->current_cache_origin);
+
+                /* In the previous iteration we tried to use the cache, and it did work out. Yay! Let's now
+                 * write the cached item, and seek where we are supposed to continue */
+
+                log_debug("Succeeded with cached block!");
+
+                r = ca_sync_write_one_cached_chunk(s, &s->current_cache_chunk_id, s->current_cache_chunk_size, s->current_cache_start_location);
+                if (r < 0)
+                        return log_debug_errno(r, "Failed to write cached item to index: %m");
+
+                s->n_cache_hits++;
+
+                /* Reset the cached item we are operating on */
+                ca_sync_reset_cache_data(s);
+                s->cache_state = CA_SYNC_CACHE_CHECK;
+
+                return CA_SYNC_STEP;
+
+        case CA_SYNC_CACHE_FAILED:
+                assert(s->current_cache_start_location);
+                assert(s->current_cache_origin);
+
+                /* In the previous iteration we tried to use the cache, but this didn't work out, the stuff on disk
+                 * didn't match our cache anymore. In this iteration we'll hence seek back to where our cache adventure
+                 * started, and read off disk again. But we'll remove the bogus cache entry first, so that this doesn't
+                 * happen again, ever. */
+
+                log_debug("Cached block didn't check out, seeking back to %s.", ca_location_format(s->current_cache_start_location));
+
+                r = ca_cache_remove(s->cache, s->current_cache_start_location);
+                if (r < 0 && r != -ENOENT)
+                        return log_debug_errno(r, "Failed to remove cache item: %m");
+
+                s->n_cache_invalidated++;
+
+                step = ca_encoder_seek_location(s->encoder, s->current_cache_start_location);
+                if (step < 0)
+                        return log_debug_errno(step, "Failed to seek encoder: %m");
+
+                /* Reset the cached item we are operating on */
+                ca_sync_reset_cache_data(s);
+                s->cache_state = CA_SYNC_CACHE_IDLE;
+
+                /* Clear whatever is currently in the buffer */
+                realloc_buffer_empty(&s->buffer);
+                s->buffer_origin = ca_origin_unref(s->buffer_origin);
+
+                s->chunker = s->original_chunker;
+
+                next_step = false;
+                break;
+        }
+
+        if (next_step) {
+                step = ca_encoder_step(s->encoder);
+                if (step < 0)
+                        return log_debug_errno(step, "Failed to run encoder step: %m");
+        }
+
+        switch (step) {
+
+        case CA_ENCODER_FINISHED:
+
+                if (s->cache_state == CA_SYNC_CACHE_VERIFY) {
+                        /* What? There's still a cache item pending that didn't finish yet? If so, it's invalid. Let's
+                         * treat it as miss */
+
+                        log_debug("Cache item out of date, reached EOF too early.");
+                        s->cache_state = CA_SYNC_CACHE_FAILED;
+                        return CA_SYNC_STEP;
+                }
+
+                assert(IN_SET(s->cache_state, CA_SYNC_CACHE_OFF, CA_SYNC_CACHE_CHECK, CA_SYNC_CACHE_IDLE));
+
+                r = ca_sync_write_final_chunk(s);
+                if (r < 0)
+                        return r;
+
+                r = ca_sync_install_archive(s);
+                if (r < 0)
+                        return r;
+
+                r = ca_sync_write_remote_archive_eof(s);
+                if (r < 0)
+                        return r;
+
+                s->archive_eof = true;
+
+                /* If we install an index or archive remotely, let's decide the peer when it's done */
+                if (s->remote_index || s->remote_archive)
+                        return CA_SYNC_STEP;
+
+                return CA_SYNC_FINISHED;
+
+        case CA_ENCODER_NEXT_FILE:
+        case CA_ENCODER_PAYLOAD:
+        case CA_ENCODER_DATA: {
+                _cleanup_(ca_location_unrefp) CaLocation *location = NULL;
+                size_t l, extra_offset = 0;
+                const void *p = NULL;
+
+                switch (s->cache_state) {
+
+                case CA_SYNC_CACHE_OFF:
+                case CA_SYNC_CACHE_IDLE:
+                        break;
+
+                case CA_SYNC_CACHE_CHECK: {
+                        /* Let's check if the cache provides an item for our current location */
+
+                        assert(!s->current_cache_start_location);
+                        assert(!s->current_cache_origin);
+
+                        assert(realloc_buffer_size(&s->buffer) == 0);
+                        assert(ca_origin_bytes(s->buffer_origin) == 0);
+
+                        /* Let's figure out the location we are at right now */
+                        r = ca_encoder_current_location(s->encoder, 0, &location);
+                        if (r < 0)
+                                return log_debug_errno(r, "Failed to acquire encoder location: %m");
+
+                        /* Hmm, let's check the cache now then, maybe we can use that and avoid the disk accesses for
+                           the new data? */
+                        r = ca_sync_cache_get(s, location);
+                        if (r == -ENOENT) { /* No luck, let's generate new data then. */
+                                s->cache_state = CA_SYNC_CACHE_IDLE;
+                                break;
+                        }
+                        if (r < 0)
+                                return r;
+
+                        /* This worked! Let's proceed with verifying what we just got. */
+                        s->cache_state = CA_SYNC_CACHE_VERIFY;
+                } _fallthrough_;
+
+                case CA_SYNC_CACHE_VERIFY: {
+                        CaLocation *cached_location;
+                        uint64_t sz;
+                        size_t data_size;
+
+                        assert(s->current_cache_start_location);
+                        assert(s->current_cache_origin);
+
+                        assert(realloc_buffer_size(&s->buffer) == 0);
+                        assert(ca_origin_bytes(s->buffer_origin) == 0);
+
+                        if (!location) {
+                                /* Let's figure out the location we are at right now */
+                                r = ca_encoder_current_location(s->encoder, 0, &location);
+                                if (r < 0)
+                                        return log_debug_errno(r, "Failed to acquire encoder location: %m");
+                        }
+
+                        assert_se(cached_location = ca_origin_get(s->current_cache_origin, 0));
+
+                        if (!ca_location_equal(location, cached_location, CA_LOCATION_WITH_MTIME|CA_LOCATION_WITH_FEATURE_FLAGS)) {
+                                /* We are not where we should be. Bummer. */
+                                log_debug("Cache item out of date, location didn't match (on encoder). %s != %s",
+                                          ca_location_format(location), ca_location_format(cached_location));
+                                s->cache_state = CA_SYNC_CACHE_FAILED;
+                                return CA_SYNC_STEP;
+                        }
+
+                        assert_se(cached_location->size != UINT64_MAX);
+                        assert_se(cached_location->size != 0);
+
+                        r = ca_sync_cache_skip_entry(s, cached_location, &data_size);
                         if (r < 0)
                                 return r;
+                        if (r == 0) {
+                                /* Generate the data if necessary, but clarify that we are not actually interested, by passing NULL */
+                                r = ca_encoder_get_data(s->encoder, cached_location->size, NULL, &data_size);
+                                if (r < 0)
+                                        return log_debug_errno(r, "Failed to skip initial data: %m");
+                        }
 
-                        return CA_SYNC_STEP;
+                        for (;;) {
+                                if (data_size <= cached_location->size) {
+
+                                        /* Less or equal data than we expected was generated. Let's advance the cache origin,
+                                         * and retry */
+
+                                        r = ca_origin_advance_bytes(s->current_cache_origin, data_size);
+                                        if (r < 0)
+                                                return r;
+
+                                        goto done;
+                                }
+
+                                /* Hmm, so more data than we expected was generated. When this happens in the middle of
+                                 * our cache verification that's a problem, as in that case the cache data didn't match
+                                 * reality. However, if that happens at the end of our validation, it's OK, however we
+                                 * need to do something useful with the remainder. */
+
+                                if (ca_origin_items(s->current_cache_origin) > 1) {
+                                        /* Not at the end. Bummer. */
+                                        log_debug("Cache item out of date, size didn't match.");
+                                        s->cache_state = CA_SYNC_CACHE_FAILED;
+                                        return CA_SYNC_STEP;
+                                }
+
+                                log_debug("Chunk matched, writing out.");
+
+                                /* Yay, we are at the end of our cache entry. That's excellent! */
+
+                                r = ca_sync_write_one_cached_chunk(s, &s->current_cache_chunk_id, s->current_cache_chunk_size, s->current_cache_start_location);
+                                if (r < 0)
+                                        return log_debug_errno(r, "Failed to write cached item to index: %m");
+
+                                sz = cached_location->size;
+
+                                s->n_cache_hits++;
+                                ca_sync_reset_cache_data(s);
+
+                                /* So we have some more data to handle. Let's see if we have a hit for that one too. */
+
+                                r = ca_location_advance(&location, sz);
+                                if (r < 0)
+                                        return r;
+                                data_size -= sz;
+
+                                r = ca_sync_cache_get(s, location);
+                                if (r == -ENOENT) {
+                                        s->cache_state = CA_SYNC_CACHE_IDLE;
+
+                                        /* So, this is available in the cache, we hence need to generate data here. Hence we
+                                         * need to call ca_encoder_get_data() again, but this time ask for real data. And then
+                                         * we need to skip what we already used. */
+                                        extra_offset = sz;
+                                        break;
+                                }
+                                if (r < 0)
+                                        return r;
+
+                                assert_se(cached_location = ca_origin_get(s->current_cache_origin, 0));
+                        }
+
+                        assert_se(extra_offset > 0);
+                        break;
                 }
 
-                /* Ah, dang, this didn't check out. Let's revert back. */
-                log_debug("Cache item out of date, location didn't match (on buffer).");
-                s->cache_state = CA_SYNC_CACHE_FAILED;
-                return CA_SYNC_STEP;
+                case CA_SYNC_CACHE_FAILED:
+                case CA_SYNC_CACHE_SUCCEEDED:
+                        assert_not_reached("Unexpected cache state");
+                }
+
+                if (ca_sync_need_data(s))
+                        r = ca_encoder_get_data(s->encoder, UINT64_MAX, &p, &l);
+                else
+                        r = ca_encoder_get_data(s->encoder, UINT64_MAX, NULL, &l);
+                if (r < 0)
+                        return log_debug_errno(r, "Failed to acquire data: %m");
+
+                /* Apply the extra offset, if there's any */
+                if (p)
+                        p = (const uint8_t*) p + extra_offset;
+                l -= extra_offset;
+
+                if (s->cache) {
+                        /* When caching enabled, query current encoder location, so that we can generate a cache entry
+                         * for it. Note that the location might already be initialized, and if it is the 'extra_offset'
+                         * is already applied to it.  */
+
+                        if (!location) {
+                                r = ca_encoder_current_location(s->encoder, 0, &location);
+                                if (r < 0)
+                                        return r;
+                        }
+
+                        r = ca_location_patch_size(&location, l);
+                        if (r < 0)
+                                return r;
+                }
+
+                if (p) {
+                        bool zero;
+
+                        zero = step == CA_ENCODER_PAYLOAD && ca_encoder_current_payload_hole(s->encoder) > 0;
+
+                        r = ca_sync_write_chunks(s, p, l, zero, location);
+                        if (r < 0)
+                                return r;
+
+                        r = ca_sync_write_archive(s, p, l);
+                        if (r < 0)
+                                return r;
+
+                        r = ca_sync_write_remote_archive(s, p, l);
+                        if (r < 0)
+                                return r;
+                }
+
+        done:
+                return step == CA_ENCODER_NEXT_FILE ? CA_SYNC_NEXT_FILE :
+                       step == CA_ENCODER_PAYLOAD   ? CA_SYNC_PAYLOAD   :
+                                                      CA_SYNC_STEP;
+        }
+
+        case CA_ENCODER_DONE_FILE:
+                return CA_SYNC_DONE_FILE;
+
+        default:
+                assert(false);
         }
+}
+
+static bool ca_sync_shall_seed(CaSync *s) {
+
+        assert(s);
+
+        if (s->direction != CA_SYNC_DECODE)
+        		/*非decode返回false*/
+                return false;  /* only run the seeds when decoding */
+        if (s->n_seeds == 0) /* no point in bothering if there are no seeds */
+                return false;
+
+        if (!s->index && !s->hardlink) /* If there's no chunk index and hardlinking is turned off, there's no point of managing seeds. */
+                return false;
+
+        return true;
+}
+
+static bool ca_sync_seed_ready(CaSync *s) {
+        assert(s);
+
+        if (!ca_sync_shall_seed(s))
+                return true;
+
+        return s->current_seed >= s->n_seeds;
+}
+
+static CaStore *ca_sync_prefetch_store(CaSync *s) {
+        assert(s);
+
+        /* The store we load chunks from ahead of time: the first one we look into */
+
+        if (s->wstore)
+                return s->wstore;
+        if (s->n_rstores > 0)
+                return s->rstores[0];
+
+        return NULL;
+}
+
+static int ca_sync_restore_index_position(CaSync *s, uint64_t saved) {
+        int r;
+
+        assert(s);
+
+        if (saved == 0)
+                return ca_index_set_position(s->index, saved);
+
+        /* Let's not just seek back to where we came from, but one earlier, and read it again, so that the previous
+         * offset is known, so that the size of the next chunk can be determined properly */
 
-        case CA_SYNC_CACHE_SUCCEEDED:
-                assert(s->current_cache_start_location);
-                assert(s->current_cache_origin);
+        r = ca_index_set_position(s->index, saved-1);
+        if (r < 0)
+                return r;
 
-                /* In the previous iteration we tried to use the cache, and it did work out. Yay! Let's now
-                 * write the cached item, and seek where we are supposed to continue */
+        r = ca_index_read_chunk(s->index, NULL, NULL, NULL);
+        if (r < 0)
+                return r;
 
-                log_debug("Succeeded with cached block!");
+        return 0;
+}
 
-                r = ca_sync_write_one_cached_chunk(s, &s->current_cache_chunk_id, s->current_cache_chunk_size, s->current_cache_start_location);
-                if (r < 0)
-                        return log_debug_errno(r, "Failed to write cached item to index: %m");
+static int ca_sync_local_prefetch_chunk(CaSync *s, CaStore *store, const CaChunkID *id) {
+        int r;
 
-                s->n_cache_hits++;
+        assert(s);
+        assert(store);
+        assert(id);
 
-                /* Reset the cached item we are operating on */
-                ca_sync_reset_cache_data(s);
-                s->cache_state = CA_SYNC_CACHE_CHECK;
+        if (!s->local_prefetch_advise) {
+                r = ca_store_prefetch(store, id);
+                if (r != -EOPNOTSUPP)
+                        return r;
 
-                return CA_SYNC_STEP;
+                /* Without io_uring let the kernel do the read-ahead at least */
+                s->local_prefetch_advise = true;
+        }
 
-        case CA_SYNC_CACHE_FAILED:
-                assert(s->current_cache_start_location);
-                assert(s->current_cache_origin);
+        r = ca_store_advise(store, id);
+        if (IN_SET(r, -ENOENT, -EADDRNOTAVAIL)) /* Packed or missing, ca_store_get() deals with that */
+                return 0;
 
-                /* In the previous iteration we tried to use the cache, but this didn't work out, the stuff on disk
-                 * didn't match our cache anymore. In this iteration we'll hence seek back to where our cache adventure
-                 * started, and read off disk again. But we'll remove the bogus cache entry first, so that this doesn't
-                 * happen again, ever. */
+        return r;
+}
 
-                log_debug("Cached block didn't check out, seeking back to %s.", ca_location_format(s->current_cache_start_location));
+static int ca_sync_local_prefetch(CaSync *s) {
+        uint64_t available, saved, base, offset = 0;
+        CaStore *store;
+        int r;
 
-                r = ca_cache_remove(s->cache, s->current_cache_start_location);
-                if (r < 0 && r != -ENOENT)
-                        return log_debug_errno(r, "Failed to remove cache item: %m");
+        assert(s);
 
-                s->n_cache_invalidated++;
+        /* Keeps the chunks following the current one loading from the local store in the background, so that the
+         * decoder finds them in memory (or at least in the page cache) once it gets to them. The window ahead is
+         * bounded both by the number of chunks and by their size. */
 
-                step = ca_encoder_seek_location(s->encoder, s->current_cache_start_location);
-                if (step < 0)
-                        return log_debug_errno(step, "Failed to seek encoder: %m");
+        if (!s->index)
+                return 0;
+        if (s->direction != CA_SYNC_DECODE)
+                return 0;
+        if (s->prefetch_chunks == 0)
+                return 0;
 
-                /* Reset the cached item we are operating on */
-                ca_sync_reset_cache_data(s);
-                s->cache_state = CA_SYNC_CACHE_IDLE;
+        store = ca_sync_prefetch_store(s);
+        if (!store)
+                return 0;
 
-                /* Clear whatever is currently in the buffer */
-                realloc_buffer_empty(&s->buffer);
-                s->buffer_origin = ca_origin_unref(s->buffer_origin);
+        r = ca_index_get_available_chunks(s->index, &available);
+        if (r == -ENODATA || r == -EAGAIN)
+                return 0;
+        if (r < 0)
+                return r;
 
-                s->chunker = s->original_chunker;
+        r = ca_index_get_position(s->index, &saved);
+        if (r < 0)
+                return r;
 
-                next_step = false;
-                break;
+        /* Chunks on the decode queue have been loaded already, hence look ahead of those */
+        base = MAX(saved, s->decode_position);
+        if (base >= available)
+                return 0;
+
+        if (s->prefetch_bytes != UINT64_MAX && base > 0) {
+                /* The window in bytes starts where the first chunk not loaded yet does */
+                r = ca_index_get_chunk(s->index, base - 1, NULL, &offset, NULL);
+                if (r == -ENXIO)
+                        return 0;
+                if (r < 0)
+                        return r;
         }
 
-        if (next_step) {
-                step = ca_encoder_step(s->encoder);
-                if (step < 0)
-                        return log_debug_errno(step, "Failed to run encoder step: %m");
+        if (s->n_local_prefetched_chunks <= base) {
+                s->n_local_prefetched_chunks = base;
+                s->local_prefetch_offset = offset;
         }
 
-        switch (step) {
+        /* Only top up once half of the window has been used, to keep the index seeking down */
+        if (s->n_local_prefetched_chunks >= base + (s->prefetch_chunks + 1) / 2)
+                return 0;
+        if (s->prefetch_bytes != UINT64_MAX &&
+            s->n_local_prefetched_chunks > base &&
+            s->local_prefetch_offset - offset >= s->prefetch_bytes / 2)
+                return 0;
+        if (s->n_local_prefetched_chunks >= available)
+                return 0;
 
-        case CA_ENCODER_FINISHED:
+        r = ca_store_set_prefetch_max(store, s->prefetch_chunks);
+        if (r < 0 && r != -EBUSY)
+                return r;
 
-                if (s->cache_state == CA_SYNC_CACHE_VERIFY) {
-                        /* What? There's still a cache item pending that didn't finish yet? If so, it's invalid. Let's
-                         * treat it as miss */
+        r = ca_index_set_position(s->index, s->n_local_prefetched_chunks);
+        if (r < 0)
+                return r;
 
-                        log_debug("Cache item out of date, reached EOF too early.");
-                        s->cache_state = CA_SYNC_CACHE_FAILED;
-                        return CA_SYNC_STEP;
-                }
+        while (s->n_local_prefetched_chunks < base + s->prefetch_chunks) {
+                uint64_t offset_end, size;
+                bool skip = false;
+                CaChunkID id;
+                size_t i;
 
-                assert(IN_SET(s->cache_state, CA_SYNC_CACHE_OFF, CA_SYNC_CACHE_CHECK, CA_SYNC_CACHE_IDLE));
+                r = ca_index_read_chunk(s->index, &id, &offset_end, &size);
+                if (r == 0 || r == -EAGAIN)
+                        break;
+                if (r < 0)
+                        return r;
 
-                r = ca_sync_write_final_chunk(s);
+                /* The first chunk is always loaded, however large it is */
+                if (s->n_local_prefetched_chunks > base &&
+                    s->prefetch_bytes != UINT64_MAX &&
+                    offset_end - offset > s->prefetch_bytes)
+                        break;
+
+                /* All-zero chunks are never loaded, and seeds are looked into first, no need to load those either */
+                r = ca_sync_is_zero_chunk(s, &id, size);
                 if (r < 0)
                         return r;
+                skip = r > 0;
 
-                r = ca_sync_install_archive(s);
+                for (i = 0; !skip && i < s->n_seeds; i++) {
+                        r = ca_seed_has(s->seeds[i], &id);
+                        if (r > 0)
+                                skip = true;
+                }
+
+                if (!skip) {
+                        r = ca_sync_local_prefetch_chunk(s, store, &id);
+                        if (r == -EBUSY)
+                                break;
+                        if (r < 0)
+                                return r;
+                }
+
+                s->n_local_prefetched_chunks++;
+                s->local_prefetch_offset = offset_end;
+        }
+
+        return ca_sync_restore_index_position(s, saved);
+}
+
+typedef struct CaSyncDecodeJob {
+        CaChunkID id;
+        uint64_t position;
+        CaChunkCompression compression;
+        ReallocBuffer stored;  /* The chunk as loaded from the store */
+        ReallocBuffer decoded; /* The chunk decompressed, if it was stored compressed */
+        const void *data;      /* Points into either of the two above, once validated */
+        size_t size;
+        bool verify;
+        CaDigest *digest;
+} CaSyncDecodeJob;
+
+static int ca_sync_decode_job_run(void *p, void *userdata) {
+        CaSyncDecodeJob *job = p;
+        CaSync *s = userdata;
+        ReallocBuffer *b;
+        CaChunkID actual;
+        int r;
+
+        assert(job);
+        assert(s);
+
+        if (job->compression == CA_CHUNK_COMPRESSED) {
+                realloc_buffer_empty(&job->decoded);
+
+                r = ca_decompress(realloc_buffer_data(&job->stored), realloc_buffer_size(&job->stored), &job->decoded);
                 if (r < 0)
                         return r;
 
-                r = ca_sync_write_remote_archive_eof(s);
+                b = &job->decoded;
+        } else
+                b = &job->stored;
+
+        if (!job->verify)
+                goto finish;
+
+        if (!job->digest) {
+                r = ca_digest_new(s->decode_digest_type, &job->digest);
                 if (r < 0)
                         return r;
+        }
 
-                s->archive_eof = true;
+        r = ca_chunk_id_make(job->digest, realloc_buffer_data(b), realloc_buffer_size(b), &actual);
+        if (r < 0)
+                return r;
+        if (!ca_chunk_id_equal(&job->id, &actual))
+                return -EBADMSG;
 
-                /* If we install an index or archive remotely, let's decide the peer when it's done */
-                if (s->remote_index || s->remote_archive)
-                        return CA_SYNC_STEP;
+finish:
+        job->data = realloc_buffer_data(b);
+        job->size = realloc_buffer_size(b);
 
-                return CA_SYNC_FINISHED;
+        return 0;
+}
 
-        case CA_ENCODER_NEXT_FILE:
-        case CA_ENCODER_PAYLOAD:
-        case CA_ENCODER_DATA: {
-                _cleanup_(ca_location_unrefp) CaLocation *location = NULL;
-                size_t l, extra_offset = 0;
-                const void *p = NULL;
+static void ca_sync_decode_job_free(void *p) {
+        CaSyncDecodeJob *job = p;
 
-                switch (s->cache_state) {
+        realloc_buffer_free(&job->stored);
+        realloc_buffer_free(&job->decoded);
+        ca_digest_free(job->digest);
+}
 
-                case CA_SYNC_CACHE_OFF:
-                case CA_SYNC_CACHE_IDLE:
-                        break;
+static int ca_sync_get_store_raw(
+                CaSync *s,
+                const CaChunkID *id,
+                const void **ret,
+                uint64_t *ret_size,
+                CaChunkCompression *ret_compression) {
 
-                case CA_SYNC_CACHE_CHECK: {
-                        /* Let's check if the cache provides an item for our current location */
+        size_t i;
+        int r;
 
-                        assert(!s->current_cache_start_location);
-                        assert(!s->current_cache_origin);
+        assert(s);
+        assert(id);
 
-                        assert(realloc_buffer_size(&s->buffer) == 0);
-                        assert(ca_origin_bytes(s->buffer_origin) == 0);
+        /* Looks for the chunk in the local stores in the same order as ca_sync_get_local() */
 
-                        /* Let's figure out the location we are at right now */
-                        r = ca_encoder_current_location(s->encoder, 0, &location);
-                        if (r < 0)
-                                return log_debug_errno(r, "Failed to acquire encoder location: %m");
+        if (s->wstore) {
+                r = ca_store_get_raw(s->wstore, id, ret, ret_size, ret_compression);
+                if (r != -ENOENT)
+                        return r;
+        }
 
-                        /* Hmm, let's check the cache now then, maybe we can use that and avoid the disk accesses for
-                           the new data? */
-                        r = ca_sync_cache_get(s, location);
-                        if (r == -ENOENT) { /* No luck, let's generate new data then. */
-                                s->cache_state = CA_SYNC_CACHE_IDLE;
-                                break;
-                        }
-                        if (r < 0)
-                                return r;
+        if (s->cache_store) {
+                r = ca_store_get_raw(s->cache_store, id, ret, ret_size, ret_compression);
+                if (r != -ENOENT)
+                        return r;
+        }
 
-                        /* This worked! Let's proceed with verifying what we just got. */
-                        s->cache_state = CA_SYNC_CACHE_VERIFY;
-                } _fallthrough_;
+        for (i = 0; i < s->n_rstores; i++) {
+                r = ca_store_get_raw(s->rstores[i], id, ret, ret_size, ret_compression);
+                if (r != -ENOENT)
+                        return r;
+        }
 
-                case CA_SYNC_CACHE_VERIFY: {
-                        CaLocation *cached_location;
-                        uint64_t sz;
-                        size_t data_size;
+        return -ENOENT;
+}
 
-                        assert(s->current_cache_start_location);
-                        assert(s->current_cache_origin);
+static int ca_sync_decode_queue_start(CaSync *s) {
+        uint64_t flags;
+        int r;
 
-                        assert(realloc_buffer_size(&s->buffer) == 0);
-                        assert(ca_origin_bytes(s->buffer_origin) == 0);
+        assert(s);
 
-                        if (!location) {
-                                /* Let's figure out the location we are at right now */
-                                r = ca_encoder_current_location(s->encoder, 0, &location);
-                                if (r < 0)
-                                        return log_debug_errno(r, "Failed to acquire encoder location: %m");
-                        }
+        /* Returns > 0 if chunks shall be decoded on the queue, 0 if they shall be loaded right when needed */
 
-                        assert_se(cached_location = ca_origin_get(s->current_cache_origin, 0));
+        if (s->decode_queue)
+                return 1;
+        if (s->n_threads <= 1)
+                return 0;
+        if (!s->wstore && !s->cache_store && s->n_rstores == 0)
+                return 0;
 
-                        if (!ca_location_equal(location, cached_location, CA_LOCATION_WITH_MTIME|CA_LOCATION_WITH_FEATURE_FLAGS)) {
-                                /* We are not where we should be. Bummer. */
-                                log_debug("Cache item out of date, location didn't match (on encoder). %s != %s",
-                                          ca_location_format(location), ca_location_format(cached_location));
-                                s->cache_state = CA_SYNC_CACHE_FAILED;
-                                return CA_SYNC_STEP;
-                        }
+        r = ca_index_get_feature_flags(s->index, &flags);
+        if (r == -ENODATA)
+                return 0;
+        if (r < 0)
+                return r;
 
-                        assert_se(cached_location->size != UINT64_MAX);
-                        assert_se(cached_location->size != 0);
+        s->decode_digest_type = ca_feature_flags_to_digest_type(flags);
+        if (s->decode_digest_type < 0)
+                return -EINVAL;
 
-                        /* Generate the data if necessary, but clarify that we are not actually interested, by passing NULL */
-                        r = ca_encoder_get_data(s->encoder, cached_location->size, NULL, &data_size);
-                        if (r < 0)
-                                return log_debug_errno(r, "Failed to skip initial data: %m");
+        /* A couple of chunks per thread, so that the workers don't run dry while we retire chunks in order */
+        s->decode_slots = s->n_threads * 4;
 
-                        for (;;) {
-                                if (data_size <= cached_location->size) {
+        r = ca_job_queue_new(s->n_threads, s->decode_slots, sizeof(CaSyncDecodeJob),
+                             ca_sync_decode_job_run, ca_sync_decode_job_free, s, &s->decode_queue);
+        if (r < 0)
+                return r;
 
-                                        /* Less or equal data than we expected was generated. Let's advance the cache origin,
-                                         * and retry */
+        return 1;
+}
 
-                                        r = ca_origin_advance_bytes(s->current_cache_origin, data_size);
-                                        if (r < 0)
-                                                return r;
+static void ca_sync_decode_queue_flush(CaSync *s) {
+        assert(s);
 
-                                        goto done;
-                                }
+        /* Drops all queued chunks, after a seek */
 
-                                /* Hmm, so more data than we expected was generated. When this happens in the middle of
-                                 * our cache verification that's a problem, as in that case the cache data didn't match
-                                 * reality. However, if that happens at the end of our validation, it's OK, however we
-                                 * need to do something useful with the remainder. */
+        s->decode_position = 0;
 
-                                if (ca_origin_items(s->current_cache_origin) > 1) {
-                                        /* Not at the end. Bummer. */
-                                        log_debug("Cache item out of date, size didn't match.");
-                                        s->cache_state = CA_SYNC_CACHE_FAILED;
-                                        return CA_SYNC_STEP;
-                                }
+        if (!s->decode_queue)
+                return;
 
-                                log_debug("Chunk matched, writing out.");
+        while (ca_job_queue_peek(s->decode_queue, true, NULL, NULL) >= 0)
+                assert_se(ca_job_queue_retire(s->decode_queue) >= 0);
+}
 
-                                /* Yay, we are at the end of our cache entry. That's excellent! */
+static int ca_sync_decode_ahead(CaSync *s, uint64_t position) {
+        uint64_t available, saved;
+        int r;
 
-                                r = ca_sync_write_one_cached_chunk(s, &s->current_cache_chunk_id, s->current_cache_chunk_size, s->current_cache_start_location);
-                                if (r < 0)
-                                        return log_debug_errno(r, "Failed to write cached item to index: %m");
+        assert(s);
 
-                                sz = cached_location->size;
+        /* Queues the chunks from 'position' on that are found in the local stores, to be decompressed and validated
+         * on the worker threads */
 
-                                s->n_cache_hits++;
-                                ca_sync_reset_cache_data(s);
+        r = ca_sync_decode_queue_start(s);
+        if (r <= 0)
+                return r;
 
-                                /* So we have some more data to handle. Let's see if we have a hit for that one too. */
+        /* Only top up once half of the queue has been used, to keep the index seeking down */
+        if (ca_job_queue_queued(s->decode_queue) > s->decode_slots / 2)
+                return 0;
 
-                                r = ca_location_advance(&location, sz);
-                                if (r < 0)
-                                        return r;
-                                data_size -= sz;
+        r = ca_index_get_available_chunks(s->index, &available);
+        if (r == -ENODATA || r == -EAGAIN)
+                return 0;
+        if (r < 0)
+                return r;
 
-                                r = ca_sync_cache_get(s, location);
-                                if (r == -ENOENT) {
-                                        s->cache_state = CA_SYNC_CACHE_IDLE;
+        if (s->decode_position < position)
+                s->decode_position = position;
+        if (s->decode_position >= available)
+                return 0;
 
-                                        /* So, this is available in the cache, we hence need to generate data here. Hence we
-                                         * need to call ca_encoder_get_data() again, but this time ask for real data. And then
-                                         * we need to skip what we already used. */
-                                        extra_offset = sz;
-                                        break;
-                                }
-                                if (r < 0)
-                                        return r;
+        r = ca_index_get_position(s->index, &saved);
+        if (r < 0)
+                return r;
 
-                                assert_se(cached_location = ca_origin_get(s->current_cache_origin, 0));
-                        }
+        r = ca_index_set_position(s->index, s->decode_position);
+        if (r < 0)
+                return r;
 
-                        assert_se(extra_offset > 0);
-                        break;
-                }
+        for (;;) {
+                CaChunkCompression compression;
+                CaSyncDecodeJob *job;
+                uint64_t l, size;
+                bool skip = false;
+                const void *p;
+                CaChunkID id;
+                size_t i;
 
-                case CA_SYNC_CACHE_FAILED:
-                case CA_SYNC_CACHE_SUCCEEDED:
-                        assert_not_reached("Unexpected cache state");
-                }
+                job = ca_job_queue_acquire(s->decode_queue);
+                if (!job)
+                        break;
 
-                if (ca_sync_need_data(s))
-                        r = ca_encoder_get_data(s->encoder, UINT64_MAX, &p, &l);
-                else
-                        r = ca_encoder_get_data(s->encoder, UINT64_MAX, NULL, &l);
+                r = ca_index_read_chunk(s->index, &id, NULL, &size);
+                if (r == 0 || r == -EAGAIN)
+                        break;
                 if (r < 0)
-                        return log_debug_errno(r, "Failed to acquire data: %m");
+                        return r;
 
-                /* Apply the extra offset, if there's any */
-                if (p)
-                        p = (const uint8_t*) p + extra_offset;
-                l -= extra_offset;
+                /* All-zero chunks are never loaded, and seeds are looked into first, those chunks are taken from
+                 * there when needed */
+                r = ca_sync_is_zero_chunk(s, &id, size);
+                if (r < 0)
+                        return r;
+                skip = r > 0;
 
-                if (s->cache) {
-                        /* When caching enabled, query current encoder location, so that we can generate a cache entry
-                         * for it. Note that the location might already be initialized, and if it is the 'extra_offset'
-                         * is already applied to it.  */
+                for (i = 0; !skip && i < s->n_seeds; i++) {
+                        r = ca_seed_has(s->seeds[i], &id);
+                        if (r > 0)
+                                skip = true;
+                }
 
-                        if (!location) {
-                                r = ca_encoder_current_location(s->encoder, 0, &location);
+                if (!skip) {
+                        r = ca_sync_get_store_raw(s, &id, &p, &l, &compression);
+                        if (r >= 0) {
+                                realloc_buffer_empty(&job->stored);
+                                if (!realloc_buffer_append(&job->stored, p, l))
+                                        return -ENOMEM;
+
+                                job->id = id;
+                                job->position = s->decode_position;
+                                job->compression = compression;
+                                job->verify = ca_chunk_verify_pick(s->verify, s->verify_sample);
+                                job->data = NULL;
+                                job->size = 0;
+
+                                r = ca_job_queue_submit(s->decode_queue);
                                 if (r < 0)
                                         return r;
-                        }
-
-                        r = ca_location_patch_size(&location, l);
-                        if (r < 0)
+                        } else if (r != -ENOENT) /* Not around locally, hence it's requested from a remote later */
                                 return r;
                 }
 
-                if (p) {
-                        r = ca_sync_write_chunks(s, p, l, location);
-                        if (r < 0)
-                                return r;
+                s->decode_position++;
+        }
 
-                        r = ca_sync_write_archive(s, p, l);
-                        if (r < 0)
-                                return r;
+        return ca_sync_restore_index_position(s, saved);
+}
 
-                        r = ca_sync_write_remote_archive(s, p, l);
-                        if (r < 0)
-                                return r;
-                }
+static int ca_sync_decode_get(CaSync *s, uint64_t position, const void **ret, uint64_t *ret_size) {
+        CaSyncDecodeJob *job;
+        int r, result;
 
-        done:
-                return step == CA_ENCODER_NEXT_FILE ? CA_SYNC_NEXT_FILE :
-                       step == CA_ENCODER_PAYLOAD   ? CA_SYNC_PAYLOAD   :
-                                                      CA_SYNC_STEP;
-        }
+        assert(s);
+        assert(ret);
+        assert(ret_size);
 
-        case CA_ENCODER_DONE_FILE:
-                return CA_SYNC_DONE_FILE;
+        /* Returns > 0 if the chunk at 'position' was taken from the queue, 0 if it hasn't been queued. The data
+         * stays valid until ca_sync_decode_release() is called. */
 
-        default:
-                assert(false);
-        }
-}
+        if (!s->decode_queue)
+                return 0;
 
-static bool ca_sync_shall_seed(CaSync *s) {
+        for (;;) {
+                r = ca_job_queue_peek(s->decode_queue, true, (void**) &job, &result);
+                if (r == -ENODATA)
+                        return 0;
+                if (r < 0)
+                        return r;
 
-        assert(s);
+                if (job->position > position)
+                        return 0;
+                if (job->position == position)
+                        break;
 
-        if (s->direction != CA_SYNC_DECODE)
-        		/*非decode返回false*/
-                return false;  /* only run the seeds when decoding */
-        if (s->n_seeds == 0) /* no point in bothering if there are no seeds */
-                return false;
+                /* Skipped over, for example because it was found in a seed by the time it was needed */
+                r = ca_job_queue_retire(s->decode_queue);
+                if (r < 0)
+                        return r;
+        }
 
-        if (!s->index && !s->hardlink) /* If there's no chunk index and hardlinking is turned off, there's no point of managing seeds. */
-                return false;
+        if (result < 0)
+                return result;
 
-        return true;
+        *ret = job->data;
+        *ret_size = job->size;
+
+        return 1;
 }
 
-static bool ca_sync_seed_ready(CaSync *s) {
+static int ca_sync_decode_release(CaSync *s) {
         assert(s);
+        assert(s->decode_queue);
 
-        if (!ca_sync_shall_seed(s))
-                return true;
-
-        return s->current_seed >= s->n_seeds;
+        return ca_job_queue_retire(s->decode_queue);
 }
 
 static int ca_sync_process_decoder_request(CaSync *s) {
@@ -2348,8 +3712,9 @@ static int ca_sync_process_decoder_request(CaSync *s) {
         assert(s->decoder);
 
         if (s->index)  {
+                uint64_t chunk_size, position;
                 CaOrigin *origin = NULL;
-                uint64_t chunk_size;
+                bool decoded = false;
                 const void *p;
 
                 for (;;) {
@@ -2397,13 +3762,47 @@ static int ca_sync_process_decoder_request(CaSync *s) {
                 if (s->first_chunk_request_nsec == 0)
                         s->first_chunk_request_nsec = now(CLOCK_MONOTONIC);
 
-                r = ca_sync_get(s, &s->next_chunk, CA_CHUNK_UNCOMPRESSED, &p, &chunk_size, NULL, &origin);
-                if (r == -EAGAIN) /* Don't have this right now, but requested it now */
-                        return CA_SYNC_STEP;
-                if (r == -EALREADY) /* Don't have this right now, but it was already enqueued. */
-                        return CA_SYNC_POLL;
+                r = ca_sync_local_prefetch(s);
+                if (r < 0)
+                        return log_debug_errno(r, "Failed to prefetch chunks: %m");
+
+                /* The chunk we are looking at is the one just read from the index */
+                r = ca_index_get_position(s->index, &position);
+                if (r < 0)
+                        return log_debug_errno(r, "Failed to determine index position: %m");
+                assert(position > 0);
+                position--;
+
+                r = ca_sync_decode_ahead(s, position);
+                if (r < 0)
+                        return log_debug_errno(r, "Failed to queue chunks for decoding: %m");
+
+                r = ca_sync_is_zero_chunk(s, &s->next_chunk, s->next_chunk_size);
                 if (r < 0)
-                        return log_debug_errno(r, "Failed to acquire chunk: %m");
+                        return log_debug_errno(r, "Failed to check for all-zero chunk: %m");
+                if (r > 0) {
+                        /* Nothing to get from anywhere, and the decoder turns it into a hole if it punches holes */
+                        p = ca_sync_zeros(s, s->next_chunk_size);
+                        if (!p)
+                                return -ENOMEM;
+
+                        chunk_size = s->next_chunk_size;
+                } else {
+                        r = ca_sync_decode_get(s, position, &p, &chunk_size);
+                        if (r < 0)
+                                return log_debug_errno(r, "Failed to acquire chunk: %m");
+                        if (r > 0)
+                                decoded = true;
+                        else {
+                                r = ca_sync_get(s, &s->next_chunk, CA_CHUNK_UNCOMPRESSED, &p, &chunk_size, NULL, &origin);
+                                if (r == -EAGAIN) /* Don't have this right now, but requested it now */
+                                        return CA_SYNC_STEP;
+                                if (r == -EALREADY) /* Don't have this right now, but it was already enqueued. */
+                                        return CA_SYNC_POLL;
+                                if (r < 0)
+                                        return log_debug_errno(r, "Failed to acquire chunk: %m");
+                        }
+                }
                 if (s->next_chunk_size != UINT64_MAX && /* next_chunk_size will be -1 if we just seeked in the index file */
                     s->next_chunk_size != chunk_size) {
                         ca_origin_unref(origin);
@@ -2432,6 +3831,12 @@ static int ca_sync_process_decoder_request(CaSync *s) {
                 if (r < 0)
                         return log_debug_errno(r, "Decoder didn't accept chunk: %m");
 
+                if (decoded) {
+                        r = ca_sync_decode_release(s);
+                        if (r < 0)
+                                return r;
+                }
+
                 return CA_SYNC_STEP;
         }
 
@@ -2525,6 +3930,11 @@ static void ca_sync_reset_seek(CaSync *s) {
         s->remote_index_eof = false;
         s->next_chunk_valid = false;
         s->chunk_skip = 0;
+
+        ca_sync_decode_queue_flush(s);
+
+        s->n_local_prefetched_chunks = 0;
+        ca_store_prefetch_discard(ca_sync_prefetch_store(s));
 }
 
 static int ca_sync_process_decoder_seek(CaSync *s) {
@@ -2708,12 +4118,114 @@ static CaSeed *ca_sync_current_seed(CaSync *s) {
         if (!ca_sync_shall_seed(s))
                 return NULL;
 
+        if (s->seed_queue) /* The seeds are indexed concurrently, hence there's no single current one */
+                return NULL;
+
         if (s->current_seed >= s->n_seeds)
                 return NULL;
 
         return s->seeds[s->current_seed];
 }
 
+typedef struct CaSyncSeedJob {
+        CaSeed *seed;
+} CaSyncSeedJob;
+
+static int ca_sync_seed_job_run(void *p, void *userdata) {
+        CaSyncSeedJob *job = p;
+        CaSync *s = userdata;
+        int r;
+
+        for (;;) {
+                if (__atomic_load_n(&s->seed_cancel, __ATOMIC_RELAXED))
+                        return -ECANCELED;
+
+                r = ca_seed_step(job->seed);
+                if (r < 0)
+                        return r;
+                if (r == CA_SEED_READY)
+                        return 0;
+        }
+}
+
+static int ca_sync_start_seed_queue(CaSync *s) {
+        size_t i;
+        int r;
+
+        assert(s);
+
+        /* Returns > 0 if the seeds are now indexed on worker threads, 0 if they shall be stepped through one by one */
+
+        if (s->seed_queue)
+                return 1;
+        if (s->n_seeds <= 1 || s->n_threads <= 1)
+                return 0;
+        if (s->current_seed > 0) /* Already started indexing them one by one */
+                return 0;
+
+        s->seed_notify_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (s->seed_notify_fd < 0)
+                return -errno;
+
+        r = ca_job_queue_new(MIN(s->n_seeds, (size_t) s->n_threads), s->n_seeds, sizeof(CaSyncSeedJob),
+                             ca_sync_seed_job_run, NULL, s, &s->seed_queue);
+        if (r < 0)
+                return r;
+
+        r = ca_job_queue_set_notify_fd(s->seed_queue, s->seed_notify_fd);
+        if (r < 0)
+                return r;
+
+        for (i = 0; i < s->n_seeds; i++) {
+                CaSyncSeedJob *job;
+
+                job = ca_job_queue_acquire(s->seed_queue);
+                assert(job);
+
+                job->seed = s->seeds[i];
+
+                r = ca_job_queue_submit(s->seed_queue);
+                if (r < 0)
+                        return r;
+        }
+
+        return 1;
+}
+
+static int ca_sync_retire_seed_jobs(CaSync *s) {
+        uint64_t counter;
+        int r, result;
+
+        assert(s);
+        assert(s->seed_queue);
+
+        /* Reset the notification counter first, so that a job completing after we looked wakes up the next poll */
+        (void) read(s->seed_notify_fd, &counter, sizeof(counter));
+
+        for (;;) {
+                r = ca_job_queue_peek(s->seed_queue, false, NULL, &result);
+                if (r == -EAGAIN)
+                        return CA_SYNC_POLL;
+                if (r == -ENODATA)
+                        break;
+                if (r < 0)
+                        return r;
+                if (result < 0)
+                        return result;
+
+                r = ca_job_queue_retire(s->seed_queue);
+                if (r < 0)
+                        return r;
+
+                s->current_seed++;
+        }
+
+        s->seed_queue = ca_job_queue_unref(s->seed_queue);
+        s->seed_notify_fd = safe_close(s->seed_notify_fd);
+
+        return CA_SYNC_STEP;
+}
+
 static int ca_sync_seed_step(CaSync *s) {
         int r;
 
@@ -2725,6 +4237,15 @@ static int ca_sync_seed_step(CaSync *s) {
         if (s->index && !s->index_flags_propagated) /* Index flags/chunk sizes not propagated to the seeds yet. Let's wait until then */
                 return CA_SYNC_POLL;
 
+        if (s->current_seed >= s->n_seeds)
+                return CA_SYNC_POLL;
+
+        r = ca_sync_start_seed_queue(s);
+        if (r < 0)
+                return r;
+        if (r > 0)
+                return ca_sync_retire_seed_jobs(s);
+
         for (;;) {
                 CaSeed *seed;
 
@@ -2862,18 +4383,7 @@ static int ca_sync_remote_prefetch(CaSync *s) {
                 requested ++;
         }
 
-        if (saved > 0) {
-                /* Let's not just seek back to where we came from, but one earlier, and read it again, so that the
-                 * previous offset is known, so that the size of the next chunk can be determined properly */
-
-                r = ca_index_set_position(s->index, saved-1);
-                if (r < 0)
-                        return r;
-
-                r = ca_index_read_chunk(s->index, NULL, NULL, NULL);
-        } else
-                r = ca_index_set_position(s->index, saved);
-
+        r = ca_sync_restore_index_position(s, saved);
         if (r < 0)
                 return r;
 
@@ -3842,14 +5352,21 @@ int ca_sync_poll(CaSync *s, uint64_t timeout_nsec, const sigset_t *ss) {
         n_pollfd = (!!s->remote_archive
                     + !!s->remote_index
                     + !!s->remote_wstore
-                    + s->n_remote_rstores) * 2;
+                    + s->n_remote_rstores) * 2
+                + (s->seed_notify_fd >= 0);
 
         if (n_pollfd == 0)
                 return -EUNATCH;
 
         pollfd = newa(struct pollfd, n_pollfd);
 
-        r = ca_sync_add_pollfd(s->remote_archive, pollfd);
+        if (s->seed_notify_fd >= 0)
+                pollfd[n++] = (struct pollfd) {
+                        .fd = s->seed_notify_fd,
+                        .events = POLLIN,
+                };
+
+        r = ca_sync_add_pollfd(s->remote_archive, pollfd + n);
         if (r < 0)
                 return r;
         n += r;
@@ -4465,6 +5982,40 @@ int ca_sync_get_remote_request_bytes(CaSync *s, uint64_t *ret) {
         return 0;
 }
 
+int ca_sync_get_remote_window_stall_nsec(CaSync *s, uint64_t *ret) {
+        uint64_t sum;
+        size_t i;
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (!s->remote_wstore && s->n_remote_rstores == 0)
+                return -ENODATA;
+
+        if (s->remote_wstore) {
+                r = ca_remote_get_window_stall_nsec(s->remote_wstore, &sum);
+                if (r < 0)
+                        return r;
+        } else
+                sum = 0;
+
+        for (i = 0; i < s->n_remote_rstores; i++) {
+                uint64_t x;
+
+                r = ca_remote_get_window_stall_nsec(s->remote_rstores[i], &x);
+                if (r < 0)
+                        return r;
+
+                sum += x;
+        }
+
+        *ret = sum;
+        return 0;
+}
+
 int ca_sync_get_decoding_time_nsec(CaSync *s, uint64_t *ret) {
         if (!s)
                 return -EINVAL;
@@ -4507,6 +6058,16 @@ int ca_sync_set_compression_type(CaSync *s, CaCompressionType compression) {
         return 0;
 }
 
+int ca_sync_set_store_packs(CaSync *s, bool enabled) {
+        if (!s)
+                return -EINVAL;
+        if (CA_SYNC_IS_STARTED(s))
+                return -EBUSY;
+
+        s->store_packs = enabled;
+        return 0;
+}
+
 int ca_sync_current_cache_hits(CaSync *s, uint64_t *ret) {
         if (!s)
                 return -EINVAL;
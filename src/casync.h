@@ -33,6 +33,16 @@ DEFINE_TRIVIAL_CLEANUP_FUNC(CaSync *, ca_sync_unref);
 
 int ca_sync_set_log_level(CaSync *s, int log_level);
 int ca_sync_set_rate_limit_bps(CaSync *s, uint64_t rate_limit_bps);
+int ca_sync_set_max_active_chunks(CaSync *s, unsigned n);
+int ca_sync_set_max_host_connections(CaSync *s, unsigned n);
+int ca_sync_set_n_threads(CaSync *s, unsigned n);
+
+/* How far to load chunks ahead of the decoder from the local store, in chunks and in bytes */
+int ca_sync_set_prefetch_chunks(CaSync *s, unsigned n);
+int ca_sync_set_prefetch_bytes(CaSync *s, uint64_t bytes);
+
+/* How thoroughly to validate chunks taken from stores and remotes, see ca_store_set_verify() */
+int ca_sync_set_verify(CaSync *s, CaChunkVerify verify, uint64_t sample);
 
 int ca_sync_set_feature_flags(CaSync *s, uint64_t flags);
 int ca_sync_get_feature_flags(CaSync *s, uint64_t *ret);
@@ -47,6 +57,7 @@ int ca_sync_set_delete(CaSync *s, bool enabled);
 int ca_sync_set_payload(CaSync *s, bool enabled);
 int ca_sync_set_undo_immutable(CaSync *s, bool enabled);
 int ca_sync_set_compression_type(CaSync *s, CaCompressionType compression);
+int ca_sync_set_store_packs(CaSync *s, bool enabled);
 
 int ca_sync_set_uid_shift(CaSync *s, uid_t uid);
 int ca_sync_set_uid_range(CaSync *s, uid_t uid);
@@ -89,6 +100,10 @@ int ca_sync_add_store_auto(CaSync *sync, const char *locator);
 int ca_sync_add_seed_fd(CaSync *sync, int fd);
 int ca_sync_add_seed_path(CaSync *sync, const char *path);
 
+/* Directory to keep the seeds' chunk caches in, so that they may be reused by later runs while the seeds don't
+ * change */
+int ca_sync_set_seed_cache_path(CaSync *sync, const char *path);
+
 /* Path to use as cache */
 int ca_sync_set_cache_fd(CaSync *sync, int fd);
 int ca_sync_set_cache_path(CaSync *sync, const char *path);
@@ -158,6 +173,7 @@ int ca_sync_get_local_requests(CaSync *s, uint64_t *ret);
 int ca_sync_get_local_request_bytes(CaSync *s, uint64_t *ret);
 int ca_sync_get_remote_requests(CaSync *s, uint64_t *ret);
 int ca_sync_get_remote_request_bytes(CaSync *s, uint64_t *ret);
+int ca_sync_get_remote_window_stall_nsec(CaSync *s, uint64_t *ret);
 
 int ca_sync_get_decoding_time_nsec(CaSync *s, uint64_t *ret);
 int ca_sync_get_runtime_nsec(CaSync *s, uint64_t *ret);
@@ -0,0 +1,333 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "cauring.h"
+
+#if HAVE_LINUX_IO_URING_H && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+
+struct CaUring {
+        int fd;
+
+        void *sq_ring, *cq_ring;
+        size_t sq_ring_size, cq_ring_size;
+
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        unsigned *sq_head, *sq_tail, *sq_array;
+        unsigned sq_mask, sq_entries;
+
+        unsigned *cq_head, *cq_tail;
+        struct io_uring_cqe *cqes;
+        unsigned cq_mask, cq_entries;
+
+        unsigned n_queued;  /* Filled in, but not passed to the kernel yet */
+        size_t n_pending;   /* Queued or in flight, completion not returned yet */
+};
+
+int ca_uring_new(unsigned entries, CaUring **ret) {
+        struct io_uring_params p = {};
+        CaUring *u;
+        long fd;
+        int r;
+
+        if (entries == 0)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0)
+                return IN_SET(errno, ENOSYS, EPERM, EACCES) ? -EOPNOTSUPP : -errno;
+
+        /* We need IORING_OP_OPENAT and IORING_OP_READ, which were added together with this feature */
+        if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+                safe_close(fd);
+                return -EOPNOTSUPP;
+        }
+
+        u = new0(CaUring, 1);
+        if (!u) {
+                safe_close(fd);
+                return -ENOMEM;
+        }
+
+        u->fd = fd;
+        u->sq_ring = u->cq_ring = MAP_FAILED;
+        u->sqes = MAP_FAILED;
+
+        u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+                u->sq_ring_size = u->cq_ring_size = MAX(u->sq_ring_size, u->cq_ring_size);
+
+        u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+        if (u->sq_ring == MAP_FAILED) {
+                r = -errno;
+                goto fail;
+        }
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+                u->cq_ring = u->sq_ring;
+        else {
+                u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+                if (u->cq_ring == MAP_FAILED) {
+                        r = -errno;
+                        goto fail;
+                }
+        }
+
+        u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+        if (u->sqes == MAP_FAILED) {
+                r = -errno;
+                goto fail;
+        }
+
+        u->sq_head = (unsigned*) ((uint8_t*) u->sq_ring + p.sq_off.head);
+        u->sq_tail = (unsigned*) ((uint8_t*) u->sq_ring + p.sq_off.tail);
+        u->sq_array = (unsigned*) ((uint8_t*) u->sq_ring + p.sq_off.array);
+        u->sq_mask = *(unsigned*) ((uint8_t*) u->sq_ring + p.sq_off.ring_mask);
+        u->sq_entries = p.sq_entries;
+
+        u->cq_head = (unsigned*) ((uint8_t*) u->cq_ring + p.cq_off.head);
+        u->cq_tail = (unsigned*) ((uint8_t*) u->cq_ring + p.cq_off.tail);
+        u->cqes = (struct io_uring_cqe*) ((uint8_t*) u->cq_ring + p.cq_off.cqes);
+        u->cq_mask = *(unsigned*) ((uint8_t*) u->cq_ring + p.cq_off.ring_mask);
+        u->cq_entries = p.cq_entries;
+
+        *ret = u;
+        return 0;
+
+fail:
+        ca_uring_unref(u);
+        return r;
+}
+
+CaUring* ca_uring_unref(CaUring *u) {
+        if (!u)
+                return NULL;
+
+        if (u->sqes != MAP_FAILED)
+                (void) munmap(u->sqes, u->sqes_size);
+        if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+                (void) munmap(u->cq_ring, u->cq_ring_size);
+        if (u->sq_ring != MAP_FAILED)
+                (void) munmap(u->sq_ring, u->sq_ring_size);
+
+        safe_close(u->fd);
+
+        return mfree(u);
+}
+
+static struct io_uring_sqe *ca_uring_get_sqe(CaUring *u) {
+        struct io_uring_sqe *sqe;
+        unsigned tail, head;
+
+        assert(u);
+
+        /* Don't queue more than the completion ring can take, so that no completion is ever dropped */
+        if (u->n_pending >= u->cq_entries)
+                return NULL;
+
+        tail = *u->sq_tail;
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+        if (tail - head >= u->sq_entries)
+                return NULL;
+
+        sqe = u->sqes + (tail & u->sq_mask);
+        memzero(sqe, sizeof(*sqe));
+
+        return sqe;
+}
+
+static void ca_uring_push_sqe(CaUring *u, struct io_uring_sqe *sqe) {
+        unsigned tail;
+
+        assert(u);
+        assert(sqe);
+
+        tail = *u->sq_tail;
+        u->sq_array[tail & u->sq_mask] = sqe - u->sqes;
+
+        __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        u->n_queued++;
+        u->n_pending++;
+}
+
+int ca_uring_queue_openat(CaUring *u, int dir_fd, const char *path, int flags, uint64_t cookie) {
+        struct io_uring_sqe *sqe;
+
+        if (!u)
+                return -EINVAL;
+        if (dir_fd < 0 && dir_fd != AT_FDCWD)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+
+        sqe = ca_uring_get_sqe(u);
+        if (!sqe)
+                return -EBUSY;
+
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dir_fd;
+        sqe->addr = (uintptr_t) path;
+        sqe->open_flags = flags;
+        sqe->user_data = cookie;
+
+        ca_uring_push_sqe(u, sqe);
+        return 0;
+}
+
+int ca_uring_queue_read(CaUring *u, int fd, void *p, size_t size, uint64_t offset, uint64_t cookie) {
+        struct io_uring_sqe *sqe;
+
+        if (!u)
+                return -EINVAL;
+        if (fd < 0)
+                return -EINVAL;
+        if (!p && size > 0)
+                return -EINVAL;
+        if (size > UINT32_MAX)
+                return -EFBIG;
+
+        sqe = ca_uring_get_sqe(u);
+        if (!sqe)
+                return -EBUSY;
+
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t) p;
+        sqe->len = size;
+        sqe->off = offset;
+        sqe->user_data = cookie;
+
+        ca_uring_push_sqe(u, sqe);
+        return 0;
+}
+
+static int ca_uring_enter(CaUring *u, unsigned min_complete, unsigned flags) {
+        long n;
+
+        assert(u);
+
+        n = syscall(__NR_io_uring_enter, u->fd, u->n_queued, min_complete, flags, NULL, 0);
+        if (n < 0)
+                return -errno;
+
+        assert((unsigned) n <= u->n_queued);
+        u->n_queued -= n;
+
+        return 0;
+}
+
+int ca_uring_submit(CaUring *u) {
+        int r;
+
+        if (!u)
+                return -EINVAL;
+
+        if (u->n_queued == 0)
+                return 0;
+
+        r = ca_uring_enter(u, 0, 0);
+        if (IN_SET(r, -EINTR, -EAGAIN, -EBUSY)) /* Try again with the next call */
+                return 0;
+
+        return r;
+}
+
+int ca_uring_complete(CaUring *u, bool wait, uint64_t *ret_cookie, int *ret_result) {
+        int r;
+
+        if (!u)
+                return -EINVAL;
+        if (!ret_cookie)
+                return -EINVAL;
+        if (!ret_result)
+                return -EINVAL;
+
+        for (;;) {
+                struct io_uring_cqe *cqe;
+                unsigned head, tail;
+
+                head = *u->cq_head;
+                tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+                if (head != tail) {
+                        cqe = u->cqes + (head & u->cq_mask);
+
+                        *ret_cookie = cqe->user_data;
+                        *ret_result = cqe->res;
+
+                        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+                        assert(u->n_pending > 0);
+                        u->n_pending--;
+
+                        return 0;
+                }
+
+                if (u->n_pending == 0)
+                        return -ENODATA;
+                if (!wait)
+                        return -EAGAIN;
+
+                r = ca_uring_enter(u, 1, IORING_ENTER_GETEVENTS);
+                if (r < 0 && !IN_SET(r, -EINTR, -EAGAIN, -EBUSY))
+                        return r;
+        }
+}
+
+size_t ca_uring_pending(CaUring *u) {
+        if (!u)
+                return 0;
+
+        return u->n_pending;
+}
+
+#else
+
+int ca_uring_new(unsigned entries, CaUring **ret) {
+        return -EOPNOTSUPP;
+}
+
+CaUring* ca_uring_unref(CaUring *u) {
+        assert(!u);
+        return NULL;
+}
+
+int ca_uring_queue_openat(CaUring *u, int dir_fd, const char *path, int flags, uint64_t cookie) {
+        return -EOPNOTSUPP;
+}
+
+int ca_uring_queue_read(CaUring *u, int fd, void *p, size_t size, uint64_t offset, uint64_t cookie) {
+        return -EOPNOTSUPP;
+}
+
+int ca_uring_submit(CaUring *u) {
+        return -EOPNOTSUPP;
+}
+
+int ca_uring_complete(CaUring *u, bool wait, uint64_t *ret_cookie, int *ret_result) {
+        return -EOPNOTSUPP;
+}
+
+size_t ca_uring_pending(CaUring *u) {
+        return 0;
+}
+
+#endif
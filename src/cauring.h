@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef foocauringhfoo
+#define foocauringhfoo
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util.h"
+
+/* A minimal io_uring submission and completion queue, driven through the system calls directly. Operations are queued
+ * with a caller-chosen cookie, which is returned along with their result once they completed. On kernels without (a
+ * sufficiently recent) io_uring ca_uring_new() fails with -EOPNOTSUPP, and callers are expected to do their I/O
+ * synchronously instead. */
+
+typedef struct CaUring CaUring;
+
+int ca_uring_new(unsigned entries, CaUring **ret);
+CaUring* ca_uring_unref(CaUring *u);
+DEFINE_TRIVIAL_CLEANUP_FUNC(CaUring*, ca_uring_unref);
+
+/* Queue an operation. 'path' resp. 'p' have to stay valid until the operation completed. Returns -EBUSY if there's
+ * no room for further operations until some completed. */
+int ca_uring_queue_openat(CaUring *u, int dir_fd, const char *path, int flags, uint64_t cookie);
+int ca_uring_queue_read(CaUring *u, int fd, void *p, size_t size, uint64_t offset, uint64_t cookie);
+
+/* Passes the queued operations on to the kernel */
+int ca_uring_submit(CaUring *u);
+
+/* Returns the cookie and result (a negative errno, or what the system call would have returned) of the next
+ * completed operation. Returns -EAGAIN if none completed yet and 'wait' is false, and -ENODATA if there's nothing in
+ * flight at all. */
+int ca_uring_complete(CaUring *u, bool wait, uint64_t *ret_cookie, int *ret_result);
+
+/* The number of operations queued or in flight, whose completion hasn't been returned yet */
+size_t ca_uring_pending(CaUring *u);
+
+#endif
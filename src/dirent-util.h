@@ -29,6 +29,8 @@
 
 bool dirent_is_file_with_suffix(const struct dirent *de, const char *suffix) _pure_;
 
+DEFINE_TRIVIAL_CLEANUP_FUNC(DIR*, closedir);
+
 struct dirent* readdir_no_dot(DIR *dirp);
 
 #define FOREACH_DIRENT_ALL(de, d, on_error)                             \
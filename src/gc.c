@@ -12,21 +12,6 @@ struct CaChunkCollection {
         Set *used_chunks;
 };
 
-static void chunk_hash_func(const void *p, struct siphash *state) {
-        const CaChunkID *id = p;
-
-        siphash24_compress(id, sizeof(CaChunkID), state);
-}
-
-static int chunk_compare_func(const void *a, const void *b) {
-        return memcmp(a, b, sizeof(CaChunkID));
-}
-
-const struct hash_ops chunk_hash_ops = {
-        .hash = chunk_hash_func,
-        .compare = chunk_compare_func,
-};
-
 CaChunkCollection* ca_chunk_collection_new(void) {
         CaChunkCollection *c;
 
@@ -34,7 +19,7 @@ CaChunkCollection* ca_chunk_collection_new(void) {
         if (!c)
                 return NULL;
 
-        c->used_chunks = set_new(&chunk_hash_ops);
+        c->used_chunks = set_new(&ca_chunk_id_hash_ops);
 
         return c;
 }
@@ -124,9 +109,7 @@ int ca_chunk_collection_add_index(CaChunkCollection *coll, const char *path) {
 }
 
 int ca_gc_cleanup_unused(CaStore *store, CaChunkCollection *coll, unsigned flags) {
-        _cleanup_free_ char *ids = NULL;
-        size_t ids_size = 0;
-        size_t removed_chunks = 0, all_chunks = 0, removed_dirs = 0;
+        size_t removed_chunks = 0, all_chunks = 0;
         int r;
 
         if (!store || !coll)
@@ -137,11 +120,10 @@ int ca_gc_cleanup_unused(CaStore *store, CaChunkCollection *coll, unsigned flags
                 return log_oom();
 
         while (true) {
-                int rootdir_fd, subdir_fd;
-                const char *subdir, *chunk, *dot;
+                char ids[CA_CHUNK_ID_FORMAT_MAX];
                 CaChunkID id;
 
-                r = ca_store_iterator_next(iter, &rootdir_fd, &subdir, &subdir_fd, &chunk);
+                r = ca_store_iterator_next(iter, &id);
                 if (r < 0)
                         return log_error_errno(r, "Failed to iterate over store: %m");
                 if (r == 0)
@@ -149,45 +131,37 @@ int ca_gc_cleanup_unused(CaStore *store, CaChunkCollection *coll, unsigned flags
 
                 all_chunks++;
 
-                assert_se(dot = strchr(chunk, '.')); /* we requested .chunk extension before */
-                if (!GREEDY_REALLOC(ids, ids_size, dot - chunk + 1))
-                        return log_oom();
-
-                strncpy(ids, chunk, dot - chunk);
-                ids[dot - chunk] = '\0';
-                if (!ca_chunk_id_parse(ids, &id)) {
-                        log_error("Failed to parse chunk ID \"%s\", ignoring.", ids);
-                        continue;
-                }
-
                 if (set_contains(coll->used_chunks, &id))
                         continue;
 
                 if (flags & CA_GC_VERBOSE)
                         printf("%s chunk %s.\n",
                                flags & CA_GC_DRY_RUN ? "Would remove" : "Removing",
-                               chunk);
+                               ca_chunk_id_format(&id, ids));
 
                 if (!(flags & CA_GC_DRY_RUN)) {
-                        if (unlinkat(subdir_fd, chunk, 0) < 0) {
-                                log_error_errno(errno,
-                                                "Failed to unlink chunk file \"%s\", ignoring: %m", chunk);
+                        r = ca_store_remove(store, &id);
+                        if (r < 0) {
+                                log_error_errno(r, "Failed to remove chunk %s, ignoring: %m", ca_chunk_id_format(&id, ids));
                                 continue;
                         }
-
-                        r = unlinkat(rootdir_fd, subdir, AT_REMOVEDIR);
-                        if (r >= 0)
-                                removed_dirs++;
                 }
 
                 removed_chunks++;
         }
 
+        /* Chunks in packfiles are only dropped now, by rewriting the packfiles containing them */
+        if (!(flags & CA_GC_DRY_RUN)) {
+                r = ca_store_compact(store);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to compact packfiles: %m");
+        }
+
         if (flags & CA_GC_DRY_RUN)
                 printf("Would remove %zu chunks, %zu chunks remaining.\n",
                        removed_chunks, all_chunks - removed_chunks);
         else if (flags & CA_GC_VERBOSE)
-                printf("Removed %zu chunks, %zu directories, %zu chunks remaining.\n",
-                       removed_chunks, removed_dirs, all_chunks - removed_chunks);
+                printf("Removed %zu chunks, %zu chunks remaining.\n",
+                       removed_chunks, all_chunks - removed_chunks);
         return 0;
 }
@@ -0,0 +1,837 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <endian.h>
+#include <string.h>
+
+#include "sha2-multibuffer.h"
+#include "util.h"
+
+#if SHA2_MULTI_BUFFER_HAVE_AVX2 || SHA2_MULTI_BUFFER_HAVE_AVX512
+#  include <immintrin.h>
+#endif
+
+#define SHA256_BLOCK_LEN 64
+#define SHA512_BLOCK_LEN 128
+#define SHA2_BLOCK_LEN_MAX SHA512_BLOCK_LEN
+
+/* The number of buffers processed at once by the portable and AVX2 code, and by the AVX512 code */
+#define SHA256_LANES 8
+#define SHA512_LANES 4
+#define SHA512_LANES_AVX512 8
+#define SHA2_LANES_MAX 8
+
+static const uint32_t sha256_iv[8] = {
+        UINT32_C(0x6a09e667), UINT32_C(0xbb67ae85), UINT32_C(0x3c6ef372), UINT32_C(0xa54ff53a),
+        UINT32_C(0x510e527f), UINT32_C(0x9b05688c), UINT32_C(0x1f83d9ab), UINT32_C(0x5be0cd19),
+};
+
+static const uint32_t sha256_k[64] = {
+        UINT32_C(0x428a2f98), UINT32_C(0x71374491), UINT32_C(0xb5c0fbcf), UINT32_C(0xe9b5dba5),
+        UINT32_C(0x3956c25b), UINT32_C(0x59f111f1), UINT32_C(0x923f82a4), UINT32_C(0xab1c5ed5),
+        UINT32_C(0xd807aa98), UINT32_C(0x12835b01), UINT32_C(0x243185be), UINT32_C(0x550c7dc3),
+        UINT32_C(0x72be5d74), UINT32_C(0x80deb1fe), UINT32_C(0x9bdc06a7), UINT32_C(0xc19bf174),
+        UINT32_C(0xe49b69c1), UINT32_C(0xefbe4786), UINT32_C(0x0fc19dc6), UINT32_C(0x240ca1cc),
+        UINT32_C(0x2de92c6f), UINT32_C(0x4a7484aa), UINT32_C(0x5cb0a9dc), UINT32_C(0x76f988da),
+        UINT32_C(0x983e5152), UINT32_C(0xa831c66d), UINT32_C(0xb00327c8), UINT32_C(0xbf597fc7),
+        UINT32_C(0xc6e00bf3), UINT32_C(0xd5a79147), UINT32_C(0x06ca6351), UINT32_C(0x14292967),
+        UINT32_C(0x27b70a85), UINT32_C(0x2e1b2138), UINT32_C(0x4d2c6dfc), UINT32_C(0x53380d13),
+        UINT32_C(0x650a7354), UINT32_C(0x766a0abb), UINT32_C(0x81c2c92e), UINT32_C(0x92722c85),
+        UINT32_C(0xa2bfe8a1), UINT32_C(0xa81a664b), UINT32_C(0xc24b8b70), UINT32_C(0xc76c51a3),
+        UINT32_C(0xd192e819), UINT32_C(0xd6990624), UINT32_C(0xf40e3585), UINT32_C(0x106aa070),
+        UINT32_C(0x19a4c116), UINT32_C(0x1e376c08), UINT32_C(0x2748774c), UINT32_C(0x34b0bcb5),
+        UINT32_C(0x391c0cb3), UINT32_C(0x4ed8aa4a), UINT32_C(0x5b9cca4f), UINT32_C(0x682e6ff3),
+        UINT32_C(0x748f82ee), UINT32_C(0x78a5636f), UINT32_C(0x84c87814), UINT32_C(0x8cc70208),
+        UINT32_C(0x90befffa), UINT32_C(0xa4506ceb), UINT32_C(0xbef9a3f7), UINT32_C(0xc67178f2),
+};
+
+/* SHA512/256 is SHA512 with different start values, truncated to 256 bit */
+static const uint64_t sha512_256_iv[8] = {
+        UINT64_C(0x22312194fc2bf72c), UINT64_C(0x9f555fa3c84c64c2), UINT64_C(0x2393b86b6f53b151), UINT64_C(0x963877195940eabd),
+        UINT64_C(0x96283ee2a88effe3), UINT64_C(0xbe5e1e2553863992), UINT64_C(0x2b0199fc2c85b8aa), UINT64_C(0x0eb72ddc81c52ca2),
+};
+
+static const uint64_t sha512_k[80] = {
+        UINT64_C(0x428a2f98d728ae22), UINT64_C(0x7137449123ef65cd), UINT64_C(0xb5c0fbcfec4d3b2f), UINT64_C(0xe9b5dba58189dbbc),
+        UINT64_C(0x3956c25bf348b538), UINT64_C(0x59f111f1b605d019), UINT64_C(0x923f82a4af194f9b), UINT64_C(0xab1c5ed5da6d8118),
+        UINT64_C(0xd807aa98a3030242), UINT64_C(0x12835b0145706fbe), UINT64_C(0x243185be4ee4b28c), UINT64_C(0x550c7dc3d5ffb4e2),
+        UINT64_C(0x72be5d74f27b896f), UINT64_C(0x80deb1fe3b1696b1), UINT64_C(0x9bdc06a725c71235), UINT64_C(0xc19bf174cf692694),
+        UINT64_C(0xe49b69c19ef14ad2), UINT64_C(0xefbe4786384f25e3), UINT64_C(0x0fc19dc68b8cd5b5), UINT64_C(0x240ca1cc77ac9c65),
+        UINT64_C(0x2de92c6f592b0275), UINT64_C(0x4a7484aa6ea6e483), UINT64_C(0x5cb0a9dcbd41fbd4), UINT64_C(0x76f988da831153b5),
+        UINT64_C(0x983e5152ee66dfab), UINT64_C(0xa831c66d2db43210), UINT64_C(0xb00327c898fb213f), UINT64_C(0xbf597fc7beef0ee4),
+        UINT64_C(0xc6e00bf33da88fc2), UINT64_C(0xd5a79147930aa725), UINT64_C(0x06ca6351e003826f), UINT64_C(0x142929670a0e6e70),
+        UINT64_C(0x27b70a8546d22ffc), UINT64_C(0x2e1b21385c26c926), UINT64_C(0x4d2c6dfc5ac42aed), UINT64_C(0x53380d139d95b3df),
+        UINT64_C(0x650a73548baf63de), UINT64_C(0x766a0abb3c77b2a8), UINT64_C(0x81c2c92e47edaee6), UINT64_C(0x92722c851482353b),
+        UINT64_C(0xa2bfe8a14cf10364), UINT64_C(0xa81a664bbc423001), UINT64_C(0xc24b8b70d0f89791), UINT64_C(0xc76c51a30654be30),
+        UINT64_C(0xd192e819d6ef5218), UINT64_C(0xd69906245565a910), UINT64_C(0xf40e35855771202a), UINT64_C(0x106aa07032bbd1b8),
+        UINT64_C(0x19a4c116b8d2d0c8), UINT64_C(0x1e376c085141ab53), UINT64_C(0x2748774cdf8eeb99), UINT64_C(0x34b0bcb5e19b48a8),
+        UINT64_C(0x391c0cb3c5c95a63), UINT64_C(0x4ed8aa4ae3418acb), UINT64_C(0x5b9cca4f7763e373), UINT64_C(0x682e6ff3d6b2b8a3),
+        UINT64_C(0x748f82ee5defb2fc), UINT64_C(0x78a5636f43172f60), UINT64_C(0x84c87814a1f0ab72), UINT64_C(0x8cc702081a6439ec),
+        UINT64_C(0x90befffa23631e28), UINT64_C(0xa4506cebde82bde9), UINT64_C(0xbef9a3f7b2c67915), UINT64_C(0xc67178f2e372532b),
+        UINT64_C(0xca273eceea26619c), UINT64_C(0xd186b8c721c0c207), UINT64_C(0xeada7dd6cde0eb1e), UINT64_C(0xf57d4f7fee6ed178),
+        UINT64_C(0x06f067aa72176fba), UINT64_C(0x0a637dc5a2c898a6), UINT64_C(0x113f9804bef90dae), UINT64_C(0x1b710b35131c471b),
+        UINT64_C(0x28db77f523047d84), UINT64_C(0x32caab7b40c72493), UINT64_C(0x3c9ebe0a15c9bebc), UINT64_C(0x431d67c49c100d4c),
+        UINT64_C(0x4cc5d4becb3e42b6), UINT64_C(0x597f299cfc657e2a), UINT64_C(0x5fcb6fab3ad6faec), UINT64_C(0x6c44198c4a475817),
+};
+
+/* The state of all lanes is kept interleaved, i.e. as state[word][lane], so that the SIMD code can load the n-th
+ * word of all lanes with a single instruction */
+typedef void (*Sha2BlocksFunc)(void *state, const uint8_t *const p[], size_t n_blocks);
+
+typedef struct Sha2MultiBufferAlgorithm {
+        size_t n_lanes[_SHA2_MULTI_BUFFER_KERNEL_MAX];
+        size_t block_len;
+        size_t word_size;
+        const void *iv;
+        Sha2BlocksFunc blocks[_SHA2_MULTI_BUFFER_KERNEL_MAX];
+} Sha2MultiBufferAlgorithm;
+
+static inline uint32_t rotr32(uint32_t x, unsigned n) {
+        return (x >> n) | (x << (32 - n));
+}
+
+static inline uint64_t rotr64(uint64_t x, unsigned n) {
+        return (x >> n) | (x << (64 - n));
+}
+
+static inline uint32_t load_be32(const uint8_t *p) {
+        uint32_t x;
+
+        memcpy(&x, p, sizeof(x));
+        return be32toh(x);
+}
+
+static inline uint64_t load_be64(const uint8_t *p) {
+        uint64_t x;
+
+        memcpy(&x, p, sizeof(x));
+        return be64toh(x);
+}
+
+static void sha256_compress_portable(uint32_t h[8], const uint8_t *p) {
+        uint32_t w[64], v[8];
+        unsigned t;
+
+        for (t = 0; t < 16; t++)
+                w[t] = load_be32(p + t * 4);
+        for (; t < 64; t++) {
+                uint32_t s0, s1;
+
+                s0 = rotr32(w[t-15], 7) ^ rotr32(w[t-15], 18) ^ (w[t-15] >> 3);
+                s1 = rotr32(w[t-2], 17) ^ rotr32(w[t-2], 19) ^ (w[t-2] >> 10);
+                w[t] = w[t-16] + s0 + w[t-7] + s1;
+        }
+
+        memcpy(v, h, sizeof(v));
+
+        for (t = 0; t < 64; t++) {
+                uint32_t t1, t2;
+
+                t1 = v[7] + (rotr32(v[4], 6) ^ rotr32(v[4], 11) ^ rotr32(v[4], 25)) +
+                        ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[t] + w[t];
+                t2 = (rotr32(v[0], 2) ^ rotr32(v[0], 13) ^ rotr32(v[0], 22)) +
+                        ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+
+                memmove(v + 1, v, sizeof(uint32_t) * 7);
+                v[4] += t1;
+                v[0] = t1 + t2;
+        }
+
+        for (t = 0; t < 8; t++)
+                h[t] += v[t];
+}
+
+static void sha256_blocks_portable(void *state, const uint8_t *const p[], size_t n_blocks) {
+        uint32_t (*s)[SHA256_LANES] = state;
+        size_t j, b, i;
+
+        for (j = 0; j < SHA256_LANES; j++) {
+                uint32_t h[8];
+
+                for (i = 0; i < 8; i++)
+                        h[i] = s[i][j];
+
+                for (b = 0; b < n_blocks; b++)
+                        sha256_compress_portable(h, p[j] + b * SHA256_BLOCK_LEN);
+
+                for (i = 0; i < 8; i++)
+                        s[i][j] = h[i];
+        }
+}
+
+static void sha512_compress_portable(uint64_t h[8], const uint8_t *p) {
+        uint64_t w[80], v[8];
+        unsigned t;
+
+        for (t = 0; t < 16; t++)
+                w[t] = load_be64(p + t * 8);
+        for (; t < 80; t++) {
+                uint64_t s0, s1;
+
+                s0 = rotr64(w[t-15], 1) ^ rotr64(w[t-15], 8) ^ (w[t-15] >> 7);
+                s1 = rotr64(w[t-2], 19) ^ rotr64(w[t-2], 61) ^ (w[t-2] >> 6);
+                w[t] = w[t-16] + s0 + w[t-7] + s1;
+        }
+
+        memcpy(v, h, sizeof(v));
+
+        for (t = 0; t < 80; t++) {
+                uint64_t t1, t2;
+
+                t1 = v[7] + (rotr64(v[4], 14) ^ rotr64(v[4], 18) ^ rotr64(v[4], 41)) +
+                        ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha512_k[t] + w[t];
+                t2 = (rotr64(v[0], 28) ^ rotr64(v[0], 34) ^ rotr64(v[0], 39)) +
+                        ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+
+                memmove(v + 1, v, sizeof(uint64_t) * 7);
+                v[4] += t1;
+                v[0] = t1 + t2;
+        }
+
+        for (t = 0; t < 8; t++)
+                h[t] += v[t];
+}
+
+static void sha512_blocks_portable(void *state, const uint8_t *const p[], size_t n_blocks) {
+        uint64_t (*s)[SHA512_LANES] = state;
+        size_t j, b, i;
+
+        for (j = 0; j < SHA512_LANES; j++) {
+                uint64_t h[8];
+
+                for (i = 0; i < 8; i++)
+                        h[i] = s[i][j];
+
+                for (b = 0; b < n_blocks; b++)
+                        sha512_compress_portable(h, p[j] + b * SHA512_BLOCK_LEN);
+
+                for (i = 0; i < 8; i++)
+                        s[i][j] = h[i];
+        }
+}
+
+#if SHA2_MULTI_BUFFER_HAVE_AVX2
+
+/* In the round functions below the working variables a…h are kept in v[], rotated by one position in each round
+ * instead of being moved around. 'i' is the number of the round modulo 8, and must be a constant, so that v[] can
+ * live in registers. */
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i rotr32_avx2(__m256i x, int n) {
+        return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void sha256_round_avx2(__m256i *v, unsigned i, __m256i kw) {
+        __m256i a = v[(0 - i) & 7], b = v[(1 - i) & 7], c = v[(2 - i) & 7], d = v[(3 - i) & 7],
+                e = v[(4 - i) & 7], f = v[(5 - i) & 7], g = v[(6 - i) & 7], h = v[(7 - i) & 7];
+        __m256i t1, t2;
+
+        t1 = _mm256_add_epi32(h, _mm256_xor_si256(_mm256_xor_si256(rotr32_avx2(e, 6), rotr32_avx2(e, 11)), rotr32_avx2(e, 25)));
+        t1 = _mm256_add_epi32(t1, _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)));
+        t1 = _mm256_add_epi32(t1, kw);
+
+        t2 = _mm256_xor_si256(_mm256_xor_si256(rotr32_avx2(a, 2), rotr32_avx2(a, 13)), rotr32_avx2(a, 22));
+        t2 = _mm256_add_epi32(t2, _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b))));
+
+        v[(3 - i) & 7] = _mm256_add_epi32(d, t1);
+        v[(7 - i) & 7] = _mm256_add_epi32(t1, t2);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void sha256_rounds8_avx2(__m256i *v, const __m256i *w, const uint32_t *k) {
+        sha256_round_avx2(v, 0, _mm256_add_epi32(w[0], _mm256_set1_epi32((int) k[0])));
+        sha256_round_avx2(v, 1, _mm256_add_epi32(w[1], _mm256_set1_epi32((int) k[1])));
+        sha256_round_avx2(v, 2, _mm256_add_epi32(w[2], _mm256_set1_epi32((int) k[2])));
+        sha256_round_avx2(v, 3, _mm256_add_epi32(w[3], _mm256_set1_epi32((int) k[3])));
+        sha256_round_avx2(v, 4, _mm256_add_epi32(w[4], _mm256_set1_epi32((int) k[4])));
+        sha256_round_avx2(v, 5, _mm256_add_epi32(w[5], _mm256_set1_epi32((int) k[5])));
+        sha256_round_avx2(v, 6, _mm256_add_epi32(w[6], _mm256_set1_epi32((int) k[6])));
+        sha256_round_avx2(v, 7, _mm256_add_epi32(w[7], _mm256_set1_epi32((int) k[7])));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void sha256_schedule_avx2(__m256i w[16]) {
+        unsigned j;
+
+        /* Calculates the next 16 words of the message schedule, in place */
+
+        for (j = 0; j < 16; j++) {
+                __m256i x = w[(j + 1) & 15], y = w[(j + 14) & 15], s0, s1;
+
+                s0 = _mm256_xor_si256(_mm256_xor_si256(rotr32_avx2(x, 7), rotr32_avx2(x, 18)), _mm256_srli_epi32(x, 3));
+                s1 = _mm256_xor_si256(_mm256_xor_si256(rotr32_avx2(y, 17), rotr32_avx2(y, 19)), _mm256_srli_epi32(y, 10));
+
+                w[j] = _mm256_add_epi32(_mm256_add_epi32(w[j], s0), _mm256_add_epi32(w[(j + 9) & 15], s1));
+        }
+}
+
+__attribute__((target("avx2")))
+static void transpose32_avx2(__m256i v[8]) {
+        __m256i t[8], u[8];
+
+        /* Turns eight vectors of eight 32bit words each into eight vectors made of the n-th word of each */
+
+        t[0] = _mm256_unpacklo_epi32(v[0], v[1]);
+        t[1] = _mm256_unpackhi_epi32(v[0], v[1]);
+        t[2] = _mm256_unpacklo_epi32(v[2], v[3]);
+        t[3] = _mm256_unpackhi_epi32(v[2], v[3]);
+        t[4] = _mm256_unpacklo_epi32(v[4], v[5]);
+        t[5] = _mm256_unpackhi_epi32(v[4], v[5]);
+        t[6] = _mm256_unpacklo_epi32(v[6], v[7]);
+        t[7] = _mm256_unpackhi_epi32(v[6], v[7]);
+
+        u[0] = _mm256_unpacklo_epi64(t[0], t[2]);
+        u[1] = _mm256_unpackhi_epi64(t[0], t[2]);
+        u[2] = _mm256_unpacklo_epi64(t[1], t[3]);
+        u[3] = _mm256_unpackhi_epi64(t[1], t[3]);
+        u[4] = _mm256_unpacklo_epi64(t[4], t[6]);
+        u[5] = _mm256_unpackhi_epi64(t[4], t[6]);
+        u[6] = _mm256_unpacklo_epi64(t[5], t[7]);
+        u[7] = _mm256_unpackhi_epi64(t[5], t[7]);
+
+        v[0] = _mm256_permute2x128_si256(u[0], u[4], 0x20);
+        v[1] = _mm256_permute2x128_si256(u[1], u[5], 0x20);
+        v[2] = _mm256_permute2x128_si256(u[2], u[6], 0x20);
+        v[3] = _mm256_permute2x128_si256(u[3], u[7], 0x20);
+        v[4] = _mm256_permute2x128_si256(u[0], u[4], 0x31);
+        v[5] = _mm256_permute2x128_si256(u[1], u[5], 0x31);
+        v[6] = _mm256_permute2x128_si256(u[2], u[6], 0x31);
+        v[7] = _mm256_permute2x128_si256(u[3], u[7], 0x31);
+}
+
+__attribute__((target("avx2")))
+static void sha256_blocks_avx2(void *state, const uint8_t *const p[], size_t n_blocks) {
+        uint32_t (*s)[SHA256_LANES] = state;
+        __m256i h[8], bswap;
+        size_t b;
+        unsigned i, t;
+
+        bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+        for (i = 0; i < 8; i++)
+                h[i] = _mm256_loadu_si256((const __m256i*) s[i]);
+
+        for (b = 0; b < n_blocks; b++) {
+                __m256i w[16], v[8];
+
+                /* Load the b-th block of each lane, and transpose it, so that w[j] contains the j-th message word
+                 * of each lane */
+                for (i = 0; i < SHA256_LANES; i++) {
+                        const uint8_t *q = p[i] + b * SHA256_BLOCK_LEN;
+
+                        w[i] = _mm256_loadu_si256((const __m256i*) q);
+                        w[i + 8] = _mm256_loadu_si256((const __m256i*) (q + 32));
+                }
+                transpose32_avx2(w);
+                transpose32_avx2(w + 8);
+
+                for (i = 0; i < 16; i++)
+                        w[i] = _mm256_shuffle_epi8(w[i], bswap);
+
+                for (i = 0; i < 8; i++)
+                        v[i] = h[i];
+
+                for (t = 0; t < 64; t += 16) {
+                        if (t > 0)
+                                sha256_schedule_avx2(w);
+
+                        sha256_rounds8_avx2(v, w, sha256_k + t);
+                        sha256_rounds8_avx2(v, w + 8, sha256_k + t + 8);
+                }
+
+                for (i = 0; i < 8; i++)
+                        h[i] = _mm256_add_epi32(h[i], v[i]);
+        }
+
+        for (i = 0; i < 8; i++)
+                _mm256_storeu_si256((__m256i*) s[i], h[i]);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i rotr64_avx2(__m256i x, int n) {
+        return _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - n));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void sha512_round_avx2(__m256i *v, unsigned i, __m256i kw) {
+        __m256i a = v[(0 - i) & 7], b = v[(1 - i) & 7], c = v[(2 - i) & 7], d = v[(3 - i) & 7],
+                e = v[(4 - i) & 7], f = v[(5 - i) & 7], g = v[(6 - i) & 7], h = v[(7 - i) & 7];
+        __m256i t1, t2;
+
+        t1 = _mm256_add_epi64(h, _mm256_xor_si256(_mm256_xor_si256(rotr64_avx2(e, 14), rotr64_avx2(e, 18)), rotr64_avx2(e, 41)));
+        t1 = _mm256_add_epi64(t1, _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)));
+        t1 = _mm256_add_epi64(t1, kw);
+
+        t2 = _mm256_xor_si256(_mm256_xor_si256(rotr64_avx2(a, 28), rotr64_avx2(a, 34)), rotr64_avx2(a, 39));
+        t2 = _mm256_add_epi64(t2, _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b))));
+
+        v[(3 - i) & 7] = _mm256_add_epi64(d, t1);
+        v[(7 - i) & 7] = _mm256_add_epi64(t1, t2);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void sha512_rounds8_avx2(__m256i *v, const __m256i *w, const uint64_t *k) {
+        sha512_round_avx2(v, 0, _mm256_add_epi64(w[0], _mm256_set1_epi64x((long long) k[0])));
+        sha512_round_avx2(v, 1, _mm256_add_epi64(w[1], _mm256_set1_epi64x((long long) k[1])));
+        sha512_round_avx2(v, 2, _mm256_add_epi64(w[2], _mm256_set1_epi64x((long long) k[2])));
+        sha512_round_avx2(v, 3, _mm256_add_epi64(w[3], _mm256_set1_epi64x((long long) k[3])));
+        sha512_round_avx2(v, 4, _mm256_add_epi64(w[4], _mm256_set1_epi64x((long long) k[4])));
+        sha512_round_avx2(v, 5, _mm256_add_epi64(w[5], _mm256_set1_epi64x((long long) k[5])));
+        sha512_round_avx2(v, 6, _mm256_add_epi64(w[6], _mm256_set1_epi64x((long long) k[6])));
+        sha512_round_avx2(v, 7, _mm256_add_epi64(w[7], _mm256_set1_epi64x((long long) k[7])));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void sha512_schedule_avx2(__m256i w[16]) {
+        unsigned j;
+
+        for (j = 0; j < 16; j++) {
+                __m256i x = w[(j + 1) & 15], y = w[(j + 14) & 15], s0, s1;
+
+                s0 = _mm256_xor_si256(_mm256_xor_si256(rotr64_avx2(x, 1), rotr64_avx2(x, 8)), _mm256_srli_epi64(x, 7));
+                s1 = _mm256_xor_si256(_mm256_xor_si256(rotr64_avx2(y, 19), rotr64_avx2(y, 61)), _mm256_srli_epi64(y, 6));
+
+                w[j] = _mm256_add_epi64(_mm256_add_epi64(w[j], s0), _mm256_add_epi64(w[(j + 9) & 15], s1));
+        }
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void transpose64_avx2(__m256i v[4]) {
+        __m256i t[4];
+
+        /* Turns four vectors of four 64bit words each into four vectors made of the n-th word of each */
+
+        t[0] = _mm256_unpacklo_epi64(v[0], v[1]);
+        t[1] = _mm256_unpackhi_epi64(v[0], v[1]);
+        t[2] = _mm256_unpacklo_epi64(v[2], v[3]);
+        t[3] = _mm256_unpackhi_epi64(v[2], v[3]);
+
+        v[0] = _mm256_permute2x128_si256(t[0], t[2], 0x20);
+        v[1] = _mm256_permute2x128_si256(t[1], t[3], 0x20);
+        v[2] = _mm256_permute2x128_si256(t[0], t[2], 0x31);
+        v[3] = _mm256_permute2x128_si256(t[1], t[3], 0x31);
+}
+
+__attribute__((target("avx2")))
+static void sha512_blocks_avx2(void *state, const uint8_t *const p[], size_t n_blocks) {
+        uint64_t (*s)[SHA512_LANES] = state;
+        __m256i h[8], bswap;
+        size_t b;
+        unsigned i, j, t;
+
+        bswap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+
+        for (i = 0; i < 8; i++)
+                h[i] = _mm256_loadu_si256((const __m256i*) s[i]);
+
+        for (b = 0; b < n_blocks; b++) {
+                __m256i w[16], v[8];
+
+                for (j = 0; j < 4; j++) {
+                        for (i = 0; i < SHA512_LANES; i++)
+                                w[j * 4 + i] = _mm256_loadu_si256((const __m256i*) (p[i] + b * SHA512_BLOCK_LEN + j * 32));
+
+                        transpose64_avx2(w + j * 4);
+                }
+
+                for (i = 0; i < 16; i++)
+                        w[i] = _mm256_shuffle_epi8(w[i], bswap);
+
+                for (i = 0; i < 8; i++)
+                        v[i] = h[i];
+
+                for (t = 0; t < 80; t += 16) {
+                        if (t > 0)
+                                sha512_schedule_avx2(w);
+
+                        sha512_rounds8_avx2(v, w, sha512_k + t);
+                        sha512_rounds8_avx2(v, w + 8, sha512_k + t + 8);
+                }
+
+                for (i = 0; i < 8; i++)
+                        h[i] = _mm256_add_epi64(h[i], v[i]);
+        }
+
+        for (i = 0; i < 8; i++)
+                _mm256_storeu_si256((__m256i*) s[i], h[i]);
+}
+
+#endif
+
+#if SHA2_MULTI_BUFFER_HAVE_AVX512
+
+/* AVX512 has 64bit rotations and three-way logic operations built in, and twice as many lanes as AVX2, hence it's
+ * well worth it for SHA512. There's no SHA256 code for it, as CPUs with AVX512 tend to have the SHA extensions, which
+ * are faster. Note that the zero-masking variants of some intrinsics are used with a full mask below, as the unmasked
+ * ones of older GCC versions trip up -Winit-self. */
+
+__attribute__((target("avx512f"), always_inline))
+static inline __m512i rotr64_avx512(__m512i x, int n) {
+        return _mm512_maskz_ror_epi64((__mmask8) 0xFF, x, n);
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline __m512i shr64_avx512(__m512i x, int n) {
+        return _mm512_maskz_srli_epi64((__mmask8) 0xFF, x, n);
+}
+
+__attribute__((target("avx512f,avx512bw"), always_inline))
+static inline void sha512_round_avx512(__m512i *v, unsigned i, __m512i kw) {
+        __m512i a = v[(0 - i) & 7], b = v[(1 - i) & 7], c = v[(2 - i) & 7], d = v[(3 - i) & 7],
+                e = v[(4 - i) & 7], f = v[(5 - i) & 7], g = v[(6 - i) & 7], h = v[(7 - i) & 7];
+        __m512i t1, t2;
+
+        /* 0x96 is the truth table of a ^ b ^ c, 0xCA of (a & b) ^ (~a & c), 0xE8 of the majority function */
+
+        t1 = _mm512_add_epi64(h, _mm512_ternarylogic_epi64(rotr64_avx512(e, 14), rotr64_avx512(e, 18), rotr64_avx512(e, 41), 0x96));
+        t1 = _mm512_add_epi64(t1, _mm512_ternarylogic_epi64(e, f, g, 0xCA));
+        t1 = _mm512_add_epi64(t1, kw);
+
+        t2 = _mm512_ternarylogic_epi64(rotr64_avx512(a, 28), rotr64_avx512(a, 34), rotr64_avx512(a, 39), 0x96);
+        t2 = _mm512_add_epi64(t2, _mm512_ternarylogic_epi64(a, b, c, 0xE8));
+
+        v[(3 - i) & 7] = _mm512_add_epi64(d, t1);
+        v[(7 - i) & 7] = _mm512_add_epi64(t1, t2);
+}
+
+__attribute__((target("avx512f,avx512bw"), always_inline))
+static inline void sha512_rounds8_avx512(__m512i *v, const __m512i *w, const uint64_t *k) {
+        sha512_round_avx512(v, 0, _mm512_add_epi64(w[0], _mm512_set1_epi64((long long) k[0])));
+        sha512_round_avx512(v, 1, _mm512_add_epi64(w[1], _mm512_set1_epi64((long long) k[1])));
+        sha512_round_avx512(v, 2, _mm512_add_epi64(w[2], _mm512_set1_epi64((long long) k[2])));
+        sha512_round_avx512(v, 3, _mm512_add_epi64(w[3], _mm512_set1_epi64((long long) k[3])));
+        sha512_round_avx512(v, 4, _mm512_add_epi64(w[4], _mm512_set1_epi64((long long) k[4])));
+        sha512_round_avx512(v, 5, _mm512_add_epi64(w[5], _mm512_set1_epi64((long long) k[5])));
+        sha512_round_avx512(v, 6, _mm512_add_epi64(w[6], _mm512_set1_epi64((long long) k[6])));
+        sha512_round_avx512(v, 7, _mm512_add_epi64(w[7], _mm512_set1_epi64((long long) k[7])));
+}
+
+__attribute__((target("avx512f,avx512bw"), always_inline))
+static inline void sha512_schedule_avx512(__m512i w[16]) {
+        unsigned j;
+
+        for (j = 0; j < 16; j++) {
+                __m512i x = w[(j + 1) & 15], y = w[(j + 14) & 15], s0, s1;
+
+                s0 = _mm512_ternarylogic_epi64(rotr64_avx512(x, 1), rotr64_avx512(x, 8), shr64_avx512(x, 7), 0x96);
+                s1 = _mm512_ternarylogic_epi64(rotr64_avx512(y, 19), rotr64_avx512(y, 61), shr64_avx512(y, 6), 0x96);
+
+                w[j] = _mm512_add_epi64(_mm512_add_epi64(w[j], s0), _mm512_add_epi64(w[(j + 9) & 15], s1));
+        }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void transpose64_avx512(__m512i v[8]) {
+        __m512i t[8], u[8];
+        unsigned i;
+
+        /* Turns eight vectors of eight 64bit words each into eight vectors made of the n-th word of each */
+
+        for (i = 0; i < 4; i++) {
+                t[i * 2] = _mm512_maskz_unpacklo_epi64((__mmask8) 0xFF, v[i * 2], v[i * 2 + 1]);
+                t[i * 2 + 1] = _mm512_maskz_unpackhi_epi64((__mmask8) 0xFF, v[i * 2], v[i * 2 + 1]);
+        }
+
+        u[0] = _mm512_maskz_shuffle_i64x2((__mmask8) 0xFF, t[0], t[2], 0x88);
+        u[1] = _mm512_maskz_shuffle_i64x2((__mmask8) 0xFF, t[1], t[3], 0x88);
+        u[2] = _mm512_maskz_shuffle_i64x2((__mmask8) 0xFF, t[0], t[2], 0xDD);
+        u[3] = _mm512_maskz_shuffle_i64x2((__mmask8) 0xFF, t[1], t[3], 0xDD);
+        u[4] = _mm512_maskz_shuffle_i64x2((__mmask8) 0xFF, t[4], t[6], 0x88);
+        u[5] = _mm512_maskz_shuffle_i64x2((__mmask8) 0xFF, t[5], t[7], 0x88);
+        u[6] = _mm512_maskz_shuffle_i64x2((__mmask8) 0xFF, t[4], t[6], 0xDD);
+        u[7] = _mm512_maskz_shuffle_i64x2((__mmask8) 0xFF, t[5], t[7], 0xDD);
+
+        for (i = 0; i < 4; i++) {
+                v[i] = _mm512_maskz_shuffle_i64x2((__mmask8) 0xFF, u[i], u[i + 4], 0x88);
+                v[i + 4] = _mm512_maskz_shuffle_i64x2((__mmask8) 0xFF, u[i], u[i + 4], 0xDD);
+        }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void sha512_blocks_avx512(void *state, const uint8_t *const p[], size_t n_blocks) {
+        uint64_t (*s)[SHA512_LANES_AVX512] = state;
+        __m512i h[8], bswap;
+        size_t b;
+        unsigned i, t;
+
+        bswap = _mm512_set_epi64(INT64_C(0x08090a0b0c0d0e0f), INT64_C(0x0001020304050607),
+                                 INT64_C(0x08090a0b0c0d0e0f), INT64_C(0x0001020304050607),
+                                 INT64_C(0x08090a0b0c0d0e0f), INT64_C(0x0001020304050607),
+                                 INT64_C(0x08090a0b0c0d0e0f), INT64_C(0x0001020304050607));
+
+        for (i = 0; i < 8; i++)
+                h[i] = _mm512_loadu_si512(s[i]);
+
+        for (b = 0; b < n_blocks; b++) {
+                __m512i w[16], v[8];
+
+                for (i = 0; i < SHA512_LANES_AVX512; i++) {
+                        const uint8_t *q = p[i] + b * SHA512_BLOCK_LEN;
+
+                        w[i] = _mm512_loadu_si512(q);
+                        w[i + 8] = _mm512_loadu_si512(q + 64);
+                }
+                transpose64_avx512(w);
+                transpose64_avx512(w + 8);
+
+                for (i = 0; i < 16; i++)
+                        w[i] = _mm512_shuffle_epi8(w[i], bswap);
+
+                for (i = 0; i < 8; i++)
+                        v[i] = h[i];
+
+                for (t = 0; t < 80; t += 16) {
+                        if (t > 0)
+                                sha512_schedule_avx512(w);
+
+                        sha512_rounds8_avx512(v, w, sha512_k + t);
+                        sha512_rounds8_avx512(v, w + 8, sha512_k + t + 8);
+                }
+
+                for (i = 0; i < 8; i++)
+                        h[i] = _mm512_add_epi64(h[i], v[i]);
+        }
+
+        for (i = 0; i < 8; i++)
+                _mm512_storeu_si512(s[i], h[i]);
+}
+
+#endif
+
+static const Sha2MultiBufferAlgorithm sha256_algorithm = {
+        .n_lanes = {
+                [SHA2_MULTI_BUFFER_KERNEL_PORTABLE] = SHA256_LANES,
+                [SHA2_MULTI_BUFFER_KERNEL_AVX2] = SHA256_LANES,
+                [SHA2_MULTI_BUFFER_KERNEL_AVX512] = SHA256_LANES,
+        },
+        .block_len = SHA256_BLOCK_LEN,
+        .word_size = sizeof(uint32_t),
+        .iv = sha256_iv,
+        .blocks = {
+                [SHA2_MULTI_BUFFER_KERNEL_PORTABLE] = sha256_blocks_portable,
+#if SHA2_MULTI_BUFFER_HAVE_AVX2
+                [SHA2_MULTI_BUFFER_KERNEL_AVX2] = sha256_blocks_avx2,
+                [SHA2_MULTI_BUFFER_KERNEL_AVX512] = sha256_blocks_avx2,
+#endif
+        },
+};
+
+static const Sha2MultiBufferAlgorithm sha512_256_algorithm = {
+        .n_lanes = {
+                [SHA2_MULTI_BUFFER_KERNEL_PORTABLE] = SHA512_LANES,
+                [SHA2_MULTI_BUFFER_KERNEL_AVX2] = SHA512_LANES,
+                [SHA2_MULTI_BUFFER_KERNEL_AVX512] = SHA512_LANES_AVX512,
+        },
+        .block_len = SHA512_BLOCK_LEN,
+        .word_size = sizeof(uint64_t),
+        .iv = sha512_256_iv,
+        .blocks = {
+                [SHA2_MULTI_BUFFER_KERNEL_PORTABLE] = sha512_blocks_portable,
+#if SHA2_MULTI_BUFFER_HAVE_AVX2
+                [SHA2_MULTI_BUFFER_KERNEL_AVX2] = sha512_blocks_avx2,
+#endif
+#if SHA2_MULTI_BUFFER_HAVE_AVX512
+                [SHA2_MULTI_BUFFER_KERNEL_AVX512] = sha512_blocks_avx512,
+#endif
+        },
+};
+
+bool sha2_multi_buffer_kernel_supported(Sha2MultiBufferKernel kernel) {
+
+        switch (kernel) {
+
+        case SHA2_MULTI_BUFFER_KERNEL_PORTABLE:
+                return true;
+
+        case SHA2_MULTI_BUFFER_KERNEL_AVX2:
+#if SHA2_MULTI_BUFFER_HAVE_AVX2 && __BYTE_ORDER == __LITTLE_ENDIAN
+                return __builtin_cpu_supports("avx2");
+#else
+                return false;
+#endif
+
+        case SHA2_MULTI_BUFFER_KERNEL_AVX512:
+#if SHA2_MULTI_BUFFER_HAVE_AVX2 && SHA2_MULTI_BUFFER_HAVE_AVX512 && __BYTE_ORDER == __LITTLE_ENDIAN
+                return __builtin_cpu_supports("avx2") &&
+                        __builtin_cpu_supports("avx512f") &&
+                        __builtin_cpu_supports("avx512bw");
+#else
+                return false;
+#endif
+
+        default:
+                return false;
+        }
+}
+
+Sha2MultiBufferKernel sha2_multi_buffer_kernel_best(void) {
+        Sha2MultiBufferKernel k;
+
+        for (k = _SHA2_MULTI_BUFFER_KERNEL_MAX - 1; k > SHA2_MULTI_BUFFER_KERNEL_PORTABLE; k--)
+                if (sha2_multi_buffer_kernel_supported(k))
+                        return k;
+
+        return SHA2_MULTI_BUFFER_KERNEL_PORTABLE;
+}
+
+typedef struct Sha2Lane {
+        size_t idx;             /* The buffer processed in this lane, or SIZE_MAX if the lane is idle */
+        const uint8_t *p;       /* The next block to process */
+        size_t n_blocks;        /* The number of blocks left at 'p' */
+        bool tail;              /* Whether 'p' points to the padded tail already */
+        uint8_t buffer[2 * SHA2_BLOCK_LEN_MAX];
+} Sha2Lane;
+
+static void sha2_lane_pad(const Sha2MultiBufferAlgorithm *a, Sha2Lane *lane, const uint8_t *p, size_t l) {
+        size_t rest, n, length_len;
+        uint64_t bits;
+
+        /* Prepares the final block(s) of a buffer: the rest of the data that didn't fill a complete block, a 0x80
+         * byte, zeroes, and the length of the data in bits. The length field is twice the size of a word. */
+
+        length_len = a->word_size * 2;
+        rest = l % a->block_len;
+        n = rest + 1 + length_len <= a->block_len ? 1 : 2;
+
+        memset(lane->buffer, 0, n * a->block_len);
+        memcpy(lane->buffer, p + l - rest, rest);
+        lane->buffer[rest] = 0x80;
+
+        /* Only the lower 64bit of the length can be non-zero for anything we can keep in memory, except for the
+         * upper three bits of the byte count */
+        bits = htobe64((uint64_t) l << 3);
+        memcpy(lane->buffer + n * a->block_len - sizeof(bits), &bits, sizeof(bits));
+        if (length_len > sizeof(bits))
+                lane->buffer[n * a->block_len - sizeof(bits) - 1] = (uint8_t) ((uint64_t) l >> 61);
+
+        lane->p = lane->buffer;
+        lane->n_blocks = n;
+        lane->tail = true;
+}
+
+static void sha2_multi_buffer(
+                const Sha2MultiBufferAlgorithm *a,
+                Sha2MultiBufferKernel kernel,
+                const void *const p[],
+                const size_t l[],
+                size_t n,
+                uint8_t (*out)[SHA2_MULTI_BUFFER_OUT_LEN]) {
+
+        union {
+                uint32_t s32[8 * SHA2_LANES_MAX];
+                uint64_t s64[8 * SHA2_LANES_MAX];
+        } state;
+        Sha2Lane lanes[SHA2_LANES_MAX];
+        const uint8_t *pointers[SHA2_LANES_MAX];
+        Sha2BlocksFunc blocks;
+        size_t n_lanes, next = 0, i, j;
+
+        assert(a);
+        assert(kernel >= 0 && kernel < _SHA2_MULTI_BUFFER_KERNEL_MAX);
+        assert(p || n == 0);
+        assert(l || n == 0);
+        assert(out || n == 0);
+
+        blocks = a->blocks[kernel];
+        n_lanes = a->n_lanes[kernel];
+        assert(blocks);
+        assert(n_lanes <= SHA2_LANES_MAX);
+
+        for (j = 0; j < n_lanes; j++)
+                lanes[j].idx = SIZE_MAX;
+
+        for (;;) {
+                size_t m = SIZE_MAX, busy = SIZE_MAX;
+
+                for (j = 0; j < n_lanes; j++) {
+                        Sha2Lane *lane = lanes + j;
+
+                        /* Start the next buffer in each idle lane */
+                        if (lane->idx == SIZE_MAX && next < n) {
+                                for (i = 0; i < 8; i++)
+                                        memcpy((uint8_t*) &state + (i * n_lanes + j) * a->word_size,
+                                               (const uint8_t*) a->iv + i * a->word_size, a->word_size);
+
+                                lane->idx = next;
+                                lane->p = p[next];
+                                lane->n_blocks = l[next] / a->block_len;
+                                lane->tail = false;
+
+                                if (lane->n_blocks == 0)
+                                        sha2_lane_pad(a, lane, p[next], l[next]);
+
+                                next++;
+                        }
+
+                        if (lane->idx == SIZE_MAX)
+                                continue;
+
+                        m = MIN(m, lane->n_blocks);
+                        busy = j;
+                }
+
+                if (busy == SIZE_MAX)
+                        break;
+
+                /* Process as many blocks as all busy lanes have left. The idle lanes just process the same data as
+                 * some busy one, their results are thrown away. */
+                for (j = 0; j < n_lanes; j++)
+                        pointers[j] = lanes[lanes[j].idx == SIZE_MAX ? busy : j].p;
+
+                blocks(&state, pointers, m);
+
+                for (j = 0; j < n_lanes; j++) {
+                        Sha2Lane *lane = lanes + j;
+
+                        if (lane->idx == SIZE_MAX)
+                                continue;
+
+                        lane->p += m * a->block_len;
+                        lane->n_blocks -= m;
+                        if (lane->n_blocks > 0)
+                                continue;
+
+                        if (!lane->tail) {
+                                sha2_lane_pad(a, lane, p[lane->idx], l[lane->idx]);
+                                continue;
+                        }
+
+                        /* The buffer is done, write out the (truncated) digest in big endian */
+                        for (i = 0; i < SHA2_MULTI_BUFFER_OUT_LEN / a->word_size; i++) {
+                                if (a->word_size == sizeof(uint32_t)) {
+                                        uint32_t x = htobe32(state.s32[i * n_lanes + j]);
+                                        memcpy(out[lane->idx] + i * sizeof(x), &x, sizeof(x));
+                                } else {
+                                        uint64_t x = htobe64(state.s64[i * n_lanes + j]);
+                                        memcpy(out[lane->idx] + i * sizeof(x), &x, sizeof(x));
+                                }
+                        }
+
+                        lane->idx = SIZE_MAX;
+                }
+        }
+}
+
+size_t sha256_multi_buffer_lanes(Sha2MultiBufferKernel kernel) {
+        if (kernel < 0 || kernel >= _SHA2_MULTI_BUFFER_KERNEL_MAX)
+                return 0;
+
+        return sha256_algorithm.n_lanes[kernel];
+}
+
+size_t sha512_256_multi_buffer_lanes(Sha2MultiBufferKernel kernel) {
+        if (kernel < 0 || kernel >= _SHA2_MULTI_BUFFER_KERNEL_MAX)
+                return 0;
+
+        return sha512_256_algorithm.n_lanes[kernel];
+}
+
+void sha256_multi_buffer(Sha2MultiBufferKernel kernel, const void *const p[], const size_t l[], size_t n, uint8_t (*out)[SHA2_MULTI_BUFFER_OUT_LEN]) {
+        sha2_multi_buffer(&sha256_algorithm, kernel, p, l, n, out);
+}
+
+void sha512_256_multi_buffer(Sha2MultiBufferKernel kernel, const void *const p[], const size_t l[], size_t n, uint8_t (*out)[SHA2_MULTI_BUFFER_OUT_LEN]) {
+        sha2_multi_buffer(&sha512_256_algorithm, kernel, p, l, n, out);
+}
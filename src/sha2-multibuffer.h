@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef foosha2multibufferhfoo
+#define foosha2multibufferhfoo
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Multi-buffer SHA256 and SHA512/256: hashes a number of independent buffers at once, each one in its own lane of a
+ * SIMD register. This doesn't make hashing a single buffer any faster, but increases the throughput when many
+ * buffers need to be hashed, as is the case for chunks. Whenever a buffer is done, the next one is started in its
+ * lane, hence the buffers don't need to be of similar size. */
+
+#define SHA2_MULTI_BUFFER_OUT_LEN 32
+
+/* Whether we can build the AVX2 and AVX512 code. Whether it is used is decided at runtime. */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define SHA2_MULTI_BUFFER_HAVE_AVX2 1
+#  define SHA2_MULTI_BUFFER_HAVE_AVX512 1
+#else
+#  define SHA2_MULTI_BUFFER_HAVE_AVX2 0
+#  define SHA2_MULTI_BUFFER_HAVE_AVX512 0
+#endif
+
+/* The implementations to use, in order of preference. All of them calculate the very same hashes. Note that the
+ * portable one is not faster than hashing the buffers one by one, it exists for completeness and testing. */
+typedef enum Sha2MultiBufferKernel {
+        SHA2_MULTI_BUFFER_KERNEL_PORTABLE,
+        SHA2_MULTI_BUFFER_KERNEL_AVX2,
+        SHA2_MULTI_BUFFER_KERNEL_AVX512,
+        _SHA2_MULTI_BUFFER_KERNEL_MAX,
+} Sha2MultiBufferKernel;
+
+bool sha2_multi_buffer_kernel_supported(Sha2MultiBufferKernel kernel);
+Sha2MultiBufferKernel sha2_multi_buffer_kernel_best(void);
+
+/* The number of buffers hashed at once with the specified kernel */
+size_t sha256_multi_buffer_lanes(Sha2MultiBufferKernel kernel);
+size_t sha512_256_multi_buffer_lanes(Sha2MultiBufferKernel kernel);
+
+/* Both calculate the digests of the 'n' buffers 'p[i]' of 'l[i]' bytes, and write them to 'out[i]' */
+void sha256_multi_buffer(Sha2MultiBufferKernel kernel, const void *const p[], const size_t l[], size_t n, uint8_t (*out)[SHA2_MULTI_BUFFER_OUT_LEN]);
+void sha512_256_multi_buffer(Sha2MultiBufferKernel kernel, const void *const p[], const size_t l[], size_t n, uint8_t (*out)[SHA2_MULTI_BUFFER_OUT_LEN]);
+
+#endif
@@ -3,6 +3,7 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
 #include <poll.h>
 #include <stdarg.h>
 #include <sys/stat.h>
@@ -147,7 +148,7 @@ fallback:
         return 0; /* Return == 0 if we could only write out zeroes */
 }
 
-static bool memeqzero(const void *data, size_t length) {
+bool memeqzero(const void *data, size_t length) {
         /* Does the buffer consist entirely of NULs?
          * Copied from https://github.com/rustyrussell/ccan/blob/master/ccan/mem/mem.c#L92,
          * which is licensed CC-0.
@@ -1156,6 +1157,16 @@ size_t page_size(void) {
         return pgsz;
 }
 
+unsigned cpus_online(void) {
+        long v;
+
+        v = sysconf(_SC_NPROCESSORS_ONLN);
+        if (v <= 0)
+                return 1;
+
+        return (unsigned) MIN(v, (long) UINT_MAX);
+}
+
 /*按bool类型解析v字符串*/
 int parse_boolean(const char *v) {
         if (!v)
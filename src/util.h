@@ -70,6 +70,7 @@ int loop_write_block(int fd, const void *p, size_t l);
 ssize_t loop_read(int fd, void *p, size_t l);
 
 int write_zeroes(int fd, size_t l);
+bool memeqzero(const void *data, size_t length);
 int loop_write_with_holes(int fd, const void *p, size_t l, uint64_t *ret_punched);
 
 int skip_bytes(int fd, uint64_t bytes);
@@ -540,6 +541,7 @@ static inline const char *empty_or_dash_to_null(const char *s) {
 }
 
 size_t page_size(void);
+unsigned cpus_online(void);
 
 static inline size_t ALIGN_TO(size_t l, size_t ali) {
         return ((l + ali - 1) & ~(ali - 1));
@@ -142,11 +142,171 @@ static int test_set_size(void) {
         return 0;
 }
 
+static uint64_t xorshift64(uint64_t *state) {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        return *state;
+}
+
+static size_t reference_cut(const CaChunker *c, const uint8_t *p, size_t n) {
+        size_t skip, i;
+
+        /* Naive implementation of the cut rule, calculating the hash from scratch at each position. Returns the size
+         * of the first chunk in the data, or (size_t) -1 if there's no border in it. */
+
+        skip = c->chunk_size_min > CA_CHUNKER_WINDOW_SIZE ? c->chunk_size_min - CA_CHUNKER_WINDOW_SIZE : 0;
+
+        for (i = skip + CA_CHUNKER_WINDOW_SIZE; i <= n; i++) {
+                CaChunker y = CA_CHUNKER_INIT;
+                uint32_t v;
+
+                if (i >= c->chunk_size_max)
+                        return i;
+
+                v = ca_chunker_start(&y, p + i - CA_CHUNKER_WINDOW_SIZE, CA_CHUNKER_WINDOW_SIZE);
+                if (v % c->discriminator == c->discriminator - 1)
+                        return i;
+        }
+
+        return (size_t) -1;
+}
+
+static void test_kernel_one(const CaChunker *template, CaChunkerKernel kernel, const uint8_t *data, size_t size, size_t max_piece) {
+        CaChunker x = *template;
+        const uint8_t *p = data, *chunk = data;
+        uint64_t state = 4711;
+        size_t n_chunks = 0;
+
+        /* Feeds the data in pieces of random size to the chunker, and checks that each border matches the one the
+         * reference implementation finds */
+
+        while (p < data + size) {
+                size_t n, k;
+
+                n = MIN(1 + xorshift64(&state) % max_piece, (size_t) (data + size - p));
+
+                while (n > 0) {
+                        k = ca_chunker_scan_with_kernel(&x, kernel, p, n);
+                        if (k == (size_t) -1) {
+                                p += n;
+                                break;
+                        }
+
+                        assert_se(k <= n);
+                        assert_se((size_t) (p + k - chunk) == reference_cut(template, chunk, data + size - chunk));
+
+                        p += k, n -= k;
+                        chunk = p;
+                        n_chunks++;
+                }
+        }
+
+        /* The remainder must not contain a border */
+        assert_se(reference_cut(template, chunk, data + size - chunk) == (size_t) -1);
+        assert_se(n_chunks > 0);
+}
+
+static void test_kernels(void) {
+        static const size_t sizes[][3] = {
+                { 0, 0, 0 },
+                { 1024, 4096, 16384 },
+                { 16, 64, 256 },
+                { 1, 1, 4 },
+                { 4096, 8192, 9000 },
+        };
+        const size_t size = 1024*1024;
+        uint64_t state = 1;
+        uint8_t *data;
+        size_t i, j;
+
+        data = malloc(size);
+        assert_se(data);
+
+        /* Mostly random data, with a stretch of zeroes and one of a repeating pattern in between */
+        for (i = 0; i < size; i++)
+                data[i] = (uint8_t) xorshift64(&state);
+        memset(data + size/4, 0, size/8);
+        for (i = size/2; i < size/2 + size/8; i++)
+                data[i] = "casync"[i % 6];
+
+        for (i = 0; i < ELEMENTSOF(sizes); i++) {
+                CaChunker x = CA_CHUNKER_INIT;
+
+                assert_se(ca_chunker_set_size(&x, sizes[i][0], sizes[i][1], sizes[i][2]) >= 0);
+
+                for (j = 0; j < _CA_CHUNKER_KERNEL_MAX; j++) {
+                        if (!ca_chunker_kernel_supported(j)) {
+                                log_info("Chunker kernel %zu not supported, skipping.", j);
+                                continue;
+                        }
+
+                        test_kernel_one(&x, j, data, size, 1);
+                        test_kernel_one(&x, j, data, size, 100);
+                        test_kernel_one(&x, j, data, size, 64*1024);
+                        test_kernel_one(&x, j, data, size, size);
+                }
+        }
+
+        free(data);
+}
+
+static void test_zero_run(void) {
+        static const size_t sizes[][3] = {
+                { 0, 0, 0 },
+                { 1024, 4096, 16384 },
+                { 4096, 8192, 9000 },
+                { 64*1024, 256*1024, 1024*1024 },
+        };
+        const size_t size = 8*1024*1024, zero_start = 100*1000, zero_end = size - 100*1000;
+        uint64_t state = 1;
+        uint8_t *data;
+        size_t i, j;
+
+        /* The chunker's hash over a run of zeros is constant, hence all chunks within such a run must be of the minimum
+         * or the maximum size. All-zero chunks are only looked for among those when extracting. */
+
+        data = malloc(size);
+        assert_se(data);
+
+        for (i = 0; i < size; i++)
+                data[i] = (uint8_t) xorshift64(&state);
+        memset(data + zero_start, 0, zero_end - zero_start);
+
+        for (i = 0; i < ELEMENTSOF(sizes); i++) {
+                CaChunker x = CA_CHUNKER_INIT;
+                size_t offset = 0, n_inside = 0;
+
+                assert_se(ca_chunker_set_size(&x, sizes[i][0], sizes[i][1], sizes[i][2]) >= 0);
+                assert_se(x.chunk_size_min >= CA_CHUNKER_WINDOW_SIZE);
+
+                for (;;) {
+                        j = ca_chunker_scan(&x, data + offset, size - offset);
+                        if (j == (size_t) -1)
+                                break;
+
+                        if (offset >= zero_start && offset + j <= zero_end) {
+                                assert_se(memeqzero(data + offset, j));
+                                assert_se(j == x.chunk_size_min || j == x.chunk_size_max);
+                                n_inside++;
+                        }
+
+                        offset += j;
+                }
+
+                assert_se(n_inside > 0);
+        }
+
+        free(data);
+}
+
 int main(int argc, char *argv[]) {
 
         test_rolling();
         test_chunk();
         test_set_size();
+        test_kernels();
+        test_zero_run();
 
         return 0;
 }
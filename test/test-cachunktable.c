@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+
+#include "cachunktable.h"
+#include "rm-rf.h"
+#include "util.h"
+
+#define N_ENTRIES 20000U
+
+static CaChunkID ids[N_ENTRIES];
+
+static void make_value(size_t i, char *buffer, size_t *ret_size) {
+        /* Vary the length of the values a bit */
+        *ret_size = (size_t) sprintf(buffer, "%zu%.*s", i, (int) (i % 50), "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz") + 1;
+}
+
+static void check_entries(CaChunkTable *t, size_t n) {
+        size_t i;
+
+        assert_se(ca_chunk_table_get_n_entries(t) == n);
+
+        for (i = 0; i < N_ENTRIES; i++) {
+                char expected[128];
+                const void *p;
+                size_t l, k;
+
+                if (i >= n) {
+                        assert_se(ca_chunk_table_get(t, ids + i, &p, &l) == -ENOENT);
+                        continue;
+                }
+
+                make_value(i, expected, &k);
+
+                assert_se(ca_chunk_table_get(t, ids + i, &p, &l) >= 0);
+                assert_se(l == k);
+                assert_se(memcmp(p, expected, k) == 0);
+        }
+}
+
+static void put_entries(CaChunkTable *t, size_t n) {
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+                char value[128];
+                size_t l;
+
+                make_value(i, value, &l);
+
+                assert_se(ca_chunk_table_put(t, ids + i, value, l) >= 0);
+        }
+}
+
+static void test_temporary(void) {
+        _cleanup_(ca_chunk_table_unrefp) CaChunkTable *t = NULL;
+        uint8_t tag[CA_CHUNK_TABLE_TAG_SIZE];
+        size_t i;
+
+        assert_se(ca_chunk_table_new_temporary(&t) >= 0);
+
+        assert_se(ca_chunk_table_get_tag(t, tag) >= 0);
+        for (i = 0; i < sizeof(tag); i++)
+                assert_se(tag[i] == 0);
+
+        check_entries(t, 0);
+
+        /* This should grow both the bucket array and the heap a couple of times */
+        put_entries(t, N_ENTRIES);
+        check_entries(t, N_ENTRIES);
+
+        assert_se(ca_chunk_table_put(t, ids, "x", 2) == -EEXIST);
+        assert_se(ca_chunk_table_put(t, ids, "x", 0) == -EINVAL);
+
+        assert_se(ca_chunk_table_reset(t) >= 0);
+        check_entries(t, 0);
+}
+
+static void test_persistent(const char *path) {
+        uint8_t tag[CA_CHUNK_TABLE_TAG_SIZE], t2[CA_CHUNK_TABLE_TAG_SIZE];
+
+        assert_se(dev_urandom(tag, sizeof(tag)) >= 0);
+
+        {
+                _cleanup_(ca_chunk_table_unrefp) CaChunkTable *t = NULL, *other = NULL;
+
+                assert_se(ca_chunk_table_new_path(path, &t) >= 0);
+
+                /* The table is locked while in use */
+                assert_se(ca_chunk_table_new_path(path, &other) == -EBUSY);
+
+                put_entries(t, N_ENTRIES / 2);
+                assert_se(ca_chunk_table_set_tag(t, tag) >= 0);
+        }
+
+        {
+                _cleanup_(ca_chunk_table_unrefp) CaChunkTable *t = NULL;
+
+                assert_se(ca_chunk_table_new_path(path, &t) >= 0);
+
+                assert_se(ca_chunk_table_get_tag(t, t2) >= 0);
+                assert_se(memcmp(tag, t2, sizeof(tag)) == 0);
+
+                check_entries(t, N_ENTRIES / 2);
+
+                /* Any modification invalidates the tag */
+                assert_se(ca_chunk_table_reset(t) >= 0);
+                put_entries(t, N_ENTRIES);
+                assert_se(ca_chunk_table_get_tag(t, t2) >= 0);
+                assert_se(memcmp(tag, t2, sizeof(tag)) != 0);
+        }
+
+        {
+                _cleanup_(ca_chunk_table_unrefp) CaChunkTable *t = NULL;
+
+                assert_se(ca_chunk_table_new_path(path, &t) >= 0);
+                check_entries(t, N_ENTRIES);
+        }
+}
+
+static void test_corrupted(const char *path) {
+        _cleanup_(ca_chunk_table_unrefp) CaChunkTable *t = NULL;
+        _cleanup_(safe_closep) int fd = -1;
+        uint64_t n_buckets, i;
+
+        /* Mark every bucket of the table as used, without touching the entry counter. Lookups would never find an
+         * unused bucket to end on in such a table, it hence needs to be detected as corrupted and reset. The file
+         * starts with a header of four 64bit fields followed by the tag, then come the buckets, each consisting of
+         * the chunk ID, the heap offset and the size. */
+
+        assert_se((fd = open(path, O_RDWR|O_CLOEXEC)) >= 0);
+        assert_se(pread(fd, &n_buckets, sizeof(n_buckets), sizeof(uint64_t)) == sizeof(n_buckets));
+        n_buckets = le64toh(n_buckets);
+
+        for (i = 0; i < n_buckets; i++) {
+                uint64_t size = htole64(1);
+                off_t o = 4 * sizeof(uint64_t) + CA_CHUNK_TABLE_TAG_SIZE +
+                        i * (CA_CHUNK_ID_SIZE + 2 * sizeof(uint64_t)) + CA_CHUNK_ID_SIZE + sizeof(uint64_t);
+
+                assert_se(pwrite(fd, &size, sizeof(size), o) == sizeof(size));
+        }
+
+        assert_se(ca_chunk_table_new_path(path, &t) >= 0);
+        check_entries(t, 0);
+
+        put_entries(t, N_ENTRIES / 4);
+        check_entries(t, N_ENTRIES / 4);
+}
+
+int main(int argc, char *argv[]) {
+        const char *d, *path;
+        char *root;
+
+        assert_se(var_tmp_dir(&d) >= 0);
+        root = strjoina(d, "/test-cachunktable.XXXXXX");
+        assert_se(mkdtemp(root));
+        path = strjoina(root, "/table");
+
+        assert_se(dev_urandom(ids, sizeof(ids)) >= 0);
+
+        test_temporary();
+        test_persistent(path);
+        test_corrupted(path);
+
+        assert_se(rm_rf(root, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
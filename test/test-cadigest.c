@@ -1,5 +1,7 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include "blake3.h"
+#include "sha2-multibuffer.h"
 #include "time-util.h"
 #include "util.h"
 #include "cadigest.h"
@@ -32,6 +34,172 @@ static void test_speed(CaDigestType t) {
         ca_digest_free(d);
 }
 
+static void test_blake3_one(Blake3Kernel kernel, const uint8_t *data, size_t size, size_t piece, const char *expected) {
+        char hex[BLAKE3_OUT_LEN * 2 + 1];
+        uint8_t out[BLAKE3_OUT_LEN];
+        struct blake3 state;
+        size_t i;
+
+        blake3_init(&state);
+        for (i = 0; i < size; i += piece)
+                blake3_update_with_kernel(&state, kernel, data + i, MIN(piece, size - i));
+        blake3_finalize(&state, out);
+
+        for (i = 0; i < BLAKE3_OUT_LEN; i++) {
+                hex[i * 2] = hexchar(out[i] >> 4);
+                hex[i * 2 + 1] = hexchar(out[i] & 15);
+        }
+        hex[BLAKE3_OUT_LEN * 2] = 0;
+
+        assert_se(streq(hex, expected));
+}
+
+static void test_blake3_kernels(void) {
+        /* A few of the official BLAKE3 test vectors, which use the repeating byte sequence 0, 1, ..., 250 as input,
+         * picked so that the tree has a couple of levels */
+        static const struct {
+                size_t size;
+                const char *digest;
+        } vectors[] = {
+                { 1025,   "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+                { 8193,   "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b" },
+                { 102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085" },
+        };
+        static const size_t pieces[] = { 1, 63, 1024, 5000, SIZE_MAX };
+        uint8_t data[102400];
+        size_t i, j, k;
+
+        for (i = 0; i < sizeof(data); i++)
+                data[i] = (uint8_t) (i % 251);
+
+        for (k = 0; k < _BLAKE3_KERNEL_MAX; k++) {
+                if (!blake3_kernel_supported(k)) {
+                        log_info("BLAKE3 kernel %zu not supported, skipping.", k);
+                        continue;
+                }
+
+                for (i = 0; i < ELEMENTSOF(vectors); i++)
+                        for (j = 0; j < ELEMENTSOF(pieces); j++)
+                                test_blake3_one(k, data, vectors[i].size, MIN(pieces[j], vectors[i].size), vectors[i].digest);
+        }
+}
+
+#define TEST_BATCH_N 300
+
+static void test_batch_data(uint8_t **ret_data, const void **p, size_t *l) {
+        uint8_t *data;
+        size_t i, offset = 0;
+
+        /* Every length up to a few blocks, so that we hit all cases of padding, followed by larger buffers of
+         * rather different sizes, at varying alignment */
+
+        data = malloc(TEST_BATCH_N * 1024);
+        assert_se(data);
+
+        srand(4711);
+        for (i = 0; i < TEST_BATCH_N * 1024; i++)
+                data[i] = (uint8_t) rand();
+
+        for (i = 0; i < TEST_BATCH_N; i++) {
+                l[i] = i < 260 ? i : (size_t) (rand() % 20000);
+                p[i] = data + (offset % (TEST_BATCH_N * 1024 - 20000));
+                offset += 997;
+        }
+
+        *ret_data = data;
+}
+
+static void test_multi_buffer_kernels(void) {
+        uint8_t (*out)[SHA2_MULTI_BUFFER_OUT_LEN], *data;
+        const void *p[TEST_BATCH_N];
+        size_t l[TEST_BATCH_N], i, n;
+        Sha2MultiBufferKernel k;
+        CaDigest *d256, *d512;
+
+        test_batch_data(&data, p, l);
+
+        out = malloc(TEST_BATCH_N * SHA2_MULTI_BUFFER_OUT_LEN);
+        assert_se(out);
+
+        assert_se(ca_digest_new(CA_DIGEST_SHA256, &d256) >= 0);
+        assert_se(ca_digest_new(CA_DIGEST_SHA512_256, &d512) >= 0);
+
+        for (k = 0; k < _SHA2_MULTI_BUFFER_KERNEL_MAX; k++) {
+                if (!sha2_multi_buffer_kernel_supported(k)) {
+                        log_info("Multi-buffer SHA2 kernel %i not supported, skipping.", (int) k);
+                        continue;
+                }
+
+                /* Also try fewer buffers than there are lanes */
+                for (n = 1; n <= TEST_BATCH_N; n = n < 10 ? n + 1 : TEST_BATCH_N) {
+                        memset(out, 0, TEST_BATCH_N * SHA2_MULTI_BUFFER_OUT_LEN);
+                        sha256_multi_buffer(k, p, l, n, out);
+
+                        for (i = 0; i < n; i++) {
+                                ca_digest_reset(d256);
+                                ca_digest_write(d256, p[i], l[i]);
+                                assert_se(memcmp(ca_digest_read(d256), out[i], SHA2_MULTI_BUFFER_OUT_LEN) == 0);
+                        }
+
+                        memset(out, 0, TEST_BATCH_N * SHA2_MULTI_BUFFER_OUT_LEN);
+                        sha512_256_multi_buffer(k, p, l, n, out);
+
+                        for (i = 0; i < n; i++) {
+                                ca_digest_reset(d512);
+                                ca_digest_write(d512, p[i], l[i]);
+                                assert_se(memcmp(ca_digest_read(d512), out[i], SHA2_MULTI_BUFFER_OUT_LEN) == 0);
+                        }
+
+                        if (n == TEST_BATCH_N)
+                                break;
+                }
+        }
+
+        ca_digest_free(d256);
+        ca_digest_free(d512);
+        free(out);
+        free(data);
+}
+
+static void test_batch(CaDigestType t) {
+        uint8_t (*out)[32], *data, empty[32];
+        const void *p[TEST_BATCH_N];
+        size_t l[TEST_BATCH_N], i;
+        CaDigest *d;
+
+        test_batch_data(&data, p, l);
+
+        out = malloc(TEST_BATCH_N * 32);
+        assert_se(out);
+
+        assert_se(ca_digest_new(t, &d) >= 0);
+        assert_se(ca_digest_get_size(d) == 32);
+        assert_se(ca_digest_get_batch_size(d) >= 1);
+
+        log_info("Batch size of %s: %zu", ca_digest_type_to_string(t), ca_digest_get_batch_size(d));
+
+        memcpy(empty, ca_digest_read(d), 32);
+        ca_digest_reset(d);
+
+        /* Leave something in the digest, to check that it doesn't interfere, and is dropped afterwards */
+        ca_digest_write(d, "foo", 3);
+
+        assert_se(ca_digest_batch(d, p, l, TEST_BATCH_N, out) >= 0);
+        assert_se(memcmp(ca_digest_read(d), empty, 32) == 0);
+
+        for (i = 0; i < TEST_BATCH_N; i++) {
+                ca_digest_reset(d);
+                ca_digest_write(d, p[i], l[i]);
+                assert_se(memcmp(ca_digest_read(d), out[i], 32) == 0);
+        }
+
+        assert_se(ca_digest_batch(d, NULL, NULL, 0, NULL) >= 0);
+
+        ca_digest_free(d);
+        free(out);
+        free(data);
+}
+
 int main(int argc, char *argv[]) {
         CaDigest *d;
         CaDigestType t;
@@ -97,6 +265,42 @@ int main(int argc, char *argv[]) {
 
         d = ca_digest_free(d);
 
+        assert_se(ca_digest_new(CA_DIGEST_BLAKE3, &d) >= 0);
+
+        assert_se(memcmp(ca_digest_read(d), (const uint8_t[]) {
+                                0xaf, 0x13, 0x49, 0xb9, 0xf5, 0xf9, 0xa1, 0xa6,
+                                0xa0, 0x40, 0x4d, 0xea, 0x36, 0xdc, 0xc9, 0x49,
+                                0x9b, 0xcb, 0x25, 0xc9, 0xad, 0xc1, 0x12, 0xb7,
+                                0xcc, 0x9a, 0x93, 0xca, 0xe4, 0x1f, 0x32, 0x62 }, 32) == 0);
+
+        ca_digest_reset(d);
+        ca_digest_write(d, "foobar", 6);
+
+        assert_se(memcmp(ca_digest_read(d), (const uint8_t[]) {
+                                0xaa, 0x51, 0xdc, 0xd4, 0x3d, 0x5c, 0x6c, 0x52,
+                                0x03, 0xee, 0x16, 0x90, 0x6f, 0xd6, 0xb3, 0x5d,
+                                0xb2, 0x98, 0xb9, 0xb2, 0xe1, 0xde, 0x3f, 0xce,
+                                0x81, 0x81, 0x1d, 0x48, 0x06, 0xb7, 0x6b, 0x7d }, 32) == 0);
+
+        ca_digest_reset(d);
+
+        ca_digest_write(d, "foo", 3);
+        ca_digest_write(d, "bar", 3);
+
+        assert_se(memcmp(ca_digest_read(d), (const uint8_t[]) {
+                                0xaa, 0x51, 0xdc, 0xd4, 0x3d, 0x5c, 0x6c, 0x52,
+                                0x03, 0xee, 0x16, 0x90, 0x6f, 0xd6, 0xb3, 0x5d,
+                                0xb2, 0x98, 0xb9, 0xb2, 0xe1, 0xde, 0x3f, 0xce,
+                                0x81, 0x81, 0x1d, 0x48, 0x06, 0xb7, 0x6b, 0x7d }, 32) == 0);
+
+        d = ca_digest_free(d);
+
+        test_blake3_kernels();
+        test_multi_buffer_kernels();
+
+        for (t = 0; t < _CA_DIGEST_TYPE_MAX; t++)
+                test_batch(t);
+
         for (t = 0; t < _CA_DIGEST_TYPE_MAX; t++)
                 test_speed(t);
 
@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+
+#include "caformat.h"
+#include "caindex.h"
+#include "def.h"
+#include "rm-rf.h"
+#include "util.h"
+
+#define N_CHUNKS 1000U
+#define CHUNK_SIZE_MIN 16U
+#define CHUNK_SIZE_AVG 64U
+#define CHUNK_SIZE_MAX 256U
+
+static CaChunkID chunk_id[N_CHUNKS];
+static uint64_t chunk_end[N_CHUNKS];
+
+static void make_index(const char *path) {
+        _cleanup_(ca_index_unrefp) CaIndex *index = NULL;
+        uint64_t offset = 0;
+        size_t i;
+
+        assert_se(index = ca_index_new_write());
+        assert_se(ca_index_set_path(index, path) >= 0);
+        assert_se(ca_index_set_buffer_size(index, 100) >= 0);
+        assert_se(ca_index_set_feature_flags(index, CA_FORMAT_SHA512_256) >= 0);
+        assert_se(ca_index_set_chunk_size_min(index, CHUNK_SIZE_MIN) >= 0);
+        assert_se(ca_index_set_chunk_size_avg(index, CHUNK_SIZE_AVG) >= 0);
+        assert_se(ca_index_set_chunk_size_max(index, CHUNK_SIZE_MAX) >= 0);
+        assert_se(ca_index_open(index) >= 0);
+
+        for (i = 0; i < N_CHUNKS; i++) {
+                uint64_t size;
+
+                size = CHUNK_SIZE_MIN + random_u64() % (CHUNK_SIZE_MAX - CHUNK_SIZE_MIN + 1);
+                offset += size;
+
+                assert_se(dev_urandom(chunk_id + i, sizeof(CaChunkID)) >= 0);
+                chunk_end[i] = offset;
+
+                assert_se(ca_index_write_chunk(index, chunk_id + i, size) >= 0);
+        }
+
+        assert_se(ca_index_write_eof(index) >= 0);
+        assert_se(ca_index_install(index) >= 0);
+}
+
+static void check_read(CaIndex *index) {
+        uint64_t previous = 0;
+        size_t i;
+
+        for (i = 0; i < N_CHUNKS; i++) {
+                uint64_t end, size;
+                CaChunkID id;
+
+                assert_se(ca_index_read_chunk(index, &id, &end, &size) > 0);
+                assert_se(ca_chunk_id_equal(&id, chunk_id + i));
+                assert_se(end == chunk_end[i]);
+                assert_se(size == end - previous);
+
+                previous = end;
+        }
+
+        assert_se(ca_index_read_chunk(index, NULL, NULL, NULL) == 0);
+}
+
+static void check_seek(CaIndex *index) {
+        uint64_t blob_size, n, previous, offset, skip, end, size;
+        CaChunkID id;
+        size_t i, j;
+
+        assert_se(ca_index_get_total_chunks(index, &n) >= 0);
+        assert_se(n == N_CHUNKS);
+
+        assert_se(ca_index_get_blob_size(index, &blob_size) >= 0);
+        assert_se(blob_size == chunk_end[N_CHUNKS-1]);
+
+        for (i = 0; i < N_CHUNKS; i++) {
+                previous = i == 0 ? 0 : chunk_end[i-1];
+
+                assert_se(ca_index_get_chunk(index, i, &id, &end, &size) >= 0);
+                assert_se(ca_chunk_id_equal(&id, chunk_id + i));
+                assert_se(end == chunk_end[i]);
+                assert_se(size == end - previous);
+
+                /* Seek to the first, the last, and some random byte of each chunk */
+                for (j = 0; j < 3; j++) {
+                        if (j == 0)
+                                offset = previous;
+                        else if (j == 1)
+                                offset = chunk_end[i] - 1;
+                        else
+                                offset = previous + random_u64() % (chunk_end[i] - previous);
+
+                        assert_se(ca_index_seek(index, offset, &skip) >= 0);
+                        assert_se(skip == offset - previous);
+
+                        assert_se(ca_index_read_chunk(index, &id, &end, &size) > 0);
+                        assert_se(ca_chunk_id_equal(&id, chunk_id + i));
+                        assert_se(end == chunk_end[i]);
+                        assert_se(size == end - previous);
+                }
+        }
+
+        assert_se(ca_index_get_chunk(index, N_CHUNKS, NULL, NULL, NULL) == -ENXIO);
+        assert_se(ca_index_seek(index, blob_size, NULL) == -ENXIO);
+
+        /* After seeking, sequential reading continues from there up to the end */
+        assert_se(ca_index_seek(index, chunk_end[N_CHUNKS/2], &skip) >= 0);
+        assert_se(skip == 0);
+
+        for (i = N_CHUNKS/2 + 1; i < N_CHUNKS; i++) {
+                assert_se(ca_index_read_chunk(index, &id, &end, NULL) > 0);
+                assert_se(ca_chunk_id_equal(&id, chunk_id + i));
+                assert_se(end == chunk_end[i]);
+        }
+
+        assert_se(ca_index_read_chunk(index, NULL, NULL, NULL) == 0);
+}
+
+static void test_path(const char *path) {
+        _cleanup_(ca_index_unrefp) CaIndex *index = NULL;
+
+        assert_se(index = ca_index_new_read());
+        assert_se(ca_index_set_path(index, path) >= 0);
+        assert_se(ca_index_open(index) >= 0);
+
+        check_read(index);
+        check_seek(index);
+}
+
+static void test_pipe(const char *path) {
+        _cleanup_(ca_index_unrefp) CaIndex *index = NULL;
+        _cleanup_(safe_closep) int fd = -1;
+        int pipe_fds[2];
+        uint8_t buffer[BUFFER_SIZE];
+        ssize_t n;
+
+        /* A pipe cannot be mapped, make sure we still read it properly. The index is small enough to fit into the
+         * pipe buffer in its entirety. */
+        assert_se(pipe2(pipe_fds, O_CLOEXEC) >= 0);
+        assert_se(fcntl(pipe_fds[1], F_SETPIPE_SZ, 128*1024) >= 0);
+
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+        assert_se(fd >= 0);
+
+        for (;;) {
+                n = read(fd, buffer, sizeof(buffer));
+                assert_se(n >= 0);
+                if (n == 0)
+                        break;
+
+                assert_se(loop_write(pipe_fds[1], buffer, n) >= 0);
+        }
+
+        safe_close(pipe_fds[1]);
+
+        assert_se(index = ca_index_new_read());
+        assert_se(ca_index_set_fd(index, pipe_fds[0]) >= 0);
+        assert_se(ca_index_set_buffer_size(index, 100) >= 0);
+        assert_se(ca_index_open(index) >= 0);
+
+        check_read(index);
+}
+
+int main(int argc, char *argv[]) {
+        const char *d, *path;
+        char *root;
+
+        assert_se(var_tmp_dir(&d) >= 0);
+        root = strjoina(d, "/test-caindex-seek.XXXXXX");
+        assert_se(mkdtemp(root));
+        path = strjoina(root, "/test.caibx");
+
+        make_index(path);
+
+        test_path(path);
+        test_pipe(path);
+
+        assert_se(rm_rf(root, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
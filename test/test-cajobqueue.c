@@ -0,0 +1,208 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cajobqueue.h"
+#include "util.h"
+
+typedef struct TestJob {
+        size_t seq;
+        char *data;
+        pthread_t thread;
+} TestJob;
+
+typedef struct TestContext {
+        unsigned n_done;
+        bool release;
+} TestContext;
+
+static unsigned n_freed = 0;
+
+static int test_job_run(void *p, void *userdata) {
+        TestContext *c = userdata;
+        TestJob *j = p;
+
+        j->thread = pthread_self();
+
+        /* The first job only completes once we are told so, after all others completed */
+        if (j->seq == 0 && c)
+                while (!__atomic_load_n(&c->release, __ATOMIC_ACQUIRE))
+                        (void) usleep(1000);
+
+        if (c)
+                __atomic_add_fetch(&c->n_done, 1, __ATOMIC_RELEASE);
+
+        return (int) j->seq;
+}
+
+static void test_job_free(void *p) {
+        TestJob *j = p;
+
+        if (j->data)
+                n_freed++;
+
+        j->data = mfree(j->data);
+}
+
+static void submit_job(CaJobQueue *q, size_t seq) {
+        TestJob *j;
+
+        assert_se(j = ca_job_queue_acquire(q));
+        j->seq = seq;
+        assert_se(ca_job_queue_submit(q) >= 0);
+}
+
+static void retire_job(CaJobQueue *q, size_t seq) {
+        TestJob *j;
+        int result;
+
+        assert_se(ca_job_queue_peek(q, true, (void**) &j, &result) >= 0);
+        assert_se(j->seq == seq);
+        assert_se(result == (int) seq);
+        assert_se(ca_job_queue_retire(q) >= 0);
+}
+
+static void test_out_of_order(void) {
+        _cleanup_(ca_job_queue_unrefp) CaJobQueue *q = NULL;
+        TestContext c = {};
+        size_t i;
+
+        assert_se(ca_job_queue_new(4, 4, sizeof(TestJob), test_job_run, NULL, &c, &q) >= 0);
+
+        for (i = 0; i < 4; i++)
+                submit_job(q, i);
+
+        while (__atomic_load_n(&c.n_done, __ATOMIC_ACQUIRE) < 3)
+                (void) usleep(1000);
+
+        /* Everything but the oldest job completed, but that one has to go first */
+        assert_se(ca_job_queue_peek(q, false, NULL, NULL) == -EAGAIN);
+        assert_se(ca_job_queue_retire(q) == -EBUSY);
+        assert_se(ca_job_queue_queued(q) == 4);
+
+        __atomic_store_n(&c.release, true, __ATOMIC_RELEASE);
+
+        for (i = 0; i < 4; i++)
+                retire_job(q, i);
+
+        assert_se(ca_job_queue_queued(q) == 0);
+        assert_se(ca_job_queue_peek(q, false, NULL, NULL) == -ENODATA);
+        assert_se(ca_job_queue_retire(q) == -ENODATA);
+}
+
+static void test_wrap(size_t n_threads) {
+        _cleanup_(ca_job_queue_unrefp) CaJobQueue *q = NULL;
+        void *slots[3];
+        size_t i, retired = 0;
+
+        assert_se(ca_job_queue_new(n_threads, ELEMENTSOF(slots), sizeof(TestJob), test_job_run, NULL, NULL, &q) >= 0);
+
+        for (i = 0; i < ELEMENTSOF(slots) * 10; i++) {
+                TestJob *j;
+
+                j = ca_job_queue_acquire(q);
+                if (!j) {
+                        assert_se(ca_job_queue_queued(q) == ELEMENTSOF(slots));
+                        retire_job(q, retired++);
+
+                        assert_se(j = ca_job_queue_acquire(q));
+                }
+
+                /* Once all slots were handed out, they are reused in the same order */
+                if (i < ELEMENTSOF(slots))
+                        slots[i] = j;
+                else
+                        assert_se(slots[i % ELEMENTSOF(slots)] == j);
+
+                j->seq = i;
+                assert_se(ca_job_queue_submit(q) >= 0);
+        }
+
+        while (retired < i)
+                retire_job(q, retired++);
+
+        assert_se(ca_job_queue_queued(q) == 0);
+}
+
+static void test_full(void) {
+        _cleanup_(ca_job_queue_unrefp) CaJobQueue *q = NULL;
+
+        assert_se(ca_job_queue_new(0, 2, sizeof(TestJob), test_job_run, NULL, NULL, &q) >= 0);
+
+        /* Nothing acquired yet */
+        assert_se(ca_job_queue_submit(q) == -EBADR);
+
+        submit_job(q, 0);
+        submit_job(q, 1);
+
+        assert_se(!ca_job_queue_acquire(q));
+        assert_se(ca_job_queue_submit(q) == -EBADR);
+
+        retire_job(q, 0);
+        submit_job(q, 2);
+        assert_se(!ca_job_queue_acquire(q));
+
+        retire_job(q, 1);
+        retire_job(q, 2);
+}
+
+static void test_synchronous(void) {
+        _cleanup_(ca_job_queue_unrefp) CaJobQueue *q = NULL;
+        TestContext c = {};
+        TestJob *j, *k;
+        int result;
+
+        assert_se(ca_job_queue_new(0, 2, sizeof(TestJob), test_job_run, NULL, &c, &q) >= 0);
+
+        assert_se(j = ca_job_queue_acquire(q));
+        j->seq = 7;
+        assert_se(ca_job_queue_submit(q) >= 0);
+
+        /* Without threads the job already ran when submit returned, and on our own thread */
+        assert_se(c.n_done == 1);
+        assert_se(pthread_equal(j->thread, pthread_self()));
+
+        assert_se(ca_job_queue_peek(q, false, (void**) &k, &result) >= 0);
+        assert_se(k == j);
+        assert_se(result == 7);
+        assert_se(ca_job_queue_retire(q) >= 0);
+}
+
+static void test_unref(size_t n_threads) {
+        CaJobQueue *q = NULL;
+        TestJob *j;
+        size_t i;
+
+        n_freed = 0;
+
+        assert_se(ca_job_queue_new(n_threads, 4, sizeof(TestJob), test_job_run, test_job_free, NULL, &q) >= 0);
+
+        for (i = 0; i < 3; i++) {
+                assert_se(j = ca_job_queue_acquire(q));
+                j->seq = i;
+                assert_se(j->data = strdup("foo"));
+                assert_se(ca_job_queue_submit(q) >= 0);
+        }
+
+        /* Release the first job's buffer ourselves when retiring it, and leave the other two to the queue */
+        assert_se(ca_job_queue_peek(q, true, (void**) &j, NULL) >= 0);
+        j->data = mfree(j->data);
+        assert_se(ca_job_queue_retire(q) >= 0);
+
+        assert_se(!ca_job_queue_unref(q));
+        assert_se(n_freed == 2);
+}
+
+int main(int argc, char *argv[]) {
+
+        test_out_of_order();
+        test_wrap(0);
+        test_wrap(2);
+        test_full();
+        test_synchronous();
+        test_unref(0);
+        test_unref(2);
+
+        return 0;
+}
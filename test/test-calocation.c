@@ -10,7 +10,7 @@
 
 int main(int argc, char *argv[]) {
         _cleanup_(ca_name_table_unrefp) CaNameTable *ntp = NULL, *nt = NULL, *nt2 = NULL;
-        _cleanup_(ca_location_unrefp) CaLocation *loc = NULL, *loc2 = NULL;
+        _cleanup_(ca_location_unrefp) CaLocation *loc = NULL, *loc2 = NULL, *bye = NULL, *bye2 = NULL;
         _cleanup_(ca_digest_freep) CaDigest *digest = NULL;
         CaChunkID id, id2;
         CaNameItem *item;
@@ -67,6 +67,23 @@ int main(int argc, char *argv[]) {
         assert_se(loc2->generation == 2345);
         assert_se(loc2->generation_valid);
         assert_se(loc2->archive_offset == 87654 + 7);
+        assert_se(loc2->subtree == UINT64_MAX);
+
+        assert_se(ca_location_new("foo", CA_LOCATION_GOODBYE, 0, 88, &bye) >= 0);
+        bye->mtime = 1517231408U * NSEC_PER_SEC;
+        bye->inode = 4711;
+        bye->subtree = 0xdeadbeefcafeU;
+
+        assert_se(ca_location_parse(ca_location_format(bye), &bye2) >= 0);
+        assert_se(bye2->subtree == 0xdeadbeefcafeU);
+        assert_se(ca_location_equal(bye, bye2, CA_LOCATION_WITH_MTIME));
+
+        /* A GOODBYE record with different children is a different location */
+        bye2->subtree++;
+        assert_se(!ca_location_equal(bye, bye2, CA_LOCATION_WITH_MTIME));
+        assert_se(ca_location_id_make(digest, bye, false, &id) >= 0);
+        assert_se(ca_location_id_make(digest, bye2, false, &id2) >= 0);
+        assert_se(!ca_chunk_id_equal(&id, &id2));
 
         return 0;
 }
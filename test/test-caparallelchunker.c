@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+
+#include "caparallelchunker.h"
+#include "util.h"
+
+static uint64_t xorshift64(uint64_t *state) {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        return *state;
+}
+
+static size_t serial_borders(const CaChunker *template, const uint8_t *data, size_t size, uint64_t **ret) {
+        CaChunker x = *template;
+        uint64_t *borders = NULL;
+        size_t n_borders = 0, n_allocated = 0, offset = 0;
+
+        while (offset < size) {
+                size_t k;
+
+                k = ca_chunker_scan(&x, data + offset, size - offset);
+                if (k == (size_t) -1)
+                        break;
+
+                offset += k;
+
+                assert_se(GREEDY_REALLOC(borders, n_allocated, n_borders + 1));
+                borders[n_borders++] = offset;
+        }
+
+        *ret = borders;
+        return n_borders;
+}
+
+static void test_parallel_one(
+                const CaChunker *template,
+                int fd,
+                const uint8_t *data,
+                size_t size,
+                uint64_t scan_size,
+                size_t n_threads,
+                uint64_t segment_size,
+                const uint64_t *borders,
+                size_t n_borders) {
+
+        _cleanup_(ca_parallel_chunker_unrefp) CaParallelChunker *p = NULL;
+        uint64_t state = 4711;
+        size_t offset = 0, i = 0;
+        int copy;
+
+        log_info("Testing with %zu threads, segment size %" PRIu64 ", scanning %" PRIu64 " of %zu bytes.",
+                 n_threads, segment_size, scan_size, size);
+
+        copy = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+        assert_se(copy >= 0);
+
+        assert_se(ca_parallel_chunker_new(template, copy, scan_size, n_threads, segment_size, &p) >= 0);
+
+        /* Feed the data in pieces of random size, and check we get the very same borders as when chunking serially */
+        while (offset < size) {
+                size_t n;
+
+                n = MIN(1 + xorshift64(&state) % (256*1024), size - offset);
+
+                while (n > 0) {
+                        size_t k;
+
+                        assert_se(ca_parallel_chunker_scan(p, data + offset, n, &k) >= 0);
+                        if (k == (size_t) -1) {
+                                offset += n;
+                                break;
+                        }
+
+                        assert_se(k <= n);
+                        offset += k;
+                        n -= k;
+
+                        assert_se(i < n_borders);
+                        assert_se(borders[i] == offset);
+                        i++;
+                }
+        }
+
+        assert_se(i == n_borders);
+}
+
+static void test_parallel(void) {
+        static const size_t sizes[][3] = {
+                { 0, 0, 0 },
+                { 1024, 4096, 16384 },
+                { 4096, 8192, 9000 },
+        };
+        static const uint64_t segment_sizes[] = {
+                1000,
+                4096 + 7,
+                64*1024,
+                1024*1024 + 3,
+        };
+        const size_t size = 4*1024*1024;
+        _cleanup_(safe_closep) int fd = -1;
+        uint64_t state = 1;
+        uint8_t *data;
+        const char *d;
+        char *path;
+        size_t i, j;
+
+        data = malloc(size);
+        assert_se(data);
+
+        /* Mostly random data, with a stretch of zeroes and one of a repeating pattern in between, so that we also
+         * get chunks cut at the maximum size */
+        for (i = 0; i < size; i++)
+                data[i] = (uint8_t) xorshift64(&state);
+        memset(data + size/4, 0, size/8);
+        for (i = size/2; i < size/2 + size/8; i++)
+                data[i] = "casync"[i % 6];
+
+        assert_se(var_tmp_dir(&d) >= 0);
+        path = strjoina(d, "/parallel-chunker-test.XXXXXX");
+
+        fd = mkostemp(path, O_RDWR|O_CLOEXEC);
+        assert_se(fd >= 0);
+        assert_se(unlink(path) >= 0);
+        assert_se(loop_write(fd, data, size) >= 0);
+
+        for (i = 0; i < ELEMENTSOF(sizes); i++) {
+                CaChunker x = CA_CHUNKER_INIT;
+                uint64_t *borders;
+                size_t n_borders;
+
+                assert_se(ca_chunker_set_size(&x, sizes[i][0], sizes[i][1], sizes[i][2]) >= 0);
+                n_borders = serial_borders(&x, data, size, &borders);
+                assert_se(n_borders > 0);
+
+                for (j = 0; j < ELEMENTSOF(segment_sizes); j++) {
+                        test_parallel_one(&x, fd, data, size, size, 0, segment_sizes[j], borders, n_borders);
+                        test_parallel_one(&x, fd, data, size, size, 3, segment_sizes[j], borders, n_borders);
+                }
+
+                /* Pretend the file grew after we determined its size, the rest needs to be chunked serially then */
+                test_parallel_one(&x, fd, data, size, size/2 + 12345, 3, 64*1024, borders, n_borders);
+
+                free(borders);
+        }
+
+        free(data);
+}
+
+int main(int argc, char *argv[]) {
+
+        test_parallel();
+
+        return 0;
+}
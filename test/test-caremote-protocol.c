@@ -0,0 +1,356 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cadigest.h"
+#include "caprotocol.h"
+#include "caremote.h"
+#include "log.h"
+#include "realloc-buffer.h"
+#include "rm-rf.h"
+#include "util.h"
+
+#define N_CHUNKS 64U
+#define CHUNK_SIZE 256U
+
+/* The feature flags known to casync versions that predate protocol extensions. Such versions refuse a hello with any
+ * other flag set, or of any other size than CaProtocolHello, and any frame type they don't know. */
+#define OLD_FEATURE_FLAGS_MAX UINT64_C(0x1fff)
+
+static uint8_t data[N_CHUNKS][CHUNK_SIZE];
+static CaChunkID ids[N_CHUNKS];
+
+/* A peer speaking the protocol as it was before extensions were added, as strict as that implementation was */
+typedef struct OldPeer {
+        int input_fd, output_fd;
+        uint64_t feature_flags;
+        ReallocBuffer buffer;
+        bool got_hello;
+        unsigned n_unknown_requests;
+        unsigned n_chunks;
+} OldPeer;
+
+static size_t find_chunk(const void *id) {
+        size_t i;
+
+        for (i = 0; i < N_CHUNKS; i++)
+                if (memcmp(id, ids + i, CA_CHUNK_ID_SIZE) == 0)
+                        return i;
+
+        return (size_t) -1;
+}
+
+static void old_peer_send(OldPeer *p, uint64_t type, const void *a, size_t a_size, const void *b, size_t b_size) {
+        CaProtocolHeader h;
+
+        write_le64(&h.size, sizeof(h) + a_size + b_size);
+        write_le64(&h.type, type);
+
+        assert_se(loop_write(p->output_fd, &h, sizeof(h)) >= 0);
+        assert_se(loop_write(p->output_fd, a, a_size) >= 0);
+        assert_se(loop_write(p->output_fd, b, b_size) >= 0);
+}
+
+static void old_peer_hello(OldPeer *p) {
+        le64_t flags;
+
+        write_le64(&flags, p->feature_flags);
+        old_peer_send(p, CA_PROTOCOL_HELLO, &flags, sizeof(flags), NULL, 0);
+}
+
+static void old_peer_process_request(OldPeer *p, const CaProtocolRequest *req) {
+        uint64_t size;
+        size_t i, n;
+
+        size = read_le64(&req->header.size);
+        assert_se(size >= offsetof(CaProtocolRequest, chunks) + CA_CHUNK_ID_SIZE);
+        assert_se((size - offsetof(CaProtocolRequest, chunks)) % CA_CHUNK_ID_SIZE == 0);
+        assert_se((read_le64(&req->flags) & ~CA_PROTOCOL_REQUEST_FLAG_MAX) == 0);
+
+        n = (size - offsetof(CaProtocolRequest, chunks)) / CA_CHUNK_ID_SIZE;
+        for (i = 0; i < n; i++) {
+                const uint8_t *id = req->chunks + i * CA_CHUNK_ID_SIZE;
+                size_t k;
+
+                k = find_chunk(id);
+                if (k == (size_t) -1) {
+                        old_peer_send(p, CA_PROTOCOL_MISSING, id, CA_CHUNK_ID_SIZE, NULL, 0);
+                        p->n_unknown_requests++;
+                } else {
+                        uint8_t header[sizeof(le64_t) + CA_CHUNK_ID_SIZE] = {};
+
+                        memcpy(header + sizeof(le64_t), id, CA_CHUNK_ID_SIZE);
+                        old_peer_send(p, CA_PROTOCOL_CHUNK, header, sizeof(header), data[k], CHUNK_SIZE);
+                }
+        }
+}
+
+static void old_peer_process(OldPeer *p) {
+        int r;
+
+        for (;;) {
+                r = realloc_buffer_read(&p->buffer, p->input_fd);
+                if (r == -EAGAIN)
+                        break;
+                assert_se(r > 0);
+        }
+
+        for (;;) {
+                const CaProtocolHeader *h;
+                uint64_t size;
+
+                if (realloc_buffer_size(&p->buffer) < sizeof(CaProtocolHeader))
+                        break;
+
+                h = realloc_buffer_data(&p->buffer);
+                size = read_le64(&h->size);
+                assert_se(size >= sizeof(CaProtocolHeader));
+                if (realloc_buffer_size(&p->buffer) < size)
+                        break;
+
+                switch (read_le64(&h->type)) {
+
+                case CA_PROTOCOL_HELLO: {
+                        const CaProtocolHello *hello = (const CaProtocolHello*) h;
+
+                        assert_se(!p->got_hello);
+                        assert_se(size == sizeof(CaProtocolHello));
+                        assert_se((read_le64(&hello->feature_flags) & ~OLD_FEATURE_FLAGS_MAX) == 0);
+                        p->got_hello = true;
+                        break;
+                }
+
+                case CA_PROTOCOL_REQUEST:
+                        assert_se(p->got_hello);
+                        assert_se(p->feature_flags & CA_PROTOCOL_READABLE_STORE);
+                        old_peer_process_request(p, (const CaProtocolRequest*) h);
+                        break;
+
+                case CA_PROTOCOL_CHUNK: {
+                        const CaProtocolChunk *chunk = (const CaProtocolChunk*) h;
+                        size_t k;
+
+                        assert_se(p->got_hello);
+                        assert_se(p->feature_flags & CA_PROTOCOL_PULL_CHUNKS);
+                        assert_se((read_le64(&chunk->flags) & ~CA_PROTOCOL_CHUNK_FLAG_MAX) == 0);
+
+                        k = find_chunk(chunk->chunk);
+                        assert_se(k != (size_t) -1);
+                        assert_se(size == offsetof(CaProtocolChunk, data) + CHUNK_SIZE);
+                        assert_se(memcmp(chunk->data, data[k], CHUNK_SIZE) == 0);
+                        p->n_chunks++;
+                        break;
+                }
+
+                default:
+                        assert_not_reached("Frame an old peer doesn't know");
+                }
+
+                assert_se(realloc_buffer_advance(&p->buffer, size) >= 0);
+        }
+}
+
+static void make_pipes(int a[2], int b[2]) {
+        assert_se(pipe2(a, O_CLOEXEC|O_NONBLOCK) >= 0);
+        assert_se(pipe2(b, O_CLOEXEC|O_NONBLOCK) >= 0);
+}
+
+static void step_remote(CaRemote *rr) {
+        int r;
+
+        do {
+                r = ca_remote_step(rr);
+                assert_se(r >= 0);
+        } while (r != CA_REMOTE_POLL);
+}
+
+static void serve_requests(CaRemote *rr) {
+        CaChunkID id;
+        size_t k;
+        int r;
+
+        for (;;) {
+                r = ca_remote_can_put_chunk(rr);
+                assert_se(r >= 0);
+                if (r == 0)
+                        return;
+
+                r = ca_remote_next_request(rr, &id);
+                if (r == -ENODATA)
+                        return;
+                assert_se(r >= 0);
+
+                k = find_chunk(&id);
+                assert_se(k != (size_t) -1);
+                assert_se(ca_remote_put_chunk(rr, &id, CA_CHUNK_UNCOMPRESSED, data[k], CHUNK_SIZE) >= 0);
+        }
+}
+
+static bool fetch_chunks(CaRemote *rr) {
+        bool done = true;
+        size_t i;
+
+        for (i = 0; i < N_CHUNKS; i++) {
+                const void *p;
+                uint64_t size;
+                int r;
+
+                r = ca_remote_request(rr, ids + i, false, CA_CHUNK_UNCOMPRESSED, &p, &size, NULL);
+                if (IN_SET(r, -EAGAIN, -EALREADY)) {
+                        done = false;
+                        continue;
+                }
+                assert_se(r > 0);
+                assert_se(size == CHUNK_SIZE);
+                assert_se(memcmp(p, data[i], CHUNK_SIZE) == 0);
+        }
+
+        return done;
+}
+
+static CaRemote *new_remote(const char *cache, uint64_t flags, int input_fd, int output_fd) {
+        CaRemote *rr;
+
+        assert_se(rr = ca_remote_new());
+        assert_se(ca_remote_set_cache_path(rr, cache) >= 0);
+        assert_se(ca_remote_set_local_feature_flags(rr, flags) >= 0);
+        assert_se(ca_remote_set_io_fds(rr, input_fd, output_fd) >= 0);
+
+        return rr;
+}
+
+static void test_old_server(const char *cache) {
+        int to_remote[2], to_peer[2];
+        uint64_t requests, bytes;
+        OldPeer peer = {};
+        CaRemote *rr;
+        unsigned n;
+
+        /* We pull chunks from an old peer: it must accept everything we send, and we must not use any extensions */
+
+        make_pipes(to_remote, to_peer);
+
+        rr = new_remote(cache, CA_PROTOCOL_PULL_CHUNKS, to_remote[0], to_peer[1]);
+
+        peer.input_fd = to_peer[0];
+        peer.output_fd = to_remote[1];
+        peer.feature_flags = CA_PROTOCOL_READABLE_STORE;
+        old_peer_hello(&peer);
+
+        for (n = 0; !fetch_chunks(rr); n++) {
+                assert_se(n < 1000);
+
+                step_remote(rr);
+                old_peer_process(&peer);
+        }
+
+        assert_se(peer.got_hello);
+        assert_se(peer.n_unknown_requests == 1); /* the probe */
+
+        /* No window to honour */
+        assert_se(ca_remote_get_window(rr, &requests, &bytes) >= 0);
+        assert_se(requests == UINT64_MAX);
+        assert_se(bytes == UINT64_MAX);
+
+        ca_remote_unref(rr); /* closes its ends of the pipes */
+        realloc_buffer_free(&peer.buffer);
+        safe_close(peer.input_fd);
+        safe_close(peer.output_fd);
+}
+
+static void test_old_client(const char *cache) {
+        uint8_t request[sizeof(le64_t) + sizeof(ids)] = {};
+        int to_remote[2], to_peer[2];
+        OldPeer peer = {};
+        CaRemote *rr;
+        unsigned n;
+
+        /* An old peer pulls chunks from us: we must answer without any extensions */
+
+        make_pipes(to_remote, to_peer);
+
+        rr = new_remote(cache, CA_PROTOCOL_READABLE_STORE, to_remote[0], to_peer[1]);
+
+        peer.input_fd = to_peer[0];
+        peer.output_fd = to_remote[1];
+        peer.feature_flags = CA_PROTOCOL_PULL_CHUNKS;
+        old_peer_hello(&peer);
+
+        memcpy(request + sizeof(le64_t), ids, sizeof(ids));
+        old_peer_send(&peer, CA_PROTOCOL_REQUEST, request, sizeof(request), NULL, 0);
+
+        for (n = 0; peer.n_chunks < N_CHUNKS; n++) {
+                assert_se(n < 1000);
+
+                step_remote(rr);
+                serve_requests(rr);
+                step_remote(rr);
+                old_peer_process(&peer);
+        }
+
+        assert_se(peer.got_hello);
+
+        ca_remote_unref(rr); /* closes its ends of the pipes */
+        realloc_buffer_free(&peer.buffer);
+        safe_close(peer.input_fd);
+        safe_close(peer.output_fd);
+}
+
+static void test_new_peers(const char *client_cache, const char *server_cache) {
+        int to_client[2], to_server[2];
+        uint64_t requests, bytes;
+        CaRemote *client, *server;
+        unsigned n;
+
+        /* Both sides know the extensions: the client has to keep within the server's window */
+
+        make_pipes(to_client, to_server);
+
+        client = new_remote(client_cache, CA_PROTOCOL_PULL_CHUNKS, to_client[0], to_server[1]);
+        server = new_remote(server_cache, CA_PROTOCOL_READABLE_STORE, to_server[0], to_client[1]);
+        assert_se(ca_remote_set_window(server, 3, UINT64_MAX) >= 0);
+
+        for (n = 0; !fetch_chunks(client); n++) {
+                assert_se(n < 1000);
+
+                step_remote(client);
+                step_remote(server);
+                serve_requests(server);
+
+                assert_se(ca_remote_get_window_used(client, &requests, &bytes) >= 0);
+                assert_se(requests <= 3);
+        }
+
+        assert_se(ca_remote_get_window(client, &requests, &bytes) >= 0);
+        assert_se(requests == 3);
+        assert_se(bytes != UINT64_MAX);
+
+        ca_remote_unref(client);
+        ca_remote_unref(server);
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_(ca_digest_freep) CaDigest *digest = NULL;
+        const char *d;
+        char *root;
+        size_t i;
+
+        assert_se(var_tmp_dir(&d) >= 0);
+        root = strjoina(d, "/test-caremote-protocol.XXXXXX");
+        assert_se(mkdtemp(root));
+
+        assert_se(dev_urandom(data, sizeof(data)) >= 0);
+
+        assert_se(ca_digest_new(CA_DIGEST_DEFAULT, &digest) >= 0);
+        for (i = 0; i < N_CHUNKS; i++)
+                assert_se(ca_chunk_id_make(digest, data[i], CHUNK_SIZE, ids + i) >= 0);
+
+        test_old_server(strjoina(root, "/old-server"));
+        test_old_client(strjoina(root, "/old-client"));
+        test_new_peers(strjoina(root, "/new-client"), strjoina(root, "/new-server"));
+
+        assert_se(rm_rf(root, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
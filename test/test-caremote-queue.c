@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include "caprotocol.h"
+#include "caremote.h"
+#include "rm-rf.h"
+#include "util.h"
+
+#define N_IDS 1000U
+
+static CaChunkID ids[N_IDS];
+
+static void expect_next(CaRemote *rr, size_t i) {
+        CaChunkID id;
+
+        assert_se(ca_remote_next_request(rr, &id) >= 0);
+        assert_se(ca_chunk_id_equal(&id, ids + i));
+}
+
+static void test_queue(const char *cache, uint64_t memory_max) {
+        CaRemote *rr;
+        CaChunkID id;
+        size_t i;
+
+        assert_se(rr = ca_remote_new());
+        assert_se(ca_remote_set_cache_path(rr, cache) >= 0);
+        assert_se(ca_remote_set_local_feature_flags(rr, CA_PROTOCOL_PULL_CHUNKS|CA_PROTOCOL_PUSH_INDEX_CHUNKS) >= 0);
+
+        if (memory_max != UINT64_MAX)
+                assert_se(ca_remote_set_requests_memory_max(rr, memory_max) >= 0);
+
+        assert_se(ca_remote_has_pending_requests(rr) == 0);
+        assert_se(ca_remote_next_request(rr, &id) == -ENODATA);
+
+        for (i = 0; i < 900; i++)
+                assert_se(ca_remote_request_async(rr, ids + i, false) > 0);
+
+        assert_se(ca_remote_has_pending_requests(rr) > 0);
+
+        /* Can't change the limit with requests queued */
+        assert_se(ca_remote_set_requests_memory_max(rr, 0) == -EBUSY);
+
+        for (i = 0; i < 100; i++)
+                expect_next(rr, i);
+
+        /* Raising the priority of dispatched requests queues them again, pending ones are moved over */
+        for (i = 50; i < 60; i++)
+                assert_se(ca_remote_request_async(rr, ids + i, true) > 0);
+        for (i = 500; i < 510; i++)
+                assert_se(ca_remote_request_async(rr, ids + i, true) > 0);
+
+        for (i = 900; i < N_IDS; i++)
+                assert_se(ca_remote_request_async(rr, ids + i, false) > 0);
+
+        /* Queuing them again is a NOP, regardless of priority */
+        for (i = 0; i < N_IDS; i++)
+                assert_se(ca_remote_request_async(rr, ids + i, false) == 0);
+        for (i = 50; i < 60; i++)
+                assert_se(ca_remote_request_async(rr, ids + i, true) == 0);
+
+        for (i = 600; i < 610; i++)
+                assert_se(ca_remote_forget_chunk(rr, ids + i) >= 0);
+
+        for (i = 50; i < 60; i++)
+                expect_next(rr, i);
+        for (i = 500; i < 510; i++)
+                expect_next(rr, i);
+
+        for (i = 100; i < N_IDS; i++) {
+                if (i >= 500 && i < 510)
+                        continue;
+                if (i >= 600 && i < 610)
+                        continue;
+
+                expect_next(rr, i);
+        }
+
+        assert_se(ca_remote_next_request(rr, &id) == -ENODATA);
+        assert_se(ca_remote_has_pending_requests(rr) == 0);
+        assert_se(ca_remote_has_chunks(rr) > 0);
+
+        /* Forgotten requests may be queued anew */
+        assert_se(ca_remote_request_async(rr, ids + 600, false) > 0);
+        expect_next(rr, 600);
+        assert_se(ca_remote_next_request(rr, &id) == -ENODATA);
+
+        ca_remote_unref(rr);
+}
+
+int main(int argc, char *argv[]) {
+        const char *d;
+        char *root;
+
+        assert_se(var_tmp_dir(&d) >= 0);
+        root = strjoina(d, "/test-caremote-queue.XXXXXX");
+        assert_se(mkdtemp(root));
+
+        assert_se(dev_urandom(ids, sizeof(ids)) >= 0);
+
+        /* Entirely in memory, entirely on disk, and moved to disk early on, as well as after some requests have
+         * been dispatched already */
+        test_queue(strjoina(root, "/memory"), UINT64_MAX);
+        test_queue(strjoina(root, "/disk"), 0);
+        test_queue(strjoina(root, "/spill-early"), 16*1024);
+        test_queue(strjoina(root, "/spill-late"), 100*1024);
+
+        assert_se(rm_rf(root, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
@@ -0,0 +1,483 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <dirent.h>
+#include <sys/wait.h>
+
+#include "capack.h"
+#include "castore.h"
+#include "def.h"
+#include "dirent-util.h"
+#include "log.h"
+#include "rm-rf.h"
+#include "util.h"
+
+#define N_CHUNKS 64U
+#define CHUNK_SIZE_MAX (8U*1024U)
+
+static uint8_t chunk_data[N_CHUNKS][CHUNK_SIZE_MAX];
+static size_t chunk_size[N_CHUNKS];
+static CaChunkID chunk_id[N_CHUNKS];
+
+static void make_chunks(void) {
+        _cleanup_(ca_digest_freep) CaDigest *digest = NULL;
+        size_t i;
+
+        assert_se(ca_digest_new(CA_DIGEST_DEFAULT, &digest) >= 0);
+
+        for (i = 0; i < N_CHUNKS; i++) {
+                chunk_size[i] = 1 + random_u64() % CHUNK_SIZE_MAX;
+
+                /* Make half of the chunks compressible */
+                if (i % 2 == 0)
+                        memset(chunk_data[i], (int) i, chunk_size[i]);
+                else
+                        assert_se(dev_urandom(chunk_data[i], chunk_size[i]) >= 0);
+
+                assert_se(ca_chunk_id_make(digest, chunk_data[i], chunk_size[i], chunk_id + i) >= 0);
+        }
+}
+
+static size_t count_packfiles(const char *path, const char *suffix) {
+        _cleanup_(closedirp) DIR *d = NULL;
+        struct dirent *de;
+        size_t n = 0;
+
+        assert_se(d = opendir(path));
+
+        FOREACH_DIRENT_ALL(de, d, assert_se(false))
+                if (dirent_is_file_with_suffix(de, suffix))
+                        n++;
+
+        return n;
+}
+
+static void check_pack_chunk(CaPack *p, size_t i, bool present) {
+        _cleanup_(realloc_buffer_free) ReallocBuffer buffer = {};
+        CaChunkCompression compression;
+
+        if (!present) {
+                assert_se(ca_pack_has(p, chunk_id + i) == 0);
+                assert_se(ca_pack_get(p, chunk_id + i, &buffer, &compression) == -ENOENT);
+                return;
+        }
+
+        assert_se(ca_pack_has(p, chunk_id + i) > 0);
+        assert_se(ca_pack_get(p, chunk_id + i, &buffer, &compression) >= 0);
+        assert_se(compression == CA_CHUNK_UNCOMPRESSED);
+        assert_se(realloc_buffer_size(&buffer) == chunk_size[i]);
+        assert_se(memcmp(realloc_buffer_data(&buffer), chunk_data[i], chunk_size[i]) == 0);
+}
+
+static size_t count_pack_chunks(CaPack *p) {
+        uint64_t cursor = 0;
+        size_t n = 0;
+        int r;
+
+        while ((r = ca_pack_enumerate(p, &cursor, NULL)) > 0)
+                n++;
+
+        assert_se(r == 0);
+        return n;
+}
+
+static CaPack *pack_new(const char *path) {
+        CaPack *p;
+
+        assert_se(p = ca_pack_new());
+        assert_se(ca_pack_set_path(p, path) >= 0);
+        assert_se(ca_pack_set_size_max(p, 16U*1024U) >= 0);
+
+        return p;
+}
+
+static void test_pack(const char *root) {
+        const char *path;
+        size_t i;
+        pid_t pid;
+        int status;
+
+        path = strjoina(root, "/packs");
+
+        {
+                _cleanup_(ca_pack_unrefp) CaPack *p = pack_new(path);
+
+                assert_se(ca_pack_exists(p) == 0);
+
+                for (i = 0; i < N_CHUNKS; i++)
+                        assert_se(ca_pack_put(p, chunk_id + i, CA_CHUNK_UNCOMPRESSED, chunk_data[i], chunk_size[i]) >= 0);
+
+                assert_se(ca_pack_exists(p) > 0);
+
+                /* All chunks are readable already, whether in a completed packfile or not */
+                for (i = 0; i < N_CHUNKS; i++) {
+                        check_pack_chunk(p, i, true);
+                        assert_se(ca_pack_put(p, chunk_id + i, CA_CHUNK_UNCOMPRESSED, chunk_data[i], chunk_size[i]) == -EEXIST);
+                }
+
+                assert_se(ca_pack_flush(p) >= 0);
+                assert_se(count_pack_chunks(p) == N_CHUNKS);
+        }
+
+        /* With the small maximum size we should have ended up with multiple packfiles */
+        assert_se(count_packfiles(path, ".capack") > 1);
+        assert_se(count_packfiles(path, ".capack") == count_packfiles(path, ".capidx"));
+
+        {
+                _cleanup_(ca_pack_unrefp) CaPack *p = pack_new(path);
+
+                for (i = 0; i < N_CHUNKS; i++)
+                        check_pack_chunk(p, i, true);
+
+                assert_se(count_pack_chunks(p) == N_CHUNKS);
+
+                for (i = 0; i < N_CHUNKS; i += 3)
+                        assert_se(ca_pack_remove(p, chunk_id + i) >= 0);
+
+                /* Nothing is removed before compaction */
+                for (i = 0; i < N_CHUNKS; i++)
+                        check_pack_chunk(p, i, true);
+
+                assert_se(ca_pack_compact(p) >= 0);
+
+                for (i = 0; i < N_CHUNKS; i++)
+                        check_pack_chunk(p, i, i % 3 != 0);
+        }
+
+        {
+                _cleanup_(ca_pack_unrefp) CaPack *p = pack_new(path);
+
+                for (i = 0; i < N_CHUNKS; i++)
+                        check_pack_chunk(p, i, i % 3 != 0);
+
+                assert_se(count_pack_chunks(p) == N_CHUNKS - (N_CHUNKS + 2) / 3);
+        }
+
+        /* Put the removed chunks back in a process that dies before completing its packfile */
+        pid = fork();
+        assert_se(pid >= 0);
+        if (pid == 0) {
+                CaPack *p = pack_new(path);
+
+                assert_se(ca_pack_set_size_max(p, UINT64_MAX) >= 0);
+
+                for (i = 0; i < N_CHUNKS; i += 3)
+                        assert_se(ca_pack_put(p, chunk_id + i, CA_CHUNK_UNCOMPRESSED, chunk_data[i], chunk_size[i]) >= 0);
+
+                _exit(EXIT_SUCCESS);
+        }
+
+        assert_se(waitpid(pid, &status, 0) == pid);
+        assert_se(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+        assert_se(count_packfiles(path, ".capack") == count_packfiles(path, ".capidx") + 1);
+
+        {
+                _cleanup_(ca_pack_unrefp) CaPack *p = pack_new(path);
+
+                /* The packfile without index is invisible, until compaction writes the index */
+                for (i = 0; i < N_CHUNKS; i++)
+                        check_pack_chunk(p, i, i % 3 != 0);
+
+                assert_se(ca_pack_compact(p) >= 0);
+
+                for (i = 0; i < N_CHUNKS; i++)
+                        check_pack_chunk(p, i, true);
+        }
+
+        assert_se(count_packfiles(path, ".capack") == count_packfiles(path, ".capidx"));
+}
+
+static void check_store_chunk(CaStore *s, size_t i) {
+        _cleanup_(realloc_buffer_free) ReallocBuffer buffer = {};
+        CaChunkCompression compression;
+        const void *p;
+        uint64_t l;
+
+        assert_se(ca_store_has(s, chunk_id + i) > 0);
+
+        assert_se(ca_store_get(s, chunk_id + i, CA_CHUNK_UNCOMPRESSED, &p, &l, &compression) >= 0);
+        assert_se(compression == CA_CHUNK_UNCOMPRESSED);
+        assert_se(l == chunk_size[i]);
+        assert_se(memcmp(p, chunk_data[i], l) == 0);
+
+        assert_se(ca_store_get(s, chunk_id + i, CA_CHUNK_COMPRESSED, &p, &l, &compression) >= 0);
+        assert_se(compression == CA_CHUNK_COMPRESSED);
+
+        /* The chunk is validated uncompressed, hence that's what we get if we don't mind either */
+        assert_se(ca_store_get(s, chunk_id + i, CA_CHUNK_AS_IS, &p, &l, &compression) >= 0);
+        assert_se(compression == CA_CHUNK_UNCOMPRESSED);
+        assert_se(l == chunk_size[i]);
+        assert_se(memcmp(p, chunk_data[i], l) == 0);
+
+        /* Chunks as stored are left for us to decompress */
+        assert_se(ca_store_get_raw(s, chunk_id + i, &p, &l, &compression) >= 0);
+        if (compression == CA_CHUNK_COMPRESSED) {
+                assert_se(ca_decompress(p, l, &buffer) >= 0);
+                p = realloc_buffer_data(&buffer);
+                l = realloc_buffer_size(&buffer);
+        } else
+                assert_se(compression == CA_CHUNK_UNCOMPRESSED);
+        assert_se(l == chunk_size[i]);
+        assert_se(memcmp(p, chunk_data[i], l) == 0);
+}
+
+static size_t count_store_chunks(CaStore *s) {
+        _cleanup_(ca_store_iterator_unrefp) CaStoreIterator *iter = NULL;
+        size_t n = 0;
+        int r;
+
+        assert_se(iter = ca_store_iterator_new(s));
+
+        while ((r = ca_store_iterator_next(iter, NULL)) > 0)
+                n++;
+
+        assert_se(r == 0);
+        return n;
+}
+
+static void test_store(const char *root) {
+        const char *path;
+        size_t i;
+
+        path = strjoina(root, "/store.castr");
+
+        /* Start out with a store with one file per chunk */
+        {
+                _cleanup_(ca_store_unrefp) CaStore *s = NULL;
+
+                assert_se(s = ca_store_new());
+                assert_se(ca_store_set_path(s, path) >= 0);
+
+                for (i = 0; i < N_CHUNKS / 2; i++)
+                        assert_se(ca_store_put(s, chunk_id + i, CA_CHUNK_UNCOMPRESSED, chunk_data[i], chunk_size[i]) >= 0);
+
+                assert_se(ca_store_flush(s) >= 0);
+        }
+
+        /* Then switch to packfiles */
+        {
+                _cleanup_(ca_store_unrefp) CaStore *s = NULL;
+
+                assert_se(s = ca_store_new());
+                assert_se(ca_store_set_path(s, path) >= 0);
+                assert_se(ca_store_set_packs(s, true) >= 0);
+
+                for (i = 0; i < N_CHUNKS; i++)
+                        assert_se(ca_store_put(s, chunk_id + i, CA_CHUNK_UNCOMPRESSED, chunk_data[i], chunk_size[i]) == (i < N_CHUNKS / 2 ? -EEXIST : 0));
+
+                assert_se(ca_store_flush(s) >= 0);
+
+                for (i = 0; i < N_CHUNKS; i++)
+                        check_store_chunk(s, i);
+
+                assert_se(count_store_chunks(s) == N_CHUNKS);
+        }
+
+        /* Once there are packfiles, they are used even if not requested explicitly */
+        {
+                _cleanup_(ca_store_unrefp) CaStore *s = NULL;
+                const char *packs;
+                size_t n;
+
+                packs = strjoina(path, "/packs");
+                n = count_packfiles(packs, ".capidx");
+
+                assert_se(s = ca_store_new());
+                assert_se(ca_store_set_path(s, path) >= 0);
+
+                for (i = 0; i < N_CHUNKS; i++)
+                        check_store_chunk(s, i);
+
+                for (i = 0; i < N_CHUNKS; i++)
+                        assert_se(ca_store_remove(s, chunk_id + i) >= 0);
+
+                assert_se(ca_store_put(s, chunk_id, CA_CHUNK_UNCOMPRESSED, chunk_data[0], chunk_size[0]) >= 0);
+                assert_se(ca_store_flush(s) >= 0);
+                assert_se(count_packfiles(packs, ".capidx") == n + 1);
+
+                assert_se(ca_store_compact(s) >= 0);
+                assert_se(count_store_chunks(s) == 1);
+                check_store_chunk(s, 0);
+        }
+}
+
+static void test_prefetch(const char *root) {
+        _cleanup_(ca_store_unrefp) CaStore *s = NULL;
+        CaChunkCompression compression;
+        CaChunkID missing;
+        const char *path;
+        size_t i, next = 0;
+        const void *p;
+        uint64_t l;
+        int r;
+
+        path = strjoina(root, "/prefetch.castr");
+
+        assert_se(s = ca_store_new());
+        assert_se(ca_store_set_path(s, path) >= 0);
+
+        for (i = 0; i < N_CHUNKS; i++)
+                assert_se(ca_store_put(s, chunk_id + i, CA_CHUNK_UNCOMPRESSED, chunk_data[i], chunk_size[i]) >= 0);
+
+        /* Keep prefetching ahead while getting the chunks in order, skipping some */
+        for (i = 0; i < N_CHUNKS; i++) {
+                for (; next < N_CHUNKS; next++) {
+                        r = ca_store_prefetch(s, chunk_id + next);
+                        if (r == -EOPNOTSUPP) {
+                                log_info("io_uring not available, skipping prefetch test.");
+                                return;
+                        }
+                        if (r == -EBUSY)
+                                break;
+                        assert_se(r > 0);
+                }
+
+                if (i % 5 == 0)
+                        continue;
+
+                check_store_chunk(s, i);
+        }
+
+        /* Chunks that don't exist are reported the usual way */
+        assert_se(dev_urandom(&missing, sizeof(missing)) >= 0);
+        assert_se(ca_store_prefetch(s, &missing) > 0);
+        assert_se(ca_store_prefetch(s, &missing) == 0);
+        assert_se(ca_store_get(s, &missing, CA_CHUNK_UNCOMPRESSED, &p, &l, &compression) == -ENOENT);
+
+        /* Dropping prefetched chunks, and destroying the store with loads still in flight */
+        for (i = 0; i < 8; i++)
+                assert_se(ca_store_prefetch(s, chunk_id + i) > 0);
+
+        ca_store_prefetch_discard(s);
+        check_store_chunk(s, 0);
+
+        for (i = 0; i < 8; i++)
+                assert_se(ca_store_prefetch(s, chunk_id + i) > 0);
+}
+
+static void test_digest_detect(const char *root) {
+        _cleanup_(ca_digest_freep) CaDigest *digest = NULL;
+        _cleanup_(ca_store_unrefp) CaStore *s = NULL;
+        CaChunkCompression compression;
+        CaChunkID id;
+        const char *path;
+        const void *p;
+        uint64_t l;
+
+        path = strjoina(root, "/digest.castr");
+
+        assert_se(s = ca_store_new());
+        assert_se(ca_store_set_path(s, path) >= 0);
+
+        /* Without a configured digest, the one that matches the first chunk is picked up */
+        assert_se(ca_digest_new(CA_DIGEST_SHA256, &digest) >= 0);
+        assert_se(ca_chunk_id_make(digest, chunk_data[0], chunk_size[0], &id) >= 0);
+        assert_se(ca_store_put(s, &id, CA_CHUNK_UNCOMPRESSED, chunk_data[0], chunk_size[0]) >= 0);
+        assert_se(ca_store_get(s, &id, CA_CHUNK_UNCOMPRESSED, &p, &l, &compression) >= 0);
+        assert_se(l == chunk_size[0]);
+
+        /* … and sticks from then on */
+        assert_se(ca_store_put(s, chunk_id + 1, CA_CHUNK_UNCOMPRESSED, chunk_data[1], chunk_size[1]) >= 0);
+        assert_se(ca_store_get(s, chunk_id + 1, CA_CHUNK_UNCOMPRESSED, &p, &l, &compression) == -EBADMSG);
+
+        /* Until the digest is configured explicitly */
+        assert_se(ca_store_set_digest_type(s, CA_DIGEST_DEFAULT) >= 0);
+        check_store_chunk(s, 1);
+        assert_se(ca_store_get(s, &id, CA_CHUNK_UNCOMPRESSED, &p, &l, &compression) == -EBADMSG);
+}
+
+static void test_verify(const char *root) {
+        _cleanup_(ca_store_unrefp) CaStore *s = NULL;
+        CaChunkCompression compression;
+        const char *path;
+        const void *p;
+        uint64_t l;
+
+        path = strjoina(root, "/verify.castr");
+
+        assert_se(s = ca_store_new());
+        assert_se(ca_store_set_path(s, path) >= 0);
+        assert_se(ca_store_set_digest_type(s, CA_DIGEST_DEFAULT) >= 0);
+
+        /* A chunk that rotted, i.e. doesn't match its ID anymore */
+        assert_se(ca_store_put(s, chunk_id + 0, CA_CHUNK_UNCOMPRESSED, chunk_data[1], chunk_size[1]) >= 0);
+        assert_se(ca_store_get(s, chunk_id + 0, CA_CHUNK_UNCOMPRESSED, &p, &l, &compression) == -EBADMSG);
+
+        /* Sampling every single chunk is the same as always validating */
+        assert_se(ca_store_set_verify(s, CA_CHUNK_VERIFY_SAMPLE, 1) >= 0);
+        assert_se(ca_store_get(s, chunk_id + 0, CA_CHUNK_UNCOMPRESSED, &p, &l, &compression) == -EBADMSG);
+
+        assert_se(ca_store_set_verify(s, CA_CHUNK_VERIFY_NEVER, 0) >= 0);
+        assert_se(ca_store_get(s, chunk_id + 0, CA_CHUNK_UNCOMPRESSED, &p, &l, &compression) >= 0);
+        assert_se(l == chunk_size[1]);
+        assert_se(memcmp(p, chunk_data[1], l) == 0);
+        assert_se(ca_store_get(s, chunk_id + 0, CA_CHUNK_COMPRESSED, &p, &l, &compression) >= 0);
+        assert_se(compression == CA_CHUNK_COMPRESSED);
+
+        assert_se(ca_store_set_verify(s, _CA_CHUNK_VERIFY_MAX, 0) == -EINVAL);
+        assert_se(ca_chunk_verify_from_string("sample") == CA_CHUNK_VERIFY_SAMPLE);
+        assert_se(ca_chunk_verify_from_string("sometimes") < 0);
+}
+
+static void test_prefetch_max(const char *root) {
+        _cleanup_(ca_store_unrefp) CaStore *s = NULL;
+        CaChunkID missing;
+        const char *path;
+        size_t i;
+        int r;
+
+        path = strjoina(root, "/prefetch-max.castr");
+
+        assert_se(s = ca_store_new());
+        assert_se(ca_store_set_path(s, path) >= 0);
+
+        for (i = 0; i < 4; i++)
+                assert_se(ca_store_put(s, chunk_id + i, CA_CHUNK_UNCOMPRESSED, chunk_data[i], chunk_size[i]) >= 0);
+
+        /* The read-ahead hint works without io_uring, for loose chunks only */
+        for (i = 0; i < 4; i++)
+                assert_se(ca_store_advise(s, chunk_id + i) >= 0);
+
+        assert_se(dev_urandom(&missing, sizeof(missing)) >= 0);
+        assert_se(ca_store_advise(s, &missing) == -ENOENT);
+
+        assert_se(ca_store_set_prefetch_max(s, 0) == -EINVAL);
+        assert_se(ca_store_set_prefetch_max(s, 2) >= 0);
+
+        r = ca_store_prefetch(s, chunk_id + 0);
+        if (r == -EOPNOTSUPP) {
+                log_info("io_uring not available, skipping prefetch limit test.");
+                return;
+        }
+        assert_se(r > 0);
+        assert_se(ca_store_prefetch(s, chunk_id + 1) > 0);
+        assert_se(ca_store_prefetch(s, chunk_id + 2) == -EBUSY);
+
+        /* The limit is fixed once loading started */
+        assert_se(ca_store_set_prefetch_max(s, 2) >= 0);
+        assert_se(ca_store_set_prefetch_max(s, 4) == -EBUSY);
+
+        for (i = 0; i < 4; i++)
+                check_store_chunk(s, i);
+}
+
+int main(int argc, char *argv[]) {
+        char *root;
+        const char *d;
+
+        assert_se(var_tmp_dir(&d) >= 0);
+        root = strjoina(d, "/test-castore.XXXXXX");
+        assert_se(mkdtemp(root));
+
+        make_chunks();
+
+        test_pack(root);
+        test_store(root);
+        test_prefetch(root);
+        test_prefetch_max(root);
+        test_digest_detect(root);
+        test_verify(root);
+
+        assert_se(rm_rf(root, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}